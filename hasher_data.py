@@ -1,4 +1,5 @@
 import json
+import sys
 import matplotlib.pyplot as plt
 from matplotlib import cm
 import numpy as np
@@ -21,13 +22,32 @@ difficulties = []
 blocks = []
 data_avg_time = []
 data_avg_hashrate = []
-for experiment in content:
-    # Each experiment has an increasing difficulty
-    difficulties.append(experiment["DIFFICULTY"].lower().count("f") * 4)
-    blocks = [i + 1 for i in range(len(experiment["BLOCK_EXPERIMENTS"]))]
-    for block_exp in (experiment["BLOCK_EXPERIMENTS"]):
-        data_avg_time.append(block_exp["avg_time"])
-        data_avg_hashrate.append(block_exp["avg_hash_per_sec"])
+if isinstance(content, dict):
+    # Report of sw/Benchmark.cpp: rows by difficulty then blocks, one per engine
+    engine = sys.argv[1] if len(sys.argv) > 1 else "accelerator"
+    rows = [row for row in content["results"] if row["engine"] == engine]
+    difficulties = sorted(set(row["difficulty_bits"] for row in rows))
+    blocks = sorted(set(row["blocks"] for row in rows))
+    for row in rows:
+        data_avg_time.append(row["time_ms"]["mean"])
+        data_avg_hashrate.append(row["hash_per_sec"]["mean"])
+else:
+    # Older logs: a list of experiments. sw/accel-model: a list of bitstreams, each with
+    # its experiments, the one named by argv[1] (the first one by default).
+    experiments = content
+    if content and "EXPERIMENTS" in content[0]:
+        name = sys.argv[1] if len(sys.argv) > 1 else content[0]["BITSTREAM"]
+        matches = [entry for entry in content if entry["BITSTREAM"].split(".")[0] == name.split(".")[0]]
+        if not matches:
+            sys.exit("No bitstream %s in the log, it has %s" % (name, ", ".join(entry["BITSTREAM"] for entry in content)))
+        experiments = matches[0]["EXPERIMENTS"]
+    for experiment in experiments:
+        # Each experiment has an increasing difficulty
+        difficulties.append(experiment["DIFFICULTY"].lower().count("f") * 4)
+        blocks = [i + 1 for i in range(len(experiment["BLOCK_EXPERIMENTS"]))]
+        for block_exp in (experiment["BLOCK_EXPERIMENTS"]):
+            data_avg_time.append(block_exp["avg_time"])
+            data_avg_hashrate.append(block_exp["avg_hash_per_sec"])
 
 for i in range(len(data_avg_hashrate)):
     data_avg_hashrate[i] /= 1000000
@@ -12,7 +12,9 @@ ENTITY AXI4Slave IS
         -- Parameters of Axi Slave Bus Interface S00_AXI
         C_S00_AXI_DATA_WIDTH : INTEGER := 32;
         C_S00_AXI_ADDR_WIDTH : INTEGER := 5;
-        C_NUM_REGISTERS      : INTEGER := 5
+        C_NUM_REGISTERS      : INTEGER := 5;
+        -- Read-only registers after the register file
+        C_NUM_COUNTERS       : INTEGER := 0
 
     );
     PORT (
@@ -39,6 +41,8 @@ ENTITY AXI4Slave IS
 
         reset_irq : out std_logic;
 
+        counters        : IN TReg(C_NUM_COUNTERS - 1 DOWNTO 0);
+
         -- outputs
         register_file   : OUT TReg(C_NUM_REGISTERS - 1 DOWNTO 0)
     );
@@ -92,7 +96,7 @@ BEGIN
                     IF s00_axi_wvalid = '1' THEN
                         if to_integer(unsigned(awrite)) = C_INDEX_TOGGLE_IRQ then 
                             reset_irq <= '1';
-                        else
+                        elsif to_integer(unsigned(awrite)) < C_NUM_REGISTERS then
                             register_file_internal(to_integer(unsigned(awrite))) <= s00_axi_wdata;
                         end if;
                         current_state                                        <= Finish;
@@ -107,7 +111,13 @@ BEGIN
 
                     WHEN Read =>
                     s00_axi_rvalid <= '1';
-                    s00_axi_rdata  <= register_file_internal(to_integer(unsigned(aread)));
+                    IF to_integer(unsigned(aread)) < C_NUM_REGISTERS THEN
+                        s00_axi_rdata <= register_file_internal(to_integer(unsigned(aread)));
+                    ELSIF to_integer(unsigned(aread)) < C_NUM_REGISTERS + C_NUM_COUNTERS THEN
+                        s00_axi_rdata <= counters(to_integer(unsigned(aread)) - C_NUM_REGISTERS);
+                    ELSE
+                        s00_axi_rdata <= (OTHERS => '0');
+                    END IF;
                     IF s00_axi_rready = '1' THEN
                         current_state <= Idle;
                     END IF;
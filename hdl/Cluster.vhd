@@ -12,8 +12,11 @@ ENTITY Cluster IS
 
         input_block : IN STD_LOGIC_VECTOR(511 DOWNTO 0);
         start : IN STD_LOGIC;
-        stop : IN STD_LOGIC;
+        stop : IN STD_LOGIC; -- one-cycle pulse from the FSM, aborts the block
         difficulty : IN STD_LOGIC_VECTOR(31 DOWNTO 0); -- Used as a mask (111000...000 means start with 3 zeros)
+        start_nonce : IN STD_LOGIC_VECTOR(31 DOWNTO 0);
+        nonce_stride : IN STD_LOGIC_VECTOR(31 DOWNTO 0);
+        nonce_limit : IN STD_LOGIC_VECTOR(31 DOWNTO 0);
 
         clk : IN STD_LOGIC;
         nReset : IN STD_LOGIC;
@@ -21,7 +24,11 @@ ENTITY Cluster IS
         -- OUTPUTS
         done : OUT STD_LOGIC;
         hash : OUT STD_LOGIC_VECTOR(159 DOWNTO 0);
-        nonce : OUT STD_LOGIC_VECTOR(31 DOWNTO 0)
+        nonce : OUT STD_LOGIC_VECTOR(31 DOWNTO 0);
+        exhausted : OUT STD_LOGIC;
+        nonces_tried : OUT STD_LOGIC_VECTOR(31 DOWNTO 0);
+        cancelled : OUT STD_LOGIC;
+        hashes_done : OUT STD_LOGIC_VECTOR(7 DOWNTO 0) -- hashes of the round that just ended
 
         -- DEBUG
         --debug_state : OUT ClusterControllerState;
@@ -44,7 +51,7 @@ ARCHITECTURE arch_imp OF Cluster IS
     SIGNAL hash_start : STD_LOGIC;
     SIGNAL hash_nonces : arr_32(N_HASHERS - 1 DOWNTO 0);
 
-    SIGNAL reset_system : STD_LOGIC;
+    SIGNAL reset_hashers : STD_LOGIC;
 
     -- DEBUG
     SIGNAL debug_state_fsm : ClusterControllerState;
@@ -57,20 +64,29 @@ BEGIN
     --debug_hash_done_all <= hash_done;
     --debug_reset_system <= reset_system;
 
-    reset_system <= nReset AND NOT stop;
+    -- The controller reports the partial search on stop, the hashers drop the nonces in flight
+    reset_hashers <= nReset AND NOT stop;
 
     controller : ENTITY work.ClusterController
         GENERIC MAP(N_HASHERS => N_HASHERS)
         PORT MAP(
             start => start,
+            abort => stop,
             difficulty => difficulty,
+            start_nonce => start_nonce,
+            nonce_stride => nonce_stride,
+            nonce_limit => nonce_limit,
             clk => clk,
-            nReset => reset_system,
+            nReset => nReset,
             hash_done => hash_done_or,
             hash_results => hash_results,
             done => done,
             hash => hash,
             nonce => nonce,
+            exhausted => exhausted,
+            nonces_tried => nonces_tried,
+            cancelled => cancelled,
+            hashes_done => hashes_done,
             hash_start => hash_start,
             hash_nonces => hash_nonces,
             debug_state => debug_state_fsm
@@ -84,7 +100,7 @@ BEGIN
                 input_block(31 DOWNTO 0) => hash_nonces(i),
                 start => hash_start,
                 clk => clk,
-                nReset => reset_system,
+                nReset => reset_hashers,
                 done => hash_done(i),
                 hash => hash_results(i)
             );
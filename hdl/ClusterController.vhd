@@ -12,7 +12,14 @@ ENTITY ClusterController IS
         -- INPUTS FROM OUTSIDE
         --input_block : IN STD_LOGIC_VECTOR(511 DOWNTO 0);
         start : IN STD_LOGIC;
+        -- One-cycle pulse: give up the block, reporting where the search stopped
+        abort : IN STD_LOGIC;
         difficulty : IN STD_LOGIC_VECTOR(31 DOWNTO 0); -- Used as a mask (111000...000 means start with 3 zeros)
+        -- Nonce range: start_nonce, start_nonce + nonce_stride, ... for nonce_limit nonces.
+        -- A stride of 0 is taken as 1, a limit of 0 means the whole 2^32 space.
+        start_nonce : IN STD_LOGIC_VECTOR(31 DOWNTO 0);
+        nonce_stride : IN STD_LOGIC_VECTOR(31 DOWNTO 0);
+        nonce_limit : IN STD_LOGIC_VECTOR(31 DOWNTO 0);
 
         clk : IN STD_LOGIC;
         nReset : IN STD_LOGIC;
@@ -22,9 +29,17 @@ ENTITY ClusterController IS
         hash_results : IN ARR_160(N_HASHERS - 1 DOWNTO 0);
 
         -- OUTPUTS TO MAIN CONTROLLER 
+        -- When the range is exhausted without a hit, hash is all zeros and nonce is
+        -- the next nonce of the range, so the search can be resumed from there.
         done : OUT STD_LOGIC;
         hash : OUT STD_LOGIC_VECTOR(159 DOWNTO 0);
         nonce : OUT STD_LOGIC_VECTOR(31 DOWNTO 0);
+        exhausted : OUT STD_LOGIC; -- range exhausted without a hit
+        nonces_tried : OUT STD_LOGIC_VECTOR(31 DOWNTO 0); -- saturates at 2^32 - 1
+        -- Aborted: hash is all zeros and nonce the first one not tried, to resume from there
+        cancelled : OUT STD_LOGIC;
+        -- Hashes of the round that just ended, for the performance counters; 0 otherwise
+        hashes_done : OUT STD_LOGIC_VECTOR(7 DOWNTO 0);
 
         -- OUTPUT TO HASHERS
         hash_start : OUT STD_LOGIC;
@@ -42,12 +57,24 @@ ARCHITECTURE arch_imp OF ClusterController IS
 
     SIGNAL curr_state : ClusterControllerState;
 
+    FUNCTION saturate_32(x : unsigned(32 DOWNTO 0)) RETURN STD_LOGIC_VECTOR IS
+    BEGIN
+        IF x(32) = '1' THEN
+            RETURN x"FFFFFFFF";
+        END IF;
+        RETURN STD_LOGIC_VECTOR(x(31 DOWNTO 0));
+    END FUNCTION;
+
 BEGIN
 
     debug_state <= curr_state;
 
     fsm : PROCESS (clk, nReset)
         VARIABLE curr_nonce : unsigned(31 DOWNTO 0);
+        VARIABLE stride : unsigned(31 DOWNTO 0);
+        VARIABLE nonces_left : unsigned(32 DOWNTO 0); -- up to 2^32
+        VARIABLE valid_hashers : INTEGER RANGE 0 TO N_HASHERS; -- hashers with a nonce inside the range
+        VARIABLE tried : unsigned(32 DOWNTO 0);
         VARIABLE correct_nonce : STD_LOGIC_VECTOR(31 DOWNTO 0);
         VARIABLE correct_hash_id : INTEGER RANGE 0 TO N_HASHERS; -- N_HASHERS used as default value
     BEGIN
@@ -61,7 +88,16 @@ BEGIN
             correct_hash_id := N_HASHERS;
             hash_nonces <= (OTHERS => (OTHERS => '0'));
             curr_nonce := (OTHERS => '0');
+            stride := to_unsigned(1, 32);
+            nonces_left := (OTHERS => '0');
+            valid_hashers := 0;
+            tried := (OTHERS => '0');
+            exhausted <= '0';
+            cancelled <= '0';
+            nonces_tried <= (OTHERS => '0');
+            hashes_done <= (OTHERS => '0');
         ELSIF rising_edge(clk) THEN
+            hashes_done <= (OTHERS => '0');
             CASE curr_state IS
                 WHEN Idle =>
                     done <= '1';
@@ -71,24 +107,73 @@ BEGIN
                     hash_nonces <= (OTHERS => (OTHERS => '0'));
                     correct_nonce := (OTHERS => '0');
                     correct_hash_id := N_HASHERS;
-                    curr_nonce := (OTHERS => '0');
+                    curr_nonce := unsigned(start_nonce);
+                    IF unsigned(nonce_stride) = 0 THEN
+                        stride := to_unsigned(1, 32);
+                    ELSE
+                        stride := unsigned(nonce_stride);
+                    END IF;
+                    IF unsigned(nonce_limit) = 0 THEN
+                        nonces_left := to_unsigned(0, 33);
+                        nonces_left(32) := '1';
+                    ELSE
+                        nonces_left := resize(unsigned(nonce_limit), 33);
+                    END IF;
+                    valid_hashers := 0;
+                    tried := (OTHERS => '0');
                     IF start = '1' THEN
                         curr_state <= PrepareAndStart;
                         done <= '0';
+                        exhausted <= '0';
+                        cancelled <= '0';
                         -- Save block? Probably not
                     END IF;
                 WHEN PrepareAndStart =>
-                    FOR i IN 0 TO N_HASHERS - 1 LOOP
-                        hash_nonces(i) <= STD_LOGIC_VECTOR(curr_nonce);
-                        curr_nonce := curr_nonce + 1;
-                    END LOOP;
-                    hash_start <= '1';
-                    curr_state <= WaitState;
+                    IF abort = '1' THEN
+                        nonce <= STD_LOGIC_VECTOR(curr_nonce);
+                        hash <= (OTHERS => '0');
+                        cancelled <= '1';
+                        nonces_tried <= saturate_32(tried);
+                        curr_state <= Idle;
+                    ELSIF nonces_left = 0 THEN
+                        -- Range exhausted, report where it stopped
+                        nonce <= STD_LOGIC_VECTOR(curr_nonce);
+                        hash <= (OTHERS => '0');
+                        exhausted <= '1';
+                        nonces_tried <= saturate_32(tried);
+                        curr_state <= Idle;
+                    ELSE
+                        IF nonces_left < N_HASHERS THEN
+                            valid_hashers := to_integer(nonces_left);
+                        ELSE
+                            valid_hashers := N_HASHERS;
+                        END IF;
+                        nonces_left := nonces_left - valid_hashers;
+                        tried := tried + valid_hashers;
+                        FOR i IN 0 TO N_HASHERS - 1 LOOP
+                            hash_nonces(i) <= STD_LOGIC_VECTOR(curr_nonce);
+                            IF i < valid_hashers THEN
+                                curr_nonce := curr_nonce + stride;
+                            END IF;
+                        END LOOP;
+                        hash_start <= '1';
+                        curr_state <= WaitState;
+                    END IF;
                 WHEN WaitState =>
                     hash_start <= '0';
-                    IF hash_done = '1' THEN
+                    IF abort = '1' THEN
+                        -- The hashers are reset with the abort: the nonces in flight were not tried
+                        nonce <= hash_nonces(0);
+                        hash <= (OTHERS => '0');
+                        cancelled <= '1';
+                        nonces_tried <= saturate_32(tried - valid_hashers);
+                        curr_state <= Idle;
+                    ELSIF hash_done = '1' THEN
+                        -- Every hasher with a nonce of the range counts, the winner's siblings too
+                        hashes_done <= STD_LOGIC_VECTOR(to_unsigned(valid_hashers, 8));
                         FOR i IN 0 TO N_HASHERS - 1 LOOP
-                            IF (hash_results(i)(159 DOWNTO 159 - 31) AND difficulty) = x"00000000" THEN
+                            -- Hashers past the end of the range got a nonce outside of it
+                            IF i < valid_hashers AND (hash_results(i)(159 DOWNTO 159 - 31) AND difficulty) = x"00000000" THEN
                                 correct_nonce := hash_nonces(i);
                                 correct_hash_id := i;
                             END IF;
@@ -96,6 +181,7 @@ BEGIN
                         IF correct_hash_id /= N_HASHERS THEN
                             nonce <= correct_nonce;
                             hash <= hash_results(correct_hash_id);
+                            nonces_tried <= saturate_32(tried);
                             curr_state <= Idle;
                         ELSE
                             curr_state <= PrepareAndStart;
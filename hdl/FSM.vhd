@@ -39,10 +39,21 @@ ENTITY FSM IS
         cluster_done                      : IN STD_LOGIC_VECTOR(CLUSTER_COUNT - 1 DOWNTO 0);
         cluster_hashes                    : IN ARR_160(CLUSTER_COUNT - 1 DOWNTO 0);
         cluster_nonces                    : IN ARR_32(CLUSTER_COUNT - 1 DOWNTO 0);
+        cluster_exhausted                 : IN STD_LOGIC_VECTOR(CLUSTER_COUNT - 1 DOWNTO 0);
+        cluster_nonces_tried              : IN ARR_32(CLUSTER_COUNT - 1 DOWNTO 0);
+        cluster_cancelled                 : IN STD_LOGIC_VECTOR(CLUSTER_COUNT - 1 DOWNTO 0);
         -- OUTPUT TO CLUSTER
         cluster_blocks                    : OUT ARR_512(CLUSTER_COUNT - 1 DOWNTO 0);
         cluster_start                     : OUT STD_LOGIC_VECTOR(CLUSTER_COUNT - 1 DOWNTO 0);
-        fsm_irq : out std_logic
+        -- One-cycle pulse when STOP is seen: every cluster gives up its block
+        cluster_abort                     : OUT STD_LOGIC;
+        -- Nonce range of every block of the job, latched on START
+        cluster_start_nonce               : OUT STD_LOGIC_VECTOR(31 DOWNTO 0);
+        cluster_nonce_stride              : OUT STD_LOGIC_VECTOR(31 DOWNTO 0);
+        cluster_nonce_limit               : OUT STD_LOGIC_VECTOR(31 DOWNTO 0);
+        fsm_irq : out std_logic;
+        -- For the performance counters of TopLevel
+        state                             : OUT FSMState
 
         -- DEBUG
 
@@ -62,12 +73,27 @@ ARCHITECTURE arch_imp OF FSM IS
     CONSTANT C_INDEX_N_BLOCKS          : INTEGER                                      := 1;
     CONSTANT C_INDEX_DIFFICULTY        : INTEGER                                      := 2;
     CONSTANT C_INDEX_START             : INTEGER                                      := 3;
-    --CONSTANT C_INDEX_STOP : INTEGER := 4;
+    CONSTANT C_INDEX_STOP              : INTEGER                                      := 4;
     CONSTANT C_INDEX_DONE              : INTEGER                                      := 5;
     CONSTANT C_INDEX_RESULT_ADDR       : INTEGER                                      := 6;
     CONSTANT C_INDEX_IRQ_ENABLE : INTEGER := 7;
     CONSTANT C_INDEX_IRQ_TOGGLE : INTEGER := 8;
+    CONSTANT C_INDEX_START_NONCE : INTEGER := 9;
+    CONSTANT C_INDEX_NONCE_STRIDE : INTEGER := 10;
+    CONSTANT C_INDEX_NONCE_LIMIT : INTEGER := 11;
+    CONSTANT C_INDEX_RING_ADDR : INTEGER := 12;
+    CONSTANT C_INDEX_RING_MASK : INTEGER := 13;
+    CONSTANT C_INDEX_RING_HEAD : INTEGER := 14;
+    CONSTANT C_INDEX_RING_IRQ_EVERY : INTEGER := 15;
     CONSTANT ZERO                      : STD_LOGIC_VECTOR(CLUSTER_COUNT - 1 DOWNTO 0) := (OTHERS => '0');
+    -- Result record: hash (160) & nonce (32) & status (32) & nonces tried (32), four 64-bit writes
+    CONSTANT C_RESULT_BYTES            : INTEGER                                      := 32;
+    CONSTANT C_STATUS_FOUND            : STD_LOGIC_VECTOR(31 DOWNTO 0)                := x"00000001";
+    CONSTANT C_STATUS_EXHAUSTED        : STD_LOGIC_VECTOR(31 DOWNTO 0)                := x"00000002";
+    CONSTANT C_STATUS_CANCELLED        : STD_LOGIC_VECTOR(31 DOWNTO 0)                := x"00000003";
+    -- Completion ring: a header holding the producer index, then 16-byte entries
+    -- (block index & nonce, status & result record address), two 64-bit writes each
+    CONSTANT C_RING_HEADER_BYTES       : INTEGER                                      := 64;
 
     SIGNAL curr_state                  : FSMState;
 
@@ -78,9 +104,22 @@ ARCHITECTURE arch_imp OF FSM IS
     -- We let it overflow
     SIGNAL block_offset                : unsigned(2 DOWNTO 0);
 
-    SIGNAL payload                     : STD_LOGIC_VECTOR(191 DOWNTO 0); -- hash + nonce
+    SIGNAL payload                     : STD_LOGIC_VECTOR(255 DOWNTO 0); -- hash + nonce + status + nonces tried
     SIGNAL curr_cluster_being_serviced : INTEGER;
     signal trigger_irq :          std_logic;
+    -- STOP was seen: no block is handed out any more, the clusters were told to give up
+    SIGNAL aborting                    : BOOLEAN;
+
+    -- Writeback of a finished block: write number block_offset goes to wb_address,
+    -- the last one is done when block_offset reaches wb_end
+    SIGNAL ring_enabled                : BOOLEAN;
+    SIGNAL ring_head                   : unsigned(31 DOWNTO 0); -- entries appended so far
+    SIGNAL ring_since_irq              : unsigned(31 DOWNTO 0);
+    SIGNAL result_record_addr          : unsigned(31 DOWNTO 0);
+    SIGNAL ring_entry_addr             : unsigned(31 DOWNTO 0);
+    SIGNAL wb_address                  : STD_LOGIC_VECTOR(C_M00_AXI_ADDR_WIDTH - 1 DOWNTO 0);
+    SIGNAL wb_data                     : STD_LOGIC_VECTOR(C_M00_AXI_DATA_WIDTH - 1 DOWNTO 0);
+    SIGNAL wb_end                      : unsigned(2 DOWNTO 0);
 
 BEGIN
 
@@ -93,6 +132,24 @@ BEGIN
     --debug_curr_block                  <= curr_block;
 
     fsm_irq <= register_file(C_INDEX_IRQ_ENABLE)(0) and trigger_irq;
+    state   <= curr_state;
+
+    -- Writes 0-3: result record. With RING_ADDR set, 4-5: ring entry, 6: producer index.
+    ring_enabled       <= unsigned(register_file(C_INDEX_RING_ADDR)) /= 0;
+    result_record_addr <= unsigned(register_file(C_INDEX_RESULT_ADDR)) + resize(unsigned(assigned_block(curr_cluster_being_serviced)), 16) * C_RESULT_BYTES;
+    ring_entry_addr    <= unsigned(register_file(C_INDEX_RING_ADDR)) + C_RING_HEADER_BYTES + shift_left(ring_head AND unsigned(register_file(C_INDEX_RING_MASK)), 4);
+    wb_end             <= "111" WHEN ring_enabled ELSE "100";
+
+    wb_address <= STD_LOGIC_VECTOR(ring_entry_addr) WHEN block_offset = "100" ELSE
+                  STD_LOGIC_VECTOR(ring_entry_addr + 8) WHEN block_offset = "101" ELSE
+                  register_file(C_INDEX_RING_ADDR) WHEN block_offset = "110" ELSE
+                  STD_LOGIC_VECTOR(result_record_addr + resize(block_offset, 8) * 8);
+    wb_data    <= payload(95 DOWNTO 64) & x"000000" & assigned_block(curr_cluster_being_serviced) WHEN block_offset = "100" ELSE
+                  STD_LOGIC_VECTOR(result_record_addr) & payload(63 DOWNTO 32) WHEN block_offset = "101" ELSE
+                  x"00000000" & STD_LOGIC_VECTOR(ring_head + 1) WHEN block_offset = "110" ELSE
+                  -- Past the last write (block fetches, end of a ring writeback): no slice of payload
+                  (OTHERS => '0') WHEN block_offset = "111" ELSE
+                  payload(255 - to_integer(block_offset) * 64 DOWNTO 255 - 63 - to_integer(block_offset) * 64);
 
     fsm : PROCESS (clk, nReset)
         VARIABLE cluster_finished  : INTEGER;
@@ -115,9 +172,17 @@ BEGIN
                 index                       <= STD_LOGIC_VECTOR(to_unsigned(C_INDEX_DONE, index'length));
                 reg_val                     <= x"00000001";
                 fetched_block               <= (OTHERS => '0');
+                cluster_start_nonce         <= (OTHERS => '0');
+                cluster_nonce_stride        <= x"00000001";
+                cluster_nonce_limit         <= (OTHERS => '0');
+                ring_head                   <= (OTHERS => '0');
+                ring_since_irq              <= (OTHERS => '0');
+                aborting                    <= FALSE;
+                cluster_abort               <= '0';
                 cluster_available := - 1;
                 cluster_finished  := - 1;
             ELSE
+                cluster_abort <= '0';
                 CASE(curr_state) IS
                     WHEN Idle                              =>
                     address                     <= (OTHERS => '0');
@@ -135,11 +200,19 @@ BEGIN
                     assigned_block              <= (OTHERS => (OTHERS => '0'));
                     busy_bitmask                <= (OTHERS => '0');
                     curr_block                  <= (OTHERS => '0');
+                    aborting                    <= FALSE;
                     cluster_available := - 1;
                     cluster_finished  := - 1;
                     IF register_file(C_INDEX_START)(0) = '1' THEN
                         index      <= STD_LOGIC_VECTOR(to_unsigned(C_INDEX_DONE, index'length));
                         reg_val    <= x"00000000";
+                        -- Software may reprogram the range registers while this job runs
+                        cluster_start_nonce  <= register_file(C_INDEX_START_NONCE);
+                        cluster_nonce_stride <= register_file(C_INDEX_NONCE_STRIDE);
+                        cluster_nonce_limit  <= register_file(C_INDEX_NONCE_LIMIT);
+                        -- The ring carries over from job to job, software may move it between jobs
+                        ring_head            <= unsigned(register_file(C_INDEX_RING_HEAD));
+                        ring_since_irq       <= (OTHERS => '0');
                         curr_state <= state_1;
                     END IF;
                     WHEN state_1 =>
@@ -148,7 +221,12 @@ BEGIN
                     END IF;
                     index   <= STD_LOGIC_VECTOR(to_unsigned(C_INDEX_START, index'length));
                     reg_val <= x"00000000";
-                    IF curr_block < unsigned(register_file(C_INDEX_N_BLOCKS)) THEN
+                    IF register_file(C_INDEX_STOP)(0) = '1' THEN
+                        -- Cancelled: the blocks not handed out yet get no result record
+                        cluster_abort <= '1';
+                        aborting      <= TRUE;
+                        curr_state    <= wait_all;
+                    ELSIF curr_block < unsigned(register_file(C_INDEX_N_BLOCKS)) THEN
                         address    <= STD_LOGIC_VECTOR(unsigned(register_file(C_INDEX_BLOCK_ADDRESS)) + resize(curr_block, 16) * 64);
                         read       <= '1';
                         curr_state <= state_2;
@@ -172,6 +250,7 @@ BEGIN
                         END IF;
                     END IF;
                     WHEN state_3 =>
+                    trigger_irq <= '0';
                     cluster_available := - 1;
                     cluster_finished  := - 1;
                     FOR cluster_id IN 0 TO CLUSTER_COUNT - 1 LOOP
@@ -184,7 +263,12 @@ BEGIN
                             END IF;
                         END IF;
                     END LOOP;
-                    IF cluster_available /= (-1) THEN
+                    IF register_file(C_INDEX_STOP)(0) = '1' THEN
+                        -- The fetched block is dropped, the finished ones are written back in wait_all
+                        cluster_abort <= '1';
+                        aborting      <= TRUE;
+                        curr_state    <= wait_all;
+                    ELSIF cluster_available /= (-1) THEN
                         cluster_blocks(cluster_available) <= fetched_block;
                         assigned_block(cluster_available) <= STD_LOGIC_VECTOR(curr_block);
                         busy_bitmask(cluster_available)   <= '1';
@@ -194,34 +278,59 @@ BEGIN
                         curr_state                        <= state_1;
                     ELSIF cluster_finished /= (-1) THEN
                         curr_state                  <= prepare_block_wb;
-                        payload(191 DOWNTO 32)      <= cluster_hashes(cluster_finished);
-                        payload(31 DOWNTO 0)        <= cluster_nonces(cluster_finished);
+                        payload(255 DOWNTO 96)      <= cluster_hashes(cluster_finished);
+                        payload(95 DOWNTO 64)       <= cluster_nonces(cluster_finished);
+                        IF cluster_exhausted(cluster_finished) = '1' THEN
+                            payload(63 DOWNTO 32)   <= C_STATUS_EXHAUSTED;
+                        ELSE
+                            payload(63 DOWNTO 32)   <= C_STATUS_FOUND;
+                        END IF;
+                        payload(31 DOWNTO 0)        <= cluster_nonces_tried(cluster_finished);
                         curr_cluster_being_serviced <= cluster_finished;
                         block_offset                <= "000";
                     END IF;
                     WHEN prepare_block_wb =>
                     write        <= '1';
-                    data_value   <= payload(191 - to_integer(block_offset) * 64 DOWNTO 191 - 63 - to_integer(block_offset) * 64);
-                    address      <= STD_LOGIC_VECTOR(unsigned(register_file(C_INDEX_RESULT_ADDR)) + resize(unsigned(assigned_block(curr_cluster_being_serviced)), 16) * 24 + resize(unsigned(block_offset), 8) * 8);
+                    data_value   <= wb_data;
+                    address      <= wb_address;
                     block_offset <= block_offset + 1;
                     curr_state   <= block_wb;
                     WHEN block_wb =>
                     IF finished_write = '1' THEN
-                        IF block_offset = "011" THEN
+                        IF block_offset = wb_end THEN
                             -- when finished
                             busy_bitmask(curr_cluster_being_serviced)   <= '0';
                             assigned_block(curr_cluster_being_serviced) <= (OTHERS => '0');
                             curr_state                                  <= state_3;
                             block_offset                                <= "000";
                             write                                       <= '0';
+                            IF ring_enabled THEN
+                                ring_head <= ring_head + 1;
+                                -- Mirror the producer index in RING_HEAD for the driver
+                                index     <= STD_LOGIC_VECTOR(to_unsigned(C_INDEX_RING_HEAD, index'length));
+                                reg_val   <= STD_LOGIC_VECTOR(ring_head + 1);
+                                IF unsigned(register_file(C_INDEX_RING_IRQ_EVERY)) /= 0 THEN
+                                    IF ring_since_irq + 1 >= unsigned(register_file(C_INDEX_RING_IRQ_EVERY)) THEN
+                                        trigger_irq    <= '1';
+                                        ring_since_irq <= (OTHERS => '0');
+                                    ELSE
+                                        ring_since_irq <= ring_since_irq + 1;
+                                    END IF;
+                                END IF;
+                            END IF;
                         ELSE
                             write        <= '1';
-                            data_value   <= payload(191 - to_integer(block_offset) * 64 DOWNTO 191 - 63 - to_integer(block_offset) * 64);
-                            address      <= STD_LOGIC_VECTOR(unsigned(register_file(C_INDEX_RESULT_ADDR)) + resize(unsigned(assigned_block(curr_cluster_being_serviced)), 16) * 24 + resize(unsigned(block_offset), 8) * 8);
+                            data_value   <= wb_data;
+                            address      <= wb_address;
                             block_offset <= block_offset + 1;
                         END IF;
                     END IF;
                     WHEN wait_all =>
+                    trigger_irq <= '0';
+                    IF register_file(C_INDEX_STOP)(0) = '1' AND NOT aborting THEN
+                        cluster_abort <= '1';
+                        aborting      <= TRUE;
+                    END IF;
                     cluster_finished := - 1;
                     FOR cluster_id IN 0 TO CLUSTER_COUNT - 1 LOOP
                         IF cluster_done(cluster_id) = '1' THEN
@@ -233,8 +342,16 @@ BEGIN
                     END LOOP;
                     IF cluster_finished /= - 1 THEN
                         curr_state                  <= prepare_block_wb2;
-                        payload(191 DOWNTO 32)      <= cluster_hashes(cluster_finished);
-                        payload(31 DOWNTO 0)        <= cluster_nonces(cluster_finished);
+                        payload(255 DOWNTO 96)      <= cluster_hashes(cluster_finished);
+                        payload(95 DOWNTO 64)       <= cluster_nonces(cluster_finished);
+                        IF cluster_cancelled(cluster_finished) = '1' THEN
+                            payload(63 DOWNTO 32)   <= C_STATUS_CANCELLED;
+                        ELSIF cluster_exhausted(cluster_finished) = '1' THEN
+                            payload(63 DOWNTO 32)   <= C_STATUS_EXHAUSTED;
+                        ELSE
+                            payload(63 DOWNTO 32)   <= C_STATUS_FOUND;
+                        END IF;
+                        payload(31 DOWNTO 0)        <= cluster_nonces_tried(cluster_finished);
                         curr_cluster_being_serviced <= cluster_finished;
                         block_offset                <= "000";
                     ELSIF busy_bitmask = ZERO THEN
@@ -243,23 +360,37 @@ BEGIN
                     END IF;
                     WHEN prepare_block_wb2 =>
                     write        <= '1';
-                    data_value   <= payload(191 - to_integer(block_offset) * 64 DOWNTO 191 - 63 - to_integer(block_offset) * 64);
-                    address      <= STD_LOGIC_VECTOR(unsigned(register_file(C_INDEX_RESULT_ADDR)) + resize(unsigned(assigned_block(curr_cluster_being_serviced)), 16) * 24 + resize(unsigned(block_offset), 8) * 8);
+                    data_value   <= wb_data;
+                    address      <= wb_address;
                     block_offset <= block_offset + 1;
                     curr_state   <= block_wb2;
                     WHEN block_wb2 =>
                     IF finished_write = '1' THEN
-                        IF block_offset = "011" THEN
+                        IF block_offset = wb_end THEN
                             -- when finished
                             busy_bitmask(curr_cluster_being_serviced)   <= '0';
                             assigned_block(curr_cluster_being_serviced) <= (OTHERS => '0');
                             curr_state                                  <= wait_all;
                             block_offset                                <= "000";
                             write                                       <= '0';
+                            IF ring_enabled THEN
+                                ring_head <= ring_head + 1;
+                                -- Mirror the producer index in RING_HEAD for the driver
+                                index     <= STD_LOGIC_VECTOR(to_unsigned(C_INDEX_RING_HEAD, index'length));
+                                reg_val   <= STD_LOGIC_VECTOR(ring_head + 1);
+                                IF unsigned(register_file(C_INDEX_RING_IRQ_EVERY)) /= 0 THEN
+                                    IF ring_since_irq + 1 >= unsigned(register_file(C_INDEX_RING_IRQ_EVERY)) THEN
+                                        trigger_irq    <= '1';
+                                        ring_since_irq <= (OTHERS => '0');
+                                    ELSE
+                                        ring_since_irq <= ring_since_irq + 1;
+                                    END IF;
+                                END IF;
+                            END IF;
                         ELSE
                             write        <= '1';
-                            data_value   <= payload(191 - to_integer(block_offset) * 64 DOWNTO 191 - 63 - to_integer(block_offset) * 64);
-                            address      <= STD_LOGIC_VECTOR(unsigned(register_file(C_INDEX_RESULT_ADDR)) + resize(unsigned(assigned_block(curr_cluster_being_serviced)), 16) * 24 + resize(unsigned(block_offset), 8) * 8);
+                            data_value   <= wb_data;
+                            address      <= wb_address;
                             block_offset <= block_offset + 1;
                         END IF;
                     END IF;
@@ -3,8 +3,14 @@ USE ieee.std_logic_1164.ALL;
 USE ieee.numeric_std.ALL;
 USE work.common_utils_pkg.ALL;
 
--- TODO: - what about timeout if there is no way with the counter to yield such hash
---       - 
+-- Blocks without a valid nonce in their range (NONCE_LIMIT, whole 2^32 space by default)
+-- are written back with status EXHAUSTED and the next block is started; software
+-- re-queues them with a different extranonce.
+-- With RING_ADDR set, every finished block is also appended to a completion ring in
+-- memory, optionally raising the interrupt every RING_IRQ_EVERY entries.
+-- Performance counters follow the registers, read only: cycles of the job, of the block
+-- fetches and of the writebacks, and per cluster the hashes computed and the cycles it
+-- waited for a block. They are cleared on START and hold their value from DONE on.
 
 ENTITY TopLevel IS
     GENERIC (
@@ -14,8 +20,8 @@ ENTITY TopLevel IS
         -- Do not modify the parameters beyond this line
         -- Parameters of Axi Slave Bus Interface S00_AXI
         C_S00_AXI_DATA_WIDTH : INTEGER := 32;
-        C_S00_AXI_ADDR_WIDTH : INTEGER := 6;
-        C_NUM_REGISTERS : INTEGER := 9;
+        C_S00_AXI_ADDR_WIDTH : INTEGER := 8;
+        C_NUM_REGISTERS : INTEGER := 16;
 
         -- Parameters of Axi Master Bus Interface M00_AXI
         C_M00_AXI_ADDR_WIDTH : INTEGER := 32;
@@ -85,6 +91,24 @@ ARCHITECTURE arch_imp OF TopLevel IS
     CONSTANT C_INDEX_RESULT_ADDR : INTEGER := 6;
     CONSTANT C_INDEX_IRQ_ENABLE : INTEGER := 7;
     CONSTANT C_INDEX_IRQ_TOGGLE : INTEGER := 8;
+    CONSTANT C_INDEX_START_NONCE : INTEGER := 9;
+    CONSTANT C_INDEX_NONCE_STRIDE : INTEGER := 10;
+    CONSTANT C_INDEX_NONCE_LIMIT : INTEGER := 11;
+    CONSTANT C_INDEX_RING_ADDR : INTEGER := 12;
+    CONSTANT C_INDEX_RING_MASK : INTEGER := 13;
+    CONSTANT C_INDEX_RING_HEAD : INTEGER := 14;
+    CONSTANT C_INDEX_RING_IRQ_EVERY : INTEGER := 15;
+
+    -- Counters, from register C_NUM_REGISTERS on. 64-bit ones take two registers, low word first.
+    CONSTANT C_PERF_MAGIC : STD_LOGIC_VECTOR(31 DOWNTO 0) := x"50455246"; -- "PERF"
+    CONSTANT C_PERF_INDEX_MAGIC : INTEGER := 0;
+    CONSTANT C_PERF_INDEX_LAYOUT : INTEGER := 1; -- N_HASHERS & CLUSTER_COUNT, a byte each
+    CONSTANT C_PERF_INDEX_JOB_CYCLES : INTEGER := 2;
+    CONSTANT C_PERF_INDEX_FETCH_CYCLES : INTEGER := 4;
+    CONSTANT C_PERF_INDEX_WRITEBACK_CYCLES : INTEGER := 6;
+    -- Then per cluster: hashes, idle cycles
+    CONSTANT C_PERF_INDEX_CLUSTERS : INTEGER := 8;
+    CONSTANT C_NUM_COUNTERS : INTEGER := C_PERF_INDEX_CLUSTERS + 4 * CLUSTER_COUNT;
 
     SIGNAL register_file_sig : TReg(C_NUM_REGISTERS - 1 DOWNTO 0);
 
@@ -104,13 +128,32 @@ ARCHITECTURE arch_imp OF TopLevel IS
     SIGNAL cluster_done_signal : STD_LOGIC_VECTOR(CLUSTER_COUNT - 1 DOWNTO 0);
     SIGNAL cluster_hashes_signal : ARR_160(CLUSTER_COUNT - 1 DOWNTO 0);
     SIGNAL cluster_nonces_signal : ARR_32(CLUSTER_COUNT - 1 DOWNTO 0);
+    SIGNAL cluster_exhausted_signal : STD_LOGIC_VECTOR(CLUSTER_COUNT - 1 DOWNTO 0);
+    SIGNAL cluster_nonces_tried_signal : ARR_32(CLUSTER_COUNT - 1 DOWNTO 0);
+    SIGNAL cluster_cancelled_signal : STD_LOGIC_VECTOR(CLUSTER_COUNT - 1 DOWNTO 0);
     -- OUTPUT TO CLUSTER
     SIGNAL cluster_blocks_signal : ARR_512(CLUSTER_COUNT - 1 DOWNTO 0);
     SIGNAL cluster_start_signal : STD_LOGIC_VECTOR(CLUSTER_COUNT - 1 DOWNTO 0);
+    SIGNAL cluster_abort_signal : STD_LOGIC;
+    SIGNAL cluster_start_nonce_signal : STD_LOGIC_VECTOR(31 DOWNTO 0);
+    SIGNAL cluster_nonce_stride_signal : STD_LOGIC_VECTOR(31 DOWNTO 0);
+    SIGNAL cluster_nonce_limit_signal : STD_LOGIC_VECTOR(31 DOWNTO 0);
+    SIGNAL cluster_hashes_done_signal : ARR_8(CLUSTER_COUNT - 1 DOWNTO 0);
     SIGNAL reset_IRQ : STD_LOGIC;
     signal fsm_irq : std_logic;
 
+    SIGNAL fsm_state : FSMState;
+    SIGNAL perf_job_cycles : unsigned(63 DOWNTO 0);
+    SIGNAL perf_fetch_cycles : unsigned(63 DOWNTO 0);
+    SIGNAL perf_writeback_cycles : unsigned(63 DOWNTO 0);
+    SIGNAL perf_hashes : ARR_U64(CLUSTER_COUNT - 1 DOWNTO 0);
+    SIGNAL perf_idle_cycles : ARR_U64(CLUSTER_COUNT - 1 DOWNTO 0);
+    SIGNAL perf_registers : TReg(C_NUM_COUNTERS - 1 DOWNTO 0);
+
 BEGIN
+    ASSERT C_NUM_REGISTERS + C_NUM_COUNTERS <= 2 ** (C_S00_AXI_ADDR_WIDTH - 2)
+        REPORT "C_S00_AXI_ADDR_WIDTH too small for the performance counters" SEVERITY failure;
+
     s00_axi_rresp <= (OTHERS => '0'); -- "OKAY"
     s00_axi_bresp <= (OTHERS => '0'); -- "OKAY"
 
@@ -134,12 +177,61 @@ BEGIN
     end if;
     end process;
 
+    -- The FSM leaves Idle on the edge after START: the counters start from zero there
+    -- and run until it is back in Idle with DONE set.
+    perf_counters : PROCESS (clk)
+    BEGIN
+        IF rising_edge(clk) THEN
+            IF nReset = '0' OR (fsm_state = Idle AND register_file_sig(C_INDEX_START)(0) = '1') THEN
+                perf_job_cycles <= (OTHERS => '0');
+                perf_fetch_cycles <= (OTHERS => '0');
+                perf_writeback_cycles <= (OTHERS => '0');
+                perf_hashes <= (OTHERS => (OTHERS => '0'));
+                perf_idle_cycles <= (OTHERS => (OTHERS => '0'));
+            ELSIF fsm_state /= Idle THEN
+                perf_job_cycles <= perf_job_cycles + 1;
+                IF fsm_state = state_2 THEN
+                    perf_fetch_cycles <= perf_fetch_cycles + 1;
+                END IF;
+                IF fsm_state = prepare_block_wb OR fsm_state = block_wb OR
+                   fsm_state = prepare_block_wb2 OR fsm_state = block_wb2 THEN
+                    perf_writeback_cycles <= perf_writeback_cycles + 1;
+                END IF;
+                FOR i IN 0 TO CLUSTER_COUNT - 1 LOOP
+                    perf_hashes(i) <= perf_hashes(i) + unsigned(cluster_hashes_done_signal(i));
+                    -- Not hashing while blocks are still handed out: once in wait_all
+                    -- there is none left to wait for
+                    IF cluster_done_signal(i) = '1' AND fsm_state /= wait_all AND
+                       fsm_state /= prepare_block_wb2 AND fsm_state /= block_wb2 THEN
+                        perf_idle_cycles(i) <= perf_idle_cycles(i) + 1;
+                    END IF;
+                END LOOP;
+            END IF;
+        END IF;
+    END PROCESS;
+
+    perf_registers(C_PERF_INDEX_MAGIC) <= C_PERF_MAGIC;
+    perf_registers(C_PERF_INDEX_LAYOUT) <= x"0000" & STD_LOGIC_VECTOR(to_unsigned(N_HASHERS, 8)) & STD_LOGIC_VECTOR(to_unsigned(CLUSTER_COUNT, 8));
+    perf_registers(C_PERF_INDEX_JOB_CYCLES) <= STD_LOGIC_VECTOR(perf_job_cycles(31 DOWNTO 0));
+    perf_registers(C_PERF_INDEX_JOB_CYCLES + 1) <= STD_LOGIC_VECTOR(perf_job_cycles(63 DOWNTO 32));
+    perf_registers(C_PERF_INDEX_FETCH_CYCLES) <= STD_LOGIC_VECTOR(perf_fetch_cycles(31 DOWNTO 0));
+    perf_registers(C_PERF_INDEX_FETCH_CYCLES + 1) <= STD_LOGIC_VECTOR(perf_fetch_cycles(63 DOWNTO 32));
+    perf_registers(C_PERF_INDEX_WRITEBACK_CYCLES) <= STD_LOGIC_VECTOR(perf_writeback_cycles(31 DOWNTO 0));
+    perf_registers(C_PERF_INDEX_WRITEBACK_CYCLES + 1) <= STD_LOGIC_VECTOR(perf_writeback_cycles(63 DOWNTO 32));
+    perf_cluster_registers : FOR i IN 0 TO CLUSTER_COUNT - 1 GENERATE
+        perf_registers(C_PERF_INDEX_CLUSTERS + 4 * i) <= STD_LOGIC_VECTOR(perf_hashes(i)(31 DOWNTO 0));
+        perf_registers(C_PERF_INDEX_CLUSTERS + 4 * i + 1) <= STD_LOGIC_VECTOR(perf_hashes(i)(63 DOWNTO 32));
+        perf_registers(C_PERF_INDEX_CLUSTERS + 4 * i + 2) <= STD_LOGIC_VECTOR(perf_idle_cycles(i)(31 DOWNTO 0));
+        perf_registers(C_PERF_INDEX_CLUSTERS + 4 * i + 3) <= STD_LOGIC_VECTOR(perf_idle_cycles(i)(63 DOWNTO 32));
+    END GENERATE perf_cluster_registers;
+
 
     slave : ENTITY work.AXI4Slave
         GENERIC MAP(
             C_S00_AXI_DATA_WIDTH => C_S00_AXI_DATA_WIDTH,
             C_S00_AXI_ADDR_WIDTH => C_S00_AXI_ADDR_WIDTH,
-            C_NUM_REGISTERS => C_NUM_REGISTERS
+            C_NUM_REGISTERS => C_NUM_REGISTERS,
+            C_NUM_COUNTERS => C_NUM_COUNTERS
         )
         PORT MAP(
 
@@ -163,6 +255,7 @@ BEGIN
             index => index_sig,
             reg_val => reg_val_sig,
             reset_irq => reset_irq,
+            counters => perf_registers,
             -- outputs
             register_file => register_file_sig
         );
@@ -225,6 +318,7 @@ BEGIN
             finished_read => finished_read_sig,
 
             fsm_irq => fsm_irq,
+            state => fsm_state,
 
             -- outputs 
             read => read_sig,
@@ -237,8 +331,15 @@ BEGIN
             cluster_done => cluster_done_signal,
             cluster_hashes => cluster_hashes_signal,
             cluster_nonces => cluster_nonces_signal,
+            cluster_exhausted => cluster_exhausted_signal,
+            cluster_nonces_tried => cluster_nonces_tried_signal,
+            cluster_cancelled => cluster_cancelled_signal,
             cluster_blocks => cluster_blocks_signal,
-            cluster_start => cluster_start_signal
+            cluster_start => cluster_start_signal,
+            cluster_abort => cluster_abort_signal,
+            cluster_start_nonce => cluster_start_nonce_signal,
+            cluster_nonce_stride => cluster_nonce_stride_signal,
+            cluster_nonce_limit => cluster_nonce_limit_signal
         );
 
     clusters : FOR i IN 0 TO CLUSTER_COUNT - 1 GENERATE
@@ -250,11 +351,19 @@ BEGIN
 
                 input_block => cluster_blocks_signal(i),
                 start => cluster_start_signal(i),
-                stop => register_file_sig(C_INDEX_STOP)(0),
+                -- STOP goes through the FSM, which collects the partial results
+                stop => cluster_abort_signal,
                 difficulty => register_file_sig(C_INDEX_DIFFICULTY),
+                start_nonce => cluster_start_nonce_signal,
+                nonce_stride => cluster_nonce_stride_signal,
+                nonce_limit => cluster_nonce_limit_signal,
                 done => cluster_done_signal(i),
                 hash => cluster_hashes_signal(i),
-                nonce => cluster_nonces_signal(i)
+                nonce => cluster_nonces_signal(i),
+                exhausted => cluster_exhausted_signal(i),
+                nonces_tried => cluster_nonces_tried_signal(i),
+                cancelled => cluster_cancelled_signal(i),
+                hashes_done => cluster_hashes_done_signal(i)
             );
     END GENERATE clusters;
 
@@ -0,0 +1,503 @@
+LIBRARY ieee;
+USE ieee.std_logic_1164.ALL;
+USE ieee.numeric_std.ALL;
+USE std.textio.ALL;
+
+-- Runs the jobs of tb_vectors.cpp through TopLevel, driving the registers over the AXI
+-- slave and serving the AXI master from a memory model, and checks every result record
+-- against the accelerator model: nonce, nonces tried and status, FOUND or EXHAUSTED,
+-- for a stride of 0, a limit of 0 (2^32) and ranges running out, and the performance
+-- counters of every job. Then stops a job mid-search and checks the CANCELLED records,
+-- and that the FSM takes the next job. Last, a job with more blocks than ring entries
+-- checks the ring: entries, wrap at RING_MASK and the RING_IRQ_EVERY interrupts.
+
+ENTITY tb_TopLevel IS
+    GENERIC (
+        VECTORS : STRING := "vectors.txt"
+    );
+END tb_TopLevel;
+
+ARCHITECTURE sim OF tb_TopLevel IS
+    CONSTANT C_CLK_PERIOD : TIME := 10 ns;
+    -- As tb_vectors.cpp
+    CONSTANT C_CLUSTER_COUNT : INTEGER := 2;
+    CONSTANT C_N_HASHERS : INTEGER := 2;
+    CONSTANT C_RESULT_ADDR : INTEGER := 16#0000#;
+    CONSTANT C_BLOCK_ADDR : INTEGER := 16#1000#;
+    CONSTANT C_MEM_WORDS : INTEGER := 16#2000# / 8;
+    -- Polls of DONE before a job is taken as hung
+    CONSTANT C_JOB_TIMEOUT : INTEGER := 100000;
+    -- Written over the records before a job, so that a missing one shows
+    CONSTANT C_SENTINEL : STD_LOGIC_VECTOR(63 DOWNTO 0) := x"DEADBEEFDEADBEEF";
+    -- Completion ring of the last job: 4 entries for 6 blocks, an interrupt every 2
+    CONSTANT C_RING_ADDR : INTEGER := 16#0800#;
+    CONSTANT C_RING_ENTRIES : INTEGER := 4;
+    CONSTANT C_RING_BLOCKS : INTEGER := 6;
+    CONSTANT C_RING_IRQ_EVERY : INTEGER := 2;
+
+    CONSTANT C_INDEX_BLOCK_ADDRESS : INTEGER := 0;
+    CONSTANT C_INDEX_N_BLOCKS : INTEGER := 1;
+    CONSTANT C_INDEX_DIFFICULTY : INTEGER := 2;
+    CONSTANT C_INDEX_START : INTEGER := 3;
+    CONSTANT C_INDEX_STOP : INTEGER := 4;
+    CONSTANT C_INDEX_DONE : INTEGER := 5;
+    CONSTANT C_INDEX_RESULT_ADDR : INTEGER := 6;
+    CONSTANT C_INDEX_IRQ_ENABLE : INTEGER := 7;
+    CONSTANT C_INDEX_IRQ_TOGGLE : INTEGER := 8;
+    CONSTANT C_INDEX_START_NONCE : INTEGER := 9;
+    CONSTANT C_INDEX_NONCE_STRIDE : INTEGER := 10;
+    CONSTANT C_INDEX_NONCE_LIMIT : INTEGER := 11;
+    CONSTANT C_INDEX_RING_ADDR : INTEGER := 12;
+    CONSTANT C_INDEX_RING_MASK : INTEGER := 13;
+    CONSTANT C_INDEX_RING_HEAD : INTEGER := 14;
+    CONSTANT C_INDEX_RING_IRQ_EVERY : INTEGER := 15;
+    -- Performance counters, read only after the registers; 64-bit ones low word first
+    CONSTANT C_INDEX_PERF_MAGIC : INTEGER := 16;
+    CONSTANT C_INDEX_PERF_LAYOUT : INTEGER := 17;
+    CONSTANT C_INDEX_PERF_JOB_CYCLES : INTEGER := 18;
+    CONSTANT C_INDEX_PERF_FETCH_CYCLES : INTEGER := 20;
+    CONSTANT C_INDEX_PERF_WRITEBACK_CYCLES : INTEGER := 22;
+    CONSTANT C_INDEX_PERF_CLUSTERS : INTEGER := 24; -- hashes of cluster c at + 4 * c
+    CONSTANT C_PERF_MAGIC : STD_LOGIC_VECTOR(31 DOWNTO 0) := x"50455246"; -- "PERF"
+
+    TYPE TMem IS ARRAY (0 TO C_MEM_WORDS - 1) OF STD_LOGIC_VECTOR(63 DOWNTO 0);
+
+    SIGNAL clk : STD_LOGIC := '0';
+    SIGNAL nReset : STD_LOGIC := '0';
+    SIGNAL sim_done : BOOLEAN := FALSE;
+    SIGNAL irq : STD_LOGIC;
+
+    SIGNAL s_awaddr : STD_LOGIC_VECTOR(7 DOWNTO 0) := (OTHERS => '0');
+    SIGNAL s_awvalid : STD_LOGIC := '0';
+    SIGNAL s_awready : STD_LOGIC;
+    SIGNAL s_wdata : STD_LOGIC_VECTOR(31 DOWNTO 0) := (OTHERS => '0');
+    SIGNAL s_wvalid : STD_LOGIC := '0';
+    SIGNAL s_wready : STD_LOGIC;
+    SIGNAL s_bresp : STD_LOGIC_VECTOR(1 DOWNTO 0);
+    SIGNAL s_bvalid : STD_LOGIC;
+    SIGNAL s_araddr : STD_LOGIC_VECTOR(7 DOWNTO 0) := (OTHERS => '0');
+    SIGNAL s_arvalid : STD_LOGIC := '0';
+    SIGNAL s_arready : STD_LOGIC;
+    SIGNAL s_rdata : STD_LOGIC_VECTOR(31 DOWNTO 0);
+    SIGNAL s_rresp : STD_LOGIC_VECTOR(1 DOWNTO 0);
+    SIGNAL s_rvalid : STD_LOGIC;
+
+    SIGNAL m_awaddr : STD_LOGIC_VECTOR(31 DOWNTO 0);
+    SIGNAL m_awprot : STD_LOGIC_VECTOR(2 DOWNTO 0);
+    SIGNAL m_awvalid : STD_LOGIC;
+    SIGNAL m_awready : STD_LOGIC := '0';
+    SIGNAL m_wdata : STD_LOGIC_VECTOR(63 DOWNTO 0);
+    SIGNAL m_wstrb : STD_LOGIC_VECTOR(7 DOWNTO 0);
+    SIGNAL m_wvalid : STD_LOGIC;
+    SIGNAL m_wready : STD_LOGIC := '0';
+    SIGNAL m_bvalid : STD_LOGIC := '0';
+    SIGNAL m_bready : STD_LOGIC;
+    SIGNAL m_araddr : STD_LOGIC_VECTOR(31 DOWNTO 0);
+    SIGNAL m_arprot : STD_LOGIC_VECTOR(2 DOWNTO 0);
+    SIGNAL m_arvalid : STD_LOGIC;
+    SIGNAL m_arready : STD_LOGIC := '0';
+    SIGNAL m_rdata : STD_LOGIC_VECTOR(63 DOWNTO 0) := (OTHERS => '0');
+    SIGNAL m_rvalid : STD_LOGIC := '0';
+    SIGNAL m_rready : STD_LOGIC;
+
+    -- Memory behind the AXI master; the stimulus fills it through the load port
+    SIGNAL mem : TMem := (OTHERS => (OTHERS => '0'));
+    SIGNAL load_en : STD_LOGIC := '0';
+    SIGNAL load_addr : INTEGER RANGE 0 TO C_MEM_WORDS - 1 := 0;
+    SIGNAL load_data : STD_LOGIC_VECTOR(63 DOWNTO 0) := (OTHERS => '0');
+
+BEGIN
+
+    clk <= NOT clk AFTER C_CLK_PERIOD / 2 WHEN NOT sim_done;
+
+    dut : ENTITY work.TopLevel
+        GENERIC MAP(
+            CLUSTER_COUNT => C_CLUSTER_COUNT,
+            N_HASHERS => C_N_HASHERS
+        )
+        PORT MAP(
+            clk => clk,
+            nReset => nReset,
+            irq => irq,
+            reset_irq_out => OPEN,
+            s00_axi_awaddr => s_awaddr,
+            s00_axi_awprot => "000",
+            s00_axi_awvalid => s_awvalid,
+            s00_axi_awready => s_awready,
+            s00_axi_wdata => s_wdata,
+            s00_axi_wstrb => "1111",
+            s00_axi_wvalid => s_wvalid,
+            s00_axi_wready => s_wready,
+            s00_axi_bresp => s_bresp,
+            s00_axi_bvalid => s_bvalid,
+            s00_axi_bready => '1',
+            s00_axi_araddr => s_araddr,
+            s00_axi_arprot => "000",
+            s00_axi_arvalid => s_arvalid,
+            s00_axi_arready => s_arready,
+            s00_axi_rdata => s_rdata,
+            s00_axi_rresp => s_rresp,
+            s00_axi_rvalid => s_rvalid,
+            s00_axi_rready => '1',
+            m00_axi_awaddr => m_awaddr,
+            m00_axi_awprot => m_awprot,
+            m00_axi_awvalid => m_awvalid,
+            m00_axi_awready => m_awready,
+            m00_axi_wdata => m_wdata,
+            m00_axi_wstrb => m_wstrb,
+            m00_axi_wvalid => m_wvalid,
+            m00_axi_wready => m_wready,
+            m00_axi_bresp => "00",
+            m00_axi_bvalid => m_bvalid,
+            m00_axi_bready => m_bready,
+            m00_axi_araddr => m_araddr,
+            m00_axi_arprot => m_arprot,
+            m00_axi_arvalid => m_arvalid,
+            m00_axi_arready => m_arready,
+            m00_axi_rdata => m_rdata,
+            m00_axi_rresp => "00",
+            m00_axi_rvalid => m_rvalid,
+            m00_axi_rready => m_rready
+        );
+
+    -- One transfer at a time, as AXI4Master issues them: address and data together on
+    -- writes, the response held until bready/rready.
+    memory : PROCESS (clk)
+    BEGIN
+        IF rising_edge(clk) THEN
+            m_awready <= '0';
+            m_wready <= '0';
+            m_arready <= '0';
+            IF m_bvalid = '1' AND m_bready = '1' THEN
+                m_bvalid <= '0';
+            END IF;
+            IF m_rvalid = '1' AND m_rready = '1' THEN
+                m_rvalid <= '0';
+            END IF;
+            IF load_en = '1' THEN
+                mem(load_addr) <= load_data;
+            ELSIF m_awvalid = '1' AND m_wvalid = '1' AND m_awready = '0' AND m_bvalid = '0' THEN
+                mem(to_integer(unsigned(m_awaddr(12 DOWNTO 3)))) <= m_wdata;
+                m_awready <= '1';
+                m_wready <= '1';
+                m_bvalid <= '1';
+            ELSIF m_arvalid = '1' AND m_arready = '0' AND m_rvalid = '0' THEN
+                m_rdata <= mem(to_integer(unsigned(m_araddr(12 DOWNTO 3))));
+                m_arready <= '1';
+                m_rvalid <= '1';
+            END IF;
+        END IF;
+    END PROCESS memory;
+
+    stimulus : PROCESS
+        FILE vectors_file : TEXT;
+        VARIABLE l : LINE;
+        VARIABLE n_blocks, difficulty, start_nonce, nonce_stride, nonce_limit : STD_LOGIC_VECTOR(31 DOWNTO 0);
+        VARIABLE word, hashes : STD_LOGIC_VECTOR(63 DOWNTO 0);
+        VARIABLE job : INTEGER := 0;
+        VARIABLE errors : INTEGER := 0;
+        VARIABLE value : STD_LOGIC_VECTOR(31 DOWNTO 0);
+        VARIABLE nonces : unsigned(31 DOWNTO 0);
+        VARIABLE entry : STD_LOGIC_VECTOR(63 DOWNTO 0);
+        VARIABLE entry_block : INTEGER;
+        VARIABLE seen : STD_LOGIC_VECTOR(C_RING_BLOCKS - 1 DOWNTO 0);
+
+        PROCEDURE tick(n : INTEGER) IS
+        BEGIN
+            FOR i IN 1 TO n LOOP
+                WAIT UNTIL rising_edge(clk);
+            END LOOP;
+        END PROCEDURE;
+
+        PROCEDURE reg_write(index : INTEGER; value : STD_LOGIC_VECTOR(31 DOWNTO 0)) IS
+        BEGIN
+            s_awaddr <= STD_LOGIC_VECTOR(to_unsigned(index * 4, s_awaddr'length));
+            s_wdata <= value;
+            s_awvalid <= '1';
+            s_wvalid <= '1';
+            WAIT UNTIL rising_edge(clk) AND s_awready = '1';
+            s_awvalid <= '0';
+            WAIT UNTIL rising_edge(clk) AND s_bvalid = '1';
+            s_wvalid <= '0';
+        END PROCEDURE;
+
+        PROCEDURE reg_read(index : INTEGER; value : OUT STD_LOGIC_VECTOR(31 DOWNTO 0)) IS
+        BEGIN
+            s_araddr <= STD_LOGIC_VECTOR(to_unsigned(index * 4, s_araddr'length));
+            s_arvalid <= '1';
+            WAIT UNTIL rising_edge(clk) AND s_arready = '1';
+            s_arvalid <= '0';
+            WAIT UNTIL rising_edge(clk) AND s_rvalid = '1';
+            value := s_rdata;
+        END PROCEDURE;
+
+        PROCEDURE counter_read(index : INTEGER; value : OUT unsigned(63 DOWNTO 0)) IS
+            VARIABLE low, high : STD_LOGIC_VECTOR(31 DOWNTO 0);
+        BEGIN
+            reg_read(index, low);
+            reg_read(index + 1, high);
+            value := unsigned(high & low);
+        END PROCEDURE;
+
+        PROCEDURE mem_load(addr : INTEGER; value : STD_LOGIC_VECTOR(63 DOWNTO 0)) IS
+        BEGIN
+            load_addr <= addr;
+            load_data <= value;
+            load_en <= '1';
+            WAIT UNTIL rising_edge(clk);
+            load_en <= '0';
+        END PROCEDURE;
+
+        -- DONE polled until the FSM is back in Idle
+        PROCEDURE wait_done IS
+            VARIABLE value : STD_LOGIC_VECTOR(31 DOWNTO 0);
+        BEGIN
+            tick(4);
+            FOR i IN 1 TO C_JOB_TIMEOUT LOOP
+                reg_read(C_INDEX_DONE, value);
+                IF value(0) = '1' THEN
+                    RETURN;
+                END IF;
+                tick(16);
+            END LOOP;
+            REPORT "job " & INTEGER'image(job) & " never raised DONE" SEVERITY failure;
+        END PROCEDURE;
+
+        PROCEDURE run_job IS
+        BEGIN
+            reg_write(C_INDEX_START, x"00000001");
+            wait_done;
+        END PROCEDURE;
+
+        PROCEDURE check_word(block_index, k : INTEGER; expected : STD_LOGIC_VECTOR(63 DOWNTO 0)) IS
+            VARIABLE got : STD_LOGIC_VECTOR(63 DOWNTO 0);
+        BEGIN
+            got := mem(C_RESULT_ADDR / 8 + block_index * 4 + k);
+            IF got /= expected THEN
+                REPORT "job " & INTEGER'image(job) & " block " & INTEGER'image(block_index) &
+                    " record word " & INTEGER'image(k) & ": " & to_hstring(got) &
+                    ", expected " & to_hstring(expected) SEVERITY error;
+                errors := errors + 1;
+            END IF;
+        END PROCEDURE;
+
+        -- Counters of the last job: the hashes of all the clusters, and the fetches and
+        -- writebacks within the cycles of the job
+        PROCEDURE check_perf(expected_hashes : STD_LOGIC_VECTOR(63 DOWNTO 0)) IS
+            VARIABLE counter, total, job_cycles, fetch_cycles, writeback_cycles : unsigned(63 DOWNTO 0);
+        BEGIN
+            total := (OTHERS => '0');
+            FOR c IN 0 TO C_CLUSTER_COUNT - 1 LOOP
+                counter_read(C_INDEX_PERF_CLUSTERS + 4 * c, counter);
+                total := total + counter;
+            END LOOP;
+            IF total /= unsigned(expected_hashes) THEN
+                REPORT "job " & INTEGER'image(job) & ": " & to_hstring(total) & " hashes counted, expected " &
+                    to_hstring(expected_hashes) SEVERITY error;
+                errors := errors + 1;
+            END IF;
+            counter_read(C_INDEX_PERF_JOB_CYCLES, job_cycles);
+            counter_read(C_INDEX_PERF_FETCH_CYCLES, fetch_cycles);
+            counter_read(C_INDEX_PERF_WRITEBACK_CYCLES, writeback_cycles);
+            IF fetch_cycles = 0 OR writeback_cycles = 0 OR job_cycles < fetch_cycles + writeback_cycles THEN
+                REPORT "job " & INTEGER'image(job) & ": " & to_hstring(job_cycles) & " job cycles, " &
+                    to_hstring(fetch_cycles) & " fetching, " & to_hstring(writeback_cycles) & " writing back" SEVERITY error;
+                errors := errors + 1;
+            END IF;
+        END PROCEDURE;
+
+    BEGIN
+        tick(10);
+        nReset <= '1';
+        tick(2);
+        -- The register file is not reset
+        FOR i IN C_INDEX_BLOCK_ADDRESS TO C_INDEX_RING_IRQ_EVERY LOOP
+            IF i /= C_INDEX_DONE AND i /= C_INDEX_IRQ_TOGGLE THEN
+                reg_write(i, x"00000000");
+            END IF;
+        END LOOP;
+        reg_write(C_INDEX_BLOCK_ADDRESS, STD_LOGIC_VECTOR(to_unsigned(C_BLOCK_ADDR, 32)));
+        reg_write(C_INDEX_RESULT_ADDR, STD_LOGIC_VECTOR(to_unsigned(C_RESULT_ADDR, 32)));
+
+        reg_read(C_INDEX_PERF_MAGIC, value);
+        ASSERT value = C_PERF_MAGIC REPORT "no performance counters: magic " & to_hstring(value) SEVERITY failure;
+        reg_read(C_INDEX_PERF_LAYOUT, value);
+        ASSERT value = x"0000" & STD_LOGIC_VECTOR(to_unsigned(C_N_HASHERS, 8)) & STD_LOGIC_VECTOR(to_unsigned(C_CLUSTER_COUNT, 8))
+            REPORT "performance counter layout " & to_hstring(value) SEVERITY failure;
+
+        file_open(vectors_file, VECTORS, read_mode);
+        WHILE NOT endfile(vectors_file) LOOP
+            readline(vectors_file, l);
+            hread(l, n_blocks);
+            hread(l, difficulty);
+            hread(l, start_nonce);
+            hread(l, nonce_stride);
+            hread(l, nonce_limit);
+            hread(l, hashes);
+            FOR i IN 0 TO to_integer(unsigned(n_blocks)) * 8 - 1 LOOP
+                readline(vectors_file, l);
+                hread(l, word);
+                mem_load(C_BLOCK_ADDR / 8 + i, word);
+            END LOOP;
+            FOR i IN 0 TO to_integer(unsigned(n_blocks)) * 4 - 1 LOOP
+                mem_load(C_RESULT_ADDR / 8 + i, C_SENTINEL);
+            END LOOP;
+
+            reg_write(C_INDEX_N_BLOCKS, n_blocks);
+            reg_write(C_INDEX_DIFFICULTY, difficulty);
+            reg_write(C_INDEX_START_NONCE, start_nonce);
+            reg_write(C_INDEX_NONCE_STRIDE, nonce_stride);
+            reg_write(C_INDEX_NONCE_LIMIT, nonce_limit);
+            run_job;
+
+            FOR b IN 0 TO to_integer(unsigned(n_blocks)) - 1 LOOP
+                FOR k IN 0 TO 3 LOOP
+                    readline(vectors_file, l);
+                    hread(l, word);
+                    check_word(b, k, word);
+                END LOOP;
+            END LOOP;
+            check_perf(hashes);
+            job := job + 1;
+        END LOOP;
+        file_close(vectors_file);
+
+        -- STOP mid-job: the blocks on the clusters come back CANCELLED with the nonces
+        -- tried so far and the first one not tried, the block still waiting for a
+        -- cluster gets no record. Nothing is found at this difficulty.
+        FOR i IN 0 TO (C_CLUSTER_COUNT + 1) * 8 - 1 LOOP
+            mem_load(C_BLOCK_ADDR / 8 + i, STD_LOGIC_VECTOR(to_unsigned(i, 64)));
+        END LOOP;
+        FOR i IN 0 TO (C_CLUSTER_COUNT + 1) * 4 - 1 LOOP
+            mem_load(C_RESULT_ADDR / 8 + i, C_SENTINEL);
+        END LOOP;
+        reg_write(C_INDEX_N_BLOCKS, STD_LOGIC_VECTOR(to_unsigned(C_CLUSTER_COUNT + 1, 32)));
+        reg_write(C_INDEX_DIFFICULTY, x"FFFFFFFF");
+        reg_write(C_INDEX_START_NONCE, x"00000064");
+        reg_write(C_INDEX_NONCE_STRIDE, x"00000003");
+        reg_write(C_INDEX_NONCE_LIMIT, x"00000000");
+        reg_write(C_INDEX_START, x"00000001");
+        tick(2000);
+        reg_read(C_INDEX_DONE, value);
+        ASSERT value(0) = '0' REPORT "job " & INTEGER'image(job) & " over before STOP" SEVERITY failure;
+        reg_write(C_INDEX_STOP, x"00000001");
+        wait_done;
+        FOR b IN 0 TO C_CLUSTER_COUNT - 1 LOOP
+            check_word(b, 0, x"0000000000000000");
+            check_word(b, 1, x"0000000000000000");
+            nonces := unsigned(mem(C_RESULT_ADDR / 8 + b * 4 + 3)(31 DOWNTO 0));
+            -- Whole rounds: the nonces in flight when the hashers were stopped do not count
+            IF nonces = 0 OR nonces MOD C_N_HASHERS /= 0 THEN
+                REPORT "job " & INTEGER'image(job) & " block " & INTEGER'image(b) &
+                    ": " & to_hstring(nonces) & " nonces tried" SEVERITY error;
+                errors := errors + 1;
+            END IF;
+            check_word(b, 2, x"00000000" & STD_LOGIC_VECTOR(unsigned'(x"00000064") + resize(nonces * 3, 32)));
+            check_word(b, 3, x"00000003" & STD_LOGIC_VECTOR(nonces));
+        END LOOP;
+        FOR k IN 0 TO 3 LOOP
+            check_word(C_CLUSTER_COUNT, k, C_SENTINEL);
+        END LOOP;
+        reg_write(C_INDEX_STOP, x"00000000");
+        job := job + 1;
+
+        -- Back in Idle, the next job runs to the end
+        mem_load(C_RESULT_ADDR / 8, C_SENTINEL);
+        reg_write(C_INDEX_N_BLOCKS, x"00000001");
+        reg_write(C_INDEX_START_NONCE, x"00000000");
+        reg_write(C_INDEX_NONCE_STRIDE, x"00000001");
+        reg_write(C_INDEX_NONCE_LIMIT, x"00000004");
+        run_job;
+        check_word(0, 0, x"0000000000000000");
+        check_word(0, 1, x"0000000000000000");
+        check_word(0, 2, x"0000000000000004");
+        check_word(0, 3, x"0000000200000004");
+        check_perf(x"0000000000000004");
+        job := job + 1;
+
+        -- Ring: 6 exhausted blocks of 64 nonces append 6 entries to a ring of 4, so the
+        -- last ones wrap to slots 0 and 1 and nothing is written past slot 3. The
+        -- interrupt comes with the header at 2 and 4 entries, then at the end of the job.
+        FOR i IN 0 TO C_RING_BLOCKS * 8 - 1 LOOP
+            mem_load(C_BLOCK_ADDR / 8 + i, STD_LOGIC_VECTOR(to_unsigned(i, 64)));
+        END LOOP;
+        FOR i IN 0 TO C_RING_BLOCKS * 4 - 1 LOOP
+            mem_load(C_RESULT_ADDR / 8 + i, C_SENTINEL);
+        END LOOP;
+        FOR i IN 0 TO (64 + 16 * (C_RING_ENTRIES + 1)) / 8 - 1 LOOP
+            mem_load(C_RING_ADDR / 8 + i, C_SENTINEL);
+        END LOOP;
+        reg_write(C_INDEX_N_BLOCKS, STD_LOGIC_VECTOR(to_unsigned(C_RING_BLOCKS, 32)));
+        reg_write(C_INDEX_NONCE_LIMIT, x"00000040");
+        reg_write(C_INDEX_RING_ADDR, STD_LOGIC_VECTOR(to_unsigned(C_RING_ADDR, 32)));
+        reg_write(C_INDEX_RING_MASK, STD_LOGIC_VECTOR(to_unsigned(C_RING_ENTRIES - 1, 32)));
+        reg_write(C_INDEX_RING_HEAD, x"00000000");
+        reg_write(C_INDEX_RING_IRQ_EVERY, STD_LOGIC_VECTOR(to_unsigned(C_RING_IRQ_EVERY, 32)));
+        reg_write(C_INDEX_IRQ_ENABLE, x"00000001");
+        reg_write(C_INDEX_START, x"00000001");
+        -- Blocks take a few thousand cycles each: every interrupt is acknowledged before
+        -- the next entry
+        FOR n IN 1 TO (C_RING_BLOCKS - 1) / C_RING_IRQ_EVERY LOOP
+            WAIT UNTIL irq = '1' FOR C_JOB_TIMEOUT * C_CLK_PERIOD;
+            ASSERT irq = '1' REPORT "no ring interrupt " & INTEGER'image(n) SEVERITY failure;
+            IF mem(C_RING_ADDR / 8) /= STD_LOGIC_VECTOR(to_unsigned(n * C_RING_IRQ_EVERY, 64)) THEN
+                REPORT "ring interrupt " & INTEGER'image(n) & " with the head at " &
+                    to_hstring(mem(C_RING_ADDR / 8)) SEVERITY error;
+                errors := errors + 1;
+            END IF;
+            reg_write(C_INDEX_IRQ_TOGGLE, x"00000001");
+        END LOOP;
+        wait_done;
+        ASSERT irq = '1' REPORT "no interrupt at the end of the ring job" SEVERITY failure;
+        reg_write(C_INDEX_IRQ_TOGGLE, x"00000001");
+
+        FOR b IN 0 TO C_RING_BLOCKS - 1 LOOP
+            check_word(b, 0, x"0000000000000000");
+            check_word(b, 1, x"0000000000000000");
+            check_word(b, 2, x"0000000000000040");
+            check_word(b, 3, x"0000000200000040");
+        END LOOP;
+        IF mem(C_RING_ADDR / 8) /= STD_LOGIC_VECTOR(to_unsigned(C_RING_BLOCKS, 64)) THEN
+            REPORT "ring head " & to_hstring(mem(C_RING_ADDR / 8)) SEVERITY error;
+            errors := errors + 1;
+        END IF;
+        reg_read(C_INDEX_RING_HEAD, value);
+        IF value /= STD_LOGIC_VECTOR(to_unsigned(C_RING_BLOCKS, 32)) THEN
+            REPORT "RING_HEAD " & to_hstring(value) SEVERITY error;
+            errors := errors + 1;
+        END IF;
+        -- Every slot holds the entry of a different block, as in its record
+        seen := (OTHERS => '0');
+        FOR s IN 0 TO C_RING_ENTRIES - 1 LOOP
+            entry := mem(C_RING_ADDR / 8 + 8 + 2 * s);
+            entry_block := to_integer(unsigned(entry(7 DOWNTO 0)));
+            IF entry(63 DOWNTO 8) /= x"00000040000000" OR entry_block >= C_RING_BLOCKS THEN
+                REPORT "ring slot " & INTEGER'image(s) & ": " & to_hstring(entry) SEVERITY error;
+                errors := errors + 1;
+            ELSIF seen(entry_block) = '1' OR mem(C_RING_ADDR / 8 + 8 + 2 * s + 1) /=
+                STD_LOGIC_VECTOR(to_unsigned(C_RESULT_ADDR + 32 * entry_block, 32)) & x"00000002" THEN
+                REPORT "ring slot " & INTEGER'image(s) & " of block " & INTEGER'image(entry_block) & ": " &
+                    to_hstring(mem(C_RING_ADDR / 8 + 8 + 2 * s + 1)) SEVERITY error;
+                errors := errors + 1;
+            ELSE
+                seen(entry_block) := '1';
+            END IF;
+        END LOOP;
+        FOR k IN 0 TO 1 LOOP
+            IF mem(C_RING_ADDR / 8 + 8 + 2 * C_RING_ENTRIES + k) /= C_SENTINEL THEN
+                REPORT "ring written past RING_MASK" SEVERITY error;
+                errors := errors + 1;
+            END IF;
+        END LOOP;
+        reg_write(C_INDEX_IRQ_ENABLE, x"00000000");
+        reg_write(C_INDEX_RING_IRQ_EVERY, x"00000000");
+        reg_write(C_INDEX_RING_ADDR, x"00000000");
+        job := job + 1;
+
+        ASSERT errors = 0 REPORT INTEGER'image(errors) & " checks failed" SEVERITY failure;
+        REPORT INTEGER'image(job) & " jobs passed" SEVERITY note;
+        sim_done <= TRUE;
+        WAIT;
+    END PROCESS stimulus;
+
+END ARCHITECTURE sim;
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "AccelModel.h"
+
+// Reference vectors of tb_TopLevel.vhd: jobs run through the accelerator model, whose
+// records are those of pow_hash_nonce() with the range semantics of ClusterController.vhd.
+// Per job, a line "n_blocks difficulty start_nonce nonce_stride nonce_limit hashes", hashes
+// being the performance counters of the model summed over the clusters, then the 8 words
+// of every block as the AXI master reads them, then the 4 words of every record as the
+// FSM writes them, all in hex.
+
+// Generics of the testbench
+#define TB_CLUSTERS 2
+#define TB_HASHERS 2
+
+#define TB_RESULT_ADDR 0x0000
+#define TB_BLOCK_ADDR 0x1000
+#define TB_MEM_BYTES 0x2000
+
+struct tb_job
+{
+    uint32_t n_blocks;
+    uint32_t difficulty;
+    uint32_t start_nonce;
+    uint32_t nonce_stride;
+    uint32_t nonce_limit;
+};
+
+// Kept to a few dozen rounds per block, the simulation hashes every nonce.
+static const struct tb_job jobs[] = {
+    {3, 0xF0000000, 0x00000000, 0, 0},          // stride 0 taken as 1, whole range
+    {2, 0xF0000000, 0xFFFFFFF0, 7, 0},          // whole range, wrapping around 2^32
+    {3, 0xFFFFFFFF, 0x00001000, 5, 7},          // exhausted, limit ends mid-round
+    {1, 0xFFFFFFFF, 0xFFFFFFFE, 0, 4},          // exhausted, stride 0, next nonce wraps
+    {3, 0xE0000000, 0x12345678, 3, 64},         // found before the limit
+};
+
+static uint64_t load64(const uint8_t* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+int main(int argc, char ** argv)
+{
+    struct accel_model_config config;
+    uint8_t* mem = (uint8_t*)calloc(1, TB_MEM_BYTES);
+    FILE* out = argc > 1 ? fopen(argv[1], "w") : stdout;
+
+    if (!mem || !out)
+    {
+        printf("Cannot set up the vectors\n");
+        return -1;
+    }
+    accel_model_default_config(&config);
+    config.clusters = TB_CLUSTERS;
+    config.hashers = TB_HASHERS;
+    struct accel_model* model = accel_model_create(&config, mem, 0, TB_MEM_BYTES);
+
+    srand(7);
+    for (size_t j = 0; j < sizeof(jobs) / sizeof(jobs[0]); ++j)
+    {
+        const struct tb_job* job = &jobs[j];
+        struct user_message message = {TB_BLOCK_ADDR, job->n_blocks, job->difficulty, TB_RESULT_ADDR,
+                                       job->start_nonce, job->nonce_stride, job->nonce_limit};
+
+        for (uint32_t i = 0; i < job->n_blocks * 64; ++i)
+            mem[TB_BLOCK_ADDR + i] = rand();
+        memset(mem + TB_RESULT_ADDR, 0, job->n_blocks * HASHER_RESULT_BYTES);
+        if (accel_model_submit(model, &message))
+            return -1;
+
+        // The model may hand the blocks to other clusters than the FSM: only the sum is checked.
+        uint64_t hashes = 0;
+        for (uint32_t c = 0; c < TB_CLUSTERS; ++c)
+            hashes += accel_model_read(model, HASHER_PERF_REG_CLUSTERS + 4 * c) |
+                      (uint64_t)accel_model_read(model, HASHER_PERF_REG_CLUSTERS + 4 * c + 1) << 32;
+        fprintf(out, "%08x %08x %08x %08x %08x %016llx\n", job->n_blocks, job->difficulty,
+                job->start_nonce, job->nonce_stride, job->nonce_limit, (unsigned long long)hashes);
+        for (uint32_t i = 0; i < job->n_blocks * 8; ++i)
+            fprintf(out, "%016llx\n", (unsigned long long)load64(mem + TB_BLOCK_ADDR + i * 8));
+        for (uint32_t i = 0; i < job->n_blocks * 4; ++i)
+            fprintf(out, "%016llx\n", (unsigned long long)load64(mem + TB_RESULT_ADDR + i * 8));
+    }
+
+    accel_model_destroy(model);
+    free(mem);
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
@@ -0,0 +1,487 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "AccelModel.h"
+
+// Register indexes, see driver/README.md.
+#define BLOCK_ADDRESS 0
+#define N_BLOCKS 1
+#define DIFFICULTY 2
+#define START 3
+#define STOP 4
+#define DONE 5
+#define RESULT_ADDRESS 6
+#define IRQ_ENABLE 7
+#define ISR 8
+#define START_NONCE 9
+#define NONCE_STRIDE 10
+#define NONCE_LIMIT 11
+#define RING_ADDR 12
+#define RING_MASK 13
+#define RING_HEAD 14
+#define RING_IRQ_EVERY 15
+
+#define MODEL_MAX_CLUSTERS 64
+// Nonces searched per call of the CPU kernel, so that 2^32 fits.
+#define MODEL_SEARCH_CHUNK (1u << 24)
+
+// SHA1Accelerator_pipelined: 16 words of the schedule per cycle, then the rounds.
+#define SCHEDULE_CYCLES (80 / 16)
+// FSM writeback: the result record in 4 writes, 3 more for the ring entry and head.
+#define RECORD_WRITES 4
+#define RING_WRITES 3
+
+struct accel_model
+{
+    struct accel_model_config config;
+    uint8_t* mem;
+    uint64_t bus_addr;
+    uint32_t size;
+    uint32_t regs[ACCEL_MODEL_REGISTERS];
+    struct accel_model_cycles last;
+    // Performance counters of the last job, per cluster.
+    uint64_t cluster_hashes[MODEL_MAX_CLUSTERS];
+    uint64_t cluster_idle[MODEL_MAX_CLUSTERS];
+    int failed;                 // the last job went outside of the memory window
+    uint64_t block_cycles[HASHER_MAX_BLOCKS];
+    uint8_t cluster_of[HASHER_MAX_BLOCKS];
+    struct hasher_result results[HASHER_MAX_BLOCKS];
+    uint8_t order[HASHER_MAX_BLOCKS];
+};
+
+void accel_model_default_config(struct accel_model_config* config)
+{
+    config->clusters = 2;
+    config->hashers = 2;
+    config->rounds_per_cycle = 2;
+    config->clock_mhz = 100.0;
+    config->read_latency = 24;
+    config->write_latency = 16;
+}
+
+int accel_model_config_from_name(const char* name, struct accel_model_config* config)
+{
+    const char* p = strrchr(name, '/');
+
+    accel_model_default_config(config);
+    config->clusters = 0;
+    config->hashers = 0;
+    config->rounds_per_cycle = 1;
+    config->clock_mhz = 0;
+
+    // Fields separated by '_': "76MHz", "2clusters", "4hashers", "unroll2", anything else is skipped.
+    for (p = p ? p + 1 : name; *p; )
+    {
+        char* end = (char*)p;
+        if (!strncmp(p, "unroll", 6))
+            config->rounds_per_cycle = strtoul(p + 6, &end, 10);
+        else if (isdigit((unsigned char)*p))
+        {
+            double value = strtod(p, &end);
+            if (!strncmp(end, "MHz", 3))
+                config->clock_mhz = value;
+            else if (!strncmp(end, "cluster", 7))
+                config->clusters = (uint32_t)value;
+            else if (!strncmp(end, "hasher", 6))
+                config->hashers = (uint32_t)value;
+        }
+        p = end;
+        while (*p && *p != '_')
+            p++;
+        if (*p)
+            p++;
+    }
+    if (!config->rounds_per_cycle || 20 % config->rounds_per_cycle)
+        return -1;
+    return config->clock_mhz > 0 && config->clusters && config->hashers ? 0 : -1;
+}
+
+// ---------- Cycle counts ----------
+
+// ClusterController round: PrepareAndStart, the hashers from Idle to wait_state
+// (two SHA-1 blocks plus setup_padding_block), then WaitState seeing done.
+static uint64_t round_cycles(const struct accel_model_config* config)
+{
+    uint64_t sha1_block = SCHEDULE_CYCLES + 80 / config->rounds_per_cycle + 1;
+    return 1 + (1 + 2 * sha1_block + 1 + 1) + 1;
+}
+
+// From the start of the cluster to its done: Idle, the rounds, and an extra
+// PrepareAndStart that finds the range empty when exhausted.
+static uint64_t block_cycles(const struct accel_model_config* config, uint64_t rounds, int exhausted)
+{
+    return 1 + rounds * round_cycles(config) + 1 + (exhausted ? 1 : 0);
+}
+
+// state_1, then 8 64-bit reads through AXI4Master (Idle, Read_state, Wait_state).
+static uint64_t fetch_cycles(const struct accel_model_config* config)
+{
+    return 1 + 8 * (2 + (uint64_t)config->read_latency);
+}
+
+// prepare_block_wb, then the writes through AXI4Master (Idle, Write_state, Wait_state).
+static uint64_t writeback_cycles(const struct accel_model_config* config, int ring)
+{
+    return 1 + (RECORD_WRITES + (ring ? RING_WRITES : 0)) * (2 + (uint64_t)config->write_latency);
+}
+
+// The FSM of a job: fetch a block, hand it to a free cluster (the last one free wins),
+// or write back a finished one while none is free; once all blocks are out, write back
+// the others as they finish. cycles[i] is the time cluster work on block i takes.
+// Fills order with the blocks in writeback order, cluster_of with the cluster of every
+// block and idle with the cycles each cluster waited for a block, as the counters of
+// TopLevel.vhd see them (not after the last block is handed out), if not NULL.
+static void model_schedule(const struct accel_model_config* config, const uint64_t* cycles,
+                           uint32_t n_blocks, int ring, struct accel_model_cycles* out, uint8_t* order,
+                           uint8_t* cluster_of, uint64_t* idle)
+{
+    uint64_t done_at[MODEL_MAX_CLUSTERS];
+    uint64_t worked_on[MODEL_MAX_CLUSTERS];
+    int block_of[MODEL_MAX_CLUSTERS];
+    uint64_t fetch = fetch_cycles(config);
+    uint64_t writeback = writeback_cycles(config, ring);
+    uint32_t busy = 0;
+    uint32_t written = 0;
+    uint64_t t = 1;             // Idle sees START
+
+    for (uint32_t c = 0; c < config->clusters; ++c)
+    {
+        block_of[c] = -1;
+        worked_on[c] = 0;
+    }
+
+    for (uint32_t b = 0; b <= n_blocks; ++b)
+    {
+        if (b < n_blocks)
+        {
+            t += fetch;
+            out->fetch += fetch;
+        }
+        else if (idle)
+        {
+            // Busy time runs past t for the blocks still hashing.
+            for (uint32_t c = 0; c < config->clusters; ++c)
+            {
+                uint64_t worked = worked_on[c] - (block_of[c] >= 0 && done_at[c] > t ? done_at[c] - t : 0);
+                idle[c] = t - 1 > worked ? t - 1 - worked : 0;
+            }
+        }
+        while (b < n_blocks || busy)
+        {
+            int available = -1;
+            int finished = -1;
+            uint64_t next = UINT64_MAX;
+
+            t++;                // state_3 or wait_all
+            for (uint32_t c = 0; c < config->clusters; ++c)
+            {
+                if (block_of[c] < 0)
+                    available = c;
+                else if (done_at[c] <= t)
+                    finished = c;
+                else if (done_at[c] < next)
+                    next = done_at[c];
+            }
+            if (b < n_blocks && available >= 0)
+            {
+                block_of[available] = b;
+                done_at[available] = t + cycles[b];
+                worked_on[available] += cycles[b];
+                out->hashing += cycles[b];
+                if (cluster_of)
+                    cluster_of[b] = available;
+                busy++;
+                break;
+            }
+            if (finished >= 0)
+            {
+                t += writeback;
+                out->writeback += writeback;
+                if (order)
+                    order[written] = block_of[finished];
+                written++;
+                block_of[finished] = -1;
+                busy--;
+                continue;
+            }
+            if (b < n_blocks)
+                out->stall += next - 1 - t;
+            t = next - 1;
+        }
+    }
+    out->total = t + 1;         // back to Idle, DONE
+}
+
+// ---------- Jobs ----------
+
+static uint8_t* model_bus(const struct accel_model* model, uint32_t addr, uint32_t bytes)
+{
+    if (addr < model->bus_addr || addr - model->bus_addr + bytes > model->size)
+        return NULL;
+    return model->mem + (addr - model->bus_addr);
+}
+
+// One block through a ClusterController: hashers nonces per round, in range order.
+// Of a round with several hits the last hasher wins, as in WaitState. Returns the rounds.
+static uint64_t model_search(const struct accel_model* model, const uint8_t* block, uint32_t difficulty,
+                             uint32_t start, uint32_t stride, uint64_t limit, struct hasher_result* res)
+{
+    struct pow_midstate ms;
+    uint64_t hit = limit;
+    uint32_t hashers = model->config.hashers;
+
+    pow_prepare_midstate(block, &ms);
+    if (stride == 1)
+    {
+        const struct pow_kernel* kernel = pow_get_kernel();
+        for (uint64_t pos = 0; pos < limit; pos += MODEL_SEARCH_CHUNK)
+        {
+            uint32_t first = start + (uint32_t)pos;
+            uint32_t count = limit - pos < MODEL_SEARCH_CHUNK ? limit - pos : MODEL_SEARCH_CHUNK;
+            if (kernel->search(&ms, difficulty, first, count, res))
+            {
+                hit = pos + (uint32_t)(res->nonce - first);
+                break;
+            }
+        }
+    }
+    else
+    {
+        for (uint64_t pos = 0; pos < limit; ++pos)
+            if (!(pow_hash_nonce(&ms, start + (uint32_t)pos * stride).a & difficulty))
+            {
+                hit = pos;
+                break;
+            }
+    }
+
+    if (hit == limit)
+    {
+        memset(res, 0, sizeof(*res));
+        res->nonce = start + (uint32_t)limit * stride;
+        res->nonces = limit > 0xFFFFFFFF ? 0xFFFFFFFF : limit;
+        res->status = HASHER_STATUS_EXHAUSTED;
+        return (limit + hashers - 1) / hashers;
+    }
+
+    uint64_t rounds = hit / hashers + 1;
+    uint64_t end = rounds * hashers < limit ? rounds * hashers : limit;
+    *res = pow_hash_nonce(&ms, start + (uint32_t)hit * stride);
+    for (uint64_t pos = hit + 1; pos < end; ++pos)
+    {
+        struct hasher_result other = pow_hash_nonce(&ms, start + (uint32_t)pos * stride);
+        if (!(other.a & difficulty))
+            *res = other;
+    }
+    res->nonces = end > 0xFFFFFFFF ? 0xFFFFFFFF : end;
+    return rounds;
+}
+
+static void model_irq(struct accel_model* model)
+{
+    if (model->regs[IRQ_ENABLE] & 1)
+        model->regs[ISR] = 1;
+}
+
+static void model_run(struct accel_model* model)
+{
+    uint32_t* regs = model->regs;
+    uint32_t n_blocks = regs[N_BLOCKS] < HASHER_MAX_BLOCKS ? regs[N_BLOCKS] : HASHER_MAX_BLOCKS;
+    uint32_t stride = regs[NONCE_STRIDE] ? regs[NONCE_STRIDE] : 1;
+    uint64_t limit = regs[NONCE_LIMIT] ? regs[NONCE_LIMIT] : 1ull << 32;
+    int ring = regs[RING_ADDR] != 0;
+    uint32_t head = regs[RING_HEAD];
+    uint32_t since_irq = 0;
+
+    memset(&model->last, 0, sizeof(model->last));
+    memset(model->cluster_hashes, 0, sizeof(model->cluster_hashes));
+    memset(model->cluster_idle, 0, sizeof(model->cluster_idle));
+    model->failed = 0;
+    regs[START] = 0;
+    if (regs[STOP] & 1)
+    {
+        // Seen in state_1 before the first fetch: nothing runs, no record is written.
+        model->last.total = 3;
+        regs[DONE] = 1;
+        model_irq(model);
+        return;
+    }
+
+    for (uint32_t i = 0; i < n_blocks; ++i)
+    {
+        uint8_t* block = model_bus(model, regs[BLOCK_ADDRESS] + i * 64, 64);
+        if (!block || !model_bus(model, regs[RESULT_ADDRESS] + i * HASHER_RESULT_BYTES, HASHER_RESULT_BYTES))
+        {
+            printf("accel_model: block %u of the job is outside of the memory window\n", i);
+            model->failed = 1;
+            regs[DONE] = 1;
+            return;
+        }
+        uint64_t rounds = model_search(model, block, regs[DIFFICULTY], regs[START_NONCE], stride, limit, &model->results[i]);
+        model->block_cycles[i] = block_cycles(&model->config, rounds, model->results[i].status == HASHER_STATUS_EXHAUSTED);
+        model->last.nonces += model->results[i].nonces;
+    }
+    model_schedule(&model->config, model->block_cycles, n_blocks, ring, &model->last, model->order,
+                   model->cluster_of, model->cluster_idle);
+    // The hashers of a cluster count every nonce they hash, past the winner of the round
+    // but not past the limit: the nonces of the record, 2^32 for a whole exhausted range.
+    for (uint32_t i = 0; i < n_blocks; ++i)
+        model->cluster_hashes[model->cluster_of[i]] +=
+            model->results[i].status == HASHER_STATUS_EXHAUSTED ? limit : model->results[i].nonces;
+
+    for (uint32_t k = 0; k < n_blocks; ++k)
+    {
+        uint32_t i = model->order[k];
+        uint32_t record = regs[RESULT_ADDRESS] + i * HASHER_RESULT_BYTES;
+        memcpy(model_bus(model, record, HASHER_RESULT_BYTES), &model->results[i], HASHER_RESULT_BYTES);
+        if (!ring)
+            continue;
+
+        struct hasher_ring_entry entry = {i, model->results[i].nonce, model->results[i].status, record};
+        uint8_t* slot = model_bus(model, regs[RING_ADDR] + HASHER_RING_HEADER_BYTES + ((head & regs[RING_MASK]) << 4), sizeof(entry));
+        uint8_t* header = model_bus(model, regs[RING_ADDR], 8);
+        if (!slot || !header)
+        {
+            printf("accel_model: ring outside of the memory window\n");
+            model->failed = 1;
+            break;
+        }
+        memcpy(slot, &entry, sizeof(entry));
+        head++;
+        uint32_t producer[2] = {head, 0};
+        memcpy(header, producer, sizeof(producer));
+        if (regs[RING_IRQ_EVERY] && ++since_irq >= regs[RING_IRQ_EVERY])
+        {
+            since_irq = 0;
+            model_irq(model);
+        }
+    }
+    regs[RING_HEAD] = head;
+    regs[DONE] = 1;
+    model_irq(model);
+}
+
+struct accel_model* accel_model_create(const struct accel_model_config* config, void* mem,
+                                       uint64_t bus_addr, uint32_t size)
+{
+    if (!config->clusters || config->clusters > MODEL_MAX_CLUSTERS || !config->hashers ||
+        !config->rounds_per_cycle || 20 % config->rounds_per_cycle || config->clock_mhz <= 0)
+        return NULL;
+
+    struct accel_model* model = new accel_model();
+    model->config = *config;
+    model->mem = (uint8_t*)mem;
+    model->bus_addr = bus_addr;
+    model->size = size;
+    model->regs[DONE] = 1;
+    model->regs[NONCE_STRIDE] = 1;
+    return model;
+}
+
+void accel_model_destroy(struct accel_model* model)
+{
+    delete model;
+}
+
+void accel_model_write(struct accel_model* model, uint32_t index, uint32_t value)
+{
+    if (index >= ACCEL_MODEL_REGISTERS || index == DONE)
+        return;
+    if (index == ISR)
+    {
+        model->regs[ISR] = 0;
+        return;
+    }
+    model->regs[index] = value;
+    if (index == START && (value & 1))
+        model_run(model);
+}
+
+// The performance counters above the register file, see driver/README.md.
+static uint32_t model_counter(const struct accel_model* model, uint32_t index)
+{
+    uint64_t value;
+
+    if (index == HASHER_PERF_REG_MAGIC)
+        return HASHER_PERF_MAGIC;
+    if (index == HASHER_PERF_REG_LAYOUT)
+        return (model->config.hashers & 0xFF) << 8 | (model->config.clusters & 0xFF);
+    if (index >= HASHER_PERF_REG_CLUSTERS)
+    {
+        uint32_t c = (index - HASHER_PERF_REG_CLUSTERS) / 4;
+        if (c >= model->config.clusters)
+            return 0;
+        value = (index - HASHER_PERF_REG_CLUSTERS) % 4 < 2 ? model->cluster_hashes[c] : model->cluster_idle[c];
+    }
+    else if (index >= HASHER_PERF_REG_WRITEBACK_CYCLES)
+        value = model->last.writeback;
+    else if (index >= HASHER_PERF_REG_FETCH_CYCLES)
+        value = model->last.fetch;
+    else if (index >= HASHER_PERF_REG_JOB_CYCLES)
+        value = model->last.total;
+    else
+        return 0;
+    // Low word at the even index.
+    return index % 2 ? (uint32_t)(value >> 32) : (uint32_t)value;
+}
+
+uint32_t accel_model_read(const struct accel_model* model, uint32_t index)
+{
+    return index < ACCEL_MODEL_REGISTERS ? model->regs[index] : model_counter(model, index);
+}
+
+int accel_model_submit(struct accel_model* model, const struct user_message* message)
+{
+    accel_model_write(model, IRQ_ENABLE, 0xFFFFFFFF);
+    accel_model_write(model, BLOCK_ADDRESS, message->block_address_base);
+    accel_model_write(model, N_BLOCKS, message->n_blocks);
+    accel_model_write(model, DIFFICULTY, message->difficulty);
+    accel_model_write(model, RESULT_ADDRESS, message->result_address);
+    accel_model_write(model, START_NONCE, message->start_nonce);
+    accel_model_write(model, NONCE_STRIDE, message->nonce_stride);
+    accel_model_write(model, NONCE_LIMIT, message->nonce_limit);
+    accel_model_write(model, START, 1);
+    return model->failed ? -1 : 0;
+}
+
+double accel_model_last_job(const struct accel_model* model, struct accel_model_cycles* cycles)
+{
+    if (cycles)
+        *cycles = model->last;
+    return model->last.total / (model->config.clock_mhz * 1000.0);
+}
+
+void accel_model_predict(const struct accel_model_config* config, uint32_t difficulty,
+                         uint32_t n_blocks, struct accel_model_prediction* prediction)
+{
+    struct accel_model_cycles cycles;
+    uint64_t per_block[HASHER_MAX_BLOCKS];
+    uint32_t clusters = config->clusters < MODEL_MAX_CLUSTERS ? config->clusters : MODEL_MAX_CLUSTERS;
+    struct accel_model_config clamped = *config;
+
+    // A nonce passes with probability 2^-bits: 2^bits nonces on average, tried
+    // hashers at a time, the round of the hit mostly past it.
+    uint32_t bits = __builtin_popcount(difficulty);
+    double nonces = bits < 32 ? (double)(1ull << bits) : 4294967296.0;
+    double hashers = config->hashers;
+    uint64_t rounds = (uint64_t)(nonces / hashers + (hashers - 1) / (2 * hashers) + 0.5);
+    if (!rounds)
+        rounds = 1;
+
+    clamped.clusters = clusters;
+    if (n_blocks > HASHER_MAX_BLOCKS)
+        n_blocks = HASHER_MAX_BLOCKS;
+    for (uint32_t i = 0; i < n_blocks; ++i)
+        per_block[i] = block_cycles(config, rounds, 0);
+    memset(&cycles, 0, sizeof(cycles));
+    model_schedule(&clamped, per_block, n_blocks, 0, &cycles, NULL, NULL, NULL);
+
+    double seconds = cycles.total / (config->clock_mhz * 1e6);
+    prediction->cycles = cycles.total;
+    prediction->time_ms = seconds * 1000.0;
+    prediction->blocks_per_sec = n_blocks / seconds;
+    prediction->hash_per_sec = (double)n_blocks * rounds * config->hashers / seconds;
+    prediction->peak_hash_per_sec = clusters * config->hashers * config->clock_mhz * 1e6 / round_cycles(config);
+}
@@ -0,0 +1,83 @@
+#ifndef	ACCELMODEL_H
+#define	ACCELMODEL_H
+
+#include <stdint.h>
+
+#include "CpuHasher.h"
+#include "driver/hasher_ioctl.h"
+
+// Software model of the accelerator (hdl/TopLevel.vhd), for machines without the board.
+// It has the register file of the hardware, reads the blocks and writes the result
+// records and ring entries to memory as the FSM does, and counts the cycles the job
+// would take: block fetch over the AXI master, the hashing rounds of the clusters and
+// the writeback. The nonces are searched with the CPU kernels, the records are those
+// the hardware writes, down to the hasher that wins when several hit at once. The
+// performance counters read as those of the hardware for the last job.
+// A job runs entirely when START is written; DONE reads 1 again right after.
+
+#define ACCEL_MODEL_REGISTERS 16
+
+struct accel_model_config
+{
+    uint32_t clusters;          // CLUSTER_COUNT
+    uint32_t hashers;           // N_HASHERS of every cluster
+    uint32_t rounds_per_cycle;  // num_op_cycle_main_loop of SHA1Accelerator_pipelined
+    double clock_mhz;
+    // Cycles from the address to the data (read) or to the response (write) on the
+    // memory port; the defaults are rough figures for the HP ports of the Zynq.
+    uint32_t read_latency;
+    uint32_t write_latency;
+};
+
+// Cycles of the last job.
+struct accel_model_cycles
+{
+    uint64_t total;             // START to DONE
+    uint64_t fetch;             // FSM reading blocks
+    uint64_t writeback;         // FSM writing records and ring entries
+    uint64_t stall;             // FSM holding a fetched block, every cluster busy
+    uint64_t hashing;           // summed over the clusters
+    uint64_t nonces;
+};
+
+struct accel_model_prediction
+{
+    uint64_t cycles;            // for the whole batch
+    double time_ms;
+    double blocks_per_sec;
+    double hash_per_sec;
+    double peak_hash_per_sec;   // every hasher busy all the time, no fetch or writeback
+};
+
+struct accel_model;
+
+// Generics of TopLevel.vhd as in the tree, at 100 MHz.
+void accel_model_default_config(struct accel_model_config* config);
+// From a bitstream name, e.g. "76MHz_2clusters_2hashers_unroll2_interrupt.bit". Names
+// without "unrollN" were built with one round per cycle. Latencies are the defaults.
+// Returns -1 if the clock, clusters or hashers are missing.
+int accel_model_config_from_name(const char* name, struct accel_model_config* config);
+
+// Accelerator whose bus sees size bytes at bus_addr, mapped at mem.
+struct accel_model* accel_model_create(const struct accel_model_config* config, void* mem,
+                                       uint64_t bus_addr, uint32_t size);
+void accel_model_destroy(struct accel_model* model);
+
+// Register access, indexes as in driver/README.md, the performance counters included.
+// Writing 1 to START runs the job.
+// Writing ISR acknowledges the interrupt.
+void accel_model_write(struct accel_model* model, uint32_t index, uint32_t value);
+uint32_t accel_model_read(const struct accel_model* model, uint32_t index);
+// The register writes of hasher_direct_submit(), then START. Returns -1 if the
+// memory window does not hold the job, 0 once its records are written.
+int accel_model_submit(struct accel_model* model, const struct user_message* message);
+
+// Cycles of the last job. Returns its duration on the hardware, in ms.
+double accel_model_last_job(const struct accel_model* model, struct accel_model_cycles* cycles);
+
+// Expected throughput on batches of n_blocks, from the expected nonces per block at
+// difficulty, without hashing anything.
+void accel_model_predict(const struct accel_model_config* config, uint32_t difficulty,
+                         uint32_t n_blocks, struct accel_model_prediction* prediction);
+
+#endif // ACCELMODEL_H
@@ -0,0 +1,208 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "BatchPipeline.h"
+#include "driver/hasher_ioctl.h"
+
+// One buffer set and the batch it holds.
+struct pipeline_set
+{
+    struct dma_slab blocks;
+    struct dma_slab results;
+    uint64_t seq;
+    int last_id;                // last job of the batch, requeued blocks included
+};
+
+struct batch_pipeline
+{
+    int fd;
+    uint32_t handle;
+    struct dma_arena* arena;
+    int blocks_class;
+    int results_class;
+    uint32_t depth;
+    uint32_t max_blocks;
+    struct pipeline_set sets[BATCH_PIPELINE_MAX_DEPTH];
+};
+
+static double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+struct batch_pipeline* batch_pipeline_create(int fd, uint32_t handle, struct dma_arena* arena,
+                                             int blocks_class, int results_class, uint32_t depth)
+{
+    struct dma_arena_stats blocks_stats, results_stats;
+
+    if (!depth || depth > BATCH_PIPELINE_MAX_DEPTH)
+        return NULL;
+    dma_arena_get_stats(arena, blocks_class, &blocks_stats);
+    dma_arena_get_stats(arena, results_class, &results_stats);
+
+    struct batch_pipeline* pipe = new batch_pipeline();
+    pipe->fd = fd;
+    pipe->handle = handle;
+    pipe->arena = arena;
+    pipe->blocks_class = blocks_class;
+    pipe->results_class = results_class;
+    pipe->max_blocks = blocks_stats.slab_size / 64;
+    if (results_stats.slab_size / sizeof(struct hasher_result) < pipe->max_blocks)
+        pipe->max_blocks = results_stats.slab_size / sizeof(struct hasher_result);
+
+    for (; pipe->depth < depth; pipe->depth++)
+    {
+        struct pipeline_set* set = &pipe->sets[pipe->depth];
+        if (dma_arena_alloc(arena, blocks_class, &set->blocks))
+            break;
+        if (dma_arena_alloc(arena, results_class, &set->results))
+        {
+            dma_arena_free(arena, blocks_class, &set->blocks);
+            break;
+        }
+    }
+    if (pipe->depth < depth)
+    {
+        batch_pipeline_destroy(pipe);
+        return NULL;
+    }
+    return pipe;
+}
+
+void batch_pipeline_destroy(struct batch_pipeline* pipe)
+{
+    for (uint32_t i = 0; i < pipe->depth; ++i)
+    {
+        dma_arena_free(pipe->arena, pipe->blocks_class, &pipe->sets[i].blocks);
+        dma_arena_free(pipe->arena, pipe->results_class, &pipe->sets[i].results);
+    }
+    delete pipe;
+}
+
+// Queues blocks [first, first + count) of the set, waiting for room in the driver queue.
+// Returns the job id, -1 on error.
+static int pipeline_submit(struct batch_pipeline* pipe, const struct pipeline_set* set,
+                           uint32_t first, uint32_t count, uint32_t difficulty)
+{
+    struct hasher_buffer_job job = {pipe->handle, set->blocks.offset + 64 * first, count, difficulty,
+                                    (uint32_t)(set->results.offset + sizeof(struct hasher_result) * first), 0, 1, 0};
+    struct pollfd pfd = {pipe->fd, POLLOUT, 0};
+
+    while (1)
+    {
+        int id = ioctl(pipe->fd, HASHER_IOC_SUBMIT_BUF, &job);
+        if (id >= 0 || errno != EBUSY)
+            return id;
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            return -1;
+    }
+}
+
+// Sleeps until job id is finished. Returns 0 on success.
+static int pipeline_wait(struct batch_pipeline* pipe, int id)
+{
+    struct pollfd pfd = {pipe->fd, POLLIN, 0};
+    struct hasher_completion completion;
+
+    while (1)
+    {
+        if (ioctl(pipe->fd, HASHER_IOC_COMPLETE, &completion) < 0)
+            return -1;
+        if (hasher_job_finished(completion.completed, id))
+            return 0;
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            return -1;
+    }
+}
+
+int batch_pipeline_run(struct batch_pipeline* pipe, uint64_t n_batches, uint32_t n_blocks, uint32_t difficulty,
+                       pipeline_prepare_fn prepare, pipeline_consume_fn consume, void* ctx,
+                       struct batch_pipeline_stats* stats)
+{
+    // Sets in flight, oldest first, as indices in pipe->sets.
+    uint32_t order[BATCH_PIPELINE_MAX_DEPTH];
+    uint32_t in_flight = 0;
+    uint64_t next = 0;          // next batch to prepare
+    int last_id = -1;           // last job submitted
+    double t;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->depth = pipe->depth;
+    if (!n_blocks || n_blocks > pipe->max_blocks)
+        return -1;
+    double start = now_ms();
+
+    while (next < n_batches || in_flight)
+    {
+        // Fill every free set first: the more is queued, the longer the host can take.
+        if (next < n_batches && in_flight < pipe->depth)
+        {
+            // Sets leave the front and come back at the back, so the free one follows the last.
+            uint32_t s = in_flight ? (order[in_flight - 1] + 1) % pipe->depth : 0;
+            struct pipeline_set* set = &pipe->sets[s];
+            struct hasher_completion completion;
+
+            t = now_ms();
+            prepare(ctx, next, set->blocks.virtual_addr, n_blocks);
+            stats->prepare_ms += now_ms() - t;
+
+            t = now_ms();
+            if (last_id > 0 && !ioctl(pipe->fd, HASHER_IOC_COMPLETE, &completion) &&
+                hasher_job_finished(completion.completed, last_id))
+                stats->starved++;
+            set->seq = next++;
+            set->last_id = last_id = pipeline_submit(pipe, set, 0, n_blocks, difficulty);
+            stats->submit_ms += now_ms() - t;
+            if (last_id < 0)
+                return -1;
+            order[in_flight++] = s;
+            continue;
+        }
+
+        struct pipeline_set* set = &pipe->sets[order[0]];
+        t = now_ms();
+        if (pipeline_wait(pipe, set->last_id))
+            return -1;
+        stats->wait_ms += now_ms() - t;
+
+        // Exhausted blocks go again, behind what is queued, before the batch is consumed.
+        struct hasher_result* results = (struct hasher_result*)set->results.virtual_addr;
+        uint32_t requeued = 0;
+        t = now_ms();
+        for (uint32_t i = 0; i < n_blocks; ++i)
+        {
+            if (results[i].status != HASHER_STATUS_EXHAUSTED)
+                continue;
+            stats->nonces += results[i].nonces;
+            pow_roll_extranonce(set->blocks.virtual_addr + 64 * i);
+            set->last_id = last_id = pipeline_submit(pipe, set, i, 1, difficulty);
+            if (last_id < 0)
+                return -1;
+            requeued++;
+        }
+        stats->submit_ms += now_ms() - t;
+        if (requeued)
+        {
+            stats->requeued += requeued;
+            continue;
+        }
+
+        t = now_ms();
+        for (uint32_t i = 0; i < n_blocks; ++i)
+            stats->nonces += results[i].nonces;
+        consume(ctx, set->seq, set->blocks.virtual_addr, results, n_blocks);
+        stats->consume_ms += now_ms() - t;
+        stats->batches++;
+
+        memmove(order, order + 1, sizeof(order[0]) * --in_flight);
+    }
+    stats->total_ms = now_ms() - start;
+    return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef	BATCHPIPELINE_H
+#define	BATCHPIPELINE_H
+
+#include <stdint.h>
+
+#include "CpuHasher.h"
+#include "DmaArena.h"
+
+// Runs a stream of batches through the driver with depth buffer sets in flight: while
+// the accelerator hashes batch k, batch k + 1 is already queued behind it in the driver
+// and the caller's thread prepares batch k + 2 and consumes batch k - 1. With depth 2
+// (double buffering) host work only hides behind the running batch, with depth 3
+// (triple buffering) a slow consumer does not hold up the next submission either.
+
+#define BATCH_PIPELINE_MAX_DEPTH 3
+
+// Fills the blocks of batch seq, right before it is submitted.
+typedef void (*pipeline_prepare_fn)(void* ctx, uint64_t seq, uint8_t* blocks, uint32_t n_blocks);
+// Checks and uses batch seq, every block solved. Its buffers are reused once it returns.
+typedef void (*pipeline_consume_fn)(void* ctx, uint64_t seq, const uint8_t* blocks,
+                                    const struct hasher_result* results, uint32_t n_blocks);
+
+// Host time spent in each stage, summed over the batches.
+struct batch_pipeline_stats
+{
+    uint32_t depth;
+    uint64_t batches;
+    uint64_t nonces;            // from the result records, failed attempts included
+    uint32_t requeued;          // blocks solved again with a new extranonce
+    uint32_t starved;           // submissions that found the accelerator idle
+    double prepare_ms;
+    double submit_ms;
+    double wait_ms;             // blocked with nothing else to do
+    double consume_ms;
+    double total_ms;
+};
+
+struct batch_pipeline;
+
+// depth buffer sets, each a block slab and a result slab of the arena, over the driver
+// buffer handle of the descriptor fd. Returns NULL if the arena has not enough free slabs.
+struct batch_pipeline* batch_pipeline_create(int fd, uint32_t handle, struct dma_arena* arena,
+                                             int blocks_class, int results_class, uint32_t depth);
+// Gives the slabs back to the arena.
+void batch_pipeline_destroy(struct batch_pipeline* pipe);
+
+// Prepares, solves and consumes n_batches batches of n_blocks blocks, in order. Blocks
+// with no valid nonce get a rolled extranonce and are queued again before their batch
+// is consumed. Returns 0 on success, -1 if a driver call failed or n_blocks does not fit.
+int batch_pipeline_run(struct batch_pipeline* pipe, uint64_t n_batches, uint32_t n_blocks, uint32_t difficulty,
+                       pipeline_prepare_fn prepare, pipeline_consume_fn consume, void* ctx,
+                       struct batch_pipeline_stats* stats);
+
+#endif // BATCHPIPELINE_H
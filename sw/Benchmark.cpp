@@ -0,0 +1,307 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "Benchmark.h"
+
+#define BENCH_KEY 32
+#define BENCH_VALUE 128
+
+struct bench_report
+{
+    FILE* out;
+    struct bench_options options;
+    uint32_t n_meta;
+    char meta_keys[BENCH_MAX_META][BENCH_KEY];
+    char meta_values[BENCH_MAX_META][BENCH_VALUE];
+    uint32_t rows;
+    int row_open;               // JSON: the last row takes extras until the next one
+    // Runs of bench_measure().
+    double* time_ms;
+    double* hash_per_sec;
+};
+
+// ---------- Options ----------
+
+static void bench_usage(const char* program, const char* engines)
+{
+    printf("usage: %s [-b max_blocks] [-r repetitions] [-w warmups] [-d min:max[:step]] [-f json|csv] [-o file] [-e %s] [-y]\n",
+           program, engines);
+    printf("       %s max_blocks repetitions max_difficulty\n", program);
+}
+
+int bench_parse_args(int argc, char** argv, struct bench_options* options, const char* engines)
+{
+    int opt;
+    char* end;
+
+    while ((opt = getopt(argc, argv, "b:r:w:d:f:o:e:y")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            options->max_blocks = atoi(optarg);
+            break;
+        case 'r':
+            options->repetitions = atoi(optarg);
+            break;
+        case 'w':
+            options->warmups = atoi(optarg);
+            break;
+        case 'd':
+            options->min_difficulty = strtoul(optarg, &end, 10);
+            options->max_difficulty = options->min_difficulty;
+            if (*end == ':')
+                options->max_difficulty = strtoul(end + 1, &end, 10);
+            if (*end == ':')
+                options->difficulty_step = strtoul(end + 1, &end, 10);
+            if (*end)
+            {
+                bench_usage(argv[0], engines);
+                return -1;
+            }
+            break;
+        case 'f':
+            if (!strcmp(optarg, "json"))
+                options->format = BENCH_JSON;
+            else if (!strcmp(optarg, "csv"))
+                options->format = BENCH_CSV;
+            else
+            {
+                bench_usage(argv[0], engines);
+                return -1;
+            }
+            break;
+        case 'o':
+            options->output = optarg;
+            break;
+        case 'e':
+            options->engines = optarg;
+            break;
+        case 'y':
+            options->assume_yes = 1;
+            break;
+        default:
+            bench_usage(argv[0], engines);
+            return -1;
+        }
+    }
+    if (argc - optind == 3)
+    {
+        options->max_blocks = atoi(argv[optind]);
+        options->repetitions = atoi(argv[optind + 1]);
+        options->max_difficulty = atoi(argv[optind + 2]);
+    }
+    else if (argc != optind)
+    {
+        bench_usage(argv[0], engines);
+        return -1;
+    }
+    if (options->max_blocks < 2 || !options->repetitions || !options->difficulty_step ||
+        options->min_difficulty > options->max_difficulty || options->max_difficulty > 32)
+    {
+        printf("Invalid blocks, repetitions or difficulty selected\n");
+        return -1;
+    }
+    return 0;
+}
+
+int bench_engine_enabled(const struct bench_options* options, const char* engine)
+{
+    size_t len = strlen(engine);
+
+    if (!options->engines)
+        return 1;
+    for (const char* p = options->engines; (p = strstr(p, engine)); p += len)
+        if ((p == options->engines || p[-1] == ',') && (p[len] == ',' || !p[len]))
+            return 1;
+    return 0;
+}
+
+// ---------- Timing ----------
+
+double bench_now_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec * 1000.0 + (double)now.tv_nsec / 1000000.0;
+}
+
+uint32_t bench_difficulty(uint32_t difficulty_bits)
+{
+    return difficulty_bits ? 0xFFFFFFFF << (32 - difficulty_bits) : 0;
+}
+
+static double percentile(const double* sorted, uint32_t n, uint32_t p)
+{
+    uint32_t rank = (p * n + 99) / 100;
+    return sorted[rank ? rank - 1 : 0];
+}
+
+void bench_stats_compute(const double* samples, uint32_t n, struct bench_stats* stats)
+{
+    double* sorted = new double[n];
+    double sum = 0;
+
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        sorted[i] = samples[i];
+        sum += samples[i];
+    }
+    std::sort(sorted, sorted + n);
+    stats->min = sorted[0];
+    stats->mean = sum / n;
+    stats->p50 = percentile(sorted, n, 50);
+    stats->p90 = percentile(sorted, n, 90);
+    stats->p99 = percentile(sorted, n, 99);
+    stats->max = sorted[n - 1];
+    delete[] sorted;
+}
+
+// ---------- Report ----------
+
+struct bench_report* bench_report_open(const struct bench_options* options, const char* program)
+{
+    struct bench_report* report = new bench_report();
+    const char* bitstream = getenv("HASHER_BITSTREAM");
+
+    report->out = options->output ? fopen(options->output, "w") : stdout;
+    if (!report->out)
+    {
+        perror(options->output);
+        exit(-1);
+    }
+    report->options = *options;
+    report->time_ms = new double[options->repetitions];
+    report->hash_per_sec = new double[options->repetitions];
+    bench_report_meta(report, "program", "%s", program);
+    bench_report_meta(report, "bitstream", "%s", bitstream ? bitstream : "unknown");
+    bench_report_meta(report, "clock", "CLOCK_MONOTONIC");
+    bench_report_meta(report, "warmups", "%u", options->warmups);
+    bench_report_meta(report, "repetitions", "%u", options->repetitions);
+    return report;
+}
+
+void bench_report_meta(struct bench_report* report, const char* key, const char* format, ...)
+{
+    va_list args;
+
+    if (report->n_meta == BENCH_MAX_META || report->rows)
+        return;
+    snprintf(report->meta_keys[report->n_meta], BENCH_KEY, "%s", key);
+    va_start(args, format);
+    vsnprintf(report->meta_values[report->n_meta], BENCH_VALUE, format, args);
+    va_end(args);
+    report->n_meta++;
+}
+
+static void print_header(struct bench_report* report)
+{
+    FILE* out = report->out;
+
+    if (report->options.format == BENCH_CSV)
+    {
+        for (uint32_t i = 0; i < report->n_meta; ++i)
+            fprintf(out, "%s,", report->meta_keys[i]);
+        // time_ms is the median, the column BitstreamSelector.h calibrates on.
+        fprintf(out, "engine,blocks,difficulty_bits,runs,time_ms,"
+                     "time_min_ms,time_mean_ms,time_p50_ms,time_p90_ms,time_p99_ms,time_max_ms,"
+                     "hash_per_sec_min,hash_per_sec_mean,hash_per_sec_p50,hash_per_sec_p90,hash_per_sec_p99,hash_per_sec_max\n");
+        return;
+    }
+    fprintf(out, "{\n\"meta\": {");
+    for (uint32_t i = 0; i < report->n_meta; ++i)
+        fprintf(out, "%s\"%s\": \"%s\"", i ? ", " : "", report->meta_keys[i], report->meta_values[i]);
+    fprintf(out, "},\n\"results\": [\n");
+}
+
+static void print_stats_json(FILE* out, const char* name, const struct bench_stats* s)
+{
+    fprintf(out, "\"%s\": {\"min\": %f, \"mean\": %f, \"p50\": %f, \"p90\": %f, \"p99\": %f, \"max\": %f}",
+            name, s->min, s->mean, s->p50, s->p90, s->p99, s->max);
+}
+
+static void print_stats_csv(FILE* out, const struct bench_stats* s)
+{
+    fprintf(out, "%f,%f,%f,%f,%f,%f", s->min, s->mean, s->p50, s->p90, s->p99, s->max);
+}
+
+void bench_report_row(struct bench_report* report, const char* engine, uint32_t blocks, uint32_t difficulty_bits,
+                      const double* time_ms, const double* hash_per_sec, uint32_t n)
+{
+    FILE* out = report->out;
+    struct bench_stats time_stats, hash_stats;
+
+    if (!report->rows)
+        print_header(report);
+    bench_stats_compute(time_ms, n, &time_stats);
+    bench_stats_compute(hash_per_sec, n, &hash_stats);
+
+    if (report->options.format == BENCH_CSV)
+    {
+        for (uint32_t i = 0; i < report->n_meta; ++i)
+            fprintf(out, "%s,", report->meta_values[i]);
+        fprintf(out, "%s,%u,%u,%u,%f,", engine, blocks, difficulty_bits, n, time_stats.p50);
+        print_stats_csv(out, &time_stats);
+        fprintf(out, ",");
+        print_stats_csv(out, &hash_stats);
+        fprintf(out, "\n");
+    }
+    else
+    {
+        if (report->row_open)
+            fprintf(out, "},\n");
+        fprintf(out, "{\"engine\": \"%s\", \"blocks\": %u, \"difficulty\": \"%08x\", \"difficulty_bits\": %u, \"runs\": %u,\n",
+                engine, blocks, bench_difficulty(difficulty_bits), difficulty_bits, n);
+        print_stats_json(out, "time_ms", &time_stats);
+        fprintf(out, ",\n");
+        print_stats_json(out, "hash_per_sec", &hash_stats);
+        report->row_open = 1;
+    }
+    report->rows++;
+    fflush(out);
+}
+
+void bench_report_extra(struct bench_report* report, const char* key, double value)
+{
+    if (report->row_open)
+        fprintf(report->out, ",\n\"%s\": %f", key, value);
+}
+
+int bench_measure(struct bench_report* report, const char* engine, uint32_t blocks, uint32_t difficulty_bits,
+                  bench_experiment_fn experiment)
+{
+    const struct bench_options* options = &report->options;
+
+    if (!bench_engine_enabled(options, engine))
+        return 0;
+    for (uint32_t j = 0; j < options->warmups + options->repetitions; ++j)
+    {
+        struct experiment_stats stats = experiment(blocks, bench_difficulty(difficulty_bits));
+        if (j < options->warmups)
+            continue;
+        report->time_ms[j - options->warmups] = stats.time_taken_ms;
+        report->hash_per_sec[j - options->warmups] = stats.hash_per_sec;
+    }
+    bench_report_row(report, engine, blocks, difficulty_bits, report->time_ms, report->hash_per_sec, options->repetitions);
+    return 1;
+}
+
+void bench_report_close(struct bench_report* report)
+{
+    if (!report->rows)
+        print_header(report);
+    if (report->options.format == BENCH_JSON)
+        fprintf(report->out, "%s]\n}\n", report->row_open ? "}\n" : "");
+    if (report->out != stdout)
+        fclose(report->out);
+    delete[] report->time_ms;
+    delete[] report->hash_per_sec;
+    delete report;
+}
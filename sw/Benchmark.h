@@ -0,0 +1,84 @@
+#ifndef	BENCHMARK_H
+#define	BENCHMARK_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Benchmark loop shared by master.cpp, master_driver.cpp and hasher-test-aarch64.cpp:
+// options, wall-clock timing, percentiles and the JSON or CSV report. Every
+// configuration (engine, blocks, difficulty) runs warmups times unrecorded, then
+// repetitions times; the report gives min, mean, p50, p90, p99 and max of the time and
+// of the hashrate of those runs, with the metadata of the setup.
+
+#define BENCH_MAX_META 16
+
+enum bench_format
+{
+    BENCH_JSON,
+    BENCH_CSV,
+};
+
+struct bench_options
+{
+    uint32_t max_blocks;        // batches of 1 to max_blocks - 1 blocks
+    uint32_t repetitions;
+    uint32_t warmups;
+    uint32_t min_difficulty;    // in leading zero bits
+    uint32_t max_difficulty;
+    uint32_t difficulty_step;
+    enum bench_format format;
+    const char* output;         // NULL for stdout
+    const char* engines;        // comma separated, NULL for all of the program
+    int assume_yes;             // no confirmation before touching the hardware
+};
+
+// Overrides the defaults in options with
+//   -b max_blocks -r repetitions -w warmups -d min:max[:step] -f json|csv -o file -e engines -y
+// or the positional max_blocks repetitions max_difficulty of the older versions.
+// Prints the usage and returns -1 on a bad command line.
+int bench_parse_args(int argc, char** argv, struct bench_options* options, const char* engines);
+int bench_engine_enabled(const struct bench_options* options, const char* engine);
+
+// CLOCK_MONOTONIC, in ms.
+double bench_now_ms(void);
+// Mask of difficulty_bits leading ones, as written to the DIFFICULTY register.
+uint32_t bench_difficulty(uint32_t difficulty_bits);
+
+// One run of an engine, as returned by the run_experiment*() of the programs.
+struct experiment_stats
+{
+    double time_taken_ms;
+    uint64_t hash_per_sec;
+};
+
+typedef struct experiment_stats (*bench_experiment_fn)(uint32_t n_blocks, uint32_t difficulty);
+
+struct bench_stats
+{
+    double min, mean, p50, p90, p99, max;
+};
+
+// Nearest-rank percentiles of n samples, n > 0.
+void bench_stats_compute(const double* samples, uint32_t n, struct bench_stats* stats);
+
+struct bench_report;
+
+// Opens options->output, exits if it cannot. The metadata starts with the program,
+// the bitstream (HASHER_BITSTREAM, to tell the runs of different overlays apart),
+// the clock, warmups and repetitions.
+struct bench_report* bench_report_open(const struct bench_options* options, const char* program);
+// More metadata, before the first row.
+void bench_report_meta(struct bench_report* report, const char* key, const char* format, ...)
+    __attribute__((format(printf, 3, 4)));
+// One configuration: n runs of time_ms and hash_per_sec.
+void bench_report_row(struct bench_report* report, const char* engine, uint32_t blocks, uint32_t difficulty_bits,
+                      const double* time_ms, const double* hash_per_sec, uint32_t n);
+// Extra value of the last row, JSON only.
+void bench_report_extra(struct bench_report* report, const char* key, double value);
+// Runs experiment warmups times, then repetitions times, and reports the row.
+// Returns 0 without running anything if the engine is not enabled, 1 otherwise.
+int bench_measure(struct bench_report* report, const char* engine, uint32_t blocks, uint32_t difficulty_bits,
+                  bench_experiment_fn experiment);
+void bench_report_close(struct bench_report* report);
+
+#endif // BENCHMARK_H
@@ -0,0 +1,358 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "BitstreamSelector.h"
+
+#define FPGA_MANAGER "/sys/class/fpga_manager/fpga0"
+#define FIRMWARE_DIR "/lib/firmware"
+#define OVERLAY_DIR "/sys/kernel/config/device-tree/overlays/hasher"
+#define CSV_LINE 512
+// The engine of the runs the model describes, see Benchmark.h.
+#define CALIBRATION_ENGINE "accelerator"
+
+// ---------- Workload ----------
+
+int workload_add(struct workload* workload, const char* spec)
+{
+    struct workload_class cls = {0, 0, 1.0};
+    char* end;
+
+    if (workload->n_classes == SELECTOR_MAX_CLASSES)
+        return -1;
+    cls.blocks = strtoul(spec, &end, 10);
+    if (*end++ != ':' || !cls.blocks)
+        return -1;
+    cls.difficulty_bits = strtoul(end, &end, 10);
+    if (*end == ':')
+        cls.weight = strtod(end + 1, &end);
+    if (*end || cls.difficulty_bits > 32 || cls.weight <= 0)
+        return -1;
+    workload->classes[workload->n_classes++] = cls;
+    return 0;
+}
+
+// ---------- Candidates ----------
+
+// Name markers of the bitstreams of ../bitstreams known not to work.
+static const char* broken_markers[] = {"NotWorking", "broken"};
+
+static uint32_t difficulty_mask(uint32_t bits)
+{
+    return bits ? 0xFFFFFFFF << (32 - bits) : 0;
+}
+
+static double model_ms(const struct accel_model_config* config, uint32_t blocks, uint32_t bits)
+{
+    struct accel_model_prediction prediction;
+
+    accel_model_predict(config, difficulty_mask(bits), blocks, &prediction);
+    return prediction.time_ms;
+}
+
+// Name without the directory and the extension.
+static void bitstream_name(const char* file, char* name)
+{
+    const char* base = strrchr(file, '/');
+
+    snprintf(name, SELECTOR_NAME_LEN, "%.*s", SELECTOR_NAME_LEN - 1, base ? base + 1 : file);
+    char* dot = strchr(name, '.');
+    if (dot)
+        *dot = 0;
+}
+
+int bitstream_scan(const char* dir, struct bitstream_candidate* candidates, uint32_t max)
+{
+    struct dirent** entries;
+    int n = scandir(dir, &entries, NULL, alphasort);
+    uint32_t found = 0;
+
+    if (n < 0)
+        return -1;
+    for (int i = 0; i < n; ++i)
+    {
+        const char* dot = strrchr(entries[i]->d_name, '.');
+        struct bitstream_candidate* c = &candidates[found];
+        if (found < max && dot && !strcmp(dot, ".bit") && !accel_model_config_from_name(entries[i]->d_name, &c->config))
+        {
+            bitstream_name(entries[i]->d_name, c->name);
+            c->scale = 1.0;
+            c->overhead_ms = 0;
+            c->samples = 0;
+            c->blocks_per_sec = 0;
+            c->hash_per_sec = 0;
+            c->broken = 0;
+            for (uint32_t m = 0; m < sizeof(broken_markers) / sizeof(broken_markers[0]); ++m)
+                if (strstr(c->name, broken_markers[m]))
+                    c->broken = 1;
+            found++;
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    return found;
+}
+
+// ---------- Calibration ----------
+
+struct fit_sums
+{
+    double x, y, xx, xy;
+    uint32_t n;
+};
+
+static int csv_column(char* header, const char* name)
+{
+    int index = 0;
+
+    for (char* field = strtok(header, ",\r\n"); field; field = strtok(NULL, ",\r\n"), ++index)
+        if (!strcmp(field, name))
+            return index;
+    return -1;
+}
+
+// Splits line in place into at most max fields.
+static int csv_split(char* line, char** fields, int max)
+{
+    int n = 0;
+
+    while (n < max)
+    {
+        fields[n++] = line;
+        line = strchr(line, ',');
+        if (!line)
+            break;
+        *line++ = 0;
+    }
+    fields[n - 1][strcspn(fields[n - 1], "\r\n")] = 0;
+    return n;
+}
+
+int bitstream_calibrate(struct bitstream_candidate* candidates, uint32_t n, const char* csv)
+{
+    static const char* names[] = {"bitstream", "blocks", "difficulty_bits", "time_ms", "engine"};
+    struct fit_sums sums[SELECTOR_MAX_CANDIDATES];
+    char line[CSV_LINE];
+    char header[CSV_LINE];
+    int columns[5];
+    int last = 0;
+    int runs = 0;
+    FILE* f = fopen(csv, "r");
+
+    if (!f)
+        return -1;
+    if (!fgets(line, sizeof(line), f))
+    {
+        fclose(f);
+        return -1;
+    }
+    for (int i = 0; i < 5; ++i)
+    {
+        strcpy(header, line);
+        columns[i] = csv_column(header, names[i]);
+        if (columns[i] < 0)
+        {
+            fclose(f);
+            return -1;
+        }
+        if (columns[i] > last)
+            last = columns[i];
+    }
+
+    memset(sums, 0, sizeof(sums));
+    while (fgets(line, sizeof(line), f))
+    {
+        char* fields[32];
+        char name[SELECTOR_NAME_LEN];
+        if (last >= 32 || csv_split(line, fields, 32) <= last || strcmp(fields[columns[4]], CALIBRATION_ENGINE))
+            continue;
+        bitstream_name(fields[columns[0]], name);
+        for (uint32_t c = 0; c < n && c < SELECTOR_MAX_CANDIDATES; ++c)
+        {
+            if (strcmp(candidates[c].name, name))
+                continue;
+            uint32_t blocks = strtoul(fields[columns[1]], NULL, 10);
+            uint32_t bits = strtoul(fields[columns[2]], NULL, 10);
+            double y = strtod(fields[columns[3]], NULL);
+            if (!blocks || blocks > HASHER_MAX_BLOCKS || bits > 32 || y <= 0)
+                break;
+            double x = model_ms(&candidates[c].config, blocks, bits);
+            sums[c].x += x;
+            sums[c].y += y;
+            sums[c].xx += x * x;
+            sums[c].xy += x * y;
+            sums[c].n++;
+            runs++;
+            break;
+        }
+    }
+    fclose(f);
+
+    // Least squares of measured = scale * model + overhead. Too few or too similar runs
+    // for an overhead, or a negative one: through the origin.
+    double scale_sum = 0, overhead_sum = 0;
+    uint32_t fitted = 0;
+    for (uint32_t c = 0; c < n && c < SELECTOR_MAX_CANDIDATES; ++c)
+    {
+        struct fit_sums* s = &sums[c];
+        if (!s->n)
+            continue;
+        double det = s->n * s->xx - s->x * s->x;
+        double scale = det > 1e-9 * s->n * s->xx ? (s->n * s->xy - s->x * s->y) / det : 0;
+        double overhead = scale > 0 ? (s->y - scale * s->x) / s->n : -1;
+        if (overhead < 0)
+        {
+            scale = s->xy / s->xx;
+            overhead = 0;
+        }
+        candidates[c].scale = scale;
+        candidates[c].overhead_ms = overhead;
+        candidates[c].samples = s->n;
+        scale_sum += scale;
+        overhead_sum += overhead;
+        fitted++;
+    }
+    for (uint32_t c = 0; fitted && c < n; ++c)
+    {
+        if (c < SELECTOR_MAX_CANDIDATES && sums[c].n)
+            continue;
+        candidates[c].scale = scale_sum / fitted;
+        candidates[c].overhead_ms = overhead_sum / fitted;
+    }
+    return runs;
+}
+
+// ---------- Selection ----------
+
+double bitstream_batch_ms(const struct bitstream_candidate* candidate, uint32_t blocks, uint32_t difficulty_bits)
+{
+    uint32_t full = blocks / HASHER_MAX_BLOCKS;
+    uint32_t rest = blocks % HASHER_MAX_BLOCKS;
+    double ms = 0;
+
+    if (full)
+        ms += full * (candidate->scale * model_ms(&candidate->config, HASHER_MAX_BLOCKS, difficulty_bits) + candidate->overhead_ms);
+    if (rest)
+        ms += candidate->scale * model_ms(&candidate->config, rest, difficulty_bits) + candidate->overhead_ms;
+    return ms;
+}
+
+void bitstream_evaluate(struct bitstream_candidate* candidates, uint32_t n, const struct workload* workload)
+{
+    for (uint32_t c = 0; c < n; ++c)
+    {
+        double blocks = 0, hashes = 0, ms = 0;
+        for (uint32_t i = 0; i < workload->n_classes; ++i)
+        {
+            const struct workload_class* cls = &workload->classes[i];
+            blocks += cls->weight * cls->blocks;
+            hashes += cls->weight * cls->blocks * (cls->difficulty_bits < 32 ? (double)(1ull << cls->difficulty_bits) : 4294967296.0);
+            ms += cls->weight * bitstream_batch_ms(&candidates[c], cls->blocks, cls->difficulty_bits);
+        }
+        candidates[c].blocks_per_sec = ms > 0 ? blocks * 1000.0 / ms : 0;
+        candidates[c].hash_per_sec = ms > 0 ? hashes * 1000.0 / ms : 0;
+    }
+}
+
+int bitstream_best(const struct bitstream_candidate* candidates, uint32_t n)
+{
+    int best = -1;
+
+    for (uint32_t c = 0; c < n; ++c)
+        if (!candidates[c].broken && (best < 0 || candidates[c].blocks_per_sec > candidates[best].blocks_per_sec))
+            best = c;
+    return best;
+}
+
+// ---------- Loading ----------
+
+static int write_file(const char* path, const char* value)
+{
+    int fd = open(path, O_WRONLY);
+    if (fd == -1)
+    {
+        perror(path);
+        return -1;
+    }
+    ssize_t written = write(fd, value, strlen(value));
+    close(fd);
+    if (written != (ssize_t)strlen(value))
+    {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+// Copies file into /lib/firmware, where the FPGA manager and the overlays look for it.
+static int copy_to_firmware(const char* file, const char* base)
+{
+    char dest[256];
+    char buf[65536];
+    ssize_t n;
+
+    snprintf(dest, sizeof(dest), FIRMWARE_DIR "/%s", base);
+    int in = open(file, O_RDONLY);
+    if (in == -1)
+    {
+        perror(file);
+        return -1;
+    }
+    int out = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out == -1)
+    {
+        perror(dest);
+        close(in);
+        return -1;
+    }
+    while ((n = read(in, buf, sizeof(buf))) > 0)
+        if (write(out, buf, n) != n)
+        {
+            n = -1;
+            break;
+        }
+    close(in);
+    close(out);
+    if (n < 0)
+    {
+        perror(dest);
+        return -1;
+    }
+    return 0;
+}
+
+int bitstream_load(const char* file)
+{
+    const char* base = strrchr(file, '/');
+    const char* dot = strrchr(file, '.');
+
+    base = base ? base + 1 : file;
+    if (copy_to_firmware(file, base))
+        return -1;
+
+    if (dot && !strcmp(dot, ".dtbo"))
+    {
+        // Removing the previous overlay unbinds the driver and releases the FPGA.
+        if (rmdir(OVERLAY_DIR) && errno != ENOENT)
+        {
+            perror(OVERLAY_DIR);
+            return -1;
+        }
+        if (mkdir(OVERLAY_DIR, 0755))
+        {
+            perror(OVERLAY_DIR);
+            return -1;
+        }
+        return write_file(OVERLAY_DIR "/path", base);
+    }
+
+    // Full reconfiguration.
+    if (write_file(FPGA_MANAGER "/flags", "0"))
+        return -1;
+    return write_file(FPGA_MANAGER "/firmware", base);
+}
@@ -0,0 +1,73 @@
+#ifndef	BITSTREAMSELECTOR_H
+#define	BITSTREAMSELECTOR_H
+
+#include <stdint.h>
+
+#include "AccelModel.h"
+
+// Picks the accelerator configuration for a workload. Every bitstream is scored with
+// the accelerator model (AccelModel.h) on the batches the workload is made of; with
+// measured runs at hand, the model time of each bitstream is first fitted to them as
+// scale * model + overhead, which takes in the driver and the real memory latencies.
+
+#define SELECTOR_MAX_CANDIDATES 32
+#define SELECTOR_MAX_CLASSES 16
+#define SELECTOR_NAME_LEN 128
+
+// Batches of blocks blocks at difficulty_bits leading zero bits, weight of them in the mix.
+struct workload_class
+{
+    uint32_t blocks;
+    uint32_t difficulty_bits;
+    double weight;
+};
+
+struct workload
+{
+    uint32_t n_classes;
+    struct workload_class classes[SELECTOR_MAX_CLASSES];
+};
+
+// Adds "blocks:bits[:weight]" (weight 1 by default). Returns -1 if malformed or full.
+int workload_add(struct workload* workload, const char* spec);
+
+struct bitstream_candidate
+{
+    char name[SELECTOR_NAME_LEN];       // file name without its extension
+    struct accel_model_config config;
+    double scale;                       // measured time / model time
+    double overhead_ms;                 // per job, on top of the accelerator
+    uint32_t samples;                   // measured runs fitted, 0 for the plain model
+    int broken;                         // marked as such in its name, never recommended
+    // For the workload, from bitstream_evaluate().
+    double blocks_per_sec;
+    double hash_per_sec;
+};
+
+// One candidate per .bit file of dir whose name gives its configuration, e.g.
+// 76MHz_2clusters_4hashers.bit. Names with "NotWorking" or "broken" are flagged broken.
+// Returns how many, -1 if dir cannot be read.
+int bitstream_scan(const char* dir, struct bitstream_candidate* candidates, uint32_t max);
+
+// Fits the candidates to the runs of a CSV file with a header line naming at least the
+// columns bitstream, engine, blocks, difficulty_bits and time_ms (as written by the
+// benchmarks). Only the rows of engine "accelerator" are used: the CPU, hybrid and
+// pipelined times do not follow the model. Candidates without runs get the mean fit of
+// the others. Returns the runs used, -1 if the file cannot be read or lacks a column.
+int bitstream_calibrate(struct bitstream_candidate* candidates, uint32_t n, const char* csv);
+
+// Expected time of one batch, in ms. Batches over HASHER_MAX_BLOCKS take several jobs.
+double bitstream_batch_ms(const struct bitstream_candidate* candidate, uint32_t blocks, uint32_t difficulty_bits);
+
+// Fills blocks_per_sec and hash_per_sec of every candidate for the workload.
+void bitstream_evaluate(struct bitstream_candidate* candidates, uint32_t n, const struct workload* workload);
+// Index of the candidate with the most blocks per second, broken ones left out, -1 if none.
+int bitstream_best(const struct bitstream_candidate* candidates, uint32_t n);
+
+// Programs the FPGA through the FPGA manager. A .dtbo is applied as a device tree
+// overlay (configfs), which loads the bitstream it names and brings up the hasher
+// nodes; anything else is copied to /lib/firmware and written to the FPGA manager,
+// the overlay of the driver must already be in place. Needs root. Returns 0 on success.
+int bitstream_load(const char* file);
+
+#endif // BITSTREAMSELECTOR_H
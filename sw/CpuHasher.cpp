@@ -0,0 +1,328 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include "CpuHasher.h"
+#include "CpuHasherCore.h"
+
+// Nonces handed to a search call at a time by compute_hash_block_cpu().
+#define CPU_SEARCH_CHUNK (1u << 20)
+// Nonces each kernel runs when picking the fastest one.
+#define CPU_CALIBRATION_NONCES (1u << 16)
+
+void pow_prepare_midstate(const uint8_t* block, struct pow_midstate* ms)
+{
+    for (int t = 0; t < 15; ++t)
+        ms->w[t] = load_be32(block + 4 * t);
+    ms->w[15] = 0;
+
+    uint32_t a = H_INIT[0], b = H_INIT[1], c = H_INIT[2], d = H_INIT[3], e = H_INIT[4];
+#pragma GCC unroll 15
+    for (int t = 0; t < 15; ++t)
+        SHA1_ROUND(t, a, b, c, d, e, ms->w[t] + sha1_k(t));
+
+    ms->a = a;
+    ms->b = b;
+    ms->c = c;
+    ms->d = d;
+    ms->e = e;
+
+    // Nonce-independent part of the schedule. w holds the full words that do not
+    // depend on the nonce and 0 for the others, so their terms drop out of the XOR.
+    uint32_t w[80];
+    memcpy(w, ms->w, sizeof(ms->w));
+    w[15] = 0;
+    memset(ms->wx, 0, 16 * sizeof(uint32_t));
+    for (int t = 16; t < 80; ++t)
+    {
+        uint32_t x = w[t - 3] ^ w[t - 8] ^ w[t - 14] ^ w[t - 16];
+        if (W_DEP.dep[t])
+        {
+            w[t] = 0;
+            ms->wx[t] = x;
+        }
+        else
+        {
+            w[t] = ROTL(x, 1);
+            ms->wx[t] = w[t] + sha1_k(t);
+        }
+    }
+
+    // Round 15 only adds W[15]; after it B..E are fixed, so is all of round 16 but ROTL(A, 5).
+    ms->a15 = ROTL(a, 5) + sha1_f(15, b, c, d) + e + sha1_k(15);
+    ms->r16 = sha1_f(16, a, ROTL(b, 30), c) + d + ms->wx[16];
+}
+
+// A word of the digest of the block with the given nonce, the only one the difficulty
+// test needs. Words of the schedule fixed per block come from the midstate, and the
+// last round only computes A.
+static inline uint32_t pow_digest_a(const struct pow_midstate* ms, uint32_t nonce)
+{
+    uint32_t w[80];
+    w[15] = nonce_to_word(nonce);
+#pragma GCC unroll 64
+    for (int t = 16; t < 80; ++t)
+    {
+        if (!W_DEP.dep[t])
+            continue;
+        uint32_t x = ms->wx[t];
+        if (W_DEP.dep[t - 3])
+            x ^= w[t - 3];
+        if (W_DEP.dep[t - 8])
+            x ^= w[t - 8];
+        if (W_DEP.dep[t - 14])
+            x ^= w[t - 14];
+        if (W_DEP.dep[t - 16])
+            x ^= w[t - 16];
+        w[t] = ROTL(x, 1);
+    }
+
+    uint32_t a16 = ms->a15 + w[15];
+    uint32_t a = ROTL(a16, 5) + ms->r16, b = a16, c = ROTL(ms->a, 30), d = ROTL(ms->b, 30), e = ms->c;
+#pragma GCC unroll 63
+    for (int t = 17; t < 80; ++t)
+        SHA1_ROUND(t, a, b, c, d, e, W_DEP.dep[t] ? w[t] + sha1_k(t) : ms->wx[t]);
+
+    uint32_t h0 = H_INIT[0] + a, h1 = H_INIT[1] + b, h2 = H_INIT[2] + c, h3 = H_INIT[3] + d, h4 = H_INIT[4] + e;
+    a = h0; b = h1; c = h2; d = h3; e = h4;
+#pragma GCC unroll 79
+    for (int t = 0; t < 79; ++t)
+        SHA1_ROUND(t, a, b, c, d, e, PAD.wk[t]);
+
+    return h0 + ROTL(a, 5) + sha1_f(79, b, c, d) + e + PAD.wk[79];
+}
+
+// Full two-block SHA-1 of the block with the given nonce, starting from the midstate.
+static inline void pow_compress(const struct pow_midstate* ms, uint32_t nonce, uint32_t h[5])
+{
+    uint32_t w[80];
+    memcpy(w, ms->w, sizeof(ms->w));
+    w[15] = nonce_to_word(nonce);
+#pragma GCC unroll 64
+    for (int t = 16; t < 80; ++t)
+    {
+        uint32_t x = w[t - 3] ^ w[t - 8] ^ w[t - 14] ^ w[t - 16];
+        w[t] = ROTL(x, 1);
+    }
+
+    uint32_t a = ms->a, b = ms->b, c = ms->c, d = ms->d, e = ms->e;
+#pragma GCC unroll 65
+    for (int t = 15; t < 80; ++t)
+        SHA1_ROUND(t, a, b, c, d, e, w[t] + sha1_k(t));
+
+    uint32_t h0 = H_INIT[0] + a, h1 = H_INIT[1] + b, h2 = H_INIT[2] + c, h3 = H_INIT[3] + d, h4 = H_INIT[4] + e;
+    a = h0; b = h1; c = h2; d = h3; e = h4;
+#pragma GCC unroll 80
+    for (int t = 0; t < 80; ++t)
+        SHA1_ROUND(t, a, b, c, d, e, PAD.wk[t]);
+
+    h[0] = h0 + a;
+    h[1] = h1 + b;
+    h[2] = h2 + c;
+    h[3] = h3 + d;
+    h[4] = h4 + e;
+}
+
+struct hasher_result pow_hash_nonce(const struct pow_midstate* ms, uint32_t nonce)
+{
+    uint32_t h[5];
+    struct hasher_result res;
+
+    pow_compress(ms, nonce, h);
+    res.a = h[0];
+    res.b = h[1];
+    res.c = h[2];
+    res.d = h[3];
+    res.e = h[4];
+    res.nonce = nonce;
+    res.nonces = 0;
+    res.status = HASHER_STATUS_FOUND;
+    return res;
+}
+
+void pow_roll_extranonce(uint8_t* block)
+{
+    uint32_t extranonce;
+    memcpy(&extranonce, block + EXTRANONCE_OFFSET, 4);
+    extranonce++;
+    memcpy(block + EXTRANONCE_OFFSET, &extranonce, 4);
+}
+
+int pow_search_scalar(const struct pow_midstate* ms, uint32_t difficulty,
+                      uint32_t start, uint32_t count, struct hasher_result* res)
+{
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        uint32_t nonce = start + i;
+        if (!(pow_digest_a(ms, nonce) & difficulty))
+        {
+            //Nonce found, only now compute the whole digest
+            *res = pow_hash_nonce(ms, nonce);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int always_supported(void)
+{
+    return 1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static int sse4_supported(void)
+{
+    return __builtin_cpu_supports("sse4.1");
+}
+
+static int avx2_supported(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+static int avx512_supported(void)
+{
+    return __builtin_cpu_supports("avx512f");
+}
+
+// SHA extensions: CPUID leaf 7, EBX bit 29.
+static int shani_supported(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return 0;
+    return (ebx & (1u << 29)) && __builtin_cpu_supports("sse4.1");
+}
+#endif
+
+#if defined(__aarch64__)
+static int armv8_sha1_supported(void)
+{
+    return (getauxval(AT_HWCAP) & HWCAP_SHA1) != 0;
+}
+#endif
+
+static const struct pow_kernel kernels[] = {
+    {"scalar", 1, pow_search_scalar, always_supported},
+#if defined(__x86_64__) || defined(__i386__)
+    {"sse4", 4, pow_search_sse4, sse4_supported},
+    {"avx2", 8, pow_search_avx2, avx2_supported},
+    {"avx512", 16, pow_search_avx512, avx512_supported},
+    {"shani", 4, pow_search_shani, shani_supported},
+#endif
+#if defined(__aarch64__)
+    {"neon", 4, pow_search_neon, always_supported},
+    {"armv8-sha1", 4, pow_search_armv8, armv8_sha1_supported},
+#endif
+};
+
+static const struct pow_kernel* current_kernel = NULL;
+
+const struct pow_kernel* pow_kernel_list(uint32_t* count)
+{
+    *count = sizeof(kernels) / sizeof(kernels[0]);
+    return kernels;
+}
+
+const struct pow_kernel* pow_find_kernel(const char* name)
+{
+    for (uint32_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); ++i)
+    {
+        if (!strcmp(kernels[i].name, name))
+            return kernels[i].supported() ? &kernels[i] : NULL;
+    }
+    return NULL;
+}
+
+const struct pow_kernel* pow_select_fastest_kernel(int verbose)
+{
+    // Any block will do: with this mask a hit needs A == 0, so every kernel runs the whole range.
+    uint8_t block[64] = {0};
+    struct pow_midstate ms;
+    struct hasher_result res;
+    double best_rate = 0.0;
+
+    pow_prepare_midstate(block, &ms);
+    current_kernel = &kernels[0];
+    for (uint32_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); ++i)
+    {
+        if (!kernels[i].supported())
+            continue;
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        kernels[i].search(&ms, 0xFFFFFFFF, 0, CPU_CALIBRATION_NONCES, &res);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double sec = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+        double rate = CPU_CALIBRATION_NONCES / sec;
+
+        if (verbose)
+            printf("CPU kernel %-10s %8.2f MH/s\n", kernels[i].name, rate / 1e6);
+        if (rate > best_rate)
+        {
+            best_rate = rate;
+            current_kernel = &kernels[i];
+        }
+    }
+    return current_kernel;
+}
+
+const struct pow_kernel* pow_get_kernel(void)
+{
+    if (current_kernel)
+        return current_kernel;
+
+    const char* forced = getenv("HASHER_CPU_KERNEL");
+    if (forced)
+    {
+        current_kernel = pow_find_kernel(forced);
+        if (!current_kernel)
+            printf("CPU kernel %s not available, falling back\n", forced);
+    }
+    if (!current_kernel)
+        pow_select_fastest_kernel(0);
+    return current_kernel;
+}
+
+void pow_set_kernel(const struct pow_kernel* kernel)
+{
+    current_kernel = kernel;
+}
+
+struct hasher_result compute_hash_block_cpu(uint8_t* addr, uint32_t difficulty)
+{
+    struct pow_midstate ms;
+    struct hasher_result final_result;
+    uint64_t nonce = 0;
+    uint64_t tried = 0;         // over every extranonce of the block
+
+    pow_search_fn search = pow_get_kernel()->search;
+
+    pow_prepare_midstate(addr, &ms);
+    while (!search(&ms, difficulty, (uint32_t)nonce, CPU_SEARCH_CHUNK, &final_result))
+    {
+        nonce += CPU_SEARCH_CHUNK;
+        if (nonce == (1ull << 32))
+        {
+            // No valid nonce for this block at all
+            pow_roll_extranonce(addr);
+            pow_prepare_midstate(addr, &ms);
+            tried += nonce;
+            nonce = 0;
+        }
+    }
+
+    tried += (uint64_t)final_result.nonce + 1;
+    final_result.nonces = tried > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)tried;
+    memcpy(addr + 60, &final_result.nonce, 4);
+    return final_result;
+}
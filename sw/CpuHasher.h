@@ -0,0 +1,108 @@
+#ifndef	CPUHASHER_H
+#define	CPUHASHER_H
+
+#include <stdint.h>
+
+// Result record as written back by the accelerator (and by the CPU engine).
+struct hasher_result
+{
+    uint32_t b;
+    uint32_t a;
+    uint32_t d;
+    uint32_t c;
+    uint32_t nonce;             // EXHAUSTED, CANCELLED: next nonce of the range, to resume from
+    uint32_t e;
+    uint32_t nonces;            // nonces tried for the block, saturates at 2^32 - 1
+    uint32_t status;            // HASHER_STATUS_*, 0 if the block was not processed
+} __attribute__((packed));
+
+#define HASHER_STATUS_FOUND 1
+#define HASHER_STATUS_EXHAUSTED 2       // no valid nonce in the range, hash is all zeros
+#define HASHER_STATUS_CANCELLED 3       // job cancelled while the block was searched, hash is all zeros
+
+// Bytes 56-59 of a block (message word W[14]) are its extranonce. A block with no
+// valid nonce gets a new extranonce and is searched again.
+#define EXTRANONCE_OFFSET 56
+void pow_roll_extranonce(uint8_t* block);
+
+// Everything of a 64-byte block that does not depend on the nonce.
+// The nonce lives in bytes 60-63 (message word W[15]), so rounds 0-14 of the
+// first SHA-1 block are computed once per block and every candidate restarts
+// from here. The second (padding) block is the same for all blocks.
+struct pow_midstate
+{
+    uint32_t w[16];             // big-endian message words, w[15] is overwritten per nonce
+    uint32_t a, b, c, d, e;     // working variables after round 14
+    // Only used by the search kernels, which only look at the A word of the digest:
+    // wx[t] (t >= 16) is W[t] + K[t] if W[t] does not depend on the nonce, otherwise
+    // the XOR of the terms of W[t] that do not depend on it.
+    uint32_t wx[80];
+    uint32_t a15;               // A after round 15 minus W[15]
+    uint32_t r16;               // round 16 without ROTL(A, 5), all its other inputs are fixed
+};
+
+void pow_prepare_midstate(const uint8_t* block, struct pow_midstate* ms);
+
+// Tests nonces [start, start + count) in increasing order.
+// Returns 1 and fills res with the first nonce whose hash satisfies !(A & difficulty),
+// 0 if none of them does.
+int pow_search_scalar(const struct pow_midstate* ms, uint32_t difficulty,
+                      uint32_t start, uint32_t count, struct hasher_result* res);
+
+typedef int (*pow_search_fn)(const struct pow_midstate* ms, uint32_t difficulty,
+                             uint32_t start, uint32_t count, struct hasher_result* res);
+
+// Multi-lane kernels (CpuHasherSimd.cpp), same contract as pow_search_scalar.
+// Only call them through pow_find_kernel()/pow_get_kernel(), which check the running CPU.
+#if defined(__x86_64__) || defined(__i386__)
+int pow_search_sse4(const struct pow_midstate* ms, uint32_t difficulty,
+                    uint32_t start, uint32_t count, struct hasher_result* res);
+int pow_search_avx2(const struct pow_midstate* ms, uint32_t difficulty,
+                    uint32_t start, uint32_t count, struct hasher_result* res);
+int pow_search_avx512(const struct pow_midstate* ms, uint32_t difficulty,
+                      uint32_t start, uint32_t count, struct hasher_result* res);
+#endif
+#if defined(__aarch64__)
+int pow_search_neon(const struct pow_midstate* ms, uint32_t difficulty,
+                    uint32_t start, uint32_t count, struct hasher_result* res);
+#endif
+
+// Kernels on the SHA-1 instructions of the CPU (CpuHasherShaExt.cpp).
+#if defined(__x86_64__) || defined(__i386__)
+int pow_search_shani(const struct pow_midstate* ms, uint32_t difficulty,
+                     uint32_t start, uint32_t count, struct hasher_result* res);
+#endif
+#if defined(__aarch64__)
+int pow_search_armv8(const struct pow_midstate* ms, uint32_t difficulty,
+                     uint32_t start, uint32_t count, struct hasher_result* res);
+#endif
+
+struct pow_kernel
+{
+    const char* name;
+    uint32_t lanes;             // nonces tested per iteration
+    pow_search_fn search;
+    int (*supported)(void);     // non-zero if the running CPU can execute it
+};
+
+// All kernels compiled in for this target, scalar first.
+const struct pow_kernel* pow_kernel_list(uint32_t* count);
+// Kernel with the given name, NULL if unknown or not supported by this CPU.
+const struct pow_kernel* pow_find_kernel(const char* name);
+// Times every supported kernel on a short nonce range and makes the fastest one current.
+// With verbose set, prints the rate measured for each kernel.
+const struct pow_kernel* pow_select_fastest_kernel(int verbose);
+// Kernel used by compute_hash_block_cpu(). Picked by pow_select_fastest_kernel() on
+// first use, the environment variable HASHER_CPU_KERNEL overrides it by name.
+const struct pow_kernel* pow_get_kernel(void);
+void pow_set_kernel(const struct pow_kernel* kernel);
+
+// Same as sha1(addr, 64) on the block with the nonce stored at addr + 60.
+struct hasher_result pow_hash_nonce(const struct pow_midstate* ms, uint32_t nonce);
+
+// Searches the block at addr for a nonce, writes the winning nonce back into the block.
+// If none of the 2^32 nonces is valid, rolls the extranonce and starts over: nonces
+// counts those of every extranonce, saturating as in the record.
+struct hasher_result compute_hash_block_cpu(uint8_t* addr, uint32_t difficulty);
+
+#endif // CPUHASHER_H
@@ -0,0 +1,93 @@
+#ifndef	CPUHASHERCORE_H
+#define	CPUHASHERCORE_H
+
+// SHA-1 helpers shared by the scalar and the SIMD nonce search kernels.
+// Internal to CpuHasher*.cpp, applications include CpuHasher.h.
+
+#include <stdint.h>
+#include <string.h>
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static const uint32_t H_INIT[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+static constexpr uint32_t sha1_k(int t)
+{
+    return t < 20 ? 0x5a827999 : t < 40 ? 0x6ed9eba1 : t < 60 ? 0x8f1bbcdc : 0xca62c1d6;
+}
+
+// t is a constant once the round loops are unrolled, so the branch folds away.
+static inline uint32_t sha1_f(int t, uint32_t b, uint32_t c, uint32_t d)
+{
+    if (t < 20)
+        return d ^ (b & (c ^ d));
+    if (t < 40 || t >= 60)
+        return b ^ c ^ d;
+    return (b & c) | (d & (b | c));
+}
+
+#define SHA1_ROUND(t, a, b, c, d, e, wk)                                         \
+    do {                                                                         \
+        uint32_t __tmp = ROTL(a, 5) + sha1_f(t, b, c, d) + (e) + (wk);           \
+        e = d;                                                                   \
+        d = c;                                                                   \
+        c = ROTL(b, 30);                                                         \
+        b = a;                                                                   \
+        a = __tmp;                                                               \
+    } while (0)
+
+// W[t] + K[t] of the second block. The message is always 64 bytes long, so the
+// padding block (0x80, zeros, bit length 512) is the same for every block and nonce.
+struct pad_schedule
+{
+    uint32_t wk[80];
+
+    constexpr pad_schedule() : wk()
+    {
+        uint32_t w[80] = {};
+        w[0] = 0x80000000;
+        w[15] = 512;
+        for (int t = 16; t < 80; ++t)
+        {
+            uint32_t x = w[t - 3] ^ w[t - 8] ^ w[t - 14] ^ w[t - 16];
+            w[t] = ROTL(x, 1);
+        }
+        for (int t = 0; t < 80; ++t)
+            wk[t] = w[t] + sha1_k(t);
+    }
+};
+
+static constexpr pad_schedule PAD = pad_schedule();
+
+// Which words of the first block's schedule depend on the nonce (W[15]).
+// W[16], W[17], W[19], W[20], W[22], ... only mix words 0-14 and are fixed per block;
+// for the others, the terms that do not depend on the nonce are folded into one
+// constant by pow_prepare_midstate() (see pow_midstate::wx).
+struct nonce_dependency
+{
+    bool dep[80];
+
+    constexpr nonce_dependency() : dep()
+    {
+        dep[15] = true;
+        for (int t = 16; t < 80; ++t)
+            dep[t] = dep[t - 3] || dep[t - 8] || dep[t - 14] || dep[t - 16];
+    }
+};
+
+static constexpr nonce_dependency W_DEP = nonce_dependency();
+
+static inline uint32_t load_be32(const uint8_t* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+// The nonce is stored in native byte order at addr + 60 and read back big-endian by SHA-1.
+static inline uint32_t nonce_to_word(uint32_t nonce)
+{
+    uint8_t bytes[4];
+    memcpy(bytes, &nonce, 4);
+    return load_be32(bytes);
+}
+
+#endif // CPUHASHERCORE_H
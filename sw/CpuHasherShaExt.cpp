@@ -0,0 +1,247 @@
+#include <stdint.h>
+
+#include "CpuHasher.h"
+#include "CpuHasherCore.h"
+
+// Nonce search on the SHA-1 instructions of the CPU (x86 SHA extensions, ARMv8
+// Crypto Extensions). The instructions run four rounds at a time, so the midstate
+// here is taken after round 11, the last group not touching W[15]. Several nonces
+// are interleaved to hide the latency of the round instructions.
+// Compiled with target pragmas and only called after CpuHasher.cpp checked CPUID/HWCAP.
+
+#define SHA_EXT_WAYS 4
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#pragma GCC push_options
+#pragma GCC target("sha,sse4.1")
+
+// The round function/constant selector of sha1rnds4 is an immediate.
+#define SHANI_RNDS4(abcd, e, f)                                                  \
+    ((f) == 0 ? _mm_sha1rnds4_epu32(abcd, e, 0) :                                \
+     (f) == 1 ? _mm_sha1rnds4_epu32(abcd, e, 1) :                                \
+     (f) == 2 ? _mm_sha1rnds4_epu32(abcd, e, 2) :                                \
+                _mm_sha1rnds4_epu32(abcd, e, 3))
+
+// W[4g .. 4g+3] from the four previous groups.
+#define SHANI_SCHEDULE(m0, m1, m2, m3)                                           \
+    _mm_sha1msg2_epu32(_mm_xor_si128(_mm_sha1msg1_epu32(m0, m1), m2), m3)
+
+// Registers hold ABCD with A in the top lane, words of a group with W[4g] in the top lane.
+// E is carried as the ABCD of the previous group and folded into W by sha1nexte.
+int pow_search_shani(const struct pow_midstate* ms, uint32_t difficulty,
+                     uint32_t start, uint32_t count, struct hasher_result* res)
+{
+    const __m128i init_abcd = _mm_set_epi32(H_INIT[0], H_INIT[1], H_INIT[2], H_INIT[3]);
+    const __m128i init_e = _mm_set_epi32(H_INIT[4], 0, 0, 0);
+    __m128i m[4];
+    for (int g = 0; g < 3; ++g)
+        m[g] = _mm_set_epi32(ms->w[4 * g], ms->w[4 * g + 1], ms->w[4 * g + 2], ms->w[4 * g + 3]);
+
+    // Rounds 0-11 of the first block.
+    __m128i mid_abcd = init_abcd, mid_prev, e;
+    e = _mm_add_epi32(init_e, m[0]);
+    mid_prev = mid_abcd;
+    mid_abcd = _mm_sha1rnds4_epu32(mid_abcd, e, 0);
+    e = _mm_sha1nexte_epu32(mid_prev, m[1]);
+    mid_prev = mid_abcd;
+    mid_abcd = _mm_sha1rnds4_epu32(mid_abcd, e, 0);
+    e = _mm_sha1nexte_epu32(mid_prev, m[2]);
+    mid_prev = mid_abcd;
+    mid_abcd = _mm_sha1rnds4_epu32(mid_abcd, e, 0);
+
+    // Message schedule of the padding block.
+    __m128i pad[20];
+    pad[0] = _mm_set_epi32(0x80000000, 0, 0, 0);
+    pad[1] = _mm_setzero_si128();
+    pad[2] = _mm_setzero_si128();
+    pad[3] = _mm_set_epi32(0, 0, 0, 512);
+    for (int g = 4; g < 20; ++g)
+        pad[g] = SHANI_SCHEDULE(pad[g - 4], pad[g - 3], pad[g - 2], pad[g - 1]);
+
+    uint32_t done = 0;
+    while (count - done >= SHA_EXT_WAYS)
+    {
+        uint32_t base = start + done;
+        __m128i msg[SHA_EXT_WAYS][4], abcd[SHA_EXT_WAYS], prev[SHA_EXT_WAYS];
+        __m128i h_abcd[SHA_EXT_WAYS], h_e[SHA_EXT_WAYS];
+
+        for (int j = 0; j < SHA_EXT_WAYS; ++j)
+        {
+            msg[j][0] = m[0];
+            msg[j][1] = m[1];
+            msg[j][2] = m[2];
+            msg[j][3] = _mm_set_epi32(ms->w[12], ms->w[13], ms->w[14], nonce_to_word(base + j));
+            abcd[j] = mid_abcd;
+            prev[j] = mid_prev;
+        }
+
+#pragma GCC unroll 17
+        for (int g = 3; g < 20; ++g)
+        {
+            for (int j = 0; j < SHA_EXT_WAYS; ++j)
+            {
+                if (g >= 4)
+                    msg[j][g & 3] = SHANI_SCHEDULE(msg[j][g & 3], msg[j][(g + 1) & 3],
+                                                   msg[j][(g + 2) & 3], msg[j][(g + 3) & 3]);
+                e = _mm_sha1nexte_epu32(prev[j], msg[j][g & 3]);
+                prev[j] = abcd[j];
+                abcd[j] = SHANI_RNDS4(abcd[j], e, g / 5);
+            }
+        }
+
+        for (int j = 0; j < SHA_EXT_WAYS; ++j)
+        {
+            h_e[j] = _mm_sha1nexte_epu32(prev[j], init_e);
+            h_abcd[j] = _mm_add_epi32(abcd[j], init_abcd);
+            e = _mm_add_epi32(h_e[j], pad[0]);
+            prev[j] = h_abcd[j];
+            abcd[j] = _mm_sha1rnds4_epu32(h_abcd[j], e, 0);
+        }
+
+#pragma GCC unroll 19
+        for (int g = 1; g < 20; ++g)
+        {
+            for (int j = 0; j < SHA_EXT_WAYS; ++j)
+            {
+                e = _mm_sha1nexte_epu32(prev[j], pad[g]);
+                prev[j] = abcd[j];
+                abcd[j] = SHANI_RNDS4(abcd[j], e, g / 5);
+            }
+        }
+
+        for (int j = 0; j < SHA_EXT_WAYS; ++j)
+        {
+            uint32_t a = (uint32_t)_mm_extract_epi32(_mm_add_epi32(abcd[j], h_abcd[j]), 3);
+            if (!(a & difficulty))
+            {
+                *res = pow_hash_nonce(ms, base + j);
+                return 1;
+            }
+        }
+        done += SHA_EXT_WAYS;
+    }
+
+    return pow_search_scalar(ms, difficulty, start + done, count - done, res);
+}
+
+#undef SHANI_RNDS4
+#undef SHANI_SCHEDULE
+#pragma GCC pop_options
+
+#endif // x86
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+
+#pragma GCC push_options
+#pragma GCC target("+crypto")
+
+#define ARMV8_SCHEDULE(m0, m1, m2, m3) vsha1su1q_u32(vsha1su0q_u32(m0, m1, m2), m3)
+
+// Four rounds with the round function of group g. E is a scalar here,
+// the next one is the rotated A of the current ABCD.
+#define ARMV8_ROUNDS4(g, abcd, e, w)                                             \
+    do {                                                                         \
+        uint32x4_t __wk = vaddq_u32(w, vdupq_n_u32(sha1_k(4 * (g))));            \
+        uint32_t __e_next = vsha1h_u32(vgetq_lane_u32(abcd, 0));                 \
+        if ((g) < 5)                                                             \
+            abcd = vsha1cq_u32(abcd, e, __wk);                                   \
+        else if ((g) < 10 || (g) >= 15)                                          \
+            abcd = vsha1pq_u32(abcd, e, __wk);                                   \
+        else                                                                     \
+            abcd = vsha1mq_u32(abcd, e, __wk);                                   \
+        e = __e_next;                                                            \
+    } while (0)
+
+// Registers hold ABCD with A in lane 0, words of a group with W[4g] in lane 0.
+int pow_search_armv8(const struct pow_midstate* ms, uint32_t difficulty,
+                     uint32_t start, uint32_t count, struct hasher_result* res)
+{
+    const uint32x4_t init_abcd = vld1q_u32(H_INIT);
+    uint32x4_t m[4];
+    for (int g = 0; g < 3; ++g)
+        m[g] = vld1q_u32(&ms->w[4 * g]);
+
+    // Rounds 0-11 of the first block.
+    uint32x4_t mid_abcd = init_abcd;
+    uint32_t mid_e = H_INIT[4];
+    for (int g = 0; g < 3; ++g)
+        ARMV8_ROUNDS4(g, mid_abcd, mid_e, m[g]);
+
+    // Message schedule of the padding block.
+    uint32x4_t pad[20];
+    const uint32_t pad0[4] = {0x80000000, 0, 0, 0};
+    const uint32_t pad3[4] = {0, 0, 0, 512};
+    pad[0] = vld1q_u32(pad0);
+    pad[1] = vdupq_n_u32(0);
+    pad[2] = vdupq_n_u32(0);
+    pad[3] = vld1q_u32(pad3);
+    for (int g = 4; g < 20; ++g)
+        pad[g] = ARMV8_SCHEDULE(pad[g - 4], pad[g - 3], pad[g - 2], pad[g - 1]);
+
+    uint32_t done = 0;
+    while (count - done >= SHA_EXT_WAYS)
+    {
+        uint32_t base = start + done;
+        uint32x4_t msg[SHA_EXT_WAYS][4], abcd[SHA_EXT_WAYS], h_abcd[SHA_EXT_WAYS];
+        uint32_t e[SHA_EXT_WAYS];
+
+        for (int j = 0; j < SHA_EXT_WAYS; ++j)
+        {
+            const uint32_t last[4] = {ms->w[12], ms->w[13], ms->w[14], nonce_to_word(base + j)};
+            msg[j][0] = m[0];
+            msg[j][1] = m[1];
+            msg[j][2] = m[2];
+            msg[j][3] = vld1q_u32(last);
+            abcd[j] = mid_abcd;
+            e[j] = mid_e;
+        }
+
+#pragma GCC unroll 17
+        for (int g = 3; g < 20; ++g)
+        {
+            for (int j = 0; j < SHA_EXT_WAYS; ++j)
+            {
+                if (g >= 4)
+                    msg[j][g & 3] = ARMV8_SCHEDULE(msg[j][g & 3], msg[j][(g + 1) & 3],
+                                                   msg[j][(g + 2) & 3], msg[j][(g + 3) & 3]);
+                ARMV8_ROUNDS4(g, abcd[j], e[j], msg[j][g & 3]);
+            }
+        }
+
+        for (int j = 0; j < SHA_EXT_WAYS; ++j)
+        {
+            h_abcd[j] = vaddq_u32(abcd[j], init_abcd);
+            abcd[j] = h_abcd[j];
+            e[j] += H_INIT[4];
+        }
+
+#pragma GCC unroll 20
+        for (int g = 0; g < 20; ++g)
+        {
+            for (int j = 0; j < SHA_EXT_WAYS; ++j)
+                ARMV8_ROUNDS4(g, abcd[j], e[j], pad[g]);
+        }
+
+        for (int j = 0; j < SHA_EXT_WAYS; ++j)
+        {
+            uint32_t a = vgetq_lane_u32(abcd[j], 0) + vgetq_lane_u32(h_abcd[j], 0);
+            if (!(a & difficulty))
+            {
+                *res = pow_hash_nonce(ms, base + j);
+                return 1;
+            }
+        }
+        done += SHA_EXT_WAYS;
+    }
+
+    return pow_search_scalar(ms, difficulty, start + done, count - done, res);
+}
+
+#undef ARMV8_SCHEDULE
+#undef ARMV8_ROUNDS4
+#pragma GCC pop_options
+
+#endif // aarch64
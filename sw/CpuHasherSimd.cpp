@@ -0,0 +1,162 @@
+#include <stdint.h>
+
+#include "CpuHasher.h"
+#include "CpuHasherCore.h"
+
+// Each kernel is compiled for its own instruction set with a target pragma, so the
+// binary still runs on older cores and CpuHasher.cpp picks a kernel at runtime.
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// ---------- SSE4.1, 4 lanes ----------
+#pragma GCC push_options
+#pragma GCC target("sse4.1")
+
+#define POW_SEARCH_SIMD pow_search_sse4
+#define VEC __m128i
+#define LANES 4
+#define V_SET1(x) _mm_set1_epi32((int)(x))
+#define V_LOAD(p) _mm_load_si128((const __m128i*)(p))
+#define V_ADD(x, y) _mm_add_epi32(x, y)
+#define V_XOR(x, y) _mm_xor_si128(x, y)
+#define V_ROTL(x, n) _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - (n)))
+#define V_F1(b, c, d) _mm_xor_si128(d, _mm_and_si128(b, _mm_xor_si128(c, d)))
+#define V_F2(b, c, d) _mm_xor_si128(_mm_xor_si128(b, c), d)
+#define V_F3(b, c, d) _mm_or_si128(_mm_and_si128(b, c), _mm_and_si128(d, _mm_or_si128(b, c)))
+#define V_HIT_MASK(a, d) (uint32_t)_mm_movemask_ps(_mm_castsi128_ps( \
+    _mm_cmpeq_epi32(_mm_and_si128(a, d), _mm_setzero_si128())))
+
+#include "CpuHasherLanes.inc"
+
+#undef POW_SEARCH_SIMD
+#undef VEC
+#undef LANES
+#undef V_SET1
+#undef V_LOAD
+#undef V_ADD
+#undef V_XOR
+#undef V_ROTL
+#undef V_F1
+#undef V_F2
+#undef V_F3
+#undef V_HIT_MASK
+#pragma GCC pop_options
+
+// ---------- AVX2, 8 lanes ----------
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+#define POW_SEARCH_SIMD pow_search_avx2
+#define VEC __m256i
+#define LANES 8
+#define V_SET1(x) _mm256_set1_epi32((int)(x))
+#define V_LOAD(p) _mm256_load_si256((const __m256i*)(p))
+#define V_ADD(x, y) _mm256_add_epi32(x, y)
+#define V_XOR(x, y) _mm256_xor_si256(x, y)
+#define V_ROTL(x, n) _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+#define V_F1(b, c, d) _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d)))
+#define V_F2(b, c, d) _mm256_xor_si256(_mm256_xor_si256(b, c), d)
+#define V_F3(b, c, d) _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c)))
+#define V_HIT_MASK(a, d) (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps( \
+    _mm256_cmpeq_epi32(_mm256_and_si256(a, d), _mm256_setzero_si256())))
+
+#include "CpuHasherLanes.inc"
+
+#undef POW_SEARCH_SIMD
+#undef VEC
+#undef LANES
+#undef V_SET1
+#undef V_LOAD
+#undef V_ADD
+#undef V_XOR
+#undef V_ROTL
+#undef V_F1
+#undef V_F2
+#undef V_F3
+#undef V_HIT_MASK
+#pragma GCC pop_options
+
+// ---------- AVX-512F, 16 lanes ----------
+// Native rotates and ternary logic: 0xCA = choose, 0x96 = parity, 0xE8 = majority.
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+// GCC 12 warns about _mm512_undefined_epi32() inside the rotate intrinsic.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+#define POW_SEARCH_SIMD pow_search_avx512
+#define VEC __m512i
+#define LANES 16
+#define V_SET1(x) _mm512_set1_epi32((int)(x))
+#define V_LOAD(p) _mm512_load_si512((const void*)(p))
+#define V_ADD(x, y) _mm512_add_epi32(x, y)
+#define V_XOR(x, y) _mm512_xor_si512(x, y)
+#define V_ROTL(x, n) _mm512_rol_epi32(x, n)
+#define V_F1(b, c, d) _mm512_ternarylogic_epi32(b, c, d, 0xCA)
+#define V_F2(b, c, d) _mm512_ternarylogic_epi32(b, c, d, 0x96)
+#define V_F3(b, c, d) _mm512_ternarylogic_epi32(b, c, d, 0xE8)
+#define V_HIT_MASK(a, d) (uint32_t)_mm512_testn_epi32_mask(a, d)
+
+#include "CpuHasherLanes.inc"
+
+#undef POW_SEARCH_SIMD
+#undef VEC
+#undef LANES
+#undef V_SET1
+#undef V_LOAD
+#undef V_ADD
+#undef V_XOR
+#undef V_ROTL
+#undef V_F1
+#undef V_F2
+#undef V_F3
+#undef V_HIT_MASK
+#pragma GCC diagnostic pop
+#pragma GCC pop_options
+
+#endif // x86
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+
+// ---------- NEON, 4 lanes ----------
+// Always present on ARMv8-A, no target pragma needed.
+static inline uint32_t neon_hit_mask(uint32x4_t a, uint32x4_t d)
+{
+    uint32x4_t hit = vceqq_u32(vandq_u32(a, d), vdupq_n_u32(0));
+    if (!vmaxvq_u32(hit))
+        return 0;
+    const uint32x4_t bits = {1, 2, 4, 8};
+    return vaddvq_u32(vandq_u32(hit, bits));
+}
+
+#define POW_SEARCH_SIMD pow_search_neon
+#define VEC uint32x4_t
+#define LANES 4
+#define V_SET1(x) vdupq_n_u32(x)
+#define V_LOAD(p) vld1q_u32(p)
+#define V_ADD(x, y) vaddq_u32(x, y)
+#define V_XOR(x, y) veorq_u32(x, y)
+#define V_ROTL(x, n) vsriq_n_u32(vshlq_n_u32(x, n), x, 32 - (n))
+#define V_F1(b, c, d) vbslq_u32(b, c, d)
+#define V_F2(b, c, d) veorq_u32(veorq_u32(b, c), d)
+#define V_F3(b, c, d) vbslq_u32(veorq_u32(b, c), d, b)
+#define V_HIT_MASK(a, d) neon_hit_mask(a, d)
+
+#include "CpuHasherLanes.inc"
+
+#undef POW_SEARCH_SIMD
+#undef VEC
+#undef LANES
+#undef V_SET1
+#undef V_LOAD
+#undef V_ADD
+#undef V_XOR
+#undef V_ROTL
+#undef V_F1
+#undef V_F2
+#undef V_F3
+#undef V_HIT_MASK
+
+#endif // aarch64
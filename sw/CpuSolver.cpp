@@ -0,0 +1,310 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "CpuSolver.h"
+
+#define DEFAULT_CHUNK_NONCES (1u << 16)
+#define NONCE_SPACE (1ull << 32)
+
+// Nonces still to be handed out from one worker's share of the nonce space.
+// The owner and thieves both take chunks with fetch_add, so no lock is needed.
+struct alignas(64) nonce_range
+{
+    std::atomic<uint64_t> next;
+    uint64_t end;
+};
+
+struct cpu_solver
+{
+    struct cpu_solver_config config;
+    uint32_t n_threads;
+    pow_search_fn search;
+    std::vector<std::thread> threads;
+
+    std::mutex lock;
+    std::condition_variable wake;       // workers wait here for the next job
+    std::condition_variable finished;   // cpu_solver_run() waits here for the workers
+    uint64_t generation;                // bumped for every job
+    uint32_t running;                   // workers not done with the current job
+    bool quit;
+
+    // Current job
+    enum cpu_solver_mode job_mode;
+    uint8_t* blocks;
+    uint32_t n_blocks;
+    uint32_t difficulty;
+    struct hasher_result* results;
+    std::atomic<uint32_t> next_block;   // SPLIT_BLOCKS
+    struct pow_midstate ms;             // SPLIT_NONCES
+    nonce_range ranges[CPU_SOLVER_MAX_THREADS];
+    std::atomic<int> found;
+    struct hasher_result winner;
+    std::atomic<uint64_t> nonces_tried;
+};
+
+void cpu_solver_config_from_env(struct cpu_solver_config* config)
+{
+    const char* env;
+
+    memset(config, 0, sizeof(*config));
+    config->mode = CPU_SOLVER_AUTO;
+
+    if ((env = getenv("HASHER_CPU_THREADS")))
+        config->n_threads = atoi(env);
+    if ((env = getenv("HASHER_CPU_CHUNK")))
+        config->chunk_nonces = atoi(env);
+    if ((env = getenv("HASHER_CPU_MODE")))
+    {
+        if (!strcmp(env, "nonces"))
+            config->mode = CPU_SOLVER_SPLIT_NONCES;
+        else if (!strcmp(env, "blocks"))
+            config->mode = CPU_SOLVER_SPLIT_BLOCKS;
+    }
+    if ((env = getenv("HASHER_CPU_AFFINITY")))
+    {
+        config->pin = 1;
+        while (*env && config->n_cpus < CPU_SOLVER_MAX_THREADS)
+        {
+            char* end;
+            long cpu = strtol(env, &end, 10);
+            if (end == env)
+                break;
+            config->cpus[config->n_cpus++] = (int)cpu;
+            env = (*end == ',') ? end + 1 : end;
+        }
+    }
+}
+
+static void pin_thread(const struct cpu_solver* solver, uint32_t id)
+{
+    cpu_set_t set;
+    int cpu;
+
+    if (!solver->config.pin)
+        return;
+    if (solver->config.n_cpus)
+        cpu = solver->config.cpus[id % solver->config.n_cpus];
+    else
+        cpu = id % sysconf(_SC_NPROCESSORS_ONLN);
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+        printf("CPU solver: could not pin worker %u to cpu %d\n", id, cpu);
+}
+
+// Cooperative search of one block: own range first, then steal chunks from the
+// others. Stops at the first chunk boundary after any worker found a nonce.
+static void search_nonces(struct cpu_solver* solver, uint32_t id)
+{
+    uint32_t chunk = solver->config.chunk_nonces;
+    uint64_t tried = 0;
+    struct hasher_result res;
+
+    for (uint32_t k = 0; k < solver->n_threads && !solver->found.load(std::memory_order_relaxed); ++k)
+    {
+        nonce_range* range = &solver->ranges[(id + k) % solver->n_threads];
+        while (!solver->found.load(std::memory_order_relaxed))
+        {
+            uint64_t first = range->next.fetch_add(chunk, std::memory_order_relaxed);
+            if (first >= range->end)
+                break;
+            uint32_t count = (uint32_t)((range->end - first < chunk) ? range->end - first : chunk);
+            if (solver->search(&solver->ms, solver->difficulty, (uint32_t)first, count, &res))
+            {
+                tried += res.nonce - (uint32_t)first + 1;
+                if (!solver->found.exchange(1))
+                    solver->winner = res;
+                break;
+            }
+            tried += count;
+        }
+    }
+    solver->nonces_tried.fetch_add(tried, std::memory_order_relaxed);
+}
+
+// Writes the result record of a block, res is NULL if no nonce was found.
+static void set_result(uint8_t* block, struct hasher_result* out, const struct hasher_result* res, uint64_t tried)
+{
+    if (res)
+    {
+        memcpy(block + 60, &res->nonce, 4);
+        *out = *res;
+        out->status = HASHER_STATUS_FOUND;
+    }
+    else
+    {
+        // Whole space searched, the next nonce wraps around to 0
+        memset(out, 0, sizeof(*out));
+        out->status = HASHER_STATUS_EXHAUSTED;
+    }
+    out->nonces = (tried > 0xFFFFFFFFull) ? 0xFFFFFFFF : (uint32_t)tried;
+}
+
+// Independent blocks: each worker pulls the next unsolved block and searches it alone.
+static void search_blocks(struct cpu_solver* solver)
+{
+    uint32_t chunk = solver->config.chunk_nonces;
+    uint64_t tried = 0;
+    uint32_t b;
+
+    while ((b = solver->next_block.fetch_add(1, std::memory_order_relaxed)) < solver->n_blocks)
+    {
+        uint8_t* block = solver->blocks + 64 * b;
+        struct pow_midstate ms;
+        struct hasher_result res;
+        int found = 0;
+
+        uint64_t block_tried = 0;
+
+        pow_prepare_midstate(block, &ms);
+        for (uint64_t first = 0; first < NONCE_SPACE && !found; first += chunk)
+        {
+            uint32_t count = (uint32_t)((NONCE_SPACE - first < chunk) ? NONCE_SPACE - first : chunk);
+            found = solver->search(&ms, solver->difficulty, (uint32_t)first, count, &res);
+            block_tried += found ? res.nonce - (uint32_t)first + 1 : count;
+        }
+        set_result(block, &solver->results[b], found ? &res : NULL, block_tried);
+        tried += block_tried;
+    }
+    solver->nonces_tried.fetch_add(tried, std::memory_order_relaxed);
+}
+
+static void worker_main(struct cpu_solver* solver, uint32_t id)
+{
+    uint64_t seen = 0;
+
+    pin_thread(solver, id);
+    while (1)
+    {
+        {
+            std::unique_lock<std::mutex> lk(solver->lock);
+            solver->wake.wait(lk, [&] { return solver->quit || solver->generation != seen; });
+            if (solver->quit)
+                return;
+            seen = solver->generation;
+        }
+
+        if (solver->job_mode == CPU_SOLVER_SPLIT_BLOCKS)
+            search_blocks(solver);
+        else
+            search_nonces(solver, id);
+
+        std::lock_guard<std::mutex> lk(solver->lock);
+        if (--solver->running == 0)
+            solver->finished.notify_one();
+    }
+}
+
+struct cpu_solver* cpu_solver_create(const struct cpu_solver_config* config)
+{
+    struct cpu_solver* solver = new cpu_solver();
+
+    solver->config = *config;
+    solver->n_threads = config->n_threads ? config->n_threads : (uint32_t)sysconf(_SC_NPROCESSORS_ONLN);
+    if (solver->n_threads > CPU_SOLVER_MAX_THREADS)
+        solver->n_threads = CPU_SOLVER_MAX_THREADS;
+    // Multiple of the widest kernel, so only the last chunk of a range hits the scalar tail.
+    if (!solver->config.chunk_nonces)
+        solver->config.chunk_nonces = DEFAULT_CHUNK_NONCES;
+    solver->config.chunk_nonces = (solver->config.chunk_nonces + 15) & ~15u;
+    solver->search = pow_get_kernel()->search;
+    solver->generation = 0;
+    solver->running = 0;
+    solver->quit = false;
+
+    for (uint32_t i = 0; i < solver->n_threads; ++i)
+        solver->threads.emplace_back(worker_main, solver, i);
+    return solver;
+}
+
+void cpu_solver_destroy(struct cpu_solver* solver)
+{
+    {
+        std::lock_guard<std::mutex> lk(solver->lock);
+        solver->quit = true;
+    }
+    solver->wake.notify_all();
+    for (auto& t : solver->threads)
+        t.join();
+    delete solver;
+}
+
+uint32_t cpu_solver_threads(const struct cpu_solver* solver)
+{
+    return solver->n_threads;
+}
+
+// Hands the prepared job to every worker and waits until all of them are done.
+static void run_job(struct cpu_solver* solver)
+{
+    std::unique_lock<std::mutex> lk(solver->lock);
+    solver->running = solver->n_threads;
+    solver->generation++;
+    solver->wake.notify_all();
+    solver->finished.wait(lk, [&] { return solver->running == 0; });
+}
+
+// Easy blocks are solved within a few chunks, splitting them across workers would
+// mostly cost wake-ups and cancelled chunks. Hard blocks or short batches are split.
+static enum cpu_solver_mode pick_mode(const struct cpu_solver* solver, uint32_t n_blocks, uint32_t difficulty)
+{
+    if (solver->config.mode != CPU_SOLVER_AUTO)
+        return solver->config.mode;
+    if (n_blocks < solver->n_threads)
+        return CPU_SOLVER_SPLIT_NONCES;
+
+    uint64_t expected_nonces = 1ull << __builtin_popcount(difficulty);
+    uint64_t round_nonces = (uint64_t)solver->config.chunk_nonces * solver->n_threads;
+    if (n_blocks >= 4 * solver->n_threads || expected_nonces <= 4 * round_nonces)
+        return CPU_SOLVER_SPLIT_BLOCKS;
+    return CPU_SOLVER_SPLIT_NONCES;
+}
+
+uint64_t cpu_solver_run(struct cpu_solver* solver, uint8_t* blocks, uint32_t n_blocks,
+                        uint32_t difficulty, struct hasher_result* results)
+{
+    solver->blocks = blocks;
+    solver->n_blocks = n_blocks;
+    solver->difficulty = difficulty;
+    solver->results = results;
+    solver->nonces_tried.store(0);
+    solver->job_mode = pick_mode(solver, n_blocks, difficulty);
+
+    if (solver->job_mode == CPU_SOLVER_SPLIT_BLOCKS)
+    {
+        solver->next_block.store(0);
+        run_job(solver);
+        return solver->nonces_tried.load();
+    }
+
+    for (uint32_t b = 0; b < n_blocks; ++b)
+    {
+        uint8_t* block = blocks + 64 * b;
+
+        pow_prepare_midstate(block, &solver->ms);
+        for (uint32_t i = 0; i < solver->n_threads; ++i)
+        {
+            solver->ranges[i].next.store(NONCE_SPACE * i / solver->n_threads);
+            solver->ranges[i].end = NONCE_SPACE * (i + 1) / solver->n_threads;
+        }
+        solver->found.store(0);
+        uint64_t before = solver->nonces_tried.load();
+        run_job(solver);
+
+        set_result(block, &results[b], solver->found.load() ? &solver->winner : NULL,
+                   solver->nonces_tried.load() - before);
+    }
+    return solver->nonces_tried.load();
+}
@@ -0,0 +1,48 @@
+#ifndef	CPUSOLVER_H
+#define	CPUSOLVER_H
+
+#include <stdint.h>
+
+#include "CpuHasher.h"
+
+#define CPU_SOLVER_MAX_THREADS 64
+
+enum cpu_solver_mode
+{
+    CPU_SOLVER_AUTO,            // pick per batch from block count and difficulty
+    CPU_SOLVER_SPLIT_NONCES,    // all workers on one block, nonce space split in chunks
+    CPU_SOLVER_SPLIT_BLOCKS,    // each worker solves whole blocks on its own
+};
+
+struct cpu_solver_config
+{
+    uint32_t n_threads;         // 0 = one per online core
+    uint32_t chunk_nonces;      // nonces a worker takes at a time, 0 = default
+    enum cpu_solver_mode mode;
+    // Worker i is pinned to cpus[i % n_cpus]. With n_cpus == 0 and pin set,
+    // worker i is pinned to core i % online cores. Otherwise threads float.
+    int pin;
+    uint32_t n_cpus;
+    int cpus[CPU_SOLVER_MAX_THREADS];
+};
+
+struct cpu_solver;
+
+// Defaults, overridden by HASHER_CPU_THREADS, HASHER_CPU_CHUNK,
+// HASHER_CPU_MODE (auto|nonces|blocks) and HASHER_CPU_AFFINITY (e.g. "0,1,2,3").
+void cpu_solver_config_from_env(struct cpu_solver_config* config);
+
+// Starts the worker threads. They sleep between batches.
+struct cpu_solver* cpu_solver_create(const struct cpu_solver_config* config);
+void cpu_solver_destroy(struct cpu_solver* solver);
+uint32_t cpu_solver_threads(const struct cpu_solver* solver);
+
+// Solves n_blocks consecutive 64-byte blocks. Writes the winning nonce of each block
+// at byte 60 of the block and its hash into results[i], in the accelerator layout.
+// A block without any valid nonce in the 2^32 space gets status HASHER_STATUS_EXHAUSTED,
+// the caller rolls its extranonce and solves it again.
+// Returns the number of nonces actually hashed by all workers.
+uint64_t cpu_solver_run(struct cpu_solver* solver, uint8_t* blocks, uint32_t n_blocks,
+                        uint32_t difficulty, struct hasher_result* results);
+
+#endif // CPUSOLVER_H
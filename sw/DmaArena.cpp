@@ -0,0 +1,149 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+
+#include "DmaArena.h"
+
+// Free slabs of a class form a stack linked through next[]. The head packs the index of
+// the top slab plus one (0 for empty) with a counter bumped by every update, so that a
+// pop racing with a pop and a push of the same slab fails its compare-exchange (ABA).
+struct arena_class
+{
+    uint32_t slab_size;
+    uint32_t count;
+    uint32_t first_offset;
+    std::atomic<uint64_t> head;
+    std::atomic<uint32_t>* next;
+    std::atomic<uint32_t> in_use;
+    std::atomic<uint32_t> high_water;
+    std::atomic<uint64_t> allocs;
+    std::atomic<uint64_t> exhausted;
+};
+
+struct dma_arena
+{
+    uint8_t* virtual_addr;
+    uint64_t physical_addr;
+    uint32_t size;
+    uint32_t reserved;          // bytes given to the classes so far
+    uint32_t n_classes;
+    struct arena_class classes[DMA_ARENA_MAX_CLASSES];
+};
+
+static inline uint64_t head_pack(uint64_t head, uint32_t top)
+{
+    return ((head >> 32) + 1) << 32 | top;
+}
+
+struct dma_arena* dma_arena_create(void* virtual_addr, uint64_t physical_addr, uint32_t size)
+{
+    struct dma_arena* arena = new dma_arena();
+
+    // Slabs are aligned on the bus addresses, which the virtual ones follow within a page.
+    uint32_t skip = (DMA_ARENA_ALIGN - physical_addr % DMA_ARENA_ALIGN) % DMA_ARENA_ALIGN;
+    arena->virtual_addr = (uint8_t*)virtual_addr;
+    arena->physical_addr = physical_addr;
+    arena->size = size;
+    arena->reserved = skip < size ? skip : size;
+    return arena;
+}
+
+void dma_arena_destroy(struct dma_arena* arena)
+{
+    for (uint32_t c = 0; c < arena->n_classes; ++c)
+        delete[] arena->classes[c].next;
+    delete arena;
+}
+
+int dma_arena_add_class(struct dma_arena* arena, uint32_t slab_size, uint32_t count)
+{
+    slab_size = (slab_size + DMA_ARENA_ALIGN - 1) & ~(DMA_ARENA_ALIGN - 1);
+    if (arena->n_classes == DMA_ARENA_MAX_CLASSES || !slab_size || !count ||
+        (uint64_t)slab_size * count > arena->size - arena->reserved)
+        return -1;
+
+    struct arena_class* cls = &arena->classes[arena->n_classes];
+    cls->slab_size = slab_size;
+    cls->count = count;
+    cls->first_offset = arena->reserved;
+    cls->next = new std::atomic<uint32_t>[count];
+    // All free, slab 0 on top.
+    for (uint32_t i = 0; i < count; ++i)
+        cls->next[i].store(i + 1 < count ? i + 2 : 0, std::memory_order_relaxed);
+    cls->head.store(1, std::memory_order_release);
+    arena->reserved += slab_size * count;
+    return arena->n_classes++;
+}
+
+int dma_arena_alloc(struct dma_arena* arena, int c, struct dma_slab* slab)
+{
+    struct arena_class* cls = &arena->classes[c];
+    uint64_t head = cls->head.load(std::memory_order_acquire);
+    uint32_t top;
+
+    do
+    {
+        top = (uint32_t)head;
+        if (!top)
+        {
+            cls->exhausted.fetch_add(1, std::memory_order_relaxed);
+            return -1;
+        }
+        // Possibly stale if another thread popped top meanwhile; the counter then
+        // makes the exchange fail.
+    } while (!cls->head.compare_exchange_weak(head, head_pack(head, cls->next[top - 1].load(std::memory_order_relaxed)),
+                                              std::memory_order_acquire, std::memory_order_acquire));
+
+    uint32_t index = top - 1;
+    uint32_t offset = cls->first_offset + cls->slab_size * index;
+    slab->virtual_addr = arena->virtual_addr + offset;
+    slab->physical_addr = arena->physical_addr + offset;
+    slab->offset = offset;
+    slab->index = index;
+
+    cls->allocs.fetch_add(1, std::memory_order_relaxed);
+    uint32_t in_use = cls->in_use.fetch_add(1, std::memory_order_relaxed) + 1;
+    uint32_t high = cls->high_water.load(std::memory_order_relaxed);
+    while (in_use > high && !cls->high_water.compare_exchange_weak(high, in_use, std::memory_order_relaxed))
+        ;
+    return 0;
+}
+
+void dma_arena_free(struct dma_arena* arena, int c, const struct dma_slab* slab)
+{
+    struct arena_class* cls = &arena->classes[c];
+    uint64_t head = cls->head.load(std::memory_order_relaxed);
+
+    do
+    {
+        cls->next[slab->index].store((uint32_t)head, std::memory_order_relaxed);
+    } while (!cls->head.compare_exchange_weak(head, head_pack(head, slab->index + 1),
+                                              std::memory_order_release, std::memory_order_relaxed));
+    cls->in_use.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void dma_arena_get_stats(const struct dma_arena* arena, int c, struct dma_arena_stats* stats)
+{
+    const struct arena_class* cls = &arena->classes[c];
+
+    stats->slab_size = cls->slab_size;
+    stats->slabs = cls->count;
+    stats->in_use = cls->in_use.load(std::memory_order_relaxed);
+    stats->high_water = cls->high_water.load(std::memory_order_relaxed);
+    stats->allocs = cls->allocs.load(std::memory_order_relaxed);
+    stats->exhausted = cls->exhausted.load(std::memory_order_relaxed);
+}
+
+void dma_arena_print_stats(const struct dma_arena* arena)
+{
+    struct dma_arena_stats stats;
+
+    for (uint32_t c = 0; c < arena->n_classes; ++c)
+    {
+        dma_arena_get_stats(arena, c, &stats);
+        printf("DMA arena class %u: %u slabs of %u bytes, %u in use, at most %u, %llu allocations, %llu exhausted\n",
+               c, stats.slabs, stats.slab_size, stats.in_use, stats.high_water,
+               (unsigned long long)stats.allocs, (unsigned long long)stats.exhausted);
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef	DMAARENA_H
+#define	DMAARENA_H
+
+#include <stdint.h>
+
+// Fixed-size slabs carved once out of a DMA region (a driver buffer, a cma_alloc()
+// block), so that jobs take their block and result arrays without allocating: a slab
+// is taken and given back in O(1), lock free, from any thread.
+// Every slab starts on a cache line, as the accelerator writes whole records.
+
+#define DMA_ARENA_ALIGN 64
+#define DMA_ARENA_MAX_CLASSES 4
+
+struct dma_slab
+{
+    uint8_t* virtual_addr;
+    uint64_t physical_addr;
+    uint32_t offset;            // from the start of the region, for HASHER_IOC_SUBMIT_BUF
+    uint32_t index;             // in its class, for dma_arena_free()
+};
+
+struct dma_arena_stats
+{
+    uint32_t slab_size;
+    uint32_t slabs;
+    uint32_t in_use;
+    uint32_t high_water;        // most slabs in use at once
+    uint64_t allocs;
+    uint64_t exhausted;         // dma_arena_alloc() calls that found no free slab
+};
+
+struct dma_arena;
+
+// Arena over size bytes mapped at virtual_addr, physical_addr on the bus.
+struct dma_arena* dma_arena_create(void* virtual_addr, uint64_t physical_addr, uint32_t size);
+// Does not release the region, which belongs to the caller.
+void dma_arena_destroy(struct dma_arena* arena);
+
+// Reserves count slabs of slab_size bytes (rounded up to DMA_ARENA_ALIGN) after those
+// already reserved. Returns the class to allocate from, -1 if the region is too small.
+// Not thread safe: set up the classes before using the arena.
+int dma_arena_add_class(struct dma_arena* arena, uint32_t slab_size, uint32_t count);
+
+// Takes a free slab of the class. Returns -1 if there is none, 0 on success.
+int dma_arena_alloc(struct dma_arena* arena, int cls, struct dma_slab* slab);
+void dma_arena_free(struct dma_arena* arena, int cls, const struct dma_slab* slab);
+
+void dma_arena_get_stats(const struct dma_arena* arena, int cls, struct dma_arena_stats* stats);
+// One line per class, e.g. at exit or after an allocation failed.
+void dma_arena_print_stats(const struct dma_arena* arena);
+
+#endif // DMAARENA_H
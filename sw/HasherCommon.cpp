@@ -0,0 +1,41 @@
+#include <stdio.h>
+#include <stdint.h>
+
+#include "HasherCommon.h"
+
+uint64_t compute_avg_hash_per_second(uint8_t *addr, uint32_t n_blocks, double time_taken_ms)
+{
+    uint64_t total_nonces = 0;
+    for(uint32_t i = 0; i < n_blocks; ++i)
+    {
+        struct hasher_result res = *((struct hasher_result*)(addr + sizeof(struct hasher_result)*i));
+        total_nonces += res.nonces;
+    }
+
+    return (double)total_nonces * 1000 / time_taken_ms;
+}
+
+void print_memory_bytes(uint8_t* arr, uint32_t count)
+{
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        printf("%02x", arr[i]);
+        if((i + 1) % 64 == 0)printf("\n");
+    }
+    printf("\n");
+}
+
+void print_hash_nonces(uint32_t* start_addr, uint8_t block_count)
+{
+    for(uint32_t b = 0; b < block_count; ++b)
+    {
+        printf("BLOCK: %u\n", b);
+        printf("\tHASH: ");
+        struct hasher_result res = *(struct hasher_result*)((uint8_t*)start_addr + sizeof(struct hasher_result)*b);
+        printf("%08x%08x%08x%08x%08x",res.a, res.b, res.c, res.d, res.e);
+        printf("\tNONCE: %08x", res.nonce);
+        printf("\tSTATUS: %s\n", res.status == HASHER_STATUS_FOUND ? "found" :
+                                 res.status == HASHER_STATUS_EXHAUSTED ? "exhausted" :
+                                 res.status == HASHER_STATUS_CANCELLED ? "cancelled" : "none");
+    }
+}
@@ -0,0 +1,18 @@
+#ifndef	HASHERCOMMON_H
+#define	HASHERCOMMON_H
+
+#include <stdint.h>
+
+#include "CpuHasher.h"
+
+// Helpers shared by master.cpp, master_driver.cpp and hasher-test-aarch64.cpp.
+
+// Nonces tried per second over n_blocks result records at addr, failed attempts of
+// requeued blocks excluded.
+uint64_t compute_avg_hash_per_second(uint8_t *addr, uint32_t n_blocks, double time_taken_ms);
+// Hex dump, one 64-byte block per line.
+void print_memory_bytes(uint8_t* arr, uint32_t count);
+// Hash, nonce and status of block_count result records.
+void print_hash_nonces(uint32_t* start_addr, uint8_t block_count);
+
+#endif // HASHERCOMMON_H
@@ -0,0 +1,328 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "HasherDevice.h"
+#include "HasherDirect.h"
+#include "CpuSolver.h"
+#include "AccelModel.h"
+#include "driver/hasher_ioctl.h"
+
+// Jobs started through the mapped registers are polled this long before sleeping.
+#define MMIO_SPIN_US 20
+// Where the model sees its memory on the bus.
+#define MODEL_BUS_ADDR 0x10000000
+
+// ---------- Accelerator backends ----------
+// The device file and one driver buffer: blocks at 0, result records right after them.
+
+struct accel_backend
+{
+    int fd;
+    uint8_t* mem;
+    uint32_t size;
+    uint32_t handle;
+    uint32_t phys;
+    uint32_t results_offset;
+    struct hasher_direct* direct;       // MMIO backend only
+};
+
+static void accel_close(void* ctx)
+{
+    struct accel_backend* accel = (struct accel_backend*)ctx;
+
+    if (accel->direct)
+        hasher_direct_close(accel->direct);
+    // The driver frees the buffer with the descriptor.
+    munmap(accel->mem, accel->size);
+    close(accel->fd);
+    delete accel;
+}
+
+static void* accel_open(const char* path, uint32_t max_blocks)
+{
+    int fd = ::open(path, O_RDWR);
+    if (fd == -1)
+        return NULL;
+
+    struct hasher_buffer req = {max_blocks * 64 + max_blocks * HASHER_RESULT_BYTES};
+    if (ioctl(fd, HASHER_IOC_ALLOC, &req) < 0)
+    {
+        perror("HASHER_IOC_ALLOC");
+        close(fd);
+        return NULL;
+    }
+    void* p = mmap(NULL, req.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, req.mmap_offset);
+    if (p == MAP_FAILED)
+    {
+        perror("mmap");
+        close(fd);
+        return NULL;
+    }
+
+    struct accel_backend* accel = new accel_backend();
+    accel->fd = fd;
+    accel->mem = (uint8_t*)p;
+    accel->size = req.size;
+    accel->handle = req.handle;
+    accel->phys = req.phys;
+    accel->results_offset = max_blocks * 64;
+    return accel;
+}
+
+static void* mmio_open(const char* path, uint32_t max_blocks)
+{
+    struct accel_backend* accel = (struct accel_backend*)accel_open(path, max_blocks);
+
+    if (!accel)
+        return NULL;
+    accel->direct = hasher_direct_open(accel->fd);
+    if (!accel->direct)
+    {
+        accel_close(accel);
+        return NULL;
+    }
+    return accel;
+}
+
+static uint64_t accel_copy_results(struct accel_backend* accel, uint32_t n_blocks, struct hasher_result* results)
+{
+    uint64_t nonces = 0;
+
+    memcpy(results, accel->mem + accel->results_offset, sizeof(struct hasher_result) * n_blocks);
+    for (uint32_t i = 0; i < n_blocks; ++i)
+        nonces += results[i].nonces;
+    return nonces;
+}
+
+static int driver_solve(void* ctx, uint8_t* blocks, uint32_t n_blocks, uint32_t difficulty,
+                        struct hasher_result* results, uint64_t* nonces)
+{
+    struct accel_backend* accel = (struct accel_backend*)ctx;
+    struct hasher_buffer_job job = {accel->handle, 0, n_blocks, difficulty, accel->results_offset, 0, 1, 0};
+    struct hasher_completion completion;
+    struct pollfd pfd = {accel->fd, POLLIN, 0};
+
+    memcpy(accel->mem, blocks, 64 * n_blocks);
+    int id = ioctl(accel->fd, HASHER_IOC_SUBMIT_BUF, &job);
+    if (id < 0)
+        return -1;
+    while (1)
+    {
+        if (ioctl(accel->fd, HASHER_IOC_COMPLETE, &completion) < 0)
+            return -1;
+        if (hasher_job_finished(completion.completed, id))
+            break;
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            return -1;
+    }
+    *nonces = accel_copy_results(accel, n_blocks, results);
+    return 0;
+}
+
+static int mmio_solve(void* ctx, uint8_t* blocks, uint32_t n_blocks, uint32_t difficulty,
+                      struct hasher_result* results, uint64_t* nonces)
+{
+    struct accel_backend* accel = (struct accel_backend*)ctx;
+    struct user_message message = {accel->phys, n_blocks, difficulty, accel->phys + accel->results_offset, 0, 1, 0};
+
+    memcpy(accel->mem, blocks, 64 * n_blocks);
+    if (hasher_direct_submit(accel->direct, &message) || hasher_direct_wait(accel->direct, MMIO_SPIN_US))
+        return -1;
+    *nonces = accel_copy_results(accel, n_blocks, results);
+    return 0;
+}
+
+// ---------- CPU backend ----------
+
+static void* cpu_open(const char* path, uint32_t max_blocks)
+{
+    struct cpu_solver_config config;
+
+    cpu_solver_config_from_env(&config);
+    return cpu_solver_create(&config);
+}
+
+static void cpu_close(void* ctx)
+{
+    cpu_solver_destroy((struct cpu_solver*)ctx);
+}
+
+static int cpu_solve(void* ctx, uint8_t* blocks, uint32_t n_blocks, uint32_t difficulty,
+                     struct hasher_result* results, uint64_t* nonces)
+{
+    *nonces = cpu_solver_run((struct cpu_solver*)ctx, blocks, n_blocks, difficulty, results);
+    return 0;
+}
+
+// ---------- Model backend ----------
+// The memory of the model laid out as the driver buffer: blocks at 0, records after them.
+// Unless HASHER_MODEL_PACE=0, every job returns no earlier than it would on the
+// hardware, so that the host side is timed against the accelerator it stands for.
+
+struct model_backend
+{
+    struct accel_model* model;
+    uint8_t* mem;
+    uint32_t results_offset;
+    int pace;
+};
+
+static void* model_open(const char* path, uint32_t max_blocks)
+{
+    struct accel_model_config config;
+    const char* env;
+
+    if (!path)
+        accel_model_default_config(&config);
+    else if (accel_model_config_from_name(path, &config))
+    {
+        printf("Unknown accelerator configuration %s\n", path);
+        return NULL;
+    }
+    if ((env = getenv("HASHER_MODEL_READ_LATENCY")))
+        config.read_latency = atoi(env);
+    if ((env = getenv("HASHER_MODEL_WRITE_LATENCY")))
+        config.write_latency = atoi(env);
+
+    struct model_backend* backend = new model_backend();
+    uint32_t size = max_blocks * 64 + max_blocks * HASHER_RESULT_BYTES;
+    backend->mem = new uint8_t[size];
+    backend->results_offset = max_blocks * 64;
+    backend->pace = !(env = getenv("HASHER_MODEL_PACE")) || atoi(env);
+    backend->model = accel_model_create(&config, backend->mem, MODEL_BUS_ADDR, size);
+    if (!backend->model)
+    {
+        delete[] backend->mem;
+        delete backend;
+        return NULL;
+    }
+    return backend;
+}
+
+static void model_close(void* ctx)
+{
+    struct model_backend* backend = (struct model_backend*)ctx;
+
+    accel_model_destroy(backend->model);
+    delete[] backend->mem;
+    delete backend;
+}
+
+static int model_solve(void* ctx, uint8_t* blocks, uint32_t n_blocks, uint32_t difficulty,
+                       struct hasher_result* results, uint64_t* nonces)
+{
+    struct model_backend* backend = (struct model_backend*)ctx;
+    struct user_message message = {MODEL_BUS_ADDR, n_blocks, difficulty, MODEL_BUS_ADDR + backend->results_offset, 0, 1, 0};
+    struct timespec until;
+
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    memcpy(backend->mem, blocks, 64 * n_blocks);
+    if (accel_model_submit(backend->model, &message))
+        return -1;
+    if (backend->pace)
+    {
+        uint64_t ns = (uint64_t)(accel_model_last_job(backend->model, NULL) * 1000000.0) + until.tv_nsec;
+        until.tv_sec += ns / 1000000000;
+        until.tv_nsec = ns % 1000000000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+            ;
+    }
+
+    *nonces = 0;
+    memcpy(results, backend->mem + backend->results_offset, sizeof(struct hasher_result) * n_blocks);
+    for (uint32_t i = 0; i < n_blocks; ++i)
+        *nonces += results[i].nonces;
+    return 0;
+}
+
+static const struct hasher_backend backends[] = {
+    {"driver", accel_open, accel_close, driver_solve},
+    {"mmio", mmio_open, accel_close, mmio_solve},
+    {"cpu", cpu_open, cpu_close, cpu_solve},
+    {"model", model_open, model_close, model_solve},
+};
+
+// ---------- Session ----------
+
+HasherDevice::HasherDevice(const struct hasher_backend* ops, void* ctx, uint32_t max_blocks)
+    : ops(ops), ctx(ctx), max(max_blocks)
+{
+    retry_blocks = new hasher_block[max_blocks];
+    retry_results = new hasher_result[max_blocks];
+    retry_index = new uint32_t[max_blocks];
+}
+
+HasherDevice::~HasherDevice()
+{
+    ops->close(ctx);
+    delete[] retry_blocks;
+    delete[] retry_results;
+    delete[] retry_index;
+}
+
+HasherDevice* HasherDevice::open(enum hasher_backend_kind kind, const char* path, uint32_t max_blocks)
+{
+    if ((unsigned)kind >= sizeof(backends) / sizeof(backends[0]) || !max_blocks || max_blocks > HASHER_MAX_BLOCKS)
+        return NULL;
+
+    void* ctx = backends[kind].open(path, max_blocks);
+    if (!ctx)
+        return NULL;
+    return new HasherDevice(&backends[kind], ctx, max_blocks);
+}
+
+int HasherDevice::submit(struct hasher_block* blocks, size_t n_blocks, uint32_t difficulty,
+                         struct hasher_result* results, struct hasher_batch_stats* stats)
+{
+    struct hasher_batch_stats local;
+    uint64_t nonces;
+
+    if (!stats)
+        stats = &local;
+    memset(stats, 0, sizeof(*stats));
+
+    for (size_t first = 0; first < n_blocks; first += max)
+    {
+        uint32_t count = n_blocks - first < max ? n_blocks - first : max;
+        if (ops->solve(ctx, blocks[first].bytes, count, difficulty, results + first, &nonces))
+            return -1;
+        stats->nonces += nonces;
+        stats->jobs++;
+
+        // The exhausted blocks of the job go again together, until all are solved.
+        while (1)
+        {
+            uint32_t n_retry = 0;
+            for (uint32_t i = 0; i < count; ++i)
+            {
+                if (results[first + i].status != HASHER_STATUS_EXHAUSTED)
+                    continue;
+                pow_roll_extranonce(blocks[first + i].bytes);
+                retry_blocks[n_retry] = blocks[first + i];
+                retry_index[n_retry++] = first + i;
+            }
+            if (!n_retry)
+                break;
+            if (ops->solve(ctx, retry_blocks[0].bytes, n_retry, difficulty, retry_results, &nonces))
+                return -1;
+            stats->nonces += nonces;
+            stats->requeued += n_retry;
+            stats->jobs++;
+            for (uint32_t i = 0; i < n_retry; ++i)
+            {
+                blocks[retry_index[i]] = retry_blocks[i];
+                results[retry_index[i]] = retry_results[i];
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,81 @@
+#ifndef	HASHERDEVICE_H
+#define	HASHERDEVICE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "CpuHasher.h"
+
+// One 64-byte block: extranonce in bytes 56-59, nonce in bytes 60-63.
+struct hasher_block
+{
+    uint8_t bytes[64];
+};
+
+enum hasher_backend_kind
+{
+    HASHER_BACKEND_DRIVER,      // jobs queued through the platform driver
+    HASHER_BACKEND_MMIO,        // registers mapped through the driver, see HasherDirect.h
+    HASHER_BACKEND_CPU,         // CpuSolver on all cores
+    HASHER_BACKEND_MODEL,       // software model of the accelerator, see AccelModel.h
+};
+
+struct hasher_batch_stats
+{
+    uint64_t nonces;            // nonces tried, failed attempts included
+    uint32_t requeued;          // blocks solved again with a new extranonce
+    uint32_t jobs;              // backend runs it took
+};
+
+// What a backend does, as for the CPU kernels (struct pow_kernel): solve up to the
+// max_blocks given at open, writing one result record per block.
+struct hasher_backend
+{
+    const char* name;
+    // Returns the backend state, NULL on failure. path is the device, unused by the CPU,
+    // and the bitstream the model stands for, e.g. "100MHz_1cluster_4hashers".
+    void* (*open)(const char* path, uint32_t max_blocks);
+    void (*close)(void* ctx);
+    // Returns 0 on success and the nonces tried in *nonces.
+    int (*solve)(void* ctx, uint8_t* blocks, uint32_t n_blocks, uint32_t difficulty,
+                 struct hasher_result* results, uint64_t* nonces);
+};
+
+// A session on one backend. Everything a batch needs is set up once, at open: the
+// device file, its DMA buffer and register mapping, or the CPU worker threads, so
+// that submit() only copies the blocks in and the results out.
+// Not thread safe: one session per thread.
+class HasherDevice
+{
+public:
+    // path is the device file of the accelerator backends, e.g. /dev/hasher0, and the
+    // bitstream name for the model, NULL for the generics of hdl/TopLevel.vhd.
+    // Returns NULL if the backend is not available.
+    static HasherDevice* open(enum hasher_backend_kind kind, const char* path, uint32_t max_blocks);
+    ~HasherDevice();
+
+    const char* backend_name() const { return ops->name; }
+    uint32_t max_blocks() const { return max; }
+
+    // Solves n_blocks blocks, cut in jobs of up to max_blocks. Blocks with no valid
+    // nonce get a rolled extranonce, in blocks as well, and are solved again, so
+    // every record ends up HASHER_STATUS_FOUND with its nonce in results[i].nonce.
+    // stats may be NULL. Returns 0 on success, -1 if the backend failed.
+    int submit(struct hasher_block* blocks, size_t n_blocks, uint32_t difficulty,
+               struct hasher_result* results, struct hasher_batch_stats* stats);
+
+private:
+    HasherDevice(const struct hasher_backend* ops, void* ctx, uint32_t max_blocks);
+    HasherDevice(const HasherDevice&);
+    HasherDevice& operator=(const HasherDevice&);
+
+    const struct hasher_backend* ops;
+    void* ctx;
+    uint32_t max;
+    // Exhausted blocks gathered for the next run, and where they came from.
+    struct hasher_block* retry_blocks;
+    struct hasher_result* retry_results;
+    uint32_t* retry_index;
+};
+
+#endif // HASHERDEVICE_H
@@ -0,0 +1,169 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "HasherDirect.h"
+
+// Register indexes, see driver/README.md.
+#define BLOCK_ADDRESS 0
+#define N_BLOCKS 1
+#define DIFFICULTY 2
+#define START 3
+#define STOP 4
+#define DONE 5
+#define RESULT_ADDRESS 6
+#define IRQ_ENABLE 7
+#define START_NONCE 9
+#define NONCE_STRIDE 10
+#define NONCE_LIMIT 11
+
+// Sleeps on the eventfd are cut at this, in case the interrupt was lost.
+#define DIRECT_POLL_MS 100
+
+struct hasher_direct
+{
+    volatile uint32_t* regs;
+    long page;
+    int event;                  // eventfd, counts the interrupts
+};
+
+struct hasher_direct* hasher_direct_open(int fd)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    void* p = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, HASHER_REGS_MMAP_OFFSET);
+    if (p == MAP_FAILED)
+        return NULL;
+
+    int event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event == -1 || ioctl(fd, HASHER_IOC_EVENTFD, &event) < 0)
+    {
+        perror("HASHER_IOC_EVENTFD");
+        if (event != -1)
+            close(event);
+        munmap(p, page);
+        return NULL;
+    }
+
+    struct hasher_direct* direct = new hasher_direct();
+    direct->regs = (volatile uint32_t*)p;
+    direct->page = page;
+    direct->event = event;
+    return direct;
+}
+
+void hasher_direct_close(struct hasher_direct* direct)
+{
+    // The driver drops the eventfd with the mapping.
+    munmap((void*)direct->regs, direct->page);
+    close(direct->event);
+    delete direct;
+}
+
+int hasher_direct_done(const struct hasher_direct* direct)
+{
+    if (!direct->regs[DONE])
+        return 0;
+    // The results were written before DONE was set: read them after.
+    __sync_synchronize();
+    return 1;
+}
+
+int hasher_direct_submit(struct hasher_direct* direct, const struct user_message* message)
+{
+    volatile uint32_t* regs = direct->regs;
+
+    if (!regs[DONE])
+        return -1;
+    regs[BLOCK_ADDRESS] = message->block_address_base;
+    regs[N_BLOCKS] = message->n_blocks;
+    regs[DIFFICULTY] = message->difficulty;
+    regs[RESULT_ADDRESS] = message->result_address;
+    regs[START_NONCE] = message->start_nonce;
+    regs[NONCE_STRIDE] = message->nonce_stride;
+    regs[NONCE_LIMIT] = message->nonce_limit;
+    // The blocks must be in memory before the accelerator fetches them.
+    __sync_synchronize();
+    regs[START] = 1;
+    __sync_synchronize();
+    regs[START] = 0;
+    __sync_synchronize();
+    return 0;
+}
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int hasher_direct_wait(struct hasher_direct* direct, uint32_t spin_us)
+{
+    uint64_t deadline = now_us() + spin_us;
+
+    do
+    {
+        if (hasher_direct_done(direct))
+            return 0;
+    } while (now_us() < deadline);
+
+    // The eventfd may hold interrupts of earlier jobs or of ring entries: DONE decides.
+    struct pollfd pfd = {direct->event, POLLIN, 0};
+    uint64_t count;
+    while (!hasher_direct_done(direct))
+    {
+        int n = poll(&pfd, 1, DIRECT_POLL_MS);
+        if (n < 0 && errno != EINTR)
+            return -1;
+        if (n > 0 && read(direct->event, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            return -1;
+    }
+    return 0;
+}
+
+int hasher_direct_cancel(struct hasher_direct* direct)
+{
+    volatile uint32_t* regs = direct->regs;
+
+    // The FSM is back to Idle within a few hundred cycles.
+    regs[STOP] = 1;
+    __sync_synchronize();
+    int err = hasher_direct_wait(direct, DIRECT_POLL_MS * 1000);
+    regs[STOP] = 0;
+    __sync_synchronize();
+    return err;
+}
+
+static uint64_t read_counter(volatile uint32_t* regs, uint32_t index)
+{
+    return regs[index] | (uint64_t)regs[index + 1] << 32;
+}
+
+int hasher_direct_perf(const struct hasher_direct* direct, struct hasher_perf* perf)
+{
+    volatile uint32_t* regs = direct->regs;
+
+    if (regs[HASHER_PERF_REG_MAGIC] != HASHER_PERF_MAGIC)
+        return -1;
+    uint32_t layout = regs[HASHER_PERF_REG_LAYOUT];
+    perf->clusters = layout & 0xFF;
+    if (perf->clusters > HASHER_PERF_MAX_CLUSTERS)
+        perf->clusters = HASHER_PERF_MAX_CLUSTERS;
+    perf->hashers = (layout >> 8) & 0xFF;
+    perf->clock_hz = 0;
+    perf->job_cycles = read_counter(regs, HASHER_PERF_REG_JOB_CYCLES);
+    perf->fetch_cycles = read_counter(regs, HASHER_PERF_REG_FETCH_CYCLES);
+    perf->writeback_cycles = read_counter(regs, HASHER_PERF_REG_WRITEBACK_CYCLES);
+    for (uint32_t c = 0; c < perf->clusters; ++c)
+    {
+        perf->hashes[c] = read_counter(regs, HASHER_PERF_REG_CLUSTERS + 4 * c);
+        perf->idle_cycles[c] = read_counter(regs, HASHER_PERF_REG_CLUSTERS + 4 * c + 2);
+    }
+    return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef	HASHERDIRECT_H
+#define	HASHERDIRECT_H
+
+#include <stdint.h>
+
+#include "driver/hasher_ioctl.h"
+
+// Jobs started by writing the registers of the accelerator from userspace, through the
+// register page mapped by hasher_platform.c (loaded with direct_access=1). No syscall on
+// the way in, and none on the way out for the jobs that end while the caller spins;
+// longer ones sleep on an eventfd signalled by the interrupt handler. One job at a time,
+// and the driver queues no job of its own on the instance meanwhile.
+
+struct hasher_direct;
+
+// Maps the registers of the instance open on fd. Returns NULL if the driver refuses:
+// direct_access off, or jobs of the driver still queued.
+struct hasher_direct* hasher_direct_open(int fd);
+// Unmaps the registers, the instance goes back to the driver once the job is finished.
+void hasher_direct_close(struct hasher_direct* direct);
+
+// Starts a job. Addresses are bus addresses, the phys of a driver buffer plus offsets.
+// Returns -1 while the previous job is running.
+int hasher_direct_submit(struct hasher_direct* direct, const struct user_message* message);
+// 1 once the job is finished and its results are in memory.
+int hasher_direct_done(const struct hasher_direct* direct);
+// Waits for the end of the job: polls DONE for up to spin_us, then sleeps until the
+// interrupt. Returns 0 on success.
+int hasher_direct_wait(struct hasher_direct* direct, uint32_t spin_us);
+// Stops the job, its blocks in progress get HASHER_STATUS_CANCELLED records. Returns
+// once the accelerator is idle again, 0 on success.
+int hasher_direct_cancel(struct hasher_direct* direct);
+// Performance counters of the last job, once it is finished (HASHER_IOC_PERF only sees
+// the jobs of the driver). clock_hz is left 0. Returns -1 if the bitstream has none.
+int hasher_direct_perf(const struct hasher_direct* direct, struct hasher_perf* perf);
+
+#endif // HASHERDIRECT_H
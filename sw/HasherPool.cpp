@@ -0,0 +1,234 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <deque>
+
+#include "HasherPool.h"
+#include "driver/hasher_ioctl.h"
+
+// Chunks per instance in a batch: more balance the instances better, fewer cost fewer syscalls.
+#define POOL_CHUNKS_PER_DEVICE 4
+// Jobs kept queued in the driver of every instance.
+#define POOL_IN_FLIGHT 2
+
+// Job queued on an instance, blocks [first, first + count) of the batch.
+struct pool_job
+{
+    int id;
+    uint32_t first;
+    uint32_t count;
+};
+
+// One instance. Its buffer mirrors the batch: block i at 64 * i, its result record
+// at results_offset + HASHER_RESULT_BYTES * i.
+struct pool_device
+{
+    int fd;
+    uint8_t* mem;
+    uint32_t size;
+    uint32_t handle;
+    std::deque<pool_job> jobs;  // in submission order, so in completion order too
+};
+
+struct hasher_pool
+{
+    struct pool_device devices[HASHER_POOL_MAX_DEVICES];
+    uint32_t n_devices;
+    uint32_t max_blocks;
+    uint32_t results_offset;
+};
+
+static int device_open(struct pool_device* dev, const char* path, uint32_t size)
+{
+    dev->fd = open(path, O_RDWR);
+    if (dev->fd == -1)
+        return -1;
+
+    struct hasher_buffer req = {size};
+    if (ioctl(dev->fd, HASHER_IOC_ALLOC, &req) < 0)
+    {
+        perror("HASHER_IOC_ALLOC");
+        close(dev->fd);
+        return -1;
+    }
+    void* p = mmap(NULL, req.size, PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, req.mmap_offset);
+    if (p == MAP_FAILED)
+    {
+        perror("mmap");
+        close(dev->fd);
+        return -1;
+    }
+    dev->mem = (uint8_t*)p;
+    dev->size = req.size;
+    dev->handle = req.handle;
+    return 0;
+}
+
+struct hasher_pool* hasher_pool_open(const char* prefix, uint32_t max_blocks)
+{
+    if (!max_blocks || max_blocks > HASHER_MAX_BLOCKS)
+        return NULL;
+
+    struct hasher_pool* pool = new hasher_pool();
+    pool->max_blocks = max_blocks;
+    pool->results_offset = max_blocks * 64;
+    uint32_t size = pool->results_offset + max_blocks * HASHER_RESULT_BYTES;
+
+    for (uint32_t i = 0; i < HASHER_POOL_MAX_DEVICES; ++i)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "%s%u", prefix, i);
+        if (device_open(&pool->devices[pool->n_devices], path, size))
+            break;
+        pool->n_devices++;
+    }
+    if (!pool->n_devices)
+    {
+        delete pool;
+        return NULL;
+    }
+    return pool;
+}
+
+void hasher_pool_close(struct hasher_pool* pool)
+{
+    for (uint32_t i = 0; i < pool->n_devices; ++i)
+    {
+        // The driver frees the buffer on close, once its jobs are finished.
+        munmap(pool->devices[i].mem, pool->devices[i].size);
+        close(pool->devices[i].fd);
+    }
+    delete pool;
+}
+
+uint32_t hasher_pool_devices(const struct hasher_pool* pool)
+{
+    return pool->n_devices;
+}
+
+// Copies blocks [first, first + count) into the instance buffer and queues them. Waits
+// for room while the driver queue is full: exhausted blocks are requeued one job each.
+static int device_submit(const struct hasher_pool* pool, struct pool_device* dev, const uint8_t* blocks,
+                         uint32_t first, uint32_t count, uint32_t difficulty)
+{
+    memcpy(dev->mem + 64 * first, blocks + 64 * first, 64 * count);
+    struct hasher_buffer_job job = {dev->handle, 64 * first, count, difficulty,
+                                    pool->results_offset + HASHER_RESULT_BYTES * first, 0, 1, 0};
+    int id;
+    while ((id = ioctl(dev->fd, HASHER_IOC_SUBMIT_BUF, &job)) < 0 && errno == EBUSY)
+    {
+        struct pollfd pfd = {dev->fd, POLLOUT, 0};
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            return -1;
+    }
+    if (id < 0)
+        return -1;
+    dev->jobs.push_back({id, first, count});
+    return 0;
+}
+
+// Waits for the jobs still queued on the instance, so that its buffer can be reused.
+static void device_drain(struct pool_device* dev)
+{
+    struct pollfd pfd = {dev->fd, POLLIN, 0};
+    struct hasher_completion completion;
+
+    while (!dev->jobs.empty())
+    {
+        if (ioctl(dev->fd, HASHER_IOC_COMPLETE, &completion) < 0 ||
+            hasher_job_finished(completion.completed, dev->jobs.back().id))
+            break;
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            break;
+    }
+    dev->jobs.clear();
+}
+
+int hasher_pool_run(struct hasher_pool* pool, uint8_t* blocks, uint32_t n_blocks,
+                    uint32_t difficulty, struct hasher_result* results, struct hasher_pool_stats* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (n_blocks > pool->max_blocks)
+        return -1;
+
+    uint32_t chunk = (n_blocks + pool->n_devices * POOL_CHUNKS_PER_DEVICE - 1) / (pool->n_devices * POOL_CHUNKS_PER_DEVICE);
+    uint32_t next = 0;          // first block not handed to an instance yet
+    int err = 0;
+
+    for (uint32_t d = 0; d < pool->n_devices; ++d)
+    {
+        struct pool_device* dev = &pool->devices[d];
+        while (!err && dev->jobs.size() < POOL_IN_FLIGHT && next < n_blocks)
+        {
+            uint32_t count = n_blocks - next < chunk ? n_blocks - next : chunk;
+            err = device_submit(pool, dev, blocks, next, count, difficulty);
+            next += count;
+        }
+    }
+
+    // One thread serves all the instances: sleep until any of them finished a job.
+    struct pollfd pfds[HASHER_POOL_MAX_DEVICES];
+    while (!err)
+    {
+        nfds_t n_pfds = 0;
+        for (uint32_t d = 0; d < pool->n_devices; ++d)
+            if (!pool->devices[d].jobs.empty())
+                pfds[n_pfds++] = {pool->devices[d].fd, POLLIN, 0};
+        if (!n_pfds)
+            break;
+        if (poll(pfds, n_pfds, -1) < 0 && errno != EINTR)
+            err = -1;
+
+        for (uint32_t d = 0; d < pool->n_devices && !err; ++d)
+        {
+            struct pool_device* dev = &pool->devices[d];
+            struct hasher_completion completion;
+            if (dev->jobs.empty())
+                continue;
+            if (ioctl(dev->fd, HASHER_IOC_COMPLETE, &completion) < 0)
+            {
+                err = -1;
+                break;
+            }
+
+            while (!err && !dev->jobs.empty() && hasher_job_finished(completion.completed, dev->jobs.front().id))
+            {
+                struct pool_job job = dev->jobs.front();
+                dev->jobs.pop_front();
+                memcpy(results + job.first, dev->mem + pool->results_offset + HASHER_RESULT_BYTES * job.first,
+                       sizeof(struct hasher_result) * job.count);
+                for (uint32_t i = job.first; i < job.first + job.count && !err; ++i)
+                {
+                    stats->nonces += results[i].nonces;
+                    if (results[i].status != HASHER_STATUS_EXHAUSTED)
+                    {
+                        stats->device_blocks[d]++;
+                        continue;
+                    }
+                    pow_roll_extranonce(blocks + 64 * i);
+                    stats->requeued++;
+                    err = device_submit(pool, dev, blocks, i, 1, difficulty);
+                }
+            }
+            // Refill from the rest of the batch.
+            while (!err && dev->jobs.size() < POOL_IN_FLIGHT && next < n_blocks)
+            {
+                uint32_t count = n_blocks - next < chunk ? n_blocks - next : chunk;
+                err = device_submit(pool, dev, blocks, next, count, difficulty);
+                next += count;
+            }
+        }
+    }
+
+    // After an error, leave the buffers idle for the next batch.
+    for (uint32_t d = 0; d < pool->n_devices; ++d)
+        device_drain(&pool->devices[d]);
+    return err ? -1 : 0;
+}
@@ -0,0 +1,36 @@
+#ifndef	HASHERPOOL_H
+#define	HASHERPOOL_H
+
+#include <stdint.h>
+
+#include "CpuHasher.h"
+
+// Accelerator instances opened by hasher_pool_open(), /dev/hasher0 ... /dev/hasherN.
+#define HASHER_POOL_MAX_DEVICES 8
+
+struct hasher_pool_stats
+{
+    uint64_t nonces;            // nonces tried, from the result records, failed attempts included
+    uint32_t requeued;          // blocks solved again with a new extranonce
+    uint32_t device_blocks[HASHER_POOL_MAX_DEVICES];    // blocks solved by each instance
+};
+
+struct hasher_pool;
+
+// Opens every instance prefix0, prefix1, ... up to the first one missing, each with a
+// DMA buffer for batches of up to max_blocks blocks. Returns NULL if none could be opened.
+struct hasher_pool* hasher_pool_open(const char* prefix, uint32_t max_blocks);
+void hasher_pool_close(struct hasher_pool* pool);
+uint32_t hasher_pool_devices(const struct hasher_pool* pool);
+
+// Solves a batch on all the instances at once. The batch is cut in chunks, a few per
+// instance, and every instance takes the next chunk as soon as one of its own is done, so
+// that faster or less busy instances take more of the batch. Each keeps two chunks queued
+// in its driver, so that it never waits for this thread between jobs.
+// Blocks with no valid nonce get a rolled extranonce (in blocks as well) and are
+// queued again on the same instance until solved.
+// Returns 0 on success, -1 if a driver call failed.
+int hasher_pool_run(struct hasher_pool* pool, uint8_t* blocks, uint32_t n_blocks,
+                    uint32_t difficulty, struct hasher_result* results, struct hasher_pool_stats* stats);
+
+#endif // HASHERPOOL_H
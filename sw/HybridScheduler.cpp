@@ -0,0 +1,181 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <mutex>
+#include <thread>
+
+#include "HybridScheduler.h"
+
+// Weight of the newest measurement in the running hashrate estimates.
+#define RATE_SMOOTHING 0.5
+
+struct hybrid_scheduler
+{
+    struct cpu_solver* cpu;
+    hybrid_fpga_fn fpga;
+    void* fpga_ctx;
+
+    // Nonces per second, 0 until the engine finished its first claim.
+    double fpga_rate;
+    double cpu_rate;
+
+    // Current batch: blocks [front, back) are not claimed yet.
+    std::mutex lock;
+    uint32_t front;
+    uint32_t back;
+};
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void update_rate(double* rate, uint64_t nonces, double sec)
+{
+    if (sec <= 0.0)
+        return;
+    double measured = (double)nonces / sec;
+    *rate = (*rate == 0.0) ? measured : (1.0 - RATE_SMOOTHING) * *rate + RATE_SMOOTHING * measured;
+}
+
+// Number of blocks the engine with hashrate mine may take next, 0 when nothing is left.
+// With probe set, an engine whose rate is not measured yet takes a single block: an even
+// share of a large batch would keep a slow engine busy long after the other is done.
+// Caller holds the lock.
+static uint32_t claim_size(const struct hybrid_scheduler* sched, double mine, double other, int probe)
+{
+    uint32_t remaining = sched->back - sched->front;
+    if (!remaining)
+        return 0;
+    if (probe && mine == 0.0)
+        return 1;
+
+    double share = 0.5;
+    if (mine > 0.0 && other > 0.0)
+        share = mine / (mine + other);
+    uint32_t n = (uint32_t)(remaining * share / 2);
+    return n ? n : 1;
+}
+
+struct hybrid_scheduler* hybrid_create(struct cpu_solver* cpu, hybrid_fpga_fn fpga, void* fpga_ctx)
+{
+    struct hybrid_scheduler* sched = new hybrid_scheduler();
+
+    sched->cpu = cpu;
+    sched->fpga = fpga;
+    sched->fpga_ctx = fpga_ctx;
+    sched->fpga_rate = 0.0;
+    sched->cpu_rate = 0.0;
+    return sched;
+}
+
+void hybrid_destroy(struct hybrid_scheduler* sched)
+{
+    delete sched;
+}
+
+int hybrid_run(struct hybrid_scheduler* sched, uint8_t* blocks, uint32_t n_blocks,
+               uint32_t difficulty, struct hasher_result* results, struct hybrid_stats* stats)
+{
+    uint32_t failed_first = 0, failed_count = 0;
+
+    stats->fpga_blocks = 0;
+    stats->cpu_blocks = 0;
+    stats->fpga_nonces = 0;
+    stats->cpu_nonces = 0;
+    stats->requeued = 0;
+    sched->front = 0;
+    sched->back = n_blocks;
+
+    // Accelerator: claims from the front, blocks in read() until the interrupt.
+    std::thread fpga_thread([&] {
+        while (1)
+        {
+            uint32_t first, n;
+            {
+                std::lock_guard<std::mutex> lk(sched->lock);
+                n = claim_size(sched, sched->fpga_rate, sched->cpu_rate, 0);
+                first = sched->front;
+                sched->front += n;
+            }
+            if (!n)
+                return;
+
+            double start = now_sec();
+            if (sched->fpga(sched->fpga_ctx, first, n, difficulty))
+            {
+                printf("Hybrid: accelerator failed on blocks %u-%u, moving them to the CPU\n",
+                       first, first + n - 1);
+                failed_first = first;
+                failed_count = n;
+                return;
+            }
+            double sec = now_sec() - start;
+
+            uint64_t nonces = 0;
+            for (uint32_t i = first; i < first + n; ++i)
+                nonces += results[i].nonces;
+            stats->fpga_blocks += n;
+            stats->fpga_nonces += nonces;
+            std::lock_guard<std::mutex> lk(sched->lock);
+            update_rate(&sched->fpga_rate, nonces, sec);
+        }
+    });
+
+    // CPU: claims from the back in the calling thread.
+    while (1)
+    {
+        uint32_t first, n;
+        {
+            std::lock_guard<std::mutex> lk(sched->lock);
+            n = claim_size(sched, sched->cpu_rate, sched->fpga_rate, 1);
+            sched->back -= n;
+            first = sched->back;
+        }
+        if (!n)
+            break;
+
+        double start = now_sec();
+        uint64_t nonces = cpu_solver_run(sched->cpu, blocks + 64 * first, n, difficulty, results + first);
+        double sec = now_sec() - start;
+
+        stats->cpu_blocks += n;
+        stats->cpu_nonces += nonces;
+        std::lock_guard<std::mutex> lk(sched->lock);
+        update_rate(&sched->cpu_rate, nonces, sec);
+    }
+
+    fpga_thread.join();
+
+    if (failed_count)
+    {
+        stats->cpu_nonces += cpu_solver_run(sched->cpu, blocks + 64 * failed_first, failed_count,
+                                            difficulty, results + failed_first);
+        stats->cpu_blocks += failed_count;
+    }
+
+    // Blocks without any valid nonce get a new extranonce and are solved again,
+    // on the accelerator unless it failed.
+    for (uint32_t i = 0; i < n_blocks; ++i)
+    {
+        while (results[i].status == HASHER_STATUS_EXHAUSTED)
+        {
+            pow_roll_extranonce(blocks + 64 * i);
+            stats->requeued++;
+            if (!failed_count && !sched->fpga(sched->fpga_ctx, i, 1, difficulty))
+            {
+                stats->fpga_nonces += results[i].nonces;
+                continue;
+            }
+            failed_count = 1;
+            stats->cpu_nonces += cpu_solver_run(sched->cpu, blocks + 64 * i, 1, difficulty, results + i);
+        }
+    }
+
+    stats->fpga_rate = sched->fpga_rate;
+    stats->cpu_rate = sched->cpu_rate;
+    return failed_count ? -1 : 0;
+}
@@ -0,0 +1,42 @@
+#ifndef	HYBRIDSCHEDULER_H
+#define	HYBRIDSCHEDULER_H
+
+#include <stdint.h>
+
+#include "CpuHasher.h"
+#include "CpuSolver.h"
+
+// Solves blocks [first, first + n_blocks) of the current batch on the accelerator and
+// returns once their results are written. Returns 0 on success.
+// Called from the scheduler's accelerator thread, one call at a time.
+typedef int (*hybrid_fpga_fn)(void* ctx, uint32_t first, uint32_t n_blocks, uint32_t difficulty);
+
+struct hybrid_stats
+{
+    uint32_t fpga_blocks;
+    uint32_t cpu_blocks;
+    uint64_t fpga_nonces;       // nonces tried, from the result records
+    uint64_t cpu_nonces;        // actually hashed by the CPU solver
+    uint32_t requeued;          // blocks solved again with a new extranonce
+    double fpga_rate;           // nonces per second, estimates after this batch
+    double cpu_rate;
+};
+
+struct hybrid_scheduler;
+
+// The CPU solver stays owned by the caller.
+struct hybrid_scheduler* hybrid_create(struct cpu_solver* cpu, hybrid_fpga_fn fpga, void* fpga_ctx);
+void hybrid_destroy(struct hybrid_scheduler* sched);
+
+// Solves a batch on the accelerator and the CPU at the same time. The accelerator
+// takes blocks from the front, the CPU from the back. Each claim is half of the
+// remaining blocks weighted by the engine's share of the combined hashrate, so
+// claims shrink towards the end and both engines finish close together. Until its rate
+// is measured, the CPU claims one block at a time as a probe.
+// Rates are measured on every claim and kept for the next batch.
+// Blocks with no valid nonce are re-queued with a rolled extranonce until solved.
+// Returns 0 on success, -1 if the accelerator failed (its blocks are then redone on the CPU).
+int hybrid_run(struct hybrid_scheduler* sched, uint8_t* blocks, uint32_t n_blocks,
+               uint32_t difficulty, struct hasher_result* results, struct hybrid_stats* stats);
+
+#endif // HYBRIDSCHEDULER_H
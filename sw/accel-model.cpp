@@ -0,0 +1,110 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "AccelModel.h"
+
+// Throughput of the configurations in ../bitstreams predicted by the accelerator model,
+// in the JSON of master_driver.cpp: one entry per bitstream, times and hashrates
+// per difficulty and batch size.
+
+#define DEFAULT_MAX_BLOCKS 16
+#define DEFAULT_MAX_DIFFICULTY 24
+#define BITSTREAM_DIR "../bitstreams"
+
+void predict_bitstream(const char* name, uint32_t max_blocks, uint32_t max_difficulty)
+{
+    struct accel_model_config config;
+    struct accel_model_prediction prediction;
+
+    if (accel_model_config_from_name(name, &config))
+    {
+        printf("Unknown accelerator configuration %s\n", name);
+        exit(-1);
+    }
+    accel_model_predict(&config, 0, 1, &prediction);
+
+    printf("{\n");
+    printf("\"BITSTREAM\": \"%s\",\n", name);
+    printf("\"CLUSTERS\": %u, \"HASHERS\": %u, \"MHZ\": %.1f, \"ROUNDS_PER_CYCLE\": %u,\n",
+           config.clusters, config.hashers, config.clock_mhz, config.rounds_per_cycle);
+    printf("\"PEAK_HASH_PER_SEC\": %f,\n", prediction.peak_hash_per_sec);
+    printf("\"EXPERIMENTS\": [\n");
+    for (uint32_t d = 4; d <= max_difficulty; d += 4)
+    {
+        uint32_t difficulty = 0xFFFFFFFF & (0xFFFFFFFF << (32 - d));
+        printf("{\n");
+        printf("\"DIFFICULTY\": \"%08x\",\n", difficulty);
+        printf("\"BLOCK_EXPERIMENTS\": [\n");
+        for (uint32_t i = 1; i < max_blocks; ++i)
+        {
+            accel_model_predict(&config, difficulty, i, &prediction);
+            printf("{\"Blocks\": %u, \"avg_time\": %f, \"avg_hash_per_sec\": %f}", i, prediction.time_ms, prediction.hash_per_sec);
+            if(i != max_blocks - 1)
+                printf(",\n");
+        }
+        printf("]\n");
+        printf("}");
+        if(d != max_difficulty)
+            printf(",\n");
+    }
+    printf("]\n");
+    printf("}");
+}
+
+int main(int argc, char ** argv)
+{
+    uint32_t max_blocks = DEFAULT_MAX_BLOCKS;
+    uint32_t max_difficulty = DEFAULT_MAX_DIFFICULTY;
+    int first = argc;
+
+    if (argc >= 3)
+    {
+        max_blocks = atoi(argv[1]);
+        max_difficulty = atoi(argv[2]);
+        first = 3;
+    }
+    else if (argc != 1)
+    {
+        printf("usage: ./accel-model [max_blocks max_difficulty [bitstream...]]\n");
+        exit(-1);
+    }
+    if (max_difficulty > 32 || max_difficulty % 4 || max_blocks < 2 || max_blocks > HASHER_MAX_BLOCKS)
+    {
+        printf("Invalid blocks or difficulty selected\n");
+        exit(-1);
+    }
+
+    printf("[\n");
+    if (first < argc)
+    {
+        for (int i = first; i < argc; ++i)
+        {
+            predict_bitstream(argv[i], max_blocks, max_difficulty);
+            printf(i != argc - 1 ? ",\n" : "\n");
+        }
+    }
+    else
+    {
+        struct dirent** entries;
+        int n = scandir(BITSTREAM_DIR, &entries, NULL, alphasort);
+        int printed = 0;
+        for (int i = 0; i < n; ++i)
+        {
+            const char* dot = strrchr(entries[i]->d_name, '.');
+            if (dot && !strcmp(dot, ".bit"))
+            {
+                if (printed++)
+                    printf(",\n");
+                predict_bitstream(entries[i]->d_name, max_blocks, max_difficulty);
+            }
+            free(entries[i]);
+        }
+        if (n >= 0)
+            free(entries);
+        printf("\n");
+    }
+    printf("]\n");
+    return 0;
+}
@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "BitstreamSelector.h"
+
+// Recommends the bitstream of ../bitstreams for a workload, see BitstreamSelector.h,
+// and optionally loads it. The workload is a list of blocks:bits[:weight] batches, e.g.
+// "4:20:3 64:12" for three batches of 4 blocks at 20 bits for one of 64 blocks at 12.
+
+#define BITSTREAM_DIR "../bitstreams"
+
+void usage()
+{
+    printf("usage: ./bitstream-select [-d bitstream_dir] [-c runs.csv] [-l] blocks:bits[:weight]...\n");
+    exit(-1);
+}
+
+// The overlay of the bitstream if there is one, else its .bit.bin, else the .bit.
+void load_candidate(const char* dir, const char* name)
+{
+    static const char* extensions[] = {".dtbo", ".bit.bin", ".bit"};
+    char path[512];
+
+    for (uint32_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); ++i)
+    {
+        snprintf(path, sizeof(path), "%s/%s%s", dir, name, extensions[i]);
+        if (access(path, R_OK))
+            continue;
+        printf("Loading %s\n", path);
+        if (bitstream_load(path))
+        {
+            printf("Error loading %s\n", path);
+            exit(-1);
+        }
+        return;
+    }
+    printf("No overlay or bitstream file for %s in %s\n", name, dir);
+    exit(-1);
+}
+
+int main(int argc, char ** argv)
+{
+    struct bitstream_candidate candidates[SELECTOR_MAX_CANDIDATES];
+    struct workload workload;
+    const char* dir = BITSTREAM_DIR;
+    const char* runs = NULL;
+    int load = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:c:l")) != -1)
+    {
+        if (opt == 'd')
+            dir = optarg;
+        else if (opt == 'c')
+            runs = optarg;
+        else if (opt == 'l')
+            load = 1;
+        else
+            usage();
+    }
+    workload.n_classes = 0;
+    for (int i = optind; i < argc; ++i)
+    {
+        if (workload_add(&workload, argv[i]))
+        {
+            printf("Invalid batch %s\n", argv[i]);
+            usage();
+        }
+    }
+    if (!workload.n_classes)
+        usage();
+
+    int n = bitstream_scan(dir, candidates, SELECTOR_MAX_CANDIDATES);
+    if (n <= 0)
+    {
+        printf("No bitstream in %s\n", dir);
+        exit(-1);
+    }
+    if (runs)
+    {
+        int used = bitstream_calibrate(candidates, n, runs);
+        if (used < 0)
+        {
+            printf("Error reading %s\n", runs);
+            exit(-1);
+        }
+        printf("Calibrated on %d runs\n", used);
+    }
+
+    bitstream_evaluate(candidates, n, &workload);
+    int best = bitstream_best(candidates, n);
+
+    printf("%-48s %10s %14s %8s %12s %s\n", "Bitstream", "blocks/s", "hash/s", "scale", "overhead_ms", "runs");
+    for (int i = 0; i < n; ++i)
+    {
+        printf("%-48s %10.1f %14.0f %8.3f %12.3f %u%s\n", candidates[i].name, candidates[i].blocks_per_sec,
+               candidates[i].hash_per_sec, candidates[i].scale, candidates[i].overhead_ms, candidates[i].samples,
+               i == best ? "  <--" : candidates[i].broken ? "  (broken, skipped)" : "");
+    }
+    if (best < 0)
+    {
+        printf("Only broken bitstreams in %s\n", dir);
+        exit(-1);
+    }
+    printf("Recommended: %s\n", candidates[best].name);
+
+    if (load)
+        load_candidate(dir, candidates[best].name);
+    return 0;
+}
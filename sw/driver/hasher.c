@@ -11,6 +11,10 @@
 #include <asm/uaccess.h> /* copy_to copy_from _user */
 #include <linux/uaccess.h>
 #include <linux/io.h>
+#include <linux/poll.h>
+#include <linux/spinlock.h>
+
+#include "hasher_ioctl.h"
 
 #define DRIVER_NAME "hash_driver"
 #define HASHER_IRQ 48 // Hard-coded value of IRQ vector (GIC: 61).
@@ -22,6 +26,9 @@
 #define STOP 4
 #define DONE 5
 #define RESULT_ADDRESS 6
+#define START_NONCE 9
+#define NONCE_STRIDE 10
+#define NONCE_LIMIT 11
 
 // Global enable IRQ
 #define REG_ENABLE_INTERRUPTS 0x07
@@ -30,26 +37,36 @@
 
 #define DRIVER_WITH_INTERRUPT 1
 
-// Structure used to pass commands between user-space and kernel-space.
-struct user_message
-{
-    uint32_t block_address_base;
-    uint32_t n_blocks;
-    uint32_t difficulty;
-    uint32_t result_address;
-};
-
 int hasher_major = 0;
 int hasher_minor = 0;
 module_param(hasher_major, int, S_IRUGO); // IRUGO: parameter can be read by the world but not changed
 module_param(hasher_minor, int, S_IRUGO);
 
-#if DRIVER_WITH_INTERRUPT
 // We declare a wait queue that will allow us to wait on a condition.
 // Waitqueues allow you to sleep until someone wakes you up.
+// poll() waits on it for the end of a job as well.
 wait_queue_head_t wq;
-int flag = 0;
-#endif
+
+// Jobs accepted by read() or HASHER_IOC_SUBMIT while the accelerator is busy, in
+// submission order. The interrupt handler starts the next one as soon as the running
+// job is done, so the accelerator does not wait for userspace between jobs.
+#define JOB_QUEUE_DEPTH 32
+
+struct hasher_job
+{
+    uint32_t id;
+    struct user_message message;
+};
+
+// Job state, shared by read(), ioctl(), poll() and the interrupt handler.
+static DEFINE_SPINLOCK(job_lock);
+static struct hasher_job job_queue[JOB_QUEUE_DEPTH];
+static unsigned int queue_head = 0;     // next job to start
+static unsigned int queue_len = 0;
+static uint32_t job_id = 0;             // id of the last submitted job
+static uint32_t job_running = 0;        // id of the job on the accelerator, 0 when idle
+static uint32_t job_completed = 0;      // id of the last finished job
+static int job_done = 0;                // a job finished, not reaped by HASHER_IOC_COMPLETE yet
 
 // This structure contains the device information.
 struct hasher_info
@@ -67,6 +84,8 @@ static struct hasher_info hasher_mem = {HASHER_IRQ, 0x43C00000, 0x43C0FFFF};
 int hasher_open(struct inode *inode, struct file *filp);
 int hasher_release(struct inode *inode, struct file *filed_mem);
 ssize_t hasher_read(struct file *filed_mem, char __user *buf, size_t count, loff_t *f_pos);
+long hasher_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+__poll_t hasher_poll(struct file *filp, poll_table *wait);
 
 #if DRIVER_WITH_INTERRUPT
 // IRQ handler function.
@@ -77,6 +96,8 @@ static irq_handler_t hasherIRQHandler(unsigned int irq, void *dev_id, struct pt_
 struct file_operations hasher_fops = {
     .owner = THIS_MODULE,
     .read = hasher_read,
+    .unlocked_ioctl = hasher_ioctl,
+    .poll = hasher_poll,
     .open = hasher_open,
     .release = hasher_release,
 };
@@ -130,71 +151,208 @@ void hasher_cleanup_module(void)
     pr_info("hasher_DRIVER: Cdev deleted, hasher device unmapped, chdev unregistered\n");
 }
 
+// Programs the peripheral registers and starts the job.
+// Called with job_lock held, possibly from the interrupt handler: must not sleep.
+static void hasher_start(const struct hasher_job *job)
+{
+    const struct user_message *message = &job->message;
+
+    iowrite32(message->block_address_base, hasher_mem.baseAddr + BLOCK_ADDRESS * sizeof(uint32_t));
+    iowrite32(message->n_blocks, hasher_mem.baseAddr + N_BLOCKS * sizeof(uint32_t));
+    iowrite32(message->difficulty, hasher_mem.baseAddr + DIFFICULTY * sizeof(uint32_t));
+    iowrite32(message->result_address, hasher_mem.baseAddr + RESULT_ADDRESS * sizeof(uint32_t));
+    iowrite32(message->start_nonce, hasher_mem.baseAddr + START_NONCE * sizeof(uint32_t));
+    iowrite32(message->nonce_stride, hasher_mem.baseAddr + NONCE_STRIDE * sizeof(uint32_t));
+    iowrite32(message->nonce_limit, hasher_mem.baseAddr + NONCE_LIMIT * sizeof(uint32_t));
+#if DRIVER_WITH_INTERRUPT
+    iowrite32(0xFFFFFFFF, hasher_mem.baseAddr + sizeof(uint32_t) * REG_ENABLE_INTERRUPTS);
+    iowrite32(0x1, hasher_mem.baseAddr + sizeof(uint32_t) * REG_ISR);
+    mb();
+#endif
+
+    iowrite32(1, hasher_mem.baseAddr + START * sizeof(uint32_t));
+    mb();
+    iowrite32(0, hasher_mem.baseAddr + START * sizeof(uint32_t));
+    mb();
+    job_running = job->id;
+    pr_info("hasher_DRIVER: Starting accel (job %u)...\n", job->id);
+}
+
+// The running job is done: start the next queued one straight away, then wake up
+// read() and poll() for the finished one.
+// Called by the interrupt handler, or when DONE is seen in polling mode.
+static void hasher_job_done(void)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&job_lock, flags);
+    if (job_running)
+    {
+        job_completed = job_running;
+        job_running = 0;
+        job_done = 1;
+        if (queue_len)
+        {
+            hasher_start(&job_queue[queue_head]);
+            queue_head = (queue_head + 1) % JOB_QUEUE_DEPTH;
+            queue_len--;
+        }
+    }
+    spin_unlock_irqrestore(&job_lock, flags);
+    wake_up_interruptible(&wq);
+}
+
+// Without the interrupt nobody else notices the end of a job: check the DONE register.
+static void hasher_check_done(void)
+{
+#if !DRIVER_WITH_INTERRUPT
+    if (job_running && ioread32(hasher_mem.baseAddr + DONE * sizeof(uint32_t)))
+        hasher_job_done();
+#endif
+}
+
+// Starts the job, or queues it behind the running one.
+// Returns the job id, or -EBUSY when the queue is full.
+static long hasher_submit(const struct user_message *message)
+{
+    unsigned long flags;
+    struct hasher_job job;
+
+    spin_lock_irqsave(&job_lock, flags);
+    if (queue_len == JOB_QUEUE_DEPTH)
+    {
+        spin_unlock_irqrestore(&job_lock, flags);
+        return -EBUSY;
+    }
+    // Ids stay positive, they are returned by ioctl().
+    job_id = (job_id + 1) & 0x7FFFFFFF;
+    if (!job_id)
+        job_id = 1;
+    job.id = job_id;
+    job.message = *message;
+    if (job_running)
+        job_queue[(queue_head + queue_len++) % JOB_QUEUE_DEPTH] = job;
+    else
+        hasher_start(&job);
+    spin_unlock_irqrestore(&job_lock, flags);
+    return job.id;
+}
+
 // Function that implements system call read() for our driver.
-// Returns 1 uint32_t with the number of times the interrupt has been detected.
+// Submits the job and sleeps until it is finished.
 ssize_t hasher_read(struct file *filed_mem, char __user *buf, size_t count, loff_t *f_pos)
 {
     struct user_message message;
-    uint32_t status;
+    unsigned long flags;
+    long id;
 
-    if (count < sizeof(struct user_message))
+    if (count < USER_MESSAGE_MIN_SIZE)
     {
-        pr_err("hasher_DRIVER: USer buffer too small (> %d bytes).\n", sizeof(struct user_message));
+        pr_err("hasher_DRIVER: USer buffer too small (> %d bytes).\n", USER_MESSAGE_MIN_SIZE);
         return -1;
     }
 
+    // Older applications only pass the first four fields: search every nonce from 0.
+    message.start_nonce = 0;
+    message.nonce_stride = 1;
+    message.nonce_limit = 0;
+
     // Copy the information from user-space to the kernel-space buffer.
-    if (raw_copy_from_user(&message, buf, sizeof(struct user_message)))
+    if (raw_copy_from_user(&message, buf, min(count, sizeof(struct user_message))))
     {
         pr_err("hasher_DRIVER: Raw copy from user buffer failed.\n");
         return -1;
     }
 
-    // Program the peripheral registers.
-    iowrite32(message.block_address_base, hasher_mem.baseAddr + BLOCK_ADDRESS * sizeof(uint32_t));
-    iowrite32(message.n_blocks, hasher_mem.baseAddr + N_BLOCKS * sizeof(uint32_t));
-    iowrite32(message.difficulty, hasher_mem.baseAddr + DIFFICULTY * sizeof(uint32_t));
-    iowrite32(message.result_address, hasher_mem.baseAddr + RESULT_ADDRESS * sizeof(uint32_t));
-#if DRIVER_WITH_INTERRUPT
-    iowrite32(0xFFFFFFFF, hasher_mem.baseAddr + sizeof(uint32_t) * REG_ENABLE_INTERRUPTS);
-    iowrite32(0x1, hasher_mem.baseAddr + sizeof(uint32_t) * REG_ISR);
-    mb();
-    flag = 0;
-#endif
-
-    iowrite32(1, hasher_mem.baseAddr + START * sizeof(uint32_t));
-    mb();
-    iowrite32(0, hasher_mem.baseAddr + START * sizeof(uint32_t));
-    mb();
-    pr_info("hasher_DRIVER: Starting accel...\n");
+    id = hasher_submit(&message);
+    if (id < 0)
+    {
+        pr_err("hasher_DRIVER: Job queue full.\n");
+        return id;
+    }
 
     // Sleep the thread until the peripheral generates an interrupt
     // wait_event_interruptible may exit when a signal is received, so
-    // we check our flag to ensure that it was our own interrupt handler
+    // we check the job state to ensure that it was our own interrupt handler
     // waking up us after the interrupt is received, and not an
     // spurious signal.
     // When we go to sleep, the processor is free for other tasks.
 #if DRIVER_WITH_INTERRUPT
-    // printk("Val: %x\n", ioread32(hasher_mem.baseAddr + sizeof(uint32_t) * REG_ENABLE_INTERRUPTS));
-    while (wait_event_interruptible(wq, flag != 0))
+    while (wait_event_interruptible(wq, hasher_job_finished(job_completed, id)))
     {
         printk(KERN_ALERT "hasher_DRIVER: AWOKEN BY ANOTHER SIGNAL\n");
         return 0;
     }
     pr_info("hasher_DRIVER: AWOKEN FROM INTERRUPT\n");
-
-    // Disable interrupts.
-    // iowrite32(0, hasher_mem.baseAddr + sizeof(uint32_t) * REG_ENABLE_INTERRUPTS);
 #else
-    // INSERT POLLING HERE
-    while (!ioread32(hasher_mem.baseAddr + DONE * sizeof(uint32_t)))
-        ;
+    while (!hasher_job_finished(job_completed, id))
+        hasher_check_done();
 #endif
 
+    // The caller of read() gets its results here: nothing left to reap,
+    // unless other jobs finished after this one.
+    spin_lock_irqsave(&job_lock, flags);
+    if (job_completed == id)
+        job_done = 0;
+    spin_unlock_irqrestore(&job_lock, flags);
+
     pr_info("hasher_DRIVER: Performed READ operation successfully\n");
     return 0;
 }
 
+// Function that implements system call ioctl() for our driver:
+// asynchronous submit and completion query, see hasher_ioctl.h.
+long hasher_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct user_message message;
+    struct hasher_completion completion;
+    unsigned long flags;
+
+    switch (cmd)
+    {
+    case HASHER_IOC_SUBMIT:
+        if (copy_from_user(&message, (void __user *)arg, sizeof(message)))
+            return -EFAULT;
+        return hasher_submit(&message);
+
+    case HASHER_IOC_COMPLETE:
+        hasher_check_done();
+        spin_lock_irqsave(&job_lock, flags);
+        completion.job_id = job_id;
+        completion.done = !job_running;
+        completion.completed = job_completed;
+        completion.queued = queue_len;
+        job_done = 0;
+        spin_unlock_irqrestore(&job_lock, flags);
+        if (copy_to_user((void __user *)arg, &completion, sizeof(completion)))
+            return -EFAULT;
+        return 0;
+
+    default:
+        return -ENOTTY;
+    }
+}
+
+// Function that implements system calls poll()/select()/epoll for our driver.
+// Readable when a job finished since the last HASHER_IOC_COMPLETE, writable while
+// the queue has room.
+// Without the interrupt nothing wakes the waiters: poll with a timeout.
+__poll_t hasher_poll(struct file *filp, poll_table *wait)
+{
+    __poll_t mask = 0;
+    unsigned long flags;
+
+    poll_wait(filp, &wq, wait);
+    hasher_check_done();
+    spin_lock_irqsave(&job_lock, flags);
+    if (job_done)
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (queue_len < JOB_QUEUE_DEPTH)
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    spin_unlock_irqrestore(&job_lock, flags);
+    return mask;
+}
+
 // Set up the char_dev structure for this device.
 static void hasher_setup_cdev(struct hasher_info *_hasher_mem)
 {
@@ -248,9 +406,9 @@ static int hasher_init(void)
         return -1;
     }
 
-#if DRIVER_WITH_INTERRUPT
     init_waitqueue_head(&wq);
 
+#if DRIVER_WITH_INTERRUPT
     // Request registering our interrupt handler for the IRQ of the peripheral.
     // We configure the interrupt to be detected on the rising edge of the signal.
     result = request_irq(hasher_mem.irq, (irq_handler_t)hasherIRQHandler, IRQF_TRIGGER_RISING, DRIVER_NAME, &hasher_mem);
@@ -305,10 +463,8 @@ static irq_handler_t hasherIRQHandler(unsigned int irq, void *dev_id, struct pt_
     // 'done' bit to toggle it, so that it becomes 0 and the interrupt is disarmed.
     iowrite32(1, hasher_mem.baseAddr + sizeof(uint32_t) * REG_ISR);
     mb();
-    // Signal that it is us waking the main thread.
-    flag = 1;
-    // Wake the main thread.
-    wake_up_interruptible(&wq);
+    // Start the next queued job, then signal that it is us waking the main thread, and wake it.
+    hasher_job_done();
     return (irq_handler_t)IRQ_HANDLED; // Announce that the IRQ has been handled correctly
     // In case of error, or if it was not our device which generated the IRQ, return IRQ_NONE.
 }
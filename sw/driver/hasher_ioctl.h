@@ -0,0 +1,210 @@
+#ifndef	HASHER_IOCTL_H
+#define	HASHER_IOCTL_H
+
+// Interface of the hasher drivers (hasher.c, hasher_platform.c) shared with userspace.
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#endif
+#include <linux/ioctl.h>
+
+// Job with bus addresses, passed to read() or HASHER_IOC_SUBMIT (hasher.c). The
+// accelerator reads and writes wherever they point to: hasher_platform.c only takes
+// it on read(), on the buffers of the caller (HASHER_IOC_ALLOC phys) unless loaded with
+// raw_addresses=1. Use HASHER_IOC_SUBMIT_BUF there.
+struct user_message
+{
+    uint32_t block_address_base;
+    uint32_t n_blocks;
+    uint32_t difficulty;
+    uint32_t result_address;
+    // Nonces tried for every block: start_nonce, start_nonce + nonce_stride, ...
+    // nonce_limit of them (0 = all 2^32). A block with no hit in its range is
+    // reported as exhausted with the next nonce of the range, to resume from there.
+    uint32_t start_nonce;
+    uint32_t nonce_stride;
+    uint32_t nonce_limit;
+};
+
+// Size of the message before the nonce range fields, still accepted by read().
+#define USER_MESSAGE_MIN_SIZE (4 * sizeof(uint32_t))
+
+struct hasher_completion
+{
+    uint32_t job_id;            // id of the last submitted job
+    uint32_t done;              // 1 once its results are in memory
+    uint32_t completed;         // id of the last finished job, 0 before the first one
+    uint32_t queued;            // jobs waiting behind the running one
+};
+
+// Jobs run in submission order and their ids grow by one, modulo 2^31 and skipping 0.
+// True once job id is finished, given the id of the last finished job.
+static inline int hasher_job_finished(uint32_t completed, uint32_t id)
+{
+    return ((completed - id) & 0x7FFFFFFF) < 0x40000000;
+}
+
+// Completion ring, mmap() of the device at offset 0 (read only, hasher_platform.c).
+// The accelerator appends an entry for every block it finishes, right after its
+// result record, then bumps head. Entry n is at HASHER_RING_HEADER_BYTES +
+// (n & (entries - 1)) * sizeof(struct hasher_ring_entry). Nothing holds the
+// accelerator back when the consumer falls behind: more than entries unread
+// entries means some were overwritten. Entries are only written while some descriptor
+// has the ring mapped, from the first job started after the mmap().
+#define HASHER_RING_HEADER_BYTES 64
+
+struct hasher_ring_header
+{
+    uint32_t head;              // entries appended so far, wraps at 2^32
+    uint32_t reserved;
+    uint32_t entries;           // ring size, a power of two
+};
+
+struct hasher_ring_entry
+{
+    uint32_t block;             // index of the block in its job
+    uint32_t nonce;
+    uint32_t status;            // as in the result record: 1 = found, 2 = exhausted, 3 = cancelled
+    uint32_t result;            // physical address of the block's result record
+};
+
+// Result record written by the accelerator for every block, see README.md.
+#define HASHER_RESULT_BYTES 32
+// Blocks per job, the FSM counts them on 8 bits.
+#define HASHER_MAX_BLOCKS 255
+
+// Coherent DMA buffer owned by the driver (hasher_platform.c), freed with
+// HASHER_IOC_FREE or when the descriptor is closed. Buffer h is mmap()ed at
+// offset h << HASHER_BUFFER_SHIFT, which caps its size.
+#define HASHER_BUFFER_SHIFT 24
+#define HASHER_BUFFER_MAX_SIZE (1u << HASHER_BUFFER_SHIFT)
+#define HASHER_MAX_BUFFERS 64
+
+// mmap() offset of the register page (hasher_platform.c with direct_access=1), one
+// page, uncached. The register indexes are in README.md. While it is mapped, jobs are
+// started by writing the registers and the driver queues none of its own: its submits
+// fail with EBUSY. Use HASHER_IOC_EVENTFD to sleep until the end of a job.
+#define HASHER_REGS_MMAP_OFFSET ((uint64_t)(HASHER_MAX_BUFFERS + 1) << HASHER_BUFFER_SHIFT)
+
+struct hasher_buffer
+{
+    uint32_t size;              // in: bytes wanted; out: rounded up to pages
+    uint32_t handle;            // out
+    uint64_t mmap_offset;       // out
+    uint32_t phys;              // out: bus address, as in the ring entries
+    uint32_t flags;             // in: HASHER_BUFFER_*, 0 for a coherent (uncached) buffer
+};
+
+// Buffer mapped cacheable. The CPU fills blocks and reads results at memory speed, but
+// the caches must be cleaned before the accelerator reads and invalidated before the CPU
+// reads what it wrote: HASHER_IOC_SUBMIT_BUF does both for its job, the owner of the
+// register mapping calls HASHER_IOC_SYNC.
+#define HASHER_BUFFER_CACHED 1
+
+// Cache maintenance on [offset, offset + size) of a buffer, a no-op on coherent ones.
+struct hasher_sync
+{
+    uint32_t handle;
+    uint32_t offset;
+    uint32_t size;
+    uint32_t direction;         // HASHER_SYNC_*
+};
+
+#define HASHER_SYNC_FOR_DEVICE 1        // before the accelerator reads or writes the range
+#define HASHER_SYNC_FOR_CPU 2           // before the CPU reads what the accelerator wrote
+
+// Job on a driver buffer: blocks and results are byte offsets in it, 8-byte aligned.
+// The driver checks that both fit in the buffer.
+struct hasher_buffer_job
+{
+    uint32_t handle;
+    uint32_t blocks_offset;
+    uint32_t n_blocks;
+    uint32_t difficulty;
+    uint32_t results_offset;
+    uint32_t start_nonce;
+    uint32_t nonce_stride;
+    uint32_t nonce_limit;
+};
+
+// Performance counters of the accelerator, read-only registers after the 16 of the
+// register file (README.md). Cleared on START, held from DONE to the next START.
+// 64-bit counters take two registers, low word first.
+#define HASHER_PERF_MAGIC 0x50455246            // "PERF" in HASHER_PERF_REG_MAGIC
+#define HASHER_PERF_REG_MAGIC 16
+#define HASHER_PERF_REG_LAYOUT 17               // hashers per cluster << 8 | clusters
+#define HASHER_PERF_REG_JOB_CYCLES 18
+#define HASHER_PERF_REG_FETCH_CYCLES 20
+#define HASHER_PERF_REG_WRITEBACK_CYCLES 22
+// Cluster c: hashes at HASHER_PERF_REG_CLUSTERS + 4 * c, idle cycles 2 registers after.
+#define HASHER_PERF_REG_CLUSTERS 24
+#define HASHER_PERF_MAX_CLUSTERS 10             // what a 256-byte register window holds
+
+// Counters of one job, from HASHER_IOC_PERF or hasher_direct_perf().
+struct hasher_perf
+{
+    uint32_t clusters;
+    uint32_t hashers;           // per cluster
+    uint64_t clock_hz;          // of the accelerator, 0 if unknown
+    uint64_t job_cycles;        // START to DONE
+    uint64_t fetch_cycles;      // FSM reading blocks
+    uint64_t writeback_cycles;  // FSM writing result records and ring entries
+    // Per cluster: hashes computed, every hasher of the last round included, and cycles
+    // without a block while the FSM was still handing them out.
+    uint64_t hashes[HASHER_PERF_MAX_CLUSTERS];
+    uint64_t idle_cycles[HASHER_PERF_MAX_CLUSTERS];
+};
+
+#define HASHER_IOC_MAGIC 'h'
+
+// hasher.c only: queues the job and returns at once; it starts as soon as the
+// accelerator is free. Returns the job id (> 0), or fails with EBUSY while the driver
+// queue is full.
+#define HASHER_IOC_SUBMIT _IOW(HASHER_IOC_MAGIC, 1, struct user_message)
+
+// Never blocks. Reports the state of the queue; finished jobs are reaped by this call,
+// after which poll() no longer reports the descriptor readable.
+#define HASHER_IOC_COMPLETE _IOR(HASHER_IOC_MAGIC, 2, struct hasher_completion)
+
+// Raise the interrupt every n ring entries (0, the default: only at the end of a job),
+// so that poll() wakes up for new entries.
+#define HASHER_IOC_RING_IRQ _IOW(HASHER_IOC_MAGIC, 3, uint32_t)
+
+// Tells the driver how far the caller has read the ring, for the POLLPRI of its own
+// descriptor. A new descriptor starts at the head of the ring.
+#define HASHER_IOC_RING_TAIL _IOW(HASHER_IOC_MAGIC, 4, uint32_t)
+
+// Allocates a DMA buffer.
+#define HASHER_IOC_ALLOC _IOWR(HASHER_IOC_MAGIC, 5, struct hasher_buffer)
+
+// Frees a buffer, fails with EBUSY while it is mapped or used by an unfinished job.
+#define HASHER_IOC_FREE _IOW(HASHER_IOC_MAGIC, 6, uint32_t)
+
+// Same as HASHER_IOC_SUBMIT, on a buffer of the caller: the only way to queue a job
+// on hasher_platform.c without waiting for it.
+#define HASHER_IOC_SUBMIT_BUF _IOW(HASHER_IOC_MAGIC, 7, struct hasher_buffer_job)
+
+// For the owner of the register mapping: the eventfd (an int32_t, -1 to stop) is
+// signalled on every interrupt of the instance. Dropped with the mapping.
+#define HASHER_IOC_EVENTFD _IOW(HASHER_IOC_MAGIC, 8, int32_t)
+
+// Cancels the jobs of the caller up to the given id (a uint32_t, 0 for all of them).
+// Queued ones finish without running, the running one is stopped and its result records
+// hold what was found so far, see README.md. Returns the number of jobs cancelled.
+#define HASHER_IOC_CANCEL _IOW(HASHER_IOC_MAGIC, 9, uint32_t)
+
+// Cache maintenance on a range of a HASHER_BUFFER_CACHED buffer, see struct hasher_sync.
+#define HASHER_IOC_SYNC _IOW(HASHER_IOC_MAGIC, 10, struct hasher_sync)
+
+// Counters of the last job the driver ran on the instance, read when it finished; all
+// 0 before the first one, clusters, hashers and clock_hz are set from the probe on.
+// Fails with ENODEV if the bitstream has no counters or perf_counters=0.
+#define HASHER_IOC_PERF _IOR(HASHER_IOC_MAGIC, 11, struct hasher_perf)
+
+// poll()/epoll: POLLIN when a job finished since the last HASHER_IOC_COMPLETE,
+// POLLOUT when the queue has room for another job, POLLPRI when the ring head is
+// past the position given with HASHER_IOC_RING_TAIL on the same descriptor.
+
+#endif // HASHER_IOCTL_H
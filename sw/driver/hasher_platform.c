@@ -10,6 +10,30 @@
 #include <linux/of.h>
 #include <linux/of_address.h>
 #include <linux/of_irq.h>
+#include <linux/poll.h>
+#include <linux/spinlock.h>
+#include <linux/dma-mapping.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/rwsem.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/hrtimer.h>
+#include <linux/bitops.h>
+#include <linux/eventfd.h>
+#include <linux/clk.h>
+#include <linux/version.h>
+
+#include "hasher_ioctl.h"
+
+#define CREATE_TRACE_POINTS
+#include "hasher_trace.h"
 
 #define DRIVER_NAME "hasher"
 #define CLASS_NAME "hasher_class"
@@ -21,6 +45,17 @@
 #define STOP 4
 #define DONE 5
 #define RESULT_ADDRESS 6
+#define START_NONCE 9
+#define NONCE_STRIDE 10
+#define NONCE_LIMIT 11
+#define RING_ADDR 12
+#define RING_MASK 13
+#define RING_HEAD 14
+#define RING_IRQ_EVERY 15
+
+// Words of the 32-byte result record, see README.md.
+#define RESULT_NONCES 6
+#define RESULT_STATUS 7
 
 // Global enable IRQ
 #define REG_ENABLE_INTERRUPTS 0x07
@@ -29,46 +64,250 @@
 
 #define DRIVER_WITH_INTERRUPT 1
 
-// Structure used to pass commands between user-space and kernel-space.
-struct user_message
-{
-    uint32_t block_address_base;
-    uint32_t n_blocks;
-    uint32_t difficulty;
-    uint32_t result_address;
-};
+// Accelerator instances handled by the driver, one /dev/hasherN each.
+#define HASHER_MAX_DEVICES 8
 
 int hasher_major = 0;
 int hasher_minor = 0;
 module_param(hasher_major, int, S_IRUGO); // IRUGO: parameter can be read by the world but not changed
 module_param(hasher_minor, int, S_IRUGO);
+// Entries of the completion ring of every instance, a power of two (0 disables the ring).
+unsigned int ring_entries = 1024;
+module_param(ring_entries, uint, S_IRUGO);
+// read() busy-waits on DONE for jobs expected to take less than this, instead of
+// sleeping until the interrupt (0: always sleep).
+unsigned int spin_us = 20;
+module_param(spin_us, uint, S_IRUGO | S_IWUSR);
+// A job still running after this long (or 4 times its expected time, if longer) has
+// DONE checked, in case its interrupt was lost.
+unsigned int watchdog_ms = 100;
+module_param(watchdog_ms, uint, S_IRUGO | S_IWUSR);
+// DONE polling period once an instance lost an interrupt, or without interrupts.
+unsigned int poll_us = 50;
+module_param(poll_us, uint, S_IRUGO | S_IWUSR);
+// Let the users of /dev/hasherN map its registers (HASHER_REGS_MMAP_OFFSET). The
+// accelerator then reads and writes wherever they point it to, like with /dev/mem.
+bool direct_access;
+module_param(direct_access, bool, S_IRUGO | S_IWUSR);
+// Read the performance counters of the accelerator at the end of every job, for
+// HASHER_IOC_PERF and stats/hw_*: a few dozen register reads per job.
+bool perf_counters = true;
+module_param(perf_counters, bool, S_IRUGO | S_IWUSR);
+// Let read() take jobs with bus addresses outside the buffers of the file, as the
+// applications written for the first driver pass them. The accelerator then reads and
+// writes wherever they point it to, like with /dev/mem: off by default.
+bool raw_addresses;
+module_param(raw_addresses, bool, S_IRUGO | S_IWUSR);
 
-#if DRIVER_WITH_INTERRUPT
-// We declare a wait queue that will allow us to wait on a condition.
-// Waitqueues allow you to sleep until someone wakes you up.
-wait_queue_head_t wq;
-int flag = 0;
-#endif
+// Jobs accepted by read() or HASHER_IOC_SUBMIT_BUF while the accelerator is busy, in
+// submission order. The interrupt handler starts the next one as soon as the running
+// job is done, so the accelerator does not wait for userspace between jobs.
+#define JOB_QUEUE_DEPTH 32
+
+struct hasher_job
+{
+    uint32_t id;
+    struct user_message message;
+    u64 submit_ns;
+    // Result records in a driver buffer, read for the statistics; NULL for jobs
+    // given with bus addresses.
+    const uint32_t *results;
+    int cached;                 // results in a cacheable buffer, invalidated before reading them
+    struct hasher_file *owner;  // file that submitted it
+    int cancelled;              // dropped by hasher_cancel(), finishes without running
+};
+
+// Latency histograms, bucket b counts [2^b, 2^(b+1)) ns, the last one everything above.
+#define HASHER_HIST_BUCKETS 32
+
+// Counters of an instance, protected by job_lock.
+struct hasher_stats
+{
+    u64 jobs_submitted;
+    u64 jobs_completed;
+    u64 blocks_solved;          // FOUND blocks, of jobs on driver buffers
+    u64 nonces;                 // nonces tried, of jobs on driver buffers
+    u64 irqs;
+    u64 spurious_wakeups;       // read() woken up before the end of its job
+    u64 jobs_cancelled;
+    u64 spun;                   // read() saw its job finish while busy-waiting
+    u64 missed_irqs;            // jobs finished by the watchdog
+    // Performance counters of the accelerator, summed over the jobs (and the clusters)
+    u64 hw_job_cycles;
+    u64 hw_fetch_cycles;
+    u64 hw_writeback_cycles;
+    u64 hw_hashes;
+    u64 hw_idle_cycles;
+    u64 submit_to_irq[HASHER_HIST_BUCKETS];
+    u64 irq_to_wakeup[HASHER_HIST_BUCKETS];
+};
 
-// This structure contains the device information.
+// This structure contains the information of one accelerator instance.
+// Allocated in pl_accel_probe(), one per TopLevel node of the device tree. The
+// platform device and every open file hold a reference: it outlives pl_accel_remove()
+// until the last file is closed, see hasher_free().
 struct hasher_info
 {
     int irq;
-    unsigned long memStart;
-    unsigned long memEnd;
-    void __iomem *baseAddr;
-    struct cdev cdev; /* Char device structure               */
+    void __iomem *baseAddr;     // unmapped right after pl_accel_remove()
+    struct cdev *cdev; /* Char device structure, freed with its last reference */
+    struct device *dev;         // platform device, owns the DMA allocations, referenced
+    struct kref ref;
+    // Set by pl_accel_remove(): file operations fail with ENODEV from then on. They hold
+    // remove_lock for reading, so that the registers stay mapped while they use them.
+    int dead;
+    struct rw_semaphore remove_lock;
+    int leak_dma;               // still running at removal: the ring is never freed
+    int index;                  // N of /dev/hasherN
+    dev_t devt;
+
+    // We declare a wait queue that will allow us to wait on a condition.
+    // Waitqueues allow you to sleep until someone wakes you up.
+    // poll() waits on it for the end of a job as well.
+    wait_queue_head_t wq;
+
+    // Job state, shared by read(), ioctl(), poll() and the interrupt handler.
+    spinlock_t job_lock;
+    struct hasher_job job_queue[JOB_QUEUE_DEPTH];
+    unsigned int queue_head;    // next job to start
+    unsigned int queue_len;
+    uint32_t job_id;            // id of the last submitted job
+    uint32_t job_running;       // id of the job on the accelerator, 0 when idle
+    uint32_t job_completed;     // id of the last finished job
+    int job_done;               // a job finished, not reaped by HASHER_IOC_COMPLETE yet
+    struct hasher_job running_job;      // copy of the job on the accelerator
+    int stopping;               // STOP is set for it, see hasher_cancel()
+    u64 start_ns;               // when running_job started
+    u64 expected_ns;            // its expected duration, 0 if unknown
+    u64 completed_ns;           // when job_completed finished
+
+    // Measured speed, picoseconds per nonce, 0 until the first job finished.
+    u64 ps_per_nonce;
+    // Checks DONE when the interrupt is late, then polls it once irq_lost is set.
+    struct hrtimer watchdog;
+    int irq_lost;               // no interrupts from this instance, poll DONE instead
+    int open_count;             // open files, under job_lock: the last one out disables the interrupt
+
+    // Registers mapped by userspace, see hasher_mmap_regs(). The driver queues no job
+    // while they are mapped, nor before the last job started through them is finished.
+    phys_addr_t regs_phys;
+    struct hasher_file *direct_owner;   // file that mapped them
+    int direct_maps;            // its live mappings
+    int direct_busy;            // unmapped with a job running
+    struct eventfd_ctx *direct_event;   // signalled on every interrupt, see HASHER_IOC_EVENTFD
+
+    struct hasher_stats stats;
+    struct dentry *debugfs;
+    // The bitstream has the performance counters, and those of the last job.
+    int has_perf;
+    struct hasher_perf perf;
+
+    // Completion ring, written by the accelerator, mmap()ed by userspace.
+    struct hasher_ring_header *ring;
+    dma_addr_t ring_dma;
+    size_t ring_size;
+    // Live mmap()s of the ring: the accelerator only writes entries while there are some.
+    int ring_maps;
+};
+
+// debugfs directory of the driver, one subdirectory per instance.
+static struct dentry *hasher_debugfs;
+
+// Minors of the instances, handed out in probe order.
+static DEFINE_IDA(hasher_ida);
+static dev_t hasher_devt;       // first of the HASHER_MAX_DEVICES minors
+// Live instances by minor, for open().
+static struct hasher_info *hasher_devices[HASHER_MAX_DEVICES];
+static DEFINE_MUTEX(hasher_devices_lock);
+
+// DMA buffer allocated with HASHER_IOC_ALLOC, owned by one open file.
+struct hasher_dma_buffer
+{
+    struct list_head list;
+    uint32_t handle;
+    size_t size;
+    void *virt;
+    dma_addr_t dma;
+    int cached;                 // HASHER_BUFFER_CACHED: non-coherent pages, mapped cacheable
+    struct page *pages;         // cached only, from dma_alloc_pages()
+    int map_count;              // live mmap()s
+    uint32_t last_job;          // last job using it, 0 if none
 };
 
-static struct hasher_info hasher_mem;// = {HASHER_IRQ, 0xA0000000, 0xA0000FFF};
+// State of an open file: its instance and its buffers.
+struct hasher_file
+{
+    struct hasher_info *hasher;
+    struct mutex lock;
+    struct list_head buffers;
+    uint32_t last_job;          // last job on one of the buffers, 0 if none
+    uint32_t ring_tail;         // how far it has read the ring, see HASHER_IOC_RING_TAIL
+};
+
+// Caller holds file->lock.
+static struct hasher_dma_buffer *hasher_find_buffer(struct hasher_file *file, uint32_t handle)
+{
+    struct hasher_dma_buffer *buf;
+
+    list_for_each_entry(buf, &file->buffers, list)
+        if (buf->handle == handle)
+            return buf;
+    return NULL;
+}
+
+static void hasher_free_buffer(struct hasher_info *hasher, struct hasher_dma_buffer *buf)
+{
+    list_del(&buf->list);
+    if (buf->cached)
+        dma_free_pages(hasher->dev, buf->size, buf->pages, buf->dma, DMA_BIDIRECTIONAL);
+    else
+        dma_free_coherent(hasher->dev, buf->size, buf->virt, buf->dma);
+    kfree(buf);
+}
+
+// With the last reference to the instance, once removed and with no file open.
+static void hasher_free(struct kref *ref)
+{
+    struct hasher_info *hasher = container_of(ref, struct hasher_info, ref);
+
+    // pl_accel_remove() took the ring away from the accelerator.
+    if (hasher->ring && !hasher->leak_dma)
+        dma_free_coherent(hasher->dev, PAGE_ALIGN(hasher->ring_size), hasher->ring, hasher->ring_dma);
+    if (hasher->direct_event)
+        eventfd_ctx_put(hasher->direct_event);
+    put_device(hasher->dev);
+    kfree(hasher);
+}
+
+// Every file operation but release() runs between these two. Fails with -ENODEV once
+// the instance is removed; otherwise pl_accel_remove() waits for hasher_leave().
+static int hasher_enter(struct hasher_info *hasher)
+{
+    down_read(&hasher->remove_lock);
+    if (hasher->dead)
+    {
+        up_read(&hasher->remove_lock);
+        return -ENODEV;
+    }
+    return 0;
+}
+
+static void hasher_leave(struct hasher_info *hasher)
+{
+    up_read(&hasher->remove_lock);
+}
 
 static struct class *pl_class;
-static struct device *pl_device;
 
 // Declare here the user-accessible functions that the driver implements.
 int hasher_open(struct inode *inode, struct file *filp);
 int hasher_release(struct inode *inode, struct file *filed_mem);
+static int hasher_idle(struct hasher_info *hasher);
 ssize_t hasher_read(struct file *filed_mem, char __user *buf, size_t count, loff_t *f_pos);
+long hasher_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+__poll_t hasher_poll(struct file *filp, poll_table *wait);
+int hasher_mmap(struct file *filp, struct vm_area_struct *vma);
+static int hasher_cancel(struct hasher_info *hasher, struct hasher_file *owner, uint32_t id, int up_to);
 
 #if DRIVER_WITH_INTERRUPT
 // IRQ handler function.
@@ -79,6 +318,9 @@ static irqreturn_t hasherIRQHandler(int irq, void *dev_id);
 struct file_operations hasher_fops = {
     .owner = THIS_MODULE,
     .read = hasher_read,
+    .unlocked_ioctl = hasher_ioctl,
+    .poll = hasher_poll,
+    .mmap = hasher_mmap,
     .open = hasher_open,
     .release = hasher_release,
 };
@@ -87,11 +329,47 @@ struct file_operations hasher_fops = {
 // Initialize the device and enable the interrups here.
 int hasher_open(struct inode *inode, struct file *filp)
 {
-    pr_info("hasher_DRIVER: Performing 'open' operation\n");
+    struct hasher_info *hasher;
+    struct hasher_file *file;
+    unsigned long flags;
+
+    mutex_lock(&hasher_devices_lock);
+    hasher = hasher_devices[MINOR(inode->i_rdev) - MINOR(hasher_devt)];
+    if (hasher)
+        kref_get(&hasher->ref);
+    mutex_unlock(&hasher_devices_lock);
+    if (!hasher)
+        return -ENODEV;
+
+    pr_info("hasher_DRIVER: Performing 'open' operation on hasher%d\n", hasher->index);
+    file = kzalloc(sizeof(*file), GFP_KERNEL);
+    if (!file || hasher_enter(hasher))
+    {
+        kref_put(&hasher->ref, hasher_free);
+        if (!file)
+            return -ENOMEM;
+        kfree(file);
+        return -ENODEV;
+    }
+    file->hasher = hasher;
+    mutex_init(&file->lock);
+    INIT_LIST_HEAD(&file->buffers);
+    // Entries appended before the file was opened are not for it.
+    if (hasher->ring)
+        file->ring_tail = READ_ONCE(hasher->ring->head);
+    filp->private_data = file;
+
+    spin_lock_irqsave(&hasher->job_lock, flags);
 #if DRIVER_WITH_INTERRUPT
-    iowrite32(0xFFFFFFFF, hasher_mem.baseAddr + sizeof(uint32_t) * REG_ENABLE_INTERRUPTS);
-    iowrite32(0x1, hasher_mem.baseAddr + sizeof(uint32_t) * REG_ISR);
+    // A stale interrupt is only acknowledged with nothing running: it could be the end
+    // of the job of another file.
+    iowrite32(0xFFFFFFFF, hasher->baseAddr + sizeof(uint32_t) * REG_ENABLE_INTERRUPTS);
+    if (!hasher->open_count && hasher_idle(hasher))
+        iowrite32(0x1, hasher->baseAddr + sizeof(uint32_t) * REG_ISR);
 #endif
+    hasher->open_count++;
+    spin_unlock_irqrestore(&hasher->job_lock, flags);
+    hasher_leave(hasher);
 
     mb();
     return 0;
@@ -100,85 +378,1223 @@ int hasher_open(struct inode *inode, struct file *filp)
 // Function that implements system call release() for our driver.
 // Used with close() or when the OS closes the descriptors held by
 // the process when it is closed (e.g., Ctrl-C).
-// Stop the interrupts and disable the device.
+// The last one out disables the interrupt, once nothing runs any more.
+// After removal the registers are gone and nothing finishes jobs any more: the buffers
+// are freed only if their jobs were over by then.
 int hasher_release(struct inode *inode, struct file *filed_mem)
 {
-    pr_info("hasher_DRIVER: Performing 'release' operation\n");
+    struct hasher_file *file = filed_mem->private_data;
+    struct hasher_info *hasher = file->hasher;
+    struct hasher_dma_buffer *buf, *tmp;
+    unsigned long flags;
+    int finished;
+
+    pr_info("hasher_DRIVER: Performing 'release' operation on hasher%d\n", hasher->index);
+
+    down_read(&hasher->remove_lock);
+    // The accelerator may still be writing into the buffers of this file: cancel its
+    // jobs, give them time to stop, and rather leak the buffers than free them under it.
+    if (hasher->dead)
+        finished = !file->last_job || hasher_job_finished(READ_ONCE(hasher->job_completed), file->last_job);
+    else
+    {
+        hasher_cancel(hasher, file, READ_ONCE(hasher->job_id), 1);
+        finished = !file->last_job || wait_event_timeout(hasher->wq, hasher_job_finished(READ_ONCE(hasher->job_completed), file->last_job), 10 * HZ);
+    }
+    if (!finished)
+        pr_err("hasher_DRIVER: Jobs still running at release, leaking their buffers.\n");
+    else
+        list_for_each_entry_safe(buf, tmp, &file->buffers, list)
+            hasher_free_buffer(hasher, buf);
+    kfree(file);
 
+    // Other files may still have jobs running or queued, which need their interrupt.
+    spin_lock_irqsave(&hasher->job_lock, flags);
+    if (!--hasher->open_count && !hasher->dead && hasher_idle(hasher))
+    {
 #if DRIVER_WITH_INTERRUPT
-    iowrite32(0, hasher_mem.baseAddr + sizeof(uint32_t) * REG_ENABLE_INTERRUPTS);
-    iowrite32(1, hasher_mem.baseAddr + sizeof(uint32_t) * REG_ISR);
+        iowrite32(0, hasher->baseAddr + sizeof(uint32_t) * REG_ENABLE_INTERRUPTS);
+        iowrite32(1, hasher->baseAddr + sizeof(uint32_t) * REG_ISR);
 #endif
+    }
+    spin_unlock_irqrestore(&hasher->job_lock, flags);
+    up_read(&hasher->remove_lock);
 
+    kref_put(&hasher->ref, hasher_free);
     mb();
     return 0;
 }
 
 
-// Function that implements system call read() for our driver.
-// Returns 1 uint32_t with the number of times the interrupt has been detected.
-ssize_t hasher_read(struct file *filed_mem, char __user *buf, size_t count, loff_t *f_pos)
+// Nonces the job is expected to try: a hash is valid with probability 2^-popcount(difficulty).
+static u64 hasher_expected_nonces(const struct user_message *message)
+{
+    u64 per_block = 1ull << hweight32(message->difficulty);
+
+    if (message->nonce_limit && message->nonce_limit < per_block)
+        per_block = message->nonce_limit;
+    return per_block * message->n_blocks;
+}
+
+// Delay before the watchdog looks at DONE for the running job.
+static u64 hasher_watchdog_period(const struct hasher_info *hasher)
+{
+    if (hasher->irq_lost)
+        return (u64)poll_us * NSEC_PER_USEC;
+    return max_t(u64, (u64)watchdog_ms * NSEC_PER_MSEC, 4 * hasher->expected_ns);
+}
+
+// True while userspace drives the registers, or its last job is still running.
+// Caller holds job_lock.
+static int hasher_direct_reserved(struct hasher_info *hasher)
+{
+    if (hasher->direct_busy && ioread32(hasher->baseAddr + DONE * sizeof(uint32_t)))
+        hasher->direct_busy = 0;
+    return hasher->direct_maps || hasher->direct_busy;
+}
+
+// Nothing running or queued, by the driver or through the register mapping.
+// Caller holds job_lock.
+static int hasher_idle(struct hasher_info *hasher)
+{
+    return !hasher->job_running && !hasher->queue_len && !hasher_direct_reserved(hasher);
+}
+
+// Points the accelerator to the ring while it is mapped, away from it otherwise. Only
+// between jobs: the FSM checks RING_ADDR for every block it writes back.
+// Caller holds job_lock.
+static void hasher_apply_ring(struct hasher_info *hasher)
+{
+    if (hasher->ring)
+        iowrite32(hasher->ring_maps ? (uint32_t)hasher->ring_dma : 0, hasher->baseAddr + RING_ADDR * sizeof(uint32_t));
+}
+
+// Programs the peripheral registers and starts the job.
+// Called with job_lock held, possibly from the interrupt handler: must not sleep.
+static void hasher_start(struct hasher_info *hasher, const struct hasher_job *job)
+{
+    const struct user_message *message = &job->message;
+
+    hasher_apply_ring(hasher);
+    iowrite32(message->block_address_base, hasher->baseAddr + BLOCK_ADDRESS * sizeof(uint32_t));
+    iowrite32(message->n_blocks, hasher->baseAddr + N_BLOCKS * sizeof(uint32_t));
+    iowrite32(message->difficulty, hasher->baseAddr + DIFFICULTY * sizeof(uint32_t));
+    iowrite32(message->result_address, hasher->baseAddr + RESULT_ADDRESS * sizeof(uint32_t));
+    iowrite32(message->start_nonce, hasher->baseAddr + START_NONCE * sizeof(uint32_t));
+    iowrite32(message->nonce_stride, hasher->baseAddr + NONCE_STRIDE * sizeof(uint32_t));
+    iowrite32(message->nonce_limit, hasher->baseAddr + NONCE_LIMIT * sizeof(uint32_t));
+#if DRIVER_WITH_INTERRUPT
+    iowrite32(0xFFFFFFFF, hasher->baseAddr + sizeof(uint32_t) * REG_ENABLE_INTERRUPTS);
+    iowrite32(0x1, hasher->baseAddr + sizeof(uint32_t) * REG_ISR);
+    mb();
+#endif
+
+    iowrite32(1, hasher->baseAddr + START * sizeof(uint32_t));
+    mb();
+    iowrite32(0, hasher->baseAddr + START * sizeof(uint32_t));
+    mb();
+    hasher->job_running = job->id;
+    hasher->running_job = *job;
+    hasher->start_ns = ktime_get_ns();
+    hasher->expected_ns = hasher_expected_nonces(message) * hasher->ps_per_nonce / 1000;
+    hrtimer_start(&hasher->watchdog, ns_to_ktime(hasher_watchdog_period(hasher)), HRTIMER_MODE_REL);
+    trace_hasher_start(hasher->index, job->id, message->n_blocks);
+}
+
+static void hasher_hist_add(u64 *hist, u64 ns)
+{
+    int b = ns ? ilog2(ns) : 0;
+
+    hist[min(b, HASHER_HIST_BUCKETS - 1)]++;
+}
+
+static u64 hasher_read_counter(struct hasher_info *hasher, unsigned int index)
+{
+    u64 lo = ioread32(hasher->baseAddr + index * sizeof(uint32_t));
+
+    return lo | (u64)ioread32(hasher->baseAddr + (index + 1) * sizeof(uint32_t)) << 32;
+}
+
+static void hasher_read_layout(struct hasher_info *hasher)
+{
+    uint32_t layout = ioread32(hasher->baseAddr + HASHER_PERF_REG_LAYOUT * sizeof(uint32_t));
+
+    hasher->perf.clusters = min_t(uint32_t, layout & 0xFF, HASHER_PERF_MAX_CLUSTERS);
+    hasher->perf.hashers = (layout >> 8) & 0xFF;
+}
+
+// The counters hold still from DONE to the next START: read them before starting the
+// next job. Called with job_lock held.
+static void hasher_read_perf(struct hasher_info *hasher)
+{
+    struct hasher_perf *perf = &hasher->perf;
+    uint32_t c;
+
+    perf->job_cycles = hasher_read_counter(hasher, HASHER_PERF_REG_JOB_CYCLES);
+    perf->fetch_cycles = hasher_read_counter(hasher, HASHER_PERF_REG_FETCH_CYCLES);
+    perf->writeback_cycles = hasher_read_counter(hasher, HASHER_PERF_REG_WRITEBACK_CYCLES);
+    hasher->stats.hw_job_cycles += perf->job_cycles;
+    hasher->stats.hw_fetch_cycles += perf->fetch_cycles;
+    hasher->stats.hw_writeback_cycles += perf->writeback_cycles;
+    for (c = 0; c < perf->clusters; ++c)
+    {
+        perf->hashes[c] = hasher_read_counter(hasher, HASHER_PERF_REG_CLUSTERS + 4 * c);
+        perf->idle_cycles[c] = hasher_read_counter(hasher, HASHER_PERF_REG_CLUSTERS + 4 * c + 2);
+        hasher->stats.hw_hashes += perf->hashes[c];
+        hasher->stats.hw_idle_cycles += perf->idle_cycles[c];
+    }
+}
+
+// Accounts for the job that just finished. Called with job_lock held.
+static void hasher_account_done(struct hasher_info *hasher, const struct hasher_job *job, u64 now)
+{
+    uint32_t solved = 0;
+    u64 nonces = 0;
+    u64 tried;
+    uint32_t i;
+
+    if (hasher->has_perf && perf_counters)
+        hasher_read_perf(hasher);
+
+    // The accelerator wrote around the caches: drop the stale lines before reading.
+    // This also serves the cacheable mapping of the owner of the buffer.
+    if (job->results && job->cached)
+        dma_sync_single_for_cpu(hasher->dev, job->message.result_address,
+                                HASHER_RESULT_BYTES * job->message.n_blocks, DMA_FROM_DEVICE);
+    if (job->results)
+        for (i = 0; i < job->message.n_blocks; ++i)
+        {
+            const uint32_t *record = job->results + i * (HASHER_RESULT_BYTES / sizeof(uint32_t));
+
+            nonces += READ_ONCE(record[RESULT_NONCES]);
+            solved += READ_ONCE(record[RESULT_STATUS]) == 1;
+        }
+    hasher->stats.jobs_completed++;
+    hasher->stats.blocks_solved += solved;
+    hasher->stats.nonces += nonces;
+
+    // Speed estimate for the next jobs, on the expected nonces when the real ones are unknown.
+    tried = job->results ? nonces : hasher_expected_nonces(&job->message);
+    if (tried && !hasher->stopping)
+    {
+        u64 ps = div64_u64((now - hasher->start_ns) * 1000, tried);
+
+        hasher->ps_per_nonce = hasher->ps_per_nonce ? (3 * hasher->ps_per_nonce + ps) / 4 : ps;
+    }
+    hasher_hist_add(hasher->stats.submit_to_irq, now - job->submit_ns);
+    trace_hasher_job_done(hasher->index, job->id, solved, nonces, now - job->submit_ns);
+}
+
+// If DONE is set, the running job is done: start the next queued one straight away,
+// then wake up read() and poll() for the finished one.
+// Called by the interrupt handler, the watchdog and whoever polls DONE. DONE is read
+// under job_lock, so that they never finish the same job twice. Returns 1 if a job finished.
+static int hasher_job_done(struct hasher_info *hasher)
+{
+    unsigned long flags;
+    u64 now;
+    int done = 0;
+
+    spin_lock_irqsave(&hasher->job_lock, flags);
+    if (hasher->job_running && ioread32(hasher->baseAddr + DONE * sizeof(uint32_t)))
+    {
+        now = ktime_get_ns();
+        done = 1;
+        hasher_account_done(hasher, &hasher->running_job, now);
+        hasher->completed_ns = now;
+        hasher->job_completed = hasher->job_running;
+        hasher->job_running = 0;
+        hasher->job_done = 1;
+        if (hasher->stopping)
+        {
+            // STOP must be low again before the next START.
+            iowrite32(0, hasher->baseAddr + STOP * sizeof(uint32_t));
+            hasher->stopping = 0;
+        }
+        // Cancelled jobs finish without running.
+        while (hasher->queue_len && hasher->job_queue[hasher->queue_head].cancelled)
+        {
+            hasher->job_completed = hasher->job_queue[hasher->queue_head].id;
+            hasher->queue_head = (hasher->queue_head + 1) % JOB_QUEUE_DEPTH;
+            hasher->queue_len--;
+        }
+        if (hasher->queue_len)
+        {
+            hasher_start(hasher, &hasher->job_queue[hasher->queue_head]);
+            hasher->queue_head = (hasher->queue_head + 1) % JOB_QUEUE_DEPTH;
+            hasher->queue_len--;
+        }
+        else
+            hrtimer_try_to_cancel(&hasher->watchdog);
+    }
+    spin_unlock_irqrestore(&hasher->job_lock, flags);
+    if (done)
+        wake_up_interruptible(&hasher->wq);
+    return done;
+}
+
+// Checks the DONE register, so that nobody waits for a late or lost interrupt.
+static void hasher_check_done(struct hasher_info *hasher)
+{
+    if (READ_ONCE(hasher->job_running))
+        hasher_job_done(hasher);
+}
+
+// Runs when the running job takes longer than expected. DONE set means that its interrupt
+// was lost: finish the job, and poll DONE from now on. Otherwise the job is just long.
+static enum hrtimer_restart hasher_watchdog(struct hrtimer *timer)
+{
+    struct hasher_info *hasher = container_of(timer, struct hasher_info, watchdog);
+    unsigned long flags;
+    int lost = !READ_ONCE(hasher->irq_lost);
+
+    if (!READ_ONCE(hasher->job_running))
+        return HRTIMER_NORESTART;
+    if (lost)
+        WRITE_ONCE(hasher->irq_lost, 1);
+    // The next job, if any, restarts the timer with the polling period.
+    if (hasher_job_done(hasher))
+    {
+        spin_lock_irqsave(&hasher->job_lock, flags);
+        hasher->stats.missed_irqs++;
+        spin_unlock_irqrestore(&hasher->job_lock, flags);
+        if (lost)
+            pr_warn("hasher_DRIVER: hasher%d finished a job without interrupt, polling DONE every %u us from now on.\n",
+                    hasher->index, poll_us);
+        return HRTIMER_NORESTART;
+    }
+    if (lost)
+        WRITE_ONCE(hasher->irq_lost, 0);
+    hrtimer_forward_now(timer, ns_to_ktime(hasher_watchdog_period(hasher)));
+    return HRTIMER_RESTART;
+}
+
+// Busy-waits on DONE when the running job is expected to finish within spin_us, as the
+// interrupt and the wakeup would take longer than the job. Gives up after twice the
+// expected time. Returns 1 if job id finished meanwhile.
+static int hasher_spin(struct hasher_info *hasher, uint32_t id)
+{
+    unsigned long flags;
+    u64 expected, deadline;
+
+    // Queued jobs have no estimate: their wait includes the jobs ahead of them.
+    spin_lock_irqsave(&hasher->job_lock, flags);
+    expected = hasher->job_running == id ? hasher->expected_ns : 0;
+    spin_unlock_irqrestore(&hasher->job_lock, flags);
+    if (!expected || expected > (u64)spin_us * NSEC_PER_USEC)
+        return 0;
+
+    deadline = ktime_get_ns() + min_t(u64, 2 * expected, (u64)spin_us * NSEC_PER_USEC);
+    do
+    {
+        hasher_check_done(hasher);
+        if (hasher_job_finished(READ_ONCE(hasher->job_completed), id))
+        {
+            spin_lock_irqsave(&hasher->job_lock, flags);
+            hasher->stats.spun++;
+            spin_unlock_irqrestore(&hasher->job_lock, flags);
+            return 1;
+        }
+        cpu_relax();
+    } while (ktime_get_ns() < deadline);
+    return 0;
+}
+
+// Starts the job, or queues it behind the running one.
+// results are the result records of the job in a driver buffer, NULL if unknown,
+// cached if that buffer is HASHER_BUFFER_CACHED.
+// Returns the job id, -EBUSY when the queue is full or -ENODEV once removed.
+static long hasher_submit(struct hasher_info *hasher, struct hasher_file *owner,
+                          const struct user_message *message, const uint32_t *results, int cached)
+{
+    unsigned long flags;
+    struct hasher_job job;
+
+    spin_lock_irqsave(&hasher->job_lock, flags);
+    if (hasher->dead)
+    {
+        spin_unlock_irqrestore(&hasher->job_lock, flags);
+        return -ENODEV;
+    }
+    if (hasher->queue_len == JOB_QUEUE_DEPTH || hasher_direct_reserved(hasher))
+    {
+        spin_unlock_irqrestore(&hasher->job_lock, flags);
+        return -EBUSY;
+    }
+    // Ids stay positive, they are returned by ioctl().
+    hasher->job_id = (hasher->job_id + 1) & 0x7FFFFFFF;
+    if (!hasher->job_id)
+        hasher->job_id = 1;
+    job.id = hasher->job_id;
+    job.message = *message;
+    job.submit_ns = ktime_get_ns();
+    job.results = results;
+    job.cached = cached;
+    job.owner = owner;
+    job.cancelled = 0;
+    hasher->stats.jobs_submitted++;
+    trace_hasher_submit(hasher->index, job.id, message->n_blocks, message->difficulty, hasher->queue_len);
+    if (hasher->job_running)
+        hasher->job_queue[(hasher->queue_head + hasher->queue_len++) % JOB_QUEUE_DEPTH] = job;
+    else
+        hasher_start(hasher, &job);
+    spin_unlock_irqrestore(&hasher->job_lock, flags);
+    return job.id;
+}
+
+// Cancels the jobs of owner up to id, or only job id unless up_to. Queued ones are
+// dropped, the running one is stopped: the FSM collects what the clusters found and
+// raises DONE within a few hundred cycles, see README.md. Returns the jobs cancelled.
+static int hasher_cancel(struct hasher_info *hasher, struct hasher_file *owner, uint32_t id, int up_to)
+{
+    struct hasher_job *job;
+    unsigned long flags;
+    unsigned int i;
+    int n = 0;
+
+    spin_lock_irqsave(&hasher->job_lock, flags);
+    for (i = 0; i < hasher->queue_len; ++i)
+    {
+        job = &hasher->job_queue[(hasher->queue_head + i) % JOB_QUEUE_DEPTH];
+        if (job->owner == owner && !job->cancelled && (up_to ? hasher_job_finished(id, job->id) : job->id == id))
+        {
+            job->cancelled = 1;
+            n++;
+        }
+    }
+    job = &hasher->running_job;
+    if (hasher->job_running && !hasher->stopping && job->owner == owner &&
+        (up_to ? hasher_job_finished(id, job->id) : job->id == id))
+    {
+        iowrite32(1, hasher->baseAddr + STOP * sizeof(uint32_t));
+        hasher->stopping = 1;
+        n++;
+    }
+    hasher->stats.jobs_cancelled += n;
+    spin_unlock_irqrestore(&hasher->job_lock, flags);
+    return n;
+}
+
+// Submits the job and sleeps until it is finished, or the instance is removed.
+// True if [offset, offset + bytes) lies in the buffer, 8-byte aligned for the accelerator.
+static int hasher_buffer_range(const struct hasher_dma_buffer *buf, uint32_t offset, uint64_t bytes)
+{
+    return !(offset & 7) && offset + bytes <= buf->size;
+}
+
+// True if the blocks and the records of the job lie in the buffer.
+static int hasher_buffer_fits(const struct hasher_dma_buffer *buf, const struct hasher_buffer_job *job)
+{
+    return hasher_buffer_range(buf, job->blocks_offset, 64ull * job->n_blocks) &&
+           hasher_buffer_range(buf, job->results_offset, (uint64_t)HASHER_RESULT_BYTES * job->n_blocks);
+}
+
+// Turns a job checked against buf into a message with bus addresses and queues it.
+// Caller holds file->lock.
+static long hasher_queue_buffer_job(struct hasher_file *file, struct hasher_dma_buffer *buf,
+                                    const struct hasher_buffer_job *job)
 {
     struct user_message message;
-    uint32_t status;
+    uint32_t *results;
+    uint32_t i;
+    long id;
 
-    if (count < sizeof(struct user_message))
+    message.block_address_base = (uint32_t)buf->dma + job->blocks_offset;
+    message.n_blocks = job->n_blocks;
+    message.difficulty = job->difficulty;
+    message.result_address = (uint32_t)buf->dma + job->results_offset;
+    message.start_nonce = job->start_nonce;
+    message.nonce_stride = job->nonce_stride;
+    message.nonce_limit = job->nonce_limit;
+    // Blocks that a cancelled job never started keep status 0.
+    results = (uint32_t *)((uint8_t *)buf->virt + job->results_offset);
+    for (i = 0; i < job->n_blocks; ++i)
+        results[i * (HASHER_RESULT_BYTES / sizeof(uint32_t)) + RESULT_STATUS] = 0;
+    // Write back the blocks filled by userspace and the statuses above, and make sure
+    // no dirty line of the records gets evicted over what the accelerator writes.
+    if (buf->cached)
     {
-        pr_err("hasher_DRIVER: USer buffer too small (> %d bytes).\n", sizeof(struct user_message));
+        dma_sync_single_for_device(file->hasher->dev, buf->dma + job->blocks_offset,
+                                   64 * job->n_blocks, DMA_TO_DEVICE);
+        dma_sync_single_for_device(file->hasher->dev, buf->dma + job->results_offset,
+                                   HASHER_RESULT_BYTES * job->n_blocks, DMA_BIDIRECTIONAL);
+    }
+    id = hasher_submit(file->hasher, file, &message, results, buf->cached);
+    if (id > 0)
+    {
+        buf->last_job = id;
+        file->last_job = id;
+    }
+    return id;
+}
+
+// Checks the job against the buffer and queues it.
+static long hasher_submit_buffer(struct hasher_file *file, const struct hasher_buffer_job *job)
+{
+    struct hasher_dma_buffer *buf;
+    long id = -EINVAL;
+
+    if (job->n_blocks > HASHER_MAX_BLOCKS)
+        return -EINVAL;
+
+    mutex_lock(&file->lock);
+    buf = hasher_find_buffer(file, job->handle);
+    if (buf && hasher_buffer_fits(buf, job))
+        id = hasher_queue_buffer_job(file, buf, job);
+    mutex_unlock(&file->lock);
+    return id;
+}
+
+// Finds the buffer of the file that holds both the blocks and the records of a job
+// given with bus addresses, and fills job with its offsets in it. Caller holds file->lock.
+static struct hasher_dma_buffer *hasher_buffer_of_message(struct hasher_file *file,
+                                                          const struct user_message *message,
+                                                          struct hasher_buffer_job *job)
+{
+    struct hasher_dma_buffer *buf;
+
+    job->n_blocks = message->n_blocks;
+    job->difficulty = message->difficulty;
+    job->start_nonce = message->start_nonce;
+    job->nonce_stride = message->nonce_stride;
+    job->nonce_limit = message->nonce_limit;
+    list_for_each_entry(buf, &file->buffers, list)
+    {
+        // Addresses below the buffer wrap around to offsets past its end.
+        job->handle = buf->handle;
+        job->blocks_offset = message->block_address_base - (uint32_t)buf->dma;
+        job->results_offset = message->result_address - (uint32_t)buf->dma;
+        if (hasher_buffer_fits(buf, job))
+            return buf;
+    }
+    return NULL;
+}
+
+static ssize_t hasher_do_read(struct hasher_file *file, const char __user *buf, size_t count)
+{
+    struct hasher_info *hasher = file->hasher;
+    struct user_message message;
+    struct hasher_buffer_job job;
+    struct hasher_dma_buffer *dma_buf;
+    unsigned long flags;
+    long id;
+    uint32_t seen;
+    unsigned int early = 0;     // wakeups before the end of our job
+    u64 now;
+
+    if (count < USER_MESSAGE_MIN_SIZE)
+    {
+        pr_err("hasher_DRIVER: USer buffer too small (> %d bytes).\n", USER_MESSAGE_MIN_SIZE);
         return -1;
     }
 
+    // Older applications only pass the first four fields: search every nonce from 0.
+    message.start_nonce = 0;
+    message.nonce_stride = 1;
+    message.nonce_limit = 0;
+
     // Copy the information from user-space to the kernel-space buffer.
-    if (raw_copy_from_user(&message, buf, sizeof(struct user_message)))
+    if (raw_copy_from_user(&message, buf, min(count, sizeof(struct user_message))))
     {
         pr_err("hasher_DRIVER: Raw copy from user buffer failed.\n");
         return -1;
     }
 
-    // Program the peripheral registers.
-    iowrite32(message.block_address_base, hasher_mem.baseAddr + BLOCK_ADDRESS * sizeof(uint32_t));
-    iowrite32(message.n_blocks, hasher_mem.baseAddr + N_BLOCKS * sizeof(uint32_t));
-    iowrite32(message.difficulty, hasher_mem.baseAddr + DIFFICULTY * sizeof(uint32_t));
-    iowrite32(message.result_address, hasher_mem.baseAddr + RESULT_ADDRESS * sizeof(uint32_t));
-#if DRIVER_WITH_INTERRUPT
-    iowrite32(0xFFFFFFFF, hasher_mem.baseAddr + sizeof(uint32_t) * REG_ENABLE_INTERRUPTS);
-    iowrite32(0x1, hasher_mem.baseAddr + sizeof(uint32_t) * REG_ISR);
-    mb();
-    flag = 0;
-#endif
+    // Jobs on the buffers of the file are checked and accounted as HASHER_IOC_SUBMIT_BUF
+    // ones. Other addresses go to the accelerator unchecked: only with raw_addresses=1.
+    mutex_lock(&file->lock);
+    dma_buf = hasher_buffer_of_message(file, &message, &job);
+    if (dma_buf)
+        id = hasher_queue_buffer_job(file, dma_buf, &job);
+    else if (raw_addresses)
+        id = hasher_submit(hasher, file, &message, NULL, 0);
+    else
+        id = -EPERM;
+    mutex_unlock(&file->lock);
+    if (id < 0)
+    {
+        if (id == -EBUSY)
+            pr_err("hasher_DRIVER: Job queue full.\n");
+        return id;
+    }
 
-    iowrite32(1, hasher_mem.baseAddr + START * sizeof(uint32_t));
-    mb();
-    iowrite32(0, hasher_mem.baseAddr + START * sizeof(uint32_t));
-    mb();
-    pr_info("hasher_DRIVER: Starting accel...\n");
+    // Short jobs are over before an interrupt could wake us up: wait for them here.
+    hasher_spin(hasher, id);
 
-    // Sleep the thread until the peripheral generates an interrupt
+    // Sleep the thread until the peripheral generates an interrupt, or the watchdog finds
+    // the job done.
     // wait_event_interruptible may exit when a signal is received, so
-    // we check our flag to ensure that it was our own interrupt handler
+    // we check the job state to ensure that it was our own interrupt handler
     // waking up us after the interrupt is received, and not an
     // spurious signal.
     // When we go to sleep, the processor is free for other tasks.
-#if DRIVER_WITH_INTERRUPT
-    // printk("Val: %x\n", ioread32(hasher_mem.baseAddr + sizeof(uint32_t) * REG_ENABLE_INTERRUPTS));
-    while (wait_event_interruptible(wq, flag != 0))
+    // We are woken up at the end of every job, the statistics count those that are
+    // not ours as spurious.
+    seen = READ_ONCE(hasher->job_completed);
+    while (!hasher_job_finished(seen, id))
+    {
+        if (wait_event_interruptible(hasher->wq, READ_ONCE(hasher->job_completed) != seen || READ_ONCE(hasher->dead)))
+        {
+            printk(KERN_ALERT "hasher_DRIVER: AWOKEN BY ANOTHER SIGNAL\n");
+            // Nobody waits for the results any more: stop the job rather than let it run on.
+            hasher_cancel(hasher, file, id, 0);
+            spin_lock_irqsave(&hasher->job_lock, flags);
+            hasher->stats.spurious_wakeups += early + 1;
+            spin_unlock_irqrestore(&hasher->job_lock, flags);
+            return -EINTR;
+        }
+        seen = READ_ONCE(hasher->job_completed);
+        early += !hasher_job_finished(seen, id);
+        // pl_accel_remove() cancelled it and waits for us.
+        if (READ_ONCE(hasher->dead) && !hasher_job_finished(seen, id))
+            return -ENODEV;
+    }
+
+    // The caller of read() gets its results here: nothing left to reap,
+    // unless other jobs finished after this one.
+    now = ktime_get_ns();
+    spin_lock_irqsave(&hasher->job_lock, flags);
+    hasher->stats.spurious_wakeups += early;
+    if (hasher->job_completed == id)
+    {
+        hasher->job_done = 0;
+        hasher_hist_add(hasher->stats.irq_to_wakeup, now - hasher->completed_ns);
+        trace_hasher_wakeup(hasher->index, id, now - hasher->completed_ns);
+    }
+    spin_unlock_irqrestore(&hasher->job_lock, flags);
+    return 0;
+}
+
+// Function that implements system call read() for our driver.
+ssize_t hasher_read(struct file *filed_mem, char __user *buf, size_t count, loff_t *f_pos)
+{
+    struct hasher_file *file = filed_mem->private_data;
+    ssize_t ret = hasher_enter(file->hasher);
+
+    if (ret)
+        return ret;
+    ret = hasher_do_read(file, buf, count);
+    hasher_leave(file->hasher);
+    return ret;
+}
+
+// Allocates a DMA buffer for the file.
+static long hasher_alloc_buffer(struct hasher_file *file, struct hasher_buffer __user *arg)
+{
+    struct hasher_buffer req;
+    struct hasher_dma_buffer *buf;
+    uint32_t handle;
+
+    if (copy_from_user(&req, arg, sizeof(req)))
+        return -EFAULT;
+    if (!req.size || req.size > HASHER_BUFFER_MAX_SIZE || (req.flags & ~HASHER_BUFFER_CACHED))
+        return -EINVAL;
+
+    buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+    buf->size = PAGE_ALIGN(req.size);
+    buf->cached = req.flags & HASHER_BUFFER_CACHED;
+    if (buf->cached)
+    {
+        // mmap() needs the pages: dma_alloc_noncoherent() may return an address outside
+        // the linear map (IOMMU remapping, DMA pools), where virt_to_page() is wrong.
+        buf->pages = dma_alloc_pages(file->hasher->dev, buf->size, &buf->dma, DMA_BIDIRECTIONAL, GFP_KERNEL);
+        buf->virt = buf->pages ? page_address(buf->pages) : NULL;
+    }
+    else
+        buf->virt = dma_alloc_coherent(file->hasher->dev, buf->size, &buf->dma, GFP_KERNEL);
+    if (!buf->virt)
+    {
+        kfree(buf);
+        return -ENOMEM;
+    }
+
+    mutex_lock(&file->lock);
+    // Handle 0 is the ring's mmap() offset.
+    for (handle = 1; handle <= HASHER_MAX_BUFFERS && hasher_find_buffer(file, handle); ++handle)
+        ;
+    buf->handle = handle;
+    list_add(&buf->list, &file->buffers);
+    if (handle > HASHER_MAX_BUFFERS)
     {
-        printk(KERN_ALERT "hasher_DRIVER: AWOKEN BY ANOTHER SIGNAL\n");
+        hasher_free_buffer(file->hasher, buf);
+        mutex_unlock(&file->lock);
+        return -ENOSPC;
+    }
+
+    req.size = buf->size;
+    req.handle = handle;
+    req.mmap_offset = (uint64_t)handle << HASHER_BUFFER_SHIFT;
+    req.phys = (uint32_t)buf->dma;
+    if (copy_to_user(arg, &req, sizeof(req)))
+    {
+        hasher_free_buffer(file->hasher, buf);
+        mutex_unlock(&file->lock);
+        return -EFAULT;
+    }
+    mutex_unlock(&file->lock);
+    return 0;
+}
+
+static long hasher_release_buffer(struct hasher_file *file, uint32_t handle)
+{
+    struct hasher_dma_buffer *buf;
+    long ret = 0;
+
+    mutex_lock(&file->lock);
+    buf = hasher_find_buffer(file, handle);
+    if (!buf)
+        ret = -EINVAL;
+    else if (buf->map_count || (buf->last_job && !hasher_job_finished(READ_ONCE(file->hasher->job_completed), buf->last_job)))
+        ret = -EBUSY;
+    else
+        hasher_free_buffer(file->hasher, buf);
+    mutex_unlock(&file->lock);
+    return ret;
+}
+
+// Cache maintenance on a range of a buffer, for the jobs the driver does not see
+// (started through the register mapping).
+static long hasher_sync_buffer(struct hasher_file *file, const struct hasher_sync *sync)
+{
+    struct hasher_dma_buffer *buf;
+    long ret = 0;
+
+    mutex_lock(&file->lock);
+    buf = hasher_find_buffer(file, sync->handle);
+    if (!buf || sync->offset + (uint64_t)sync->size > buf->size)
+        ret = -EINVAL;
+    else if (!buf->cached || !sync->size)
+        ;
+    else if (sync->direction == HASHER_SYNC_FOR_DEVICE)
+        dma_sync_single_for_device(file->hasher->dev, buf->dma + sync->offset, sync->size, DMA_BIDIRECTIONAL);
+    else if (sync->direction == HASHER_SYNC_FOR_CPU)
+        dma_sync_single_for_cpu(file->hasher->dev, buf->dma + sync->offset, sync->size, DMA_FROM_DEVICE);
+    else
+        ret = -EINVAL;
+    mutex_unlock(&file->lock);
+    return ret;
+}
+
+// Signals the eventfd on every interrupt of the instance, for the owner of the
+// register mapping to sleep on. fd -1 stops it.
+static long hasher_set_eventfd(struct hasher_file *file, int32_t fd)
+{
+    struct hasher_info *hasher = file->hasher;
+    struct eventfd_ctx *event = NULL, *old;
+    unsigned long flags;
+
+    if (fd >= 0)
+    {
+        event = eventfd_ctx_fdget(fd);
+        if (IS_ERR(event))
+            return PTR_ERR(event);
+    }
+    spin_lock_irqsave(&hasher->job_lock, flags);
+    if (!hasher->direct_maps || hasher->direct_owner != file)
+    {
+        spin_unlock_irqrestore(&hasher->job_lock, flags);
+        if (event)
+            eventfd_ctx_put(event);
+        return -EPERM;
+    }
+    old = hasher->direct_event;
+    hasher->direct_event = event;
+    spin_unlock_irqrestore(&hasher->job_lock, flags);
+    if (old)
+        eventfd_ctx_put(old);
+    return 0;
+}
+
+// Asynchronous submit and completion query, see hasher_ioctl.h.
+static long hasher_do_ioctl(struct hasher_file *file, unsigned int cmd, unsigned long arg)
+{
+    struct hasher_info *hasher = file->hasher;
+    struct hasher_buffer_job job;
+    uint32_t handle;
+    struct hasher_completion completion;
+    unsigned long flags;
+    uint32_t every;
+    uint32_t tail;
+    struct hasher_sync sync;
+    struct hasher_perf perf;
+    uint32_t id;
+    int32_t fd;
+
+    switch (cmd)
+    {
+    case HASHER_IOC_COMPLETE:
+        hasher_check_done(hasher);
+        spin_lock_irqsave(&hasher->job_lock, flags);
+        completion.job_id = hasher->job_id;
+        completion.done = !hasher->job_running;
+        completion.completed = hasher->job_completed;
+        completion.queued = hasher->queue_len;
+        hasher->job_done = 0;
+        spin_unlock_irqrestore(&hasher->job_lock, flags);
+        if (copy_to_user((void __user *)arg, &completion, sizeof(completion)))
+            return -EFAULT;
+        return 0;
+
+    case HASHER_IOC_ALLOC:
+        return hasher_alloc_buffer(file, (struct hasher_buffer __user *)arg);
+
+    case HASHER_IOC_FREE:
+        if (get_user(handle, (uint32_t __user *)arg))
+            return -EFAULT;
+        return hasher_release_buffer(file, handle);
+
+    case HASHER_IOC_SUBMIT_BUF:
+        if (copy_from_user(&job, (void __user *)arg, sizeof(job)))
+            return -EFAULT;
+        return hasher_submit_buffer(file, &job);
+
+    case HASHER_IOC_RING_IRQ:
+        if (!hasher->ring)
+            return -ENODEV;
+        if (get_user(every, (uint32_t __user *)arg))
+            return -EFAULT;
+        iowrite32(every, hasher->baseAddr + RING_IRQ_EVERY * sizeof(uint32_t));
+        return 0;
+
+    case HASHER_IOC_RING_TAIL:
+        if (!hasher->ring)
+            return -ENODEV;
+        if (get_user(tail, (uint32_t __user *)arg))
+            return -EFAULT;
+        WRITE_ONCE(file->ring_tail, tail);
         return 0;
+
+    case HASHER_IOC_CANCEL:
+        if (get_user(id, (uint32_t __user *)arg))
+            return -EFAULT;
+        return hasher_cancel(hasher, file, id ? id : READ_ONCE(hasher->job_id), 1);
+
+    case HASHER_IOC_EVENTFD:
+        if (get_user(fd, (int32_t __user *)arg))
+            return -EFAULT;
+        return hasher_set_eventfd(file, fd);
+
+    case HASHER_IOC_SYNC:
+        if (copy_from_user(&sync, (void __user *)arg, sizeof(sync)))
+            return -EFAULT;
+        return hasher_sync_buffer(file, &sync);
+
+    case HASHER_IOC_PERF:
+        if (!hasher->has_perf || !perf_counters)
+            return -ENODEV;
+        spin_lock_irqsave(&hasher->job_lock, flags);
+        perf = hasher->perf;
+        spin_unlock_irqrestore(&hasher->job_lock, flags);
+        if (copy_to_user((void __user *)arg, &perf, sizeof(perf)))
+            return -EFAULT;
+        return 0;
+
+    default:
+        return -ENOTTY;
     }
-    pr_info("hasher_DRIVER: AWOKEN FROM INTERRUPT\n");
+}
+
+// Function that implements system call ioctl() for our driver.
+long hasher_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct hasher_file *file = filp->private_data;
+    long ret = hasher_enter(file->hasher);
+
+    if (ret)
+        return ret;
+    ret = hasher_do_ioctl(file, cmd, arg);
+    hasher_leave(file->hasher);
+    return ret;
+}
+
+// Function that implements system calls poll()/select()/epoll for our driver.
+// Readable when a job finished since the last HASHER_IOC_COMPLETE, writable while
+// the queue has room, and an error once the instance is removed.
+// Without the interrupt nothing wakes the waiters: poll with a timeout.
+__poll_t hasher_poll(struct file *filp, poll_table *wait)
+{
+    struct hasher_file *file = filp->private_data;
+    struct hasher_info *hasher = file->hasher;
+    __poll_t mask = 0;
+    unsigned long flags;
+
+    poll_wait(filp, &hasher->wq, wait);
+    if (hasher_enter(hasher))
+        return EPOLLERR | EPOLLHUP;
+    hasher_check_done(hasher);
+    spin_lock_irqsave(&hasher->job_lock, flags);
+    if (hasher->job_done)
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (hasher->queue_len < JOB_QUEUE_DEPTH)
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    spin_unlock_irqrestore(&hasher->job_lock, flags);
+    if (hasher->ring && READ_ONCE(hasher->ring->head) != READ_ONCE(file->ring_tail))
+        mask |= EPOLLPRI;
+    hasher_leave(hasher);
+    return mask;
+}
+
+static void hasher_vma_open(struct vm_area_struct *vma)
+{
+    struct hasher_file *file = vma->vm_file->private_data;
+    struct hasher_dma_buffer *buf = vma->vm_private_data;
+
+    mutex_lock(&file->lock);
+    buf->map_count++;
+    mutex_unlock(&file->lock);
+}
+
+static void hasher_vma_close(struct vm_area_struct *vma)
+{
+    struct hasher_file *file = vma->vm_file->private_data;
+    struct hasher_dma_buffer *buf = vma->vm_private_data;
 
-    // Disable interrupts.
-    // iowrite32(0, hasher_mem.baseAddr + sizeof(uint32_t) * REG_ENABLE_INTERRUPTS);
+    mutex_lock(&file->lock);
+    buf->map_count--;
+    mutex_unlock(&file->lock);
+}
+
+// Keeps HASHER_IOC_FREE from freeing a mapped buffer.
+static const struct vm_operations_struct hasher_vm_ops = {
+    .open = hasher_vma_open,
+    .close = hasher_vma_close,
+};
+
+// Counts the mappings of the ring, see hasher_apply_ring(). Idle, the accelerator is
+// pointed to it or away from it at once, else by the next job of the driver.
+// Caller holds remove_lock.
+static void hasher_ring_map(struct hasher_info *hasher, int delta)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&hasher->job_lock, flags);
+    hasher->ring_maps += delta;
+    if (!hasher->dead && !hasher->job_running && !hasher_direct_reserved(hasher))
+        hasher_apply_ring(hasher);
+    spin_unlock_irqrestore(&hasher->job_lock, flags);
+}
+
+static void hasher_ring_vma_open(struct vm_area_struct *vma)
+{
+    struct hasher_info *hasher = ((struct hasher_file *)vma->vm_file->private_data)->hasher;
+
+    down_read(&hasher->remove_lock);
+    hasher_ring_map(hasher, 1);
+    up_read(&hasher->remove_lock);
+}
+
+static void hasher_ring_vma_close(struct vm_area_struct *vma)
+{
+    struct hasher_info *hasher = ((struct hasher_file *)vma->vm_file->private_data)->hasher;
+
+    down_read(&hasher->remove_lock);
+    hasher_ring_map(hasher, -1);
+    up_read(&hasher->remove_lock);
+}
+
+static const struct vm_operations_struct hasher_ring_vm_ops = {
+    .open = hasher_ring_vma_open,
+    .close = hasher_ring_vma_close,
+};
+
+static void hasher_regs_vma_open(struct vm_area_struct *vma)
+{
+    struct hasher_info *hasher = ((struct hasher_file *)vma->vm_file->private_data)->hasher;
+    unsigned long flags;
+
+    spin_lock_irqsave(&hasher->job_lock, flags);
+    hasher->direct_maps++;
+    spin_unlock_irqrestore(&hasher->job_lock, flags);
+}
+
+// Gives the instance back to the driver with the last mapping of its registers.
+// Caller holds remove_lock.
+static void hasher_put_regs(struct hasher_info *hasher)
+{
+    struct eventfd_ctx *event = NULL;
+    unsigned long flags;
+
+    spin_lock_irqsave(&hasher->job_lock, flags);
+    if (!--hasher->direct_maps)
+    {
+        hasher->direct_owner = NULL;
+        event = hasher->direct_event;
+        hasher->direct_event = NULL;
+        hasher->direct_busy = !hasher->dead && !ioread32(hasher->baseAddr + DONE * sizeof(uint32_t));
+    }
+    spin_unlock_irqrestore(&hasher->job_lock, flags);
+    if (event)
+        eventfd_ctx_put(event);
+}
+
+static void hasher_regs_vma_close(struct vm_area_struct *vma)
+{
+    struct hasher_info *hasher = ((struct hasher_file *)vma->vm_file->private_data)->hasher;
+
+    down_read(&hasher->remove_lock);
+    hasher_put_regs(hasher);
+    up_read(&hasher->remove_lock);
+}
+
+static const struct vm_operations_struct hasher_regs_vm_ops = {
+    .open = hasher_regs_vma_open,
+    .close = hasher_regs_vma_close,
+};
+
+// Maps the register page, uncached, for jobs started without syscalls. Only one
+// file at a time, and only while the driver has no job of its own.
+static int hasher_mmap_regs(struct hasher_file *file, struct vm_area_struct *vma)
+{
+    struct hasher_info *hasher = file->hasher;
+    unsigned long flags;
+    int ret;
+
+    if (!direct_access || !hasher->regs_phys)
+        return -EPERM;
+    if (vma->vm_end - vma->vm_start != PAGE_SIZE)
+        return -EINVAL;
+
+    spin_lock_irqsave(&hasher->job_lock, flags);
+    if (hasher->direct_maps ? hasher->direct_owner != file : hasher->job_running || hasher_direct_reserved(hasher))
+    {
+        spin_unlock_irqrestore(&hasher->job_lock, flags);
+        return -EBUSY;
+    }
+    hasher->direct_owner = file;
+    hasher->direct_maps++;
+    spin_unlock_irqrestore(&hasher->job_lock, flags);
+
+    vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+    ret = io_remap_pfn_range(vma, vma->vm_start, hasher->regs_phys >> PAGE_SHIFT, PAGE_SIZE, vma->vm_page_prot);
+    if (ret)
+    {
+        hasher_put_regs(hasher);
+        return ret;
+    }
+    vma->vm_ops = &hasher_regs_vm_ops;
+    return 0;
+}
+
+// Offset 0 maps the completion ring, read only, HASHER_REGS_MMAP_OFFSET the registers
+// and the offsets returned by HASHER_IOC_ALLOC the buffers.
+static int hasher_do_mmap(struct hasher_file *file, struct vm_area_struct *vma)
+{
+    struct hasher_info *hasher = file->hasher;
+    struct hasher_dma_buffer *buf;
+    size_t size = vma->vm_end - vma->vm_start;
+    uint64_t offset = (uint64_t)vma->vm_pgoff << PAGE_SHIFT;
+    int ret = -EINVAL;
+
+    if (!offset)
+    {
+        if (!hasher->ring)
+            return -ENODEV;
+        if (size > PAGE_ALIGN(hasher->ring_size))
+            return -EINVAL;
+        if (vma->vm_flags & VM_WRITE)
+            return -EPERM;
+        // Nor made writable later with mprotect().
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+        vm_flags_clear(vma, VM_MAYWRITE);
 #else
-    // INSERT POLLING HERE
-    while (!ioread32(hasher_mem.baseAddr + DONE * sizeof(uint32_t)))
-        ;
+        vma->vm_flags &= ~VM_MAYWRITE;
 #endif
+        ret = dma_mmap_coherent(hasher->dev, vma, hasher->ring, hasher->ring_dma, size);
+        if (ret)
+            return ret;
+        vma->vm_ops = &hasher_ring_vm_ops;
+        hasher_ring_map(hasher, 1);
+        return 0;
+    }
+    if (offset == HASHER_REGS_MMAP_OFFSET)
+        return hasher_mmap_regs(file, vma);
+    if (offset & (HASHER_BUFFER_MAX_SIZE - 1))
+        return -EINVAL;
+
+    mutex_lock(&file->lock);
+    buf = hasher_find_buffer(file, offset >> HASHER_BUFFER_SHIFT);
+    if (buf && size <= buf->size)
+    {
+        // dma_mmap_*() take vm_pgoff as the offset in the buffer.
+        vma->vm_pgoff = 0;
+        if (buf->cached)
+            ret = dma_mmap_pages(hasher->dev, vma, size, buf->pages);
+        else
+            ret = dma_mmap_coherent(hasher->dev, vma, buf->virt, buf->dma, size);
+        if (!ret)
+        {
+            vma->vm_private_data = buf;
+            vma->vm_ops = &hasher_vm_ops;
+            buf->map_count++;
+        }
+    }
+    mutex_unlock(&file->lock);
+    return ret;
+}
 
-    pr_info("hasher_DRIVER: Performed READ operation successfully\n");
+// Function that implements system call mmap() for our driver.
+int hasher_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct hasher_file *file = filp->private_data;
+    int ret = hasher_enter(file->hasher);
+
+    if (ret)
+        return ret;
+    ret = hasher_do_mmap(file, vma);
+    hasher_leave(file->hasher);
+    return ret;
+}
+
+// Allocates the completion ring.
+static int hasher_setup_ring(struct hasher_info *hasher)
+{
+    if (!ring_entries)
+        return 0;
+    if (!is_power_of_2(ring_entries))
+    {
+        pr_err("hasher_DRIVER: ring_entries must be a power of two.\n");
+        return -EINVAL;
+    }
+
+    hasher->ring_size = HASHER_RING_HEADER_BYTES + ring_entries * sizeof(struct hasher_ring_entry);
+    hasher->ring = dma_alloc_coherent(hasher->dev, PAGE_ALIGN(hasher->ring_size), &hasher->ring_dma, GFP_KERNEL);
+    if (!hasher->ring)
+        return -ENOMEM;
+    hasher->ring->head = 0;
+    hasher->ring->entries = ring_entries;
+
+    // RING_ADDR stays 0 until the ring is mapped, see hasher_apply_ring().
+    iowrite32(0, hasher->baseAddr + RING_HEAD * sizeof(uint32_t));
+    iowrite32(ring_entries - 1, hasher->baseAddr + RING_MASK * sizeof(uint32_t));
+    iowrite32(0, hasher->baseAddr + RING_IRQ_EVERY * sizeof(uint32_t));
+    iowrite32(0, hasher->baseAddr + RING_ADDR * sizeof(uint32_t));
+    mb();
+    pr_info("hasher_DRIVER: hasher%d completion ring of %u entries at 0x%08X\n", hasher->index, ring_entries, (uint32_t)hasher->ring_dma);
+    return 0;
+}
+
+static void hasher_free_ring(struct hasher_info *hasher)
+{
+    if (!hasher->ring)
+        return;
+    iowrite32(0, hasher->baseAddr + RING_ADDR * sizeof(uint32_t));
+    mb();
+    dma_free_coherent(hasher->dev, PAGE_ALIGN(hasher->ring_size), hasher->ring, hasher->ring_dma);
+    hasher->ring = NULL;
+}
+
+
+// ---------- Statistics ----------
+// Counters in /sys/class/hasher_class/hasherN/stats/, latency histograms in
+// <debugfs>/hasher/hasherN/.
+
+static u64 hasher_read_stat(struct hasher_info *hasher, const u64 *counter)
+{
+    unsigned long flags;
+    u64 value;
+
+    spin_lock_irqsave(&hasher->job_lock, flags);
+    value = *counter;
+    spin_unlock_irqrestore(&hasher->job_lock, flags);
+    return value;
+}
+
+#define HASHER_STAT_ATTR(name)                                                              \
+static ssize_t name##_show(struct device *dev, struct device_attribute *attr, char *buf)   \
+{                                                                                           \
+    struct hasher_info *hasher = dev_get_drvdata(dev);                                      \
+                                                                                            \
+    return sprintf(buf, "%llu\n", hasher_read_stat(hasher, &hasher->stats.name));           \
+}                                                                                           \
+static DEVICE_ATTR_RO(name)
+
+HASHER_STAT_ATTR(jobs_submitted);
+HASHER_STAT_ATTR(jobs_completed);
+HASHER_STAT_ATTR(blocks_solved);
+HASHER_STAT_ATTR(nonces);
+HASHER_STAT_ATTR(irqs);
+HASHER_STAT_ATTR(spurious_wakeups);
+HASHER_STAT_ATTR(jobs_cancelled);
+HASHER_STAT_ATTR(spun);
+HASHER_STAT_ATTR(missed_irqs);
+HASHER_STAT_ATTR(hw_job_cycles);
+HASHER_STAT_ATTR(hw_fetch_cycles);
+HASHER_STAT_ATTR(hw_writeback_cycles);
+HASHER_STAT_ATTR(hw_hashes);
+HASHER_STAT_ATTR(hw_idle_cycles);
+
+static struct attribute *hasher_stats_attrs[] = {
+    &dev_attr_jobs_submitted.attr,
+    &dev_attr_jobs_completed.attr,
+    &dev_attr_blocks_solved.attr,
+    &dev_attr_nonces.attr,
+    &dev_attr_irqs.attr,
+    &dev_attr_spurious_wakeups.attr,
+    &dev_attr_jobs_cancelled.attr,
+    &dev_attr_spun.attr,
+    &dev_attr_missed_irqs.attr,
+    &dev_attr_hw_job_cycles.attr,
+    &dev_attr_hw_fetch_cycles.attr,
+    &dev_attr_hw_writeback_cycles.attr,
+    &dev_attr_hw_hashes.attr,
+    &dev_attr_hw_idle_cycles.attr,
+    NULL
+};
+
+static const struct attribute_group hasher_stats_group = {
+    .name = "stats",
+    .attrs = hasher_stats_attrs,
+};
+
+static const struct attribute_group *hasher_groups[] = {
+    &hasher_stats_group,
+    NULL
+};
+
+// One line per non-empty bucket: lower bound in ns, count.
+static void hasher_show_hist(struct seq_file *m, struct hasher_info *hasher, const u64 *hist)
+{
+    u64 copy[HASHER_HIST_BUCKETS];
+    unsigned long flags;
+    int b;
+
+    spin_lock_irqsave(&hasher->job_lock, flags);
+    memcpy(copy, hist, sizeof(copy));
+    spin_unlock_irqrestore(&hasher->job_lock, flags);
+    for (b = 0; b < HASHER_HIST_BUCKETS; ++b)
+        if (copy[b])
+            seq_printf(m, "%12llu %llu\n", b ? 1ull << b : 0, copy[b]);
+}
+
+static int submit_to_irq_show(struct seq_file *m, void *v)
+{
+    struct hasher_info *hasher = m->private;
+
+    hasher_show_hist(m, hasher, hasher->stats.submit_to_irq);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(submit_to_irq);
+
+static int irq_to_wakeup_show(struct seq_file *m, void *v)
+{
+    struct hasher_info *hasher = m->private;
+
+    hasher_show_hist(m, hasher, hasher->stats.irq_to_wakeup);
     return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(irq_to_wakeup);
+
+static void hasher_debugfs_init(struct hasher_info *hasher)
+{
+    char name[16];
+
+    snprintf(name, sizeof(name), DRIVER_NAME "%d", hasher->index);
+    hasher->debugfs = debugfs_create_dir(name, hasher_debugfs);
+    debugfs_create_file("submit_to_irq", 0444, hasher->debugfs, hasher, &submit_to_irq_fops);
+    debugfs_create_file("irq_to_wakeup", 0444, hasher->debugfs, hasher, &irq_to_wakeup_fops);
+}
 
 
 // ---------- Platform Driver ----------
@@ -190,125 +1606,226 @@ MODULE_DEVICE_TABLE(of, pl_accel_of_match);
 
 static int pl_accel_probe(struct platform_device *pdev)
 {
+    struct hasher_info *hasher;
     struct resource *res;
+    struct device *char_dev;
     int ret;
-    dev_t dev;
 
-    pr_info("pl_accel: Probing...\n");
+    pr_info("pl_accel: Probing %s...\n", dev_name(&pdev->dev));
+
+    // Not devm: open files keep it past the removal of the device.
+    hasher = kzalloc(sizeof(*hasher), GFP_KERNEL);
+    if (!hasher)
+        return -ENOMEM;
+    hasher->dev = get_device(&pdev->dev);
+    kref_init(&hasher->ref);
+    init_rwsem(&hasher->remove_lock);
+    init_waitqueue_head(&hasher->wq);
+    spin_lock_init(&hasher->job_lock);
+    hrtimer_init(&hasher->watchdog, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    hasher->watchdog.function = hasher_watchdog;
+    // Without the interrupt, the watchdog polls DONE from the first job.
+    hasher->irq_lost = !DRIVER_WITH_INTERRUPT;
 
     // 1. Get register region from DT
     res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
-    hasher_mem.baseAddr = devm_ioremap_resource(&pdev->dev, res);
-    if (IS_ERR(hasher_mem.baseAddr))
-        return PTR_ERR(hasher_mem.baseAddr);
+    hasher->baseAddr = devm_ioremap_resource(&pdev->dev, res);
+    if (IS_ERR(hasher->baseAddr))
+    {
+        ret = PTR_ERR(hasher->baseAddr);
+        goto free_hasher;
+    }
+    // hasher_mmap_regs() maps a whole page: it must hold nothing else.
+    if (!PAGE_ALIGNED(res->start) || resource_size(res) < PAGE_SIZE)
+        pr_info("hasher_DRIVER: Registers not on a page of their own, no direct access.\n");
+    else
+        hasher->regs_phys = res->start;
 
-    // 3. Register char device
-    ret = alloc_chrdev_region(&dev, hasher_minor, 1, "hasher");
-    if (ret)
-        return ret;
+    // Bitstreams older than the performance counters answer with register 0 there, or
+    // have a register window too small for them.
+    if (resource_size(res) >= (HASHER_PERF_REG_CLUSTERS + 4 * HASHER_PERF_MAX_CLUSTERS) * sizeof(uint32_t))
+        hasher->has_perf = ioread32(hasher->baseAddr + HASHER_PERF_REG_MAGIC * sizeof(uint32_t)) == HASHER_PERF_MAGIC;
+    if (hasher->has_perf)
+    {
+        struct clk *clk = devm_clk_get(&pdev->dev, "clk");
 
-    hasher_major = MAJOR(dev);
+        if (!IS_ERR(clk))
+            hasher->perf.clock_hz = clk_get_rate(clk);
+        hasher_read_layout(hasher);
+        pr_info("hasher_DRIVER: Performance counters, %u clusters of %u hashers, clock %llu Hz.\n",
+                hasher->perf.clusters, hasher->perf.hashers, hasher->perf.clock_hz);
+    }
 
-    /*
-    // Request (exclusive) access to the memory address range of the peripheral.
-    if (!request_mem_region(hasher_mem.memStart, hasher_mem.memEnd - hasher_mem.memStart + 1, DRIVER_NAME))
+    // The accelerator has 32-bit addresses, for the ring and the buffers alike.
+    if (dma_set_coherent_mask(&pdev->dev, DMA_BIT_MASK(32)))
     {
-        pr_err("hasher_DRIVER: Couldn't lock memory region at %p\n", (void *)hasher_mem.memStart);
-        goto unregister_region;
+        ret = -EIO;
+        goto free_hasher;
     }
 
-    // Obtain a "kernel virtual address" for the physical address of the peripheral.
-    hasher_mem.baseAddr = ioremap(hasher_mem.memStart, hasher_mem.memEnd - hasher_mem.memStart + 1);
-    if (!hasher_mem.baseAddr)
+    // /dev/hasherN, N in probe order
+    hasher->index = ida_alloc_max(&hasher_ida, HASHER_MAX_DEVICES - 1, GFP_KERNEL);
+    if (hasher->index < 0)
     {
-        pr_err("hasher_DRIVER: Could not obtain virtual kernel address for iomem space.\n");
-        goto release_mem_region;
+        pr_err("hasher_DRIVER: No minor left, at most %d accelerators.\n", HASHER_MAX_DEVICES);
+        ret = hasher->index;
+        goto free_hasher;
     }
-        */
+    hasher->devt = MKDEV(MAJOR(hasher_devt), MINOR(hasher_devt) + hasher->index);
+
+    ret = hasher_setup_ring(hasher);
+    if (ret)
+        goto free_index;
 
 #if DRIVER_WITH_INTERRUPT
-    init_waitqueue_head(&wq);
-  //
     // 2. Get IRQ from DT
-    hasher_mem.irq = platform_get_irq(pdev, 0);
-    if (hasher_mem.irq  < 0)
+    hasher->irq = platform_get_irq(pdev, 0);
+    if (hasher->irq < 0)
     {
-        pr_err("hasher_DRIVER: cannot get irq number, error %d.\n", hasher_mem.irq );
-        goto unregister_region;
+        pr_err("hasher_DRIVER: cannot get irq number, error %d.\n", hasher->irq);
+        ret = hasher->irq;
+        goto free_ring;
     }
 
-    pr_info("Assigned irq: %d\n", hasher_mem.irq);
+    pr_info("Assigned irq: %d\n", hasher->irq);
 
-    ret = devm_request_irq(&pdev->dev, hasher_mem.irq, hasherIRQHandler, 0,
-                           dev_name(&pdev->dev), NULL);
+    // Every instance has its own line; the handler gets its hasher_info as dev_id.
+    // From this moment on, we can receive the IRQ asynchronously at any time.
+    ret = devm_request_irq(&pdev->dev, hasher->irq, hasherIRQHandler, 0,
+                           dev_name(&pdev->dev), hasher);
     if (ret)
     {
         pr_err("hasher_DRIVER: cannot request irq number, error %d.\n", ret);
-        goto unregister_region;
+        goto free_ring;
     }
-
-
-    // Enable the IRQ. From this moment on, we can receive the IRQ asynchronously at any time.
-    enable_irq(hasher_mem.irq);
-    pr_info("hasher_DRIVER: Interrupt %d registered\n", hasher_mem.irq);
+    pr_info("hasher_DRIVER: Interrupt %d registered\n", hasher->irq);
 #endif
 
-    int err;
-    int devno = MKDEV(hasher_major, hasher_minor);
-    cdev_init(&hasher_mem.cdev, &hasher_fops);
-    hasher_mem.cdev.owner = THIS_MODULE;
-    hasher_mem.cdev.ops = &hasher_fops;
-    err = cdev_add(&hasher_mem.cdev, devno, 1);
+    // 3. Register char device, in the region reserved by hasher_init()
+    // Allocated on its own: the files opened on it hold it until their last fput().
+    hasher->cdev = cdev_alloc();
+    if (!hasher->cdev)
+    {
+        ret = -ENOMEM;
+        goto free_irq;
+    }
+    hasher->cdev->ops = &hasher_fops;
+    hasher->cdev->owner = THIS_MODULE;
+    ret = cdev_add(hasher->cdev, hasher->devt, 1);
     /* Fail gracefully if need be */
-    if (err)
+    if (ret)
     {
-          pr_err("hasher_DRIVER: Error %d adding hasher cdev_add", err);
-          goto unregister_region;
+          pr_err("hasher_DRIVER: Error %d adding hasher cdev_add", ret);
+          kobject_put(&hasher->cdev->kobj);
+          goto free_irq;
     }
 
     pr_info("hasher_DRIVER: Cdev initialized\n");
 
-    pl_class = class_create(THIS_MODULE, CLASS_NAME);
-    if (IS_ERR(pl_class)) {
-        ret = PTR_ERR(pl_class);
+    char_dev = device_create_with_groups(pl_class, &pdev->dev, hasher->devt, hasher, hasher_groups,
+                                         DRIVER_NAME "%d", hasher->index);
+    if (IS_ERR(char_dev)) {
+        ret = PTR_ERR(char_dev);
         goto del_cdev;
     }
 
-    pl_device = device_create(pl_class, NULL, dev, NULL, DRIVER_NAME);
-    if (IS_ERR(pl_device)) {
-        ret = PTR_ERR(pl_device);
-        goto destroy_class;
-    }
-
-    pr_info("pl_accel: Driver loaded, IRQ=%d\n", hasher_mem.irq);
+    platform_set_drvdata(pdev, hasher);
+    hasher_debugfs_init(hasher);
+    mutex_lock(&hasher_devices_lock);
+    hasher_devices[hasher->index] = hasher;
+    mutex_unlock(&hasher_devices_lock);
+    pr_info("pl_accel: Driver loaded, /dev/" DRIVER_NAME "%d, IRQ=%d\n", hasher->index, hasher->irq);
     return 0;
 
-destroy_class:
-    class_destroy(pl_class);
 del_cdev:
-    cdev_del(&hasher_mem.cdev);
-//release_mem_region:
-    //release_mem_region(hasher_mem.memStart, hasher_mem.memEnd - hasher_mem.memStart + 1);
-unregister_region:
-    unregister_chrdev_region(dev, 1);
+    cdev_del(hasher->cdev);
+free_irq:
+#if DRIVER_WITH_INTERRUPT
+    devm_free_irq(&pdev->dev, hasher->irq, hasher);
+#endif
+free_ring:
+    hasher_free_ring(hasher);
+free_index:
+    ida_free(&hasher_ida, hasher->index);
+free_hasher:
+    put_device(hasher->dev);
+    kfree(hasher);
     return ret;
 }
 
+// Drops the queued jobs and stops the running one, then waits for the accelerator to
+// be idle: the interrupt handler and the watchdog finish the jobs meanwhile.
+// Returns 0 once nothing runs any more.
+static int hasher_quiesce(struct hasher_info *hasher)
+{
+    unsigned long flags;
+    unsigned int i;
+
+    spin_lock_irqsave(&hasher->job_lock, flags);
+    for (i = 0; i < hasher->queue_len; ++i)
+        hasher->job_queue[(hasher->queue_head + i) % JOB_QUEUE_DEPTH].cancelled = 1;
+    if (hasher->job_running && !hasher->stopping)
+    {
+        iowrite32(1, hasher->baseAddr + STOP * sizeof(uint32_t));
+        hasher->stopping = 1;
+    }
+    spin_unlock_irqrestore(&hasher->job_lock, flags);
+
+    if (!wait_event_timeout(hasher->wq, !READ_ONCE(hasher->job_running) && !READ_ONCE(hasher->queue_len) &&
+                            ioread32(hasher->baseAddr + DONE * sizeof(uint32_t)), HZ))
+        return -ETIMEDOUT;
+    return 0;
+}
+
+// The registers and the IRQ are released by devm after this, hasher_info by the last
+// file still open on the instance.
 static int pl_accel_remove(struct platform_device *pdev)
 {
-    dev_t dev = MKDEV(hasher_major, hasher_minor);
+    struct hasher_info *hasher = platform_get_drvdata(pdev);
+    unsigned long flags;
+    int idle;
+
+    mutex_lock(&hasher_devices_lock);
+    hasher_devices[hasher->index] = NULL;
+    mutex_unlock(&hasher_devices_lock);
+    debugfs_remove_recursive(hasher->debugfs);
+    device_destroy(pl_class, hasher->devt);
+    cdev_del(hasher->cdev);
+
+    // The files still open get ENODEV from now on, and no new job is queued. Once the
+    // jobs are stopped, the file operations under way are woken up and waited for:
+    // nothing touches the registers after that.
+    spin_lock_irqsave(&hasher->job_lock, flags);
+    hasher->dead = 1;
+    spin_unlock_irqrestore(&hasher->job_lock, flags);
+    // Nothing may restart the accelerator or its watchdog once they are torn down: stop
+    // the jobs first, then the interrupt, then the timer.
+    idle = !hasher_quiesce(hasher);
+    wake_up_interruptible(&hasher->wq);
+    down_write(&hasher->remove_lock);
+    up_write(&hasher->remove_lock);
 #if DRIVER_WITH_INTERRUPT
-    disable_irq(hasher_mem.irq);
-    free_irq(hasher_mem.irq, &hasher_mem);
+    iowrite32(0, hasher->baseAddr + sizeof(uint32_t) * REG_ENABLE_INTERRUPTS);
+    iowrite32(1, hasher->baseAddr + sizeof(uint32_t) * REG_ISR);
+    devm_free_irq(&pdev->dev, hasher->irq, hasher);
 #endif
-    iounmap(hasher_mem.baseAddr);
-    release_mem_region(hasher_mem.memStart, hasher_mem.memEnd - hasher_mem.memStart + 1);
-    device_destroy(pl_class, dev);
-    class_destroy(pl_class);
-    cdev_del(&hasher_mem.cdev);
-    unregister_chrdev_region(dev, 1);
+    hrtimer_cancel(&hasher->watchdog);
+    // The ring may still be mapped: hasher_free() frees it. If the accelerator may
+    // still write into it, rather leak it.
+    if (hasher->ring)
+    {
+        iowrite32(0, hasher->baseAddr + RING_ADDR * sizeof(uint32_t));
+        mb();
+    }
+    if (!idle)
+    {
+        hasher->leak_dma = 1;
+        pr_err("hasher_DRIVER: hasher%d still running at removal, leaking its ring.\n", hasher->index);
+    }
+    ida_free(&hasher_ida, hasher->index);
 
-    pr_info("pl_accel: Removed\n");
+    pr_info("pl_accel: Removed hasher%d\n", hasher->index);
+    kref_put(&hasher->ref, hasher_free);
     return 0;
 }
 
@@ -330,25 +1847,82 @@ static struct platform_driver pl_accel_driver = {
 // interact with the interrupt handler.
 static irqreturn_t hasherIRQHandler(int irq, void *dev_id)
 {
-    if (irq != hasher_mem.irq)
+    struct hasher_info *hasher = dev_id;
+    int done;
+
+    if (irq != hasher->irq)
         return IRQ_NONE;
     // Clean the interrupt in the peripheral, so that we can detect new rising transition.
     // The ISR is toggle-on-write (TOW), which means that its bits toggle when they are
     // written, whatever it was their previous value. Therefore, we write (1) to the
     // 'done' bit to toggle it, so that it becomes 0 and the interrupt is disarmed.
-    iowrite32(1, hasher_mem.baseAddr + sizeof(uint32_t) * REG_ISR);
+    iowrite32(1, hasher->baseAddr + sizeof(uint32_t) * REG_ISR);
     mb();
-    // Signal that it is us waking the main thread.
-    flag = 1;
-    pr_info("recv interrupt\n");
-    // Wake the main thread.
-    wake_up_interruptible(&wq);
+    // The line works after all, if the watchdog ever thought otherwise.
+    WRITE_ONCE(hasher->irq_lost, 0);
+    spin_lock(&hasher->job_lock);
+    hasher->stats.irqs++;
+    spin_unlock(&hasher->job_lock);
+    // The interrupt is raised at the end of a job and, with RING_IRQ_EVERY set, for new
+    // ring entries: DONE tells them apart. It is read after clearing the interrupt, so a job
+    // that ends later raises a new one.
+    // At the end of a job, start the next queued one and wake up its waiters. DONE may
+    // also be clear because a spinning read() already took the job.
+    done = hasher_job_done(hasher);
+    trace_hasher_irq(hasher->index, done);
+    if (!done)
+        wake_up_interruptible(&hasher->wq);
+    // Jobs started through the register mapping: their owner checks DONE itself.
+    spin_lock(&hasher->job_lock);
+    if (hasher->direct_event)
+        eventfd_signal(hasher->direct_event, 1);
+    spin_unlock(&hasher->job_lock);
     return (irqreturn_t)IRQ_HANDLED; // Announce that the IRQ has been handled correctly
     // In case of error, or if it was not our device which generated the IRQ, return IRQ_NONE.
 }
 #endif
 
-module_platform_driver(pl_accel_driver);
+// The char device region and the class are shared by all the instances: set up
+// once here, then pl_accel_probe() runs for every TopLevel node.
+static int __init hasher_init(void)
+{
+    int ret;
+
+    ret = alloc_chrdev_region(&hasher_devt, hasher_minor, HASHER_MAX_DEVICES, DRIVER_NAME);
+    if (ret)
+        return ret;
+    hasher_major = MAJOR(hasher_devt);
+
+    pl_class = class_create(THIS_MODULE, CLASS_NAME);
+    if (IS_ERR(pl_class)) {
+        ret = PTR_ERR(pl_class);
+        goto unregister_region;
+    }
+
+    hasher_debugfs = debugfs_create_dir(DRIVER_NAME, NULL);
+    ret = platform_driver_register(&pl_accel_driver);
+    if (ret)
+        goto remove_debugfs;
+    return 0;
+
+remove_debugfs:
+    debugfs_remove_recursive(hasher_debugfs);
+    class_destroy(pl_class);
+unregister_region:
+    unregister_chrdev_region(hasher_devt, HASHER_MAX_DEVICES);
+    return ret;
+}
+
+static void __exit hasher_exit(void)
+{
+    platform_driver_unregister(&pl_accel_driver);
+    debugfs_remove_recursive(hasher_debugfs);
+    class_destroy(pl_class);
+    unregister_chrdev_region(hasher_devt, HASHER_MAX_DEVICES);
+}
+
+module_init(hasher_init);
+module_exit(hasher_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Saverio Nasturzio");
@@ -0,0 +1,112 @@
+// Tracepoints of hasher_platform.c, under events/hasher/ in tracefs.
+// They replace the pr_info() calls that used to log every job.
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM hasher
+
+#if !defined(HASHER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define HASHER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// A job was accepted by read() or an ioctl(), queued jobs included.
+TRACE_EVENT(hasher_submit,
+    TP_PROTO(int dev, u32 id, u32 n_blocks, u32 difficulty, unsigned int queued),
+    TP_ARGS(dev, id, n_blocks, difficulty, queued),
+    TP_STRUCT__entry(
+        __field(int, dev)
+        __field(u32, id)
+        __field(u32, n_blocks)
+        __field(u32, difficulty)
+        __field(unsigned int, queued)
+    ),
+    TP_fast_assign(
+        __entry->dev = dev;
+        __entry->id = id;
+        __entry->n_blocks = n_blocks;
+        __entry->difficulty = difficulty;
+        __entry->queued = queued;
+    ),
+    TP_printk("hasher%d job=%u blocks=%u difficulty=%08x queued=%u",
+              __entry->dev, __entry->id, __entry->n_blocks, __entry->difficulty, __entry->queued)
+);
+
+// START was pulsed for the job.
+TRACE_EVENT(hasher_start,
+    TP_PROTO(int dev, u32 id, u32 n_blocks),
+    TP_ARGS(dev, id, n_blocks),
+    TP_STRUCT__entry(
+        __field(int, dev)
+        __field(u32, id)
+        __field(u32, n_blocks)
+    ),
+    TP_fast_assign(
+        __entry->dev = dev;
+        __entry->id = id;
+        __entry->n_blocks = n_blocks;
+    ),
+    TP_printk("hasher%d job=%u blocks=%u", __entry->dev, __entry->id, __entry->n_blocks)
+);
+
+// Interrupt handled: end of a job (done=1) or new ring entries.
+TRACE_EVENT(hasher_irq,
+    TP_PROTO(int dev, int done),
+    TP_ARGS(dev, done),
+    TP_STRUCT__entry(
+        __field(int, dev)
+        __field(int, done)
+    ),
+    TP_fast_assign(
+        __entry->dev = dev;
+        __entry->done = done;
+    ),
+    TP_printk("hasher%d done=%d", __entry->dev, __entry->done)
+);
+
+// The job finished. Blocks and nonces are only known for jobs on driver buffers.
+TRACE_EVENT(hasher_job_done,
+    TP_PROTO(int dev, u32 id, u32 solved, u64 nonces, u64 latency_ns),
+    TP_ARGS(dev, id, solved, nonces, latency_ns),
+    TP_STRUCT__entry(
+        __field(int, dev)
+        __field(u32, id)
+        __field(u32, solved)
+        __field(u64, nonces)
+        __field(u64, latency_ns)
+    ),
+    TP_fast_assign(
+        __entry->dev = dev;
+        __entry->id = id;
+        __entry->solved = solved;
+        __entry->nonces = nonces;
+        __entry->latency_ns = latency_ns;
+    ),
+    TP_printk("hasher%d job=%u solved=%u nonces=%llu submit_to_irq=%lluns",
+              __entry->dev, __entry->id, __entry->solved, __entry->nonces, __entry->latency_ns)
+);
+
+// read() woke up with its job finished.
+TRACE_EVENT(hasher_wakeup,
+    TP_PROTO(int dev, u32 id, u64 latency_ns),
+    TP_ARGS(dev, id, latency_ns),
+    TP_STRUCT__entry(
+        __field(int, dev)
+        __field(u32, id)
+        __field(u64, latency_ns)
+    ),
+    TP_fast_assign(
+        __entry->dev = dev;
+        __entry->id = id;
+        __entry->latency_ns = latency_ns;
+    ),
+    TP_printk("hasher%d job=%u irq_to_wakeup=%lluns", __entry->dev, __entry->id, __entry->latency_ns)
+);
+
+#endif // HASHER_TRACE_H
+
+// The header is outside of include/trace/events: tell define_trace.h where it is.
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE hasher_trace
+#include <trace/define_trace.h>
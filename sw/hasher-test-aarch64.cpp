@@ -1,20 +1,34 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <time.h>
-#include "sha.h"
+#include "CpuHasher.h"
+#include "HasherCommon.h"
+#include "driver/hasher_ioctl.h"
+#include "CpuSolver.h"
+#include "HybridScheduler.h"
+#include "HasherPool.h"
+#include "HasherDirect.h"
+#include "DmaArena.h"
+#include "BatchPipeline.h"
+#include "Benchmark.h"
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <errno.h>
+#include <vector>
 
 #include <time.h>
 
-#define TIME_BLOCK_MS(result_var, block)                                         \
+#define TIME_BLOCK_MS(result_var, ...)                                           \
     double result_var;                                                           \
         struct timespec __start, __end;                                          \
         clock_gettime(CLOCK_MONOTONIC, &__start);                                \
-        block                                                                    \
+        __VA_ARGS__                                                              \
         clock_gettime(CLOCK_MONOTONIC, &__end);                                  \
         result_var = ((double)(__end.tv_sec - __start.tv_sec) * 1000.0) +        \
                      ((double)(__end.tv_nsec - __start.tv_nsec) / 1000000.0);    
@@ -23,174 +37,424 @@ typedef struct {
     void *virtual_addr;
     unsigned long physical_addr;
 	uint32_t size;
+    uint32_t handle;            // of the driver buffer
 } BufferInfo;
 
-BufferInfo map_udmabuf(size_t requested_size) {
-	// bypass   parameter
-	requested_size = 512*1024;
-    BufferInfo info = { .virtual_addr = NULL, .physical_addr = 0, .size = requested_size};
 
-    const char *device_path = "/dev/udmabuf0";
-    const char *phys_addr_path = "/sys/class/u-dma-buf/udmabuf0/phys_addr";
-    const char *size_path = "/sys/class/u-dma-buf/udmabuf0/size";
+// Base address for the mapping of (all) peripherals
+#define BASE_MAP  0xA0000000
 
-    // Read the actual size of the udmabuf0
-    FILE *size_fp = fopen(size_path, "r");
-    if (!size_fp) {
-        perror("fopen size");
-        return info;
-    }
+#define DEFAULT_MAX_BLOCKS 16
+#define DEFAULT_N_EXPERIMENTS 5 
+#define DEFAULT_MAX_DIFFICULTY 16 
+#define DEFAULT_WARMUPS 1
 
-    unsigned long actual_size = 0;
-    if (fscanf(size_fp, "%lu", &actual_size) != 1) {
-        fprintf(stderr, "Failed to read udmabuf size\n");
-        fclose(size_fp);
-        return info;
-    }
-    fclose(size_fp);
+#define FUNC_TESTING 0
+#define DEBUG 0
+// Jobs started through the mapped registers are polled this long before sleeping.
+#define DIRECT_SPIN_US 20
+// Block and result arrays of the largest batch carved out of the DMA buffer, enough
+// for the deepest pipeline.
+#define ARENA_SLABS BATCH_PIPELINE_MAX_DEPTH
+// Buffer sets of the pipelined run, HASHER_PIPELINE_DEPTH overrides it, 0 skips the run.
+#define DEFAULT_PIPELINE_DEPTH 2
+// Batches back to back in one run of the pipeline, its time is per batch.
+#define PIPELINE_RUN_BATCHES 4
+
+// Accelerator instances are /dev/hasher0, /dev/hasher1, ...
+const char* DRIVER_PREFIX="/dev/hasher";
+const char* DRIVER_NAME="/dev/hasher0";
+// Performance counters of /dev/hasher0 summed by the driver over its jobs.
+const char* DRIVER_STATS="/sys/class/hasher_class/hasher0/stats";
+int driver;
+struct cpu_solver* cpu_solver;
+struct hybrid_scheduler* hybrid;
+// All the instances, NULL when there is only one: batches are then spread across them.
+struct hasher_pool* pool;
+// Registers of /dev/hasher0 mapped with HASHER_DIRECT=1, NULL otherwise: jobs are then
+// started without syscalls, one at a time.
+struct hasher_direct* direct;
+// DMA buffer of the driver, allocated once and reused by every experiment.
+BufferInfo dma_buf;
+// HASHER_BUFFER_CACHED with HASHER_CACHED=1: dma_buf is mapped cacheable.
+uint32_t dma_flags;
+// Slabs of dma_buf: experiments take their blocks and results from there.
+struct dma_arena* arena;
+int blocks_class;
+int results_class;
+// Completion ring of the driver, NULL if it has none, and how far it has been read.
+struct hasher_ring_header* ring;
+uint32_t ring_tail;
+
+uint32_t pipeline_depth = DEFAULT_PIPELINE_DEPTH;
+// Stage times of the last pipelined run, reported with its configuration.
+struct batch_pipeline_stats pipeline_stats;
+
+// Performance counters of the accelerator summed over jobs (driver/README.md).
+struct hw_totals
+{
+    uint64_t hashes;
+    uint64_t job_cycles;
+    uint64_t fetch_cycles;
+    uint64_t writeback_cycles;
+    uint64_t idle_cycles;       // of all the clusters
+};
+// Layout and clock of /dev/hasher0, clusters 0 if it has no counters.
+struct hasher_perf hw_layout;
+// Summed by direct_run(), the driver does not see those jobs.
+struct hw_totals direct_totals;
+// Of the last accelerator run on one instance, reported with its configuration.
+struct hw_totals hw_last;
+
+// Cache maintenance on a range of the DMA buffer, when it is cached. Returns 0 on success.
+int dma_sync(uint32_t offset, uint32_t size, uint32_t direction)
+{
+    struct hasher_sync sync = {dma_buf.handle, offset, size, direction};
 
-    if (requested_size > actual_size) {
-        fprintf(stderr, "Requested size (0x%zx) exceeds udmabuf0 size (0x%lx)\n",
-                requested_size, actual_size);
-        return info;
-    }
+    return (dma_flags & HASHER_BUFFER_CACHED) ? ioctl(driver, HASHER_IOC_SYNC, &sync) : 0;
+}
 
-    int fd = open(device_path, O_RDWR | O_SYNC);
-    if (fd < 0) {
-        perror("open");
-        return info;
+// Runs one job on the DMA buffer through the mapped registers. Returns 0 on success.
+// The driver does not see these jobs: the caches of a cached buffer are synced here.
+int direct_run(const struct hasher_buffer_job* job)
+{
+    struct user_message message = {(uint32_t)dma_buf.physical_addr + job->blocks_offset, job->n_blocks, job->difficulty,
+                                   (uint32_t)dma_buf.physical_addr + job->results_offset,
+                                   job->start_nonce, job->nonce_stride, job->nonce_limit};
+    uint32_t results_size = job->n_blocks * sizeof(struct hasher_result);
+
+    if(dma_sync(job->blocks_offset, job->n_blocks * 64, HASHER_SYNC_FOR_DEVICE) ||
+       dma_sync(job->results_offset, results_size, HASHER_SYNC_FOR_DEVICE) ||
+       hasher_direct_submit(direct, &message) || hasher_direct_wait(direct, DIRECT_SPIN_US))
+        return -1;
+    struct hasher_perf perf;
+    if(hw_layout.clusters && !hasher_direct_perf(direct, &perf))
+    {
+        direct_totals.job_cycles += perf.job_cycles;
+        direct_totals.fetch_cycles += perf.fetch_cycles;
+        direct_totals.writeback_cycles += perf.writeback_cycles;
+        for(uint32_t c = 0; c < perf.clusters; ++c)
+        {
+            direct_totals.hashes += perf.hashes[c];
+            direct_totals.idle_cycles += perf.idle_cycles[c];
+        }
     }
+    return dma_sync(job->results_offset, results_size, HASHER_SYNC_FOR_CPU);
+}
 
-    void *buf = mmap(NULL, requested_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (buf == MAP_FAILED) {
-        perror("mmap");
-        close(fd);
-        return info;
-    }
+uint64_t read_stat(const char* name)
+{
+    char path[256];
+    unsigned long long value = 0;
 
-    FILE *phys_fp = fopen(phys_addr_path, "r");
-    if (!phys_fp) {
-        perror("fopen phys_addr");
-        munmap(buf, requested_size);
-        close(fd);
-        return info;
-    }
+    snprintf(path, sizeof(path), "%s/%s", DRIVER_STATS, name);
+    FILE* f = fopen(path, "r");
+    if(!f)
+        return 0;
+    if(fscanf(f, "%llu", &value) != 1)
+        value = 0;
+    fclose(f);
+    return value;
+}
 
-    unsigned long phys_addr = 0;
-    if (fscanf(phys_fp, "%lx", &phys_addr) != 1) {
-        fprintf(stderr, "Failed to read physical address\n");
-        fclose(phys_fp);
-        munmap(buf, requested_size);
-        close(fd);
-        return info;
+// Counters of /dev/hasher0 so far; differences around a run give its own.
+void hw_totals_read(struct hw_totals* totals)
+{
+    if(direct)
+    {
+        *totals = direct_totals;
+        return;
     }
+    totals->hashes = read_stat("hw_hashes");
+    totals->job_cycles = read_stat("hw_job_cycles");
+    totals->fetch_cycles = read_stat("hw_fetch_cycles");
+    totals->writeback_cycles = read_stat("hw_writeback_cycles");
+    totals->idle_cycles = read_stat("hw_idle_cycles");
+}
 
-    fclose(phys_fp);
-    close(fd);
+// Sleeps in poll() until job id, and all the jobs queued before it, are finished.
+// Other descriptors could be served by the same poll() meanwhile. Returns 0 on success.
+// The direct path has no queue: its jobs are finished when driver_submit() returns.
+int driver_wait(uint32_t id)
+{
+    struct pollfd pfd = {driver, POLLIN, 0};
+    struct hasher_completion completion;
 
-    info.virtual_addr = buf;
-    info.physical_addr = phys_addr;
-    return info;
+    if(direct)
+        return 0;
+    while(1)
+    {
+        if(ioctl(driver, HASHER_IOC_COMPLETE, &completion) < 0)
+            return -1;
+        if(hasher_job_finished(completion.completed, id))
+            return 0;
+        if(poll(&pfd, 1, -1) < 0)
+            return -1;
+    }
 }
 
+// Queues one job on the driver and returns at once with its id, waiting for
+// the job last_id first if the driver queue is full. Returns -1 on error.
+int driver_submit(struct hasher_buffer_job* job, int last_id)
+{
+    if(direct)
+        return direct_run(job) ? -1 : 1;
 
-// Structure used to pass commands between user-space and kernel-space.
-struct user_message {
-    uint32_t block_address_base;
-    uint32_t n_blocks;
-    uint32_t difficulty;
-    uint32_t result_address;
-};
+    int id = ioctl(driver, HASHER_IOC_SUBMIT_BUF, job);
 
+    if(id < 0 && errno == EBUSY && last_id > 0 && !driver_wait(last_id))
+        id = ioctl(driver, HASHER_IOC_SUBMIT_BUF, job);
+    return id;
+}
 
-// Base address for the mapping of (all) peripherals
-#define BASE_MAP  0xA0000000
+// Runs one job through the asynchronous interface of the driver. Returns 0 on success.
+int driver_run(struct hasher_buffer_job* job)
+{
+    int id = driver_submit(job, -1);
 
-#define DEFAULT_MAX_BLOCKS 16
-#define DEFAULT_N_EXPERIMENTS 5 
-#define DEFAULT_MAX_DIFFICULTY 16 
+    return id < 0 ? -1 : driver_wait(id);
+}
 
-#define FUNC_TESTING 0
-#define DEBUG 0
-#define DUMP 0
-#define ACCELERATOR 1
+// Returns the driver buffer, allocated and mapped on first use and grown when
+// smaller than requested_size. virtual_addr is NULL on failure.
+BufferInfo get_buffer(size_t requested_size)
+{
+    if(dma_buf.virtual_addr && dma_buf.size >= requested_size)
+        return dma_buf;
+    if(dma_buf.virtual_addr)
+    {
+        munmap(dma_buf.virtual_addr, dma_buf.size);
+        ioctl(driver, HASHER_IOC_FREE, &dma_buf.handle);
+        dma_buf.virtual_addr = NULL;
+    }
 
-const char* DRIVER_NAME="/dev/hasher";
-int driver;
+    struct hasher_buffer req = {(uint32_t)requested_size};
+    req.flags = dma_flags;
+    if(ioctl(driver, HASHER_IOC_ALLOC, &req) < 0)
+    {
+        perror("HASHER_IOC_ALLOC");
+        return dma_buf;
+    }
+    void* p = mmap(NULL, req.size, PROT_READ | PROT_WRITE, MAP_SHARED, driver, req.mmap_offset);
+    if(p == MAP_FAILED)
+    {
+        perror("mmap");
+        ioctl(driver, HASHER_IOC_FREE, &req.handle);
+        return dma_buf;
+    }
+    dma_buf.virtual_addr = p;
+    dma_buf.physical_addr = req.phys;
+    dma_buf.size = req.size;
+    dma_buf.handle = req.handle;
+    return dma_buf;
+}
 
-struct experiment_stats
+// Blocks and results of one batch, each on its own slab of dma_buf.
+struct job_buffers
 {
-    double time_taken_ms;
-    uint64_t hash_per_sec;
+    struct dma_slab blocks;
+    struct dma_slab results;
 };
 
-uint64_t _bswap64(uint64_t val)
-{
-    uint64_t res = 0;
-    res |= ((val & 0xff) << 56);
-    res |= ((val & 0xff00) << 40);
-    res |= ((val & 0xff0000) << 24);
-    res |= ((val & 0xff000000) << 8);
-    res |= ((val & 0xff00000000) >> 8);
-    res |= ((val & 0xff0000000000) >> 24);
-    res |= ((val & 0xff000000000000) >> 40);
-    res |= ((val & 0xff00000000000000) >> 56);
-    return res;
+// Allocates the DMA buffer once for ARENA_SLABS batches of up to max_blocks and carves
+// it into slabs. Returns 0 on success.
+int arena_open(uint32_t max_blocks)
+{
+    uint32_t blocks_size = max_blocks * 64;
+    uint32_t results_size = max_blocks * sizeof(struct hasher_result);
+
+    // Rounded up to whole slabs, plus a line for the alignment of the first one.
+    blocks_size = (blocks_size + DMA_ARENA_ALIGN - 1) & ~(DMA_ARENA_ALIGN - 1);
+    results_size = (results_size + DMA_ARENA_ALIGN - 1) & ~(DMA_ARENA_ALIGN - 1);
+    if(!get_buffer((blocks_size + results_size) * ARENA_SLABS + DMA_ARENA_ALIGN).virtual_addr)
+        return -1;
+    arena = dma_arena_create(dma_buf.virtual_addr, dma_buf.physical_addr, dma_buf.size);
+    blocks_class = dma_arena_add_class(arena, blocks_size, ARENA_SLABS);
+    results_class = dma_arena_add_class(arena, results_size, ARENA_SLABS);
+    return blocks_class < 0 || results_class < 0 ? -1 : 0;
 }
 
-uint32_t _bswap32(uint32_t val)
+// No allocation on the way: slabs are taken from the arena. Exits when it is exhausted,
+// which means a batch was not given back.
+void job_buffers_get(struct job_buffers* bufs)
 {
-    uint32_t res = 0;
-    res |= ((val & 0xff) << 24);
-    res |= ((val & 0xff00) << 8);
-    res |= ((val & 0xff0000) >> 8);
-    res |= ((val & 0xff000000) >> 24);
-    return res;
+    if(dma_arena_alloc(arena, blocks_class, &bufs->blocks))
+    {
+        dma_arena_print_stats(arena);
+        printf("Error: no free DMA slab\n");
+        exit(-1);
+    }
+    if(dma_arena_alloc(arena, results_class, &bufs->results))
+    {
+        dma_arena_print_stats(arena);
+        printf("Error: no free DMA slab\n");
+        exit(-1);
+    }
 }
 
-struct hasher_result
+void job_buffers_put(const struct job_buffers* bufs)
 {
-    uint32_t b;
-    uint32_t a;
-    uint32_t d;
-    uint32_t c;
-    uint32_t nonce;
-    uint32_t e;
-}__attribute((packed))__;
+    dma_arena_free(arena, blocks_class, &bufs->blocks);
+    dma_arena_free(arena, results_class, &bufs->results);
+}
 
+// Job on all the blocks of bufs.
+struct hasher_buffer_job job_buffers_job(const struct job_buffers* bufs, uint32_t n_blocks, uint32_t difficulty)
+{
+    struct hasher_buffer_job job = {dma_buf.handle, bufs->blocks.offset, n_blocks, difficulty, bufs->results.offset, 0, 1, 0};
+    return job;
+}
 
-uint64_t compute_avg_hash_per_second(uint8_t *addr, uint32_t n_blocks, double time_taken_ms)
+// Job on block i of bufs alone.
+struct hasher_buffer_job job_buffers_block(const struct job_buffers* bufs, uint32_t i, uint32_t difficulty)
 {
-    uint64_t total_nonces = 0;
-    for(uint32_t i = 0; i < n_blocks; ++i)
+    struct hasher_buffer_job job = {dma_buf.handle, bufs->blocks.offset + 64 * i, 1, difficulty,
+                                    (uint32_t)(bufs->results.offset + sizeof(struct hasher_result) * i), 0, 1, 0};
+    return job;
+}
+
+// Maps the completion ring of the driver and asks for an interrupt on every entry.
+// Leaves ring NULL if the driver has none.
+void ring_open(void)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    void* p = mmap(NULL, page, PROT_READ, MAP_SHARED, driver, 0);
+    if(p == MAP_FAILED)
+        return;
+    uint32_t entries = ((struct hasher_ring_header*)p)->entries;
+    munmap(p, page);
+
+    size_t size = HASHER_RING_HEADER_BYTES + entries * sizeof(struct hasher_ring_entry);
+    p = mmap(NULL, size, PROT_READ, MAP_SHARED, driver, 0);
+    uint32_t every = 1;
+    if(p == MAP_FAILED)
+        return;
+    if(ioctl(driver, HASHER_IOC_RING_IRQ, &every) < 0)
     {
-        struct hasher_result res = *((struct hasher_result*)(addr + 24*i));
-        total_nonces += res.nonce;
+        munmap(p, size);
+        return;
     }
+    ring = (struct hasher_ring_header*)p;
+    ring_tail = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    fprintf(stderr, "Completion ring: %u entries\n", entries);
+}
+
+// Like driver_wait(), but hands every ring entry to on_entry as soon as the accelerator
+// appends it. on_entry may queue more jobs and move *last_id forward. Returns once
+// *last_id is finished and the ring is drained, 0 on success.
+int driver_wait_ring(int* last_id, void (*on_entry)(const struct hasher_ring_entry*, void*), void* ctx)
+{
+    struct pollfd pfd = {driver, POLLIN | POLLPRI, 0};
+    struct hasher_completion completion;
+    const struct hasher_ring_entry* entries =
+        (const struct hasher_ring_entry*)((uint8_t*)ring + HASHER_RING_HEADER_BYTES);
 
-    return (double)total_nonces * 1000 / time_taken_ms;
+    while(1)
+    {
+        if(ioctl(driver, HASHER_IOC_COMPLETE, &completion) < 0)
+            return -1;
+        // Read after the completion: the entries of a finished job are all there.
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        while(ring_tail != head)
+            on_entry(&entries[ring_tail++ & (ring->entries - 1)], ctx);
+        if(ioctl(driver, HASHER_IOC_RING_TAIL, &ring_tail) < 0)
+            return -1;
+        if(hasher_job_finished(completion.completed, *last_id))
+            return 0;
+        if(poll(&pfd, 1, -1) < 0)
+            return -1;
+    }
 }
 
-void print_memory_bytes(uint8_t* arr, uint32_t count)
+// Accelerator run of run_experiment() with the completion ring.
+struct requeue_ctx
 {
-    for(uint32_t i = 0; i < count; ++i)
+    const struct job_buffers* bufs;
+    uint32_t n_blocks;
+    uint32_t difficulty;
+    int last_id;
+    uint64_t wasted;
+};
+
+// Submits an exhausted block again with a rolled extranonce as soon as its ring entry
+// shows up, behind the jobs still queued.
+void requeue_entry(const struct hasher_ring_entry* entry, void* arg)
+{
+    struct requeue_ctx* ctx = (struct requeue_ctx*)arg;
+    struct hasher_result* results = (struct hasher_result*)ctx->bufs->results.virtual_addr;
+    uint64_t results_phys = ctx->bufs->results.physical_addr;
+    uint32_t i = (entry->result - results_phys) / sizeof(struct hasher_result);
+
+    if(entry->status != HASHER_STATUS_EXHAUSTED || entry->result < results_phys || i >= ctx->n_blocks)
+        return;
+    // The job is still running: the driver has not invalidated its records yet.
+    if(dma_sync(ctx->bufs->results.offset + sizeof(struct hasher_result) * i, sizeof(struct hasher_result), HASHER_SYNC_FOR_CPU))
     {
-        printf("%02x", arr[i]);
-        if((i + 1) % 64 == 0)printf("\n");
+        printf("Invalid read from driver\n");
+        exit(-1);
     }
-    printf("\n");
+    ctx->wasted += results[i].nonces;
+    pow_roll_extranonce(ctx->bufs->blocks.virtual_addr + 64 * i);
+    struct hasher_buffer_job job = job_buffers_block(ctx->bufs, i, ctx->difficulty);
+    ctx->last_id = driver_submit(&job, ctx->last_id);
+    if(ctx->last_id < 0)
+    {
+        printf("Invalid read from driver\n");
+        exit(-1);
+    }
+}
+
+// Blocks the accelerator found no nonce for get a rolled extranonce and are submitted
+// again until solved, all queued at once so that the accelerator runs them back to back.
+// Returns the nonces tried by the failed attempts.
+uint64_t requeue_exhausted(const struct job_buffers* bufs, uint32_t n_blocks, uint32_t difficulty)
+{
+    struct hasher_result* results = (struct hasher_result*)bufs->results.virtual_addr;
+    uint64_t wasted = 0;
+    int last_id = -1;
+
+    do
+    {
+        int first_id = last_id;
+        for(uint32_t i = 0; i < n_blocks; ++i)
+        {
+            if(results[i].status != HASHER_STATUS_EXHAUSTED)
+                continue;
+            wasted += results[i].nonces;
+            pow_roll_extranonce(bufs->blocks.virtual_addr + 64 * i);
+            struct hasher_buffer_job job = job_buffers_block(bufs, i, difficulty);
+            last_id = driver_submit(&job, last_id);
+            if(last_id < 0)
+            {
+                printf("Invalid read from driver\n");
+                exit(-1);
+            }
+        }
+        if(last_id == first_id)
+            break;
+        if(driver_wait(last_id))
+        {
+            printf("Invalid read from driver\n");
+            exit(-1);
+        }
+    } while(1);
+    return wasted;
 }
 
-void print_hash_nonces(uint32_t* start_addr, uint8_t block_count)
+// Same for the CPU solver. Returns all nonces hashed.
+uint64_t solve_cpu(uint8_t* blocks, uint32_t n_blocks, uint32_t difficulty, struct hasher_result* results)
 {
-    for(uint32_t b = 0; b < block_count; ++b)
+    uint64_t nonces = cpu_solver_run(cpu_solver, blocks, n_blocks, difficulty, results);
+
+    for(uint32_t i = 0; i < n_blocks; ++i)
     {
-        printf("BLOCK: %u\n", b);
-        printf("\tHASH: ");
-        struct hasher_result res = *(struct hasher_result*)((uint8_t*)start_addr +24*b);
-        printf("%08x%08x%08x%08x%08x",res.a, res.b, res.c, res.d, res.e);
-        printf("\tNONCE: %08x\n", res.nonce);
+        while(results[i].status == HASHER_STATUS_EXHAUSTED)
+        {
+            pow_roll_extranonce(blocks + 64 * i);
+            nonces += cpu_solver_run(cpu_solver, blocks + 64 * i, 1, difficulty, results + i);
+        }
     }
+    return nonces;
 }
 
 void test_device()
@@ -199,7 +463,7 @@ void test_device()
     uint32_t n_blocks = 2;
     uint32_t difficulty = 0xFFFFF000;
 
-	BufferInfo buf = map_udmabuf(1024);
+	BufferInfo buf = get_buffer(1024);
 
     uint32_t * virtual_addr = (uint32_t*)buf.virtual_addr;
     if(!virtual_addr)
@@ -231,9 +495,9 @@ void test_device()
 
 
 
-    struct user_message mex = {(uint64_t)physical_addr, n_blocks, difficulty, (uint64_t)((uint8_t*)physical_addr + 64*n_blocks + 64)};
+    struct hasher_buffer_job job = {buf.handle, 0, n_blocks, difficulty, 64*n_blocks + 64, 0, 1, 0};
 
-    TIME_BLOCK_MS(msec, uint32_t driver_err = read(driver, (void*)&mex, sizeof(mex));)
+    TIME_BLOCK_MS(msec, uint32_t driver_err = driver_run(&job);)
     if(driver_err)
     {
         printf("Invalid read from driver\n");
@@ -243,10 +507,6 @@ void test_device()
     printf("\nDONE EXPERIMENT\n");
     printf("Time: %f (ms)", msec);
     print_hash_nonces((uint32_t*)((uint8_t*)virtual_addr + 64*n_blocks + 64), n_blocks);
-
-
-    munmap(buf.virtual_addr, buf.size);
-
 }
 
 
@@ -257,21 +517,16 @@ struct experiment_stats run_experiment(uint32_t n_blocks, uint32_t difficulty)
 #if DEBUG
     printf("-----------------------------------------------\n\n");
 #endif
-    BufferInfo buf = map_udmabuf(n_blocks * 64 + n_blocks * 24 + 1024);
-    uint32_t * virtual_addr = (uint32_t *) buf.virtual_addr;
-    if(!virtual_addr)
-    {
-        printf("Error cma_alloc\n"); 
-        exit(-1);
-    }
+    struct job_buffers bufs;
+    job_buffers_get(&bufs);
+    struct hasher_result* results = (struct hasher_result*)bufs.results.virtual_addr;
 
-    uint32_t *physical_addr = (uint32_t *)buf.physical_addr;
 #if DEBUG
-    printf("Physical Addr: %x\n", (uint64_t)physical_addr);
+    printf("Physical Addr: %llx\n", (unsigned long long)bufs.blocks.physical_addr);
 #endif
 
 
-    uint64_t *start_address = (uint64_t*)virtual_addr;
+    uint64_t *start_address = (uint64_t*)bufs.blocks.virtual_addr;
     for(uint32_t i = 0; i < n_blocks; ++i)
     {
         for(uint32_t j = 0; j < 8; ++j)
@@ -285,9 +540,32 @@ struct experiment_stats run_experiment(uint32_t n_blocks, uint32_t difficulty)
     print_memory_bytes((uint8_t*)start_address, 64);
 #endif
 
-    struct user_message mex = {(uint64_t)physical_addr, n_blocks, difficulty, (uint64_t)((uint8_t*)physical_addr + 64*n_blocks + 64)};
+    struct hasher_buffer_job job = job_buffers_job(&bufs, n_blocks, difficulty);
 
-    TIME_BLOCK_MS(msec, uint32_t driver_err = read(driver, (void*)&mex, sizeof(mex));)
+    uint64_t wasted_nonces = 0;
+    uint32_t driver_err;
+    struct hasher_pool_stats pool_stats;
+    struct hw_totals before = {}, after = {};
+    if(hw_layout.clusters && !pool)
+        hw_totals_read(&before);
+    TIME_BLOCK_MS(msec,
+        if(pool)
+        {
+            driver_err = hasher_pool_run(pool, bufs.blocks.virtual_addr, n_blocks, difficulty, results, &pool_stats);
+        }
+        else if(ring && !direct)
+        {
+            struct requeue_ctx ctx = {&bufs, n_blocks, difficulty, driver_submit(&job, -1), 0};
+            driver_err = ctx.last_id < 0 || driver_wait_ring(&ctx.last_id, requeue_entry, &ctx);
+            wasted_nonces = ctx.wasted;
+        }
+        else
+        {
+            driver_err = driver_run(&job);
+            if(!driver_err)
+                wasted_nonces = requeue_exhausted(&bufs, n_blocks, difficulty);
+        }
+    )
     if(driver_err)
     {
         printf("Invalid read from driver\n");
@@ -297,40 +575,32 @@ struct experiment_stats run_experiment(uint32_t n_blocks, uint32_t difficulty)
 #if DEBUG
     printf("\nDONE EXPERIMENT\n");
     printf("Time: %f (ms)", msec);
-    print_hash_nonces((uint32_t*)((uint8_t*)virtual_addr + n_blocks * 64 + 64), n_blocks);
+    print_hash_nonces((uint32_t*)results, n_blocks);
 #endif
 
     res.time_taken_ms = msec;
-    res.hash_per_sec = compute_avg_hash_per_second((uint8_t*)virtual_addr + n_blocks * 64 + 64, n_blocks, msec);
-
-    munmap(buf.virtual_addr, buf.size);
-    return res;
-}
-
-struct hasher_result compute_hash_block_cpu(uint8_t* addr, uint32_t difficulty)
-{
-    uint32_t nonce = 0;
-    struct hasher_result final_result;
-    while(1)
+    memset(&hw_last, 0, sizeof(hw_last));
+    if(hw_layout.clusters && !pool)
     {
-        *(uint32_t*)(addr + 60) = nonce;
-        struct internal_state res = sha1(addr, 64);
-        if(!(res.A & difficulty))
-        {
-            //Nonce found
-            final_result.a = res.A;
-            final_result.b = res.B;
-            final_result.c = res.C;
-            final_result.d = res.D;
-            final_result.e = res.E;
-            final_result.nonce = nonce;
-            break;
-        }
-        nonce += 1;
+        hw_totals_read(&after);
+        hw_last.hashes = after.hashes - before.hashes;
+        hw_last.job_cycles = after.job_cycles - before.job_cycles;
+        hw_last.fetch_cycles = after.fetch_cycles - before.fetch_cycles;
+        hw_last.writeback_cycles = after.writeback_cycles - before.writeback_cycles;
+        hw_last.idle_cycles = after.idle_cycles - before.idle_cycles;
     }
-    return final_result;
-}
+    // The counters see every nonce hashed, those of the losing hashers included.
+    if(hw_last.hashes)
+        res.hash_per_sec = (double)hw_last.hashes * 1000 / msec;
+    else if(pool)
+        res.hash_per_sec = (double)pool_stats.nonces * 1000 / msec;
+    else
+        res.hash_per_sec = compute_avg_hash_per_second((uint8_t*)results, n_blocks, msec)
+                         + (double)wasted_nonces * 1000 / msec;
+    job_buffers_put(&bufs);
 
+    return res;
+}
 
 struct experiment_stats run_experiment_cpu(uint32_t n_blocks, uint32_t difficulty)
 {
@@ -339,16 +609,10 @@ struct experiment_stats run_experiment_cpu(uint32_t n_blocks, uint32_t difficult
 #if DEBUG
     printf("-----------------------------------------------\n\n");
 #endif
-	BufferInfo buf = map_udmabuf(n_blocks * 64 + n_blocks * 24 + 1024);
+    struct job_buffers bufs;
+    job_buffers_get(&bufs);
 
-    uint32_t * virtual_addr = (uint32_t*)buf.virtual_addr;
-    if(!virtual_addr)
-    {
-        printf("Error cma_alloc\n"); 
-        exit(-1);
-    }
-
-    uint64_t *start_address = (uint64_t*)virtual_addr;
+    uint64_t *start_address = (uint64_t*)bufs.blocks.virtual_addr;
     for(uint32_t i = 0; i < n_blocks; ++i)
     {
         for(uint32_t j = 0; j < 8; ++j)
@@ -363,34 +627,166 @@ struct experiment_stats run_experiment_cpu(uint32_t n_blocks, uint32_t difficult
 #endif
 
 
-    clock_t diff = 0;
-    uint32_t tot_nonces = 0;
-    clock_t start = clock();
+    // Wall-clock time over all worker threads, results go where the accelerator writes them
+    struct hasher_result* results = (struct hasher_result*)bufs.results.virtual_addr;
+    TIME_BLOCK_MS(msec, uint64_t tot_nonces = solve_cpu((uint8_t*)start_address, n_blocks, difficulty, results);)
+#if DEBUG
+    printf("\nDONE EXPERIMENT\n");
+    printf("Time: %f (ms)", msec);
+#endif
+
+    res.time_taken_ms = msec;
+    res.hash_per_sec = (double)tot_nonces * 1000 / msec;
+    job_buffers_put(&bufs);
+
+    return res;
+}
+
+// Layout of the batch handed to the accelerator by the hybrid scheduler.
+struct fpga_batch
+{
+    uint32_t handle;            // driver buffer holding blocks and results
+    uint32_t blocks_offset;
+    uint32_t results_offset;
+    uint8_t* blocks;            // the same, mapped
+    struct hasher_result* results;
+    // Where the accelerator writes its records, results unless the buffer is cached.
+    const struct hasher_result* dma_results;
+};
+
+int fpga_solve(void* ctx, uint32_t first, uint32_t n_blocks, uint32_t difficulty)
+{
+    struct fpga_batch* batch = (struct fpga_batch*)ctx;
+    if(pool)
+    {
+        struct hasher_pool_stats pool_stats;
+        return hasher_pool_run(pool, batch->blocks + 64 * first, n_blocks, difficulty, batch->results + first, &pool_stats);
+    }
+    struct hasher_buffer_job job = {batch->handle, batch->blocks_offset + 64 * first, n_blocks, difficulty,
+                                    (uint32_t)(batch->results_offset + sizeof(struct hasher_result) * first), 0, 1, 0};
+
+    if(driver_run(&job))
+        return -1;
+    if(batch->dma_results != batch->results)
+        memcpy(batch->results + first, batch->dma_results + first, sizeof(struct hasher_result) * n_blocks);
+    return 0;
+}
+
+struct experiment_stats run_experiment_hybrid(uint32_t n_blocks, uint32_t difficulty)
+{
+
+    struct experiment_stats res;
+#if DEBUG
+    printf("-----------------------------------------------\n\n");
+#endif
+    struct job_buffers bufs;
+    job_buffers_get(&bufs);
 
+    uint64_t *start_address = (uint64_t*)bufs.blocks.virtual_addr;
     for(uint32_t i = 0; i < n_blocks; ++i)
     {
-        start = clock();
-        struct hasher_result res = compute_hash_block_cpu((uint8_t*)start_address + 64*i, difficulty);
-        diff += (clock() - start);
-        tot_nonces += res.nonce;
+        for(uint32_t j = 0; j < 8; ++j)
+        {
+            *(start_address + i * 8 + j) = rand(); 
+        }
+
     }
 
+    // Same layout as run_experiment(), the CPU writes its results where the accelerator would.
+    // Not in a cached buffer: two records share a cache line, and a line the CPU dirtied
+    // would be written back over the record next to it. The CPU then writes to
+    // host_results and the accelerator records are copied there.
+    static struct fpga_batch batch;
+    batch.handle = dma_buf.handle;
+    batch.blocks_offset = bufs.blocks.offset;
+    batch.results_offset = bufs.results.offset;
+    if (!hybrid)
+        hybrid = hybrid_create(cpu_solver, fpga_solve, &batch);
+    static std::vector<struct hasher_result> host_results;
+    struct hasher_result* results = (struct hasher_result*)bufs.results.virtual_addr;
+    batch.dma_results = results;
+    if(dma_flags & HASHER_BUFFER_CACHED)
+    {
+        host_results.resize(n_blocks);
+        results = host_results.data();
+    }
+    batch.blocks = (uint8_t*)start_address;
+    batch.results = results;
+
+    struct hybrid_stats stats;
+    TIME_BLOCK_MS(msec, int hybrid_err = hybrid_run(hybrid, (uint8_t*)start_address, n_blocks, difficulty, results, &stats);)
+    if(hybrid_err)
+    {
+        fprintf(stderr, "Accelerator failed during hybrid run\n");
+    }
 
-    double msec = ((double)diff / CLOCKS_PER_SEC) * 1000;
 #if DEBUG
     printf("\nDONE EXPERIMENT\n");
-    printf("Time: %f (ms)", msec);
+    printf("Time: %f (ms), blocks FPGA/CPU: %u/%u\n", msec, stats.fpga_blocks, stats.cpu_blocks);
+    print_hash_nonces((uint32_t*)results, n_blocks);
 #endif
 
     res.time_taken_ms = msec;
-    res.hash_per_sec = (double)tot_nonces * 1000 / msec;
+    res.hash_per_sec = (double)(stats.fpga_nonces + stats.cpu_nonces) * 1000 / msec;
+    job_buffers_put(&bufs);
 
-    munmap(buf.virtual_addr, buf.size);
+    return res;
+}
+
+// Pipelined run: batches of random blocks, prepared and checked by this thread while
+// the accelerator hashes the previous ones.
+void fill_random(void* ctx, uint64_t seq, uint8_t* blocks, uint32_t n_blocks)
+{
+    uint64_t *start_address = (uint64_t*)blocks;
+    for(uint32_t i = 0; i < n_blocks * 8; ++i)
+        start_address[i] = rand();
+}
+
+struct check_ctx
+{
+    uint32_t difficulty;
+    uint32_t invalid;           // blocks whose record does not hold a valid hash
+};
+
+void check_results(void* arg, uint64_t seq, const uint8_t* blocks, const struct hasher_result* results, uint32_t n_blocks)
+{
+    struct check_ctx* ctx = (struct check_ctx*)arg;
+    for(uint32_t i = 0; i < n_blocks; ++i)
+        if(results[i].status != HASHER_STATUS_FOUND || (results[i].a & ctx->difficulty))
+            ctx->invalid++;
+}
+
+struct experiment_stats run_experiment_pipelined(uint32_t n_blocks, uint32_t difficulty)
+{
+    struct experiment_stats res;
+    struct check_ctx check = {difficulty, 0};
+
+    struct batch_pipeline* pipe = batch_pipeline_create(driver, dma_buf.handle, arena, blocks_class, results_class, pipeline_depth);
+    if(!pipe)
+    {
+        dma_arena_print_stats(arena);
+        printf("Error: no free DMA slab\n");
+        exit(-1);
+    }
+    if(batch_pipeline_run(pipe, PIPELINE_RUN_BATCHES, n_blocks, difficulty, fill_random, check_results, &check, &pipeline_stats))
+    {
+        printf("Invalid read from driver\n");
+        exit(-1);
+    }
+    batch_pipeline_destroy(pipe);
+    if(check.invalid)
+        fprintf(stderr, "Pipelined run: %u blocks without a valid hash\n", check.invalid);
+
+    res.time_taken_ms = pipeline_stats.total_ms / pipeline_stats.batches;
+    res.hash_per_sec = (double)pipeline_stats.nonces * 1000 / pipeline_stats.total_ms;
     return res;
 }
 
 int main(int argc, char **argv)
 {
+    struct bench_options options = {DEFAULT_MAX_BLOCKS, DEFAULT_N_EXPERIMENTS, DEFAULT_WARMUPS,
+                                    16, DEFAULT_MAX_DIFFICULTY, 4, BENCH_JSON, NULL, NULL, 0};
+
     driver = open(DRIVER_NAME, O_RDWR);
     if (driver == -1)
     {
@@ -406,95 +802,100 @@ int main(int argc, char **argv)
         return 0;
     }
 
-    // Argument parsing
-    uint32_t MAX_BLOCKS;
-    uint32_t N_EXPERIMENTS;
-    uint32_t MAX_DIFFICULTY;
-
-    if (argc == 1)
+    if (bench_parse_args(argc, argv, &options, "accelerator,cpu,hybrid,pipelined"))
     {
-        MAX_BLOCKS = DEFAULT_MAX_BLOCKS;
-        N_EXPERIMENTS = DEFAULT_N_EXPERIMENTS;
-        MAX_DIFFICULTY = DEFAULT_MAX_DIFFICULTY;
+        printf("       %s test\n", argv[0]);
+        exit(-1);
     }
-    else if (argc == 4)
+    // Informational output on stderr, stdout is the report.
+    ring_open();
+    if(getenv("HASHER_CACHED") && atoi(getenv("HASHER_CACHED")))
+        dma_flags = HASHER_BUFFER_CACHED;
+    // Sized for the largest batch once, so that experiments do not pay for it.
+    if(options.max_blocks > HASHER_MAX_BLOCKS || arena_open(options.max_blocks))
     {
-        MAX_BLOCKS = atoi(argv[1]);
-        N_EXPERIMENTS = atoi(argv[2]);
-        MAX_DIFFICULTY = atoi(argv[3]);
+        printf("Error allocating the DMA buffer for %u blocks (at most %u)\n", options.max_blocks, HASHER_MAX_BLOCKS);
+        exit(-1);
     }
-    else
+    pool = hasher_pool_open(DRIVER_PREFIX, options.max_blocks);
+    if(pool && hasher_pool_devices(pool) < 2)
     {
-        printf("usage: ./master [test] OR ./master max_blocks experiments max_difficulty\n");
-        exit(-1);
+        hasher_pool_close(pool);
+        pool = NULL;
     }
-
-    printf("----------------------------\n");
-    printf("Press ENTER to start experiments\n");
-    getchar();
-
-    if (MAX_DIFFICULTY > 32)
+    if(!pool && getenv("HASHER_DIRECT") && atoi(getenv("HASHER_DIRECT")))
     {
-        printf("Invalid difficulty selected\n");
-        exit(-1);
+        direct = hasher_direct_open(driver);
+        if(!direct)
+            fprintf(stderr, "Direct register access refused by the driver (direct_access=0?)\n");
     }
+    if(getenv("HASHER_PIPELINE_DEPTH"))
+        pipeline_depth = atoi(getenv("HASHER_PIPELINE_DEPTH"));
+    // The pipeline queues batches in the driver of one instance.
+    if(pool || direct || pipeline_depth > BATCH_PIPELINE_MAX_DEPTH)
+        pipeline_depth = 0;
+    struct cpu_solver_config solver_config;
+    cpu_solver_config_from_env(&solver_config);
+    cpu_solver = cpu_solver_create(&solver_config);
+    // Fails on bitstreams without the counters and with perf_counters=0.
+    if(pool || ioctl(driver, HASHER_IOC_PERF, &hw_layout) < 0)
+        hw_layout.clusters = 0;
+
+    struct bench_report* report = bench_report_open(&options, "hasher-test-aarch64");
+    bench_report_meta(report, "dma", "%s", dma_flags & HASHER_BUFFER_CACHED ? "cached" : "coherent");
+    bench_report_meta(report, "accelerators", "%u", pool ? hasher_pool_devices(pool) : 1);
+    bench_report_meta(report, "submission", "%s", direct ? "direct" : ring ? "ring" : "read");
+    bench_report_meta(report, "cpu_kernel", "%s", pow_get_kernel()->name);
+    bench_report_meta(report, "cpu_threads", "%u", cpu_solver_threads(cpu_solver));
+    bench_report_meta(report, "pipeline_depth", "%u", pipeline_depth);
+    bench_report_meta(report, "pipeline_batches", "%u", PIPELINE_RUN_BATCHES);
+    bench_report_meta(report, "perf_counters", "%s", hw_layout.clusters ? "on" : "off");
 
     // Consistent experiments
     srand(12);
 
-    struct experiment_stats stats_accel;
-    struct experiment_stats stats_cpu;
-    double temp = 0.0;
-
-    printf("[\n");
-    for (uint32_t d = 16; d <= MAX_DIFFICULTY; d += 4)
+    for (uint32_t d = options.min_difficulty; d <= options.max_difficulty; d += options.difficulty_step)
     {
-        uint32_t difficulty = 0xFFFFFFFF & (0xFFFFFFFF << (32 - d));
-        printf("{\n");
-        printf("\"DIFFICULTY\": \"%08x\",\n", difficulty);
-        printf("\"BLOCK_EXPERIMENTS\": [\n");
-
-        for (uint32_t i = 1; i < MAX_BLOCKS; ++i)
+        for (uint32_t i = 1; i < options.max_blocks; ++i)
         {
-            double avg_time_accel = 0.0, max_time_accel = 0.0, min_time_accel = 1e8, hash_per_sec_accel = 0.0;
-            double avg_time_cpu = 0.0, max_time_cpu = 0.0, min_time_cpu = 1e8, hash_per_sec_cpu = 0.0;
-
-            for (uint32_t j = 0; j < N_EXPERIMENTS; ++j)
+            // Where the cycles of the jobs of the last run went.
+            if (bench_measure(report, "accelerator", i, d, run_experiment) && hw_last.job_cycles)
             {
-                stats_accel = run_experiment(i, difficulty);
-                temp = stats_accel.time_taken_ms;
-                if (temp > max_time_accel) max_time_accel = temp;
-                if (temp < min_time_accel) min_time_accel = temp;
-                avg_time_accel += temp;
-                hash_per_sec_accel += stats_accel.hash_per_sec;
-
-                stats_cpu = run_experiment_cpu(i, difficulty);
-                temp = stats_cpu.time_taken_ms;
-                if (temp > max_time_cpu) max_time_cpu = temp;
-                if (temp < min_time_cpu) min_time_cpu = temp;
-                avg_time_cpu += temp;
-                hash_per_sec_cpu += stats_cpu.hash_per_sec;
+                struct hw_totals* h = &hw_last;
+                bench_report_extra(report, "hw_hashes", h->hashes);
+                bench_report_extra(report, "fetch_share", (double)h->fetch_cycles / h->job_cycles);
+                bench_report_extra(report, "writeback_share", (double)h->writeback_cycles / h->job_cycles);
+                bench_report_extra(report, "idle_share", (double)h->idle_cycles / (h->job_cycles * hw_layout.clusters));
+                if (hw_layout.clock_hz)
+                {
+                    bench_report_extra(report, "hw_job_ms", (double)h->job_cycles * 1000 / hw_layout.clock_hz);
+                    bench_report_extra(report, "hw_hash_per_sec", (double)h->hashes * hw_layout.clock_hz / h->job_cycles);
+                }
+            }
+            bench_measure(report, "cpu", i, d, run_experiment_cpu);
+            bench_measure(report, "hybrid", i, d, run_experiment_hybrid);
+            // Time per batch of the last run broken down by stage.
+            if (pipeline_depth && bench_measure(report, "pipelined", i, d, run_experiment_pipelined))
+            {
+                struct batch_pipeline_stats* p = &pipeline_stats;
+                bench_report_extra(report, "prepare_ms", p->prepare_ms / p->batches);
+                bench_report_extra(report, "submit_ms", p->submit_ms / p->batches);
+                bench_report_extra(report, "wait_ms", p->wait_ms / p->batches);
+                bench_report_extra(report, "consume_ms", p->consume_ms / p->batches);
+                bench_report_extra(report, "starved", p->starved);
             }
-
-            printf("{\"Blocks\": %u,\n", i);
-            printf("\"Accelerator\": {\"min_time\": %f, \"max_time\": %f, \"avg_time\": %f, \"avg_hash_per_sec\": %f},\n",
-                   min_time_accel, max_time_accel, avg_time_accel / N_EXPERIMENTS, hash_per_sec_accel / N_EXPERIMENTS);
-            printf("\"CPU\": {\"min_time\": %f, \"max_time\": %f, \"avg_time\": %f, \"avg_hash_per_sec\": %f}\n",
-                   min_time_cpu, max_time_cpu, avg_time_cpu / N_EXPERIMENTS, hash_per_sec_cpu / N_EXPERIMENTS);
-            printf("}");
-            if (i != MAX_BLOCKS - 1)
-                printf(",\n");
         }
-
-        printf("]\n");
-        printf("}");
-        if (d != MAX_DIFFICULTY)
-            printf(",\n");
     }
-    printf("]\n");
-
+    bench_report_close(report);
+
+    if (hybrid)
+        hybrid_destroy(hybrid);
+    if (pool)
+        hasher_pool_close(pool);
+    if (direct)
+        hasher_direct_close(direct);
+    cpu_solver_destroy(cpu_solver);
+    dma_arena_destroy(arena);
     close(driver);
     return 0;
 }
-
-
@@ -6,6 +6,9 @@
 #include "OverlayControl.h"
 #include <time.h>
 #include "sha.h"
+#include "HasherCommon.h"
+#include "DmaArena.h"
+#include "Benchmark.h"
 
 
 extern "C"
@@ -22,93 +25,88 @@ extern "C"
 #define STOP 4
 #define DONE 5
 #define RESULT_ADDRESS 6
+#define START_NONCE 9
+#define NONCE_STRIDE 10
+#define NONCE_LIMIT 11
 
 #define DEFAULT_MAX_BLOCKS 8
 #define DEFAULT_N_EXPERIMENTS 10
 #define DEFAULT_MAX_DIFFICULTY 16 
+#define DEFAULT_WARMUPS 1
 
 #define FUNC_TESTING 0
 #define DEBUG 0
-#define DUMP 0
-
-struct experiment_stats
-{
-    double time_taken_ms;
-    uint64_t hash_per_sec;
-};
-
-// Adjust the size of the mapping to cover all the peripherals, or use multiple mappings.
-const uint32_t MAP_SIZE = 32*1024*1024; // 0x400_0000
-
-uint64_t _bswap64(uint64_t val)
+// Map the DMA memory cacheable: blocks are filled and results read at memory speed,
+// at the cost of a cache flush before every job and an invalidate after it.
+#define CACHED_DMA 0
+
+// One cma_alloc() block for the whole run, carved into a block slab and a result
+// slab sized for the largest batch: experiments allocate nothing.
+struct dma_arena* arena;
+int blocks_class;
+int results_class;
+void* dma_mem;
+
+int arena_open(uint32_t max_blocks)
 {
-    uint64_t res = 0;
-    res |= ((val & 0xff) << 56);
-    res |= ((val & 0xff00) << 40);
-    res |= ((val & 0xff0000) << 24);
-    res |= ((val & 0xff000000) << 8);
-    res |= ((val & 0xff00000000) >> 8);
-    res |= ((val & 0xff0000000000) >> 24);
-    res |= ((val & 0xff000000000000) >> 40);
-    res |= ((val & 0xff00000000000000) >> 56);
-    return res;
+    uint32_t blocks_size = (max_blocks * 64 + DMA_ARENA_ALIGN - 1) & ~(DMA_ARENA_ALIGN - 1);
+    uint32_t results_size = (max_blocks * sizeof(struct hasher_result) + DMA_ARENA_ALIGN - 1) & ~(DMA_ARENA_ALIGN - 1);
+    uint32_t size = blocks_size + results_size + DMA_ARENA_ALIGN;
+
+    dma_mem = cma_alloc(size, CACHED_DMA);
+    if(!dma_mem)
+        return -1;
+    arena = dma_arena_create(dma_mem, (uintptr_t)cma_get_phy_addr(dma_mem), size);
+    blocks_class = dma_arena_add_class(arena, blocks_size, 1);
+    results_class = dma_arena_add_class(arena, results_size, 1);
+    return blocks_class < 0 || results_class < 0 ? -1 : 0;
 }
 
-uint32_t _bswap32(uint32_t val)
+void arena_close(void)
 {
-    uint32_t res = 0;
-    res |= ((val & 0xff) << 24);
-    res |= ((val & 0xff00) << 8);
-    res |= ((val & 0xff0000) >> 8);
-    res |= ((val & 0xff000000) >> 24);
-    return res;
+    dma_arena_destroy(arena);
+    cma_free(dma_mem);
 }
 
-struct hasher_result
+void slabs_get(struct dma_slab* blocks, struct dma_slab* results)
 {
-    uint32_t b;
-    uint32_t a;
-    uint32_t d;
-    uint32_t c;
-    uint32_t nonce;
-    uint32_t e;
-}__attribute((packed))__;
-
-
-uint64_t compute_avg_hash_per_second(uint8_t *addr, uint32_t n_blocks, double time_taken_ms)
-{
-    uint64_t total_nonces = 0;
-    for(uint32_t i = 0; i < n_blocks; ++i)
+    if(dma_arena_alloc(arena, blocks_class, blocks) || dma_arena_alloc(arena, results_class, results))
     {
-        struct hasher_result res = *((struct hasher_result*)(addr + 24*i));
-        total_nonces += res.nonce;
+        dma_arena_print_stats(arena);
+        printf("Error: no free DMA slab\n");
+        exit(-1);
     }
+}
 
-    return (double)total_nonces * 1000 / time_taken_ms;
+void slabs_put(const struct dma_slab* blocks, const struct dma_slab* results)
+{
+    dma_arena_free(arena, blocks_class, blocks);
+    dma_arena_free(arena, results_class, results);
 }
 
-void print_memory_bytes(uint8_t* arr, uint32_t count)
+// Before the accelerator reads the blocks and writes the results: write back the
+// blocks, and no dirty line of the results may be evicted over its records.
+void slabs_for_device(const struct dma_slab* blocks, const struct dma_slab* results, uint32_t n_blocks)
 {
-    for(uint32_t i = 0; i < count; ++i)
-    {
-        printf("%02x", arr[i]);
-        if((i + 1) % 64 == 0)printf("\n");
-    }
-    printf("\n");
+#if CACHED_DMA
+    cma_flush_cache(blocks->virtual_addr, blocks->physical_addr, n_blocks * 64);
+    cma_flush_cache(results->virtual_addr, results->physical_addr, n_blocks * sizeof(struct hasher_result));
+#endif
 }
 
-void print_hash_nonces(uint32_t* start_addr, uint8_t block_count)
+// Before the CPU reads the records the accelerator wrote.
+void slabs_for_cpu(const struct dma_slab* results, uint32_t n_blocks)
 {
-    for(uint32_t b = 0; b < block_count; ++b)
-    {
-        printf("BLOCK: %u\n", b);
-        printf("\tHASH: ");
-        struct hasher_result res = *(struct hasher_result*)((uint8_t*)start_addr +24*b);
-        printf("%08x%08x%08x%08x%08x",res.a, res.b, res.c, res.d, res.e);
-        printf("\tNONCE: %08x\n", res.nonce);
-    }
+#if CACHED_DMA
+    cma_invalidate_cache(results->virtual_addr, results->physical_addr, n_blocks * sizeof(struct hasher_result));
+#endif
 }
 
+// Adjust the size of the mapping to cover all the peripherals, or use multiple mappings.
+const uint32_t MAP_SIZE = 32*1024*1024; // 0x400_0000
+
+volatile uint32_t * SLAVE;
+
 void test_device(volatile uint32_t* SLAVE)
 {
 
@@ -152,9 +150,12 @@ void test_device(volatile uint32_t* SLAVE)
     *(SLAVE + STOP) = 0;
     *(SLAVE + DIFFICULTY) = 0xFFFFF000;
     *(SLAVE + RESULT_ADDRESS) = (uint32_t)((uint8_t*)physical_addr + 512);
+    // Whole nonce space of every block, from 0
+    *(SLAVE + START_NONCE) = 0;
+    *(SLAVE + NONCE_STRIDE) = 1;
+    *(SLAVE + NONCE_LIMIT) = 0;
 
-    clock_t diff;
-    clock_t start = clock();
+    double start = bench_now_ms();
 
     *(SLAVE + START) = 0x1;
     *(SLAVE + START) = 0x0;
@@ -162,9 +163,7 @@ void test_device(volatile uint32_t* SLAVE)
 
     while(!(*(SLAVE + DONE))){}
 
-    diff = clock() - start;
-
-    double msec = ((double)diff / CLOCKS_PER_SEC) * 1000;
+    double msec = bench_now_ms() - start;
 #if DEBUG
     printf("\nDONE EXPERIMENT\n");
     printf("Time: %f (ms)", msec);
@@ -177,7 +176,7 @@ void test_device(volatile uint32_t* SLAVE)
 }
 
 
-struct experiment_stats run_experiment(volatile uint32_t* SLAVE, uint32_t n_blocks, uint32_t difficulty)
+struct experiment_stats run_experiment(uint32_t n_blocks, uint32_t difficulty)
 {
     // To make all experiments the same
     srand(30);
@@ -185,20 +184,14 @@ struct experiment_stats run_experiment(volatile uint32_t* SLAVE, uint32_t n_bloc
 #if DEBUG
     printf("-----------------------------------------------\n\n");
 #endif
-    uint32_t * virtual_addr = (uint32_t *) cma_alloc(n_blocks * 64 + n_blocks * 24 + 1024, 0);
-    if(!virtual_addr)
-    {
-        printf("Error cma_alloc\n"); 
-        exit(-1);
-    }
-
-    uint32_t *physical_addr = (uint32_t *)cma_get_phy_addr(virtual_addr);
+    struct dma_slab blocks, results;
+    slabs_get(&blocks, &results);
 #if DEBUG
-    printf("Physical Addr: %x\n", (uint32_t)physical_addr);
+    printf("Physical Addr: %x\n", (uint32_t)blocks.physical_addr);
 #endif
 
 
-    uint64_t *start_address = (uint64_t*)virtual_addr;
+    uint64_t *start_address = (uint64_t*)blocks.virtual_addr;
     for(uint32_t i = 0; i < n_blocks; ++i)
     {
         for(uint32_t j = 0; j < 8; ++j)
@@ -212,17 +205,21 @@ struct experiment_stats run_experiment(volatile uint32_t* SLAVE, uint32_t n_bloc
     print_memory_bytes((uint8_t*)start_address, 64);
 #endif
 
-    *(SLAVE + BLOCK_ADDRESS) = (uint32_t)physical_addr;
+    *(SLAVE + BLOCK_ADDRESS) = (uint32_t)blocks.physical_addr;
     *(SLAVE + N_BLOCKS) = n_blocks;
     *(SLAVE + START) = 0;
     *(SLAVE + STOP) = 1;
     for(volatile uint32_t i = 0; i < 1000; ++i);
     *(SLAVE + STOP) = 0;
     *(SLAVE + DIFFICULTY) = difficulty;
-    *(SLAVE + RESULT_ADDRESS) = (uint32_t)((uint8_t*)physical_addr + n_blocks * 64 + 64);
+    *(SLAVE + RESULT_ADDRESS) = (uint32_t)results.physical_addr;
+    // Whole nonce space of every block, from 0
+    *(SLAVE + START_NONCE) = 0;
+    *(SLAVE + NONCE_STRIDE) = 1;
+    *(SLAVE + NONCE_LIMIT) = 0;
+    slabs_for_device(&blocks, &results, n_blocks);
 
-    clock_t diff;
-    clock_t start = clock();
+    double start = bench_now_ms();
 
     *(SLAVE + START) = 0x1;
     *(SLAVE + START) = 0x0;
@@ -230,19 +227,19 @@ struct experiment_stats run_experiment(volatile uint32_t* SLAVE, uint32_t n_bloc
 
     while(!(*(SLAVE + DONE))){}
 
-    diff = clock() - start;
+    double msec = bench_now_ms() - start;
+    slabs_for_cpu(&results, n_blocks);
 
-    double msec = ((double)diff / CLOCKS_PER_SEC) * 1000;
 #if DEBUG
     printf("\nDONE EXPERIMENT\n");
     printf("Time: %f (ms)", msec);
-    print_hash_nonces((uint32_t*)((uint8_t*)virtual_addr + n_blocks * 64 + 64), n_blocks);
+    print_hash_nonces((uint32_t*)results.virtual_addr, n_blocks);
 #endif
 
     res.time_taken_ms = msec;
-    res.hash_per_sec = compute_avg_hash_per_second((uint8_t*)virtual_addr + n_blocks * 64 + 64, n_blocks, msec);
+    res.hash_per_sec = compute_avg_hash_per_second(results.virtual_addr, n_blocks, msec);
 
-    cma_free(virtual_addr);
+    slabs_put(&blocks, &results);
     return res;
 }
 
@@ -250,41 +247,24 @@ struct experiment_stats run_experiment(volatile uint32_t* SLAVE, uint32_t n_bloc
 
 int main(int argc, char ** argv)
 {
-#if DUMP
-    freopen("log.txt", "w", stdout);
-#endif
-
-    uint32_t MAX_BLOCKS;
-    uint32_t N_EXPERIMENTS;
-    uint32_t MAX_DIFFICULTY;
+    struct bench_options options = {DEFAULT_MAX_BLOCKS, DEFAULT_N_EXPERIMENTS, DEFAULT_WARMUPS,
+                                    4, DEFAULT_MAX_DIFFICULTY, 4, BENCH_JSON, NULL, NULL, 0};
 
-    if (argc == 1)
-    {
-        MAX_BLOCKS = DEFAULT_MAX_BLOCKS;
-        N_EXPERIMENTS = DEFAULT_N_EXPERIMENTS;
-        MAX_DIFFICULTY = DEFAULT_MAX_DIFFICULTY;
-    }
-    else if(argc == 4)
-    {
-        MAX_BLOCKS = atoi(argv[1]);
-        N_EXPERIMENTS = atoi(argv[2]);
-        MAX_DIFFICULTY = atoi(argv[3]);
-    }
-    else
-    {
-        printf("usage: ./master max_blocks experiments max_difficulty\n");
+    if(bench_parse_args(argc, argv, &options, "accelerator"))
         exit(-1);
-    }
 
     volatile uint8_t * device = NULL;
-    volatile uint32_t * SLAVE;
 
-#if not DUMP
-    printf("\n\nThis program requires that the GPIO buttons and LEDs bitstream is loaded in the FPGA.\n");
-    printf("This program has to be run with sudo.\n");
-    printf("Press ENTER to confirm that the bitstream is loaded (proceeding without it can crash the board).\n\n");
-#endif
-    getchar();
+    // Informational output on stderr, stdout is the report.
+    fprintf(stderr, "This program requires that the hasher bitstream is loaded in the FPGA.\n");
+    fprintf(stderr, "This program has to be run with sudo.\n");
+    // Nothing tells from userspace whether the bitstream is there: touching its registers
+    // without it can hang the bus. Scripts that loaded it themselves pass -y.
+    if(!options.assume_yes)
+    {
+        fprintf(stderr, "Press ENTER to confirm that the bitstream is loaded (proceeding without it can crash the board).\n");
+        getchar();
+    }
 
     // Obtain a pointer to access the peripherals in the address map.
     device = (uint8_t*) MapMemIO(BASE_MAP, MAP_SIZE);
@@ -292,74 +272,33 @@ int main(int argc, char ** argv)
         printf("Error opening device!\n");
         exit(-1);
     }
-#if not DUMP
-    printf("Mmap done. Peripherals at %08X\n", (uint32_t)device);
-#endif
+    fprintf(stderr, "Mmap done. Peripherals at %08X\n", (uint32_t)device);
 
     SLAVE = (uint32_t*)(device);
 
-#if not DUMP
-    printf("----------------------------");
-    printf("Press ENTER to start experiments\n");
-#endif
-    getchar();
-
-#if FUNC_TESTING == 0
-
-    struct experiment_stats stats;
-    double temp = 0.0;
-
-    if(MAX_DIFFICULTY > 32)
+    if(arena_open(options.max_blocks))
     {
-        printf("Invalid difficulty selected\n");
+        printf("Error cma_alloc\n");
         exit(-1);
     }
 
-    printf("[\n");
-    for(uint32_t d = 4; d <= MAX_DIFFICULTY; d += 4)
-    {
-        uint32_t difficulty = 0xFFFFFFFF & (0xFFFFFFFF << (32 - d));
-        printf("{\n");
-        printf("\"DIFFICULTY\": \"%08x\",\n", difficulty);
-        printf("\"BLOCK_EXPERIMENTS\": [\n");
-        for(uint32_t i = 1; i < MAX_BLOCKS; ++i)
-        {
-            double avg = 0.0;
-            double max = 0.0;
-            double min = 100000000.0;
-            double hash_per_sec = 0;
-            for(uint32_t j = 0; j < N_EXPERIMENTS; ++j)
-            {
-                stats = run_experiment(SLAVE, i, difficulty);
-                temp = stats.time_taken_ms;
-                if(temp > max)max = temp;
-                else if (temp < min)min=temp;
-                avg += temp;
-                hash_per_sec += stats.hash_per_sec;
-            }
-            printf("{\"Blocks\": %u, \"min_time\": %f, \"max_time\": %f, \"avg_time\": %f, \"avg_hash_per_sec\": %f}", i, min, max, avg / N_EXPERIMENTS, hash_per_sec / N_EXPERIMENTS);
-            if(i != MAX_BLOCKS - 1)
-                printf(",\n");
-        }
-        printf("]\n");
-        printf("}");
-        //IF WE CHANGE INCREMENT VALUE REMEMBER TO CHANGE THIS TOO
-        if(d != MAX_DIFFICULTY)
-            printf(",\n");
-    }
-    printf("]\n");
+#if FUNC_TESTING == 0
+
+    struct bench_report* report = bench_report_open(&options, "master");
+    bench_report_meta(report, "dma", "%s", CACHED_DMA ? "cached" : "coherent");
+    for(uint32_t d = options.min_difficulty; d <= options.max_difficulty; d += options.difficulty_step)
+        for(uint32_t i = 1; i < options.max_blocks; ++i)
+            bench_measure(report, "accelerator", i, d, run_experiment);
+    bench_report_close(report);
 
 
     //////////////////////////////////////////////  
 
     UnmapMemIO();
-#if DUMP
-    fclose(stdout);
-#endif
+    arena_close();
 #else
     test_device(SLAVE);
 #endif
 
     return 0;
 }
-
@@ -3,18 +3,14 @@
 #include <stdint.h>
 #include <time.h>
 #include <unistd.h>
+#include <errno.h>
 #include "OverlayControl.h"
 #include <time.h>
-#include "sha.h"
-
-
-// Structure used to pass commands between user-space and kernel-space.
-struct user_message {
-    uint32_t block_address_base;
-    uint32_t n_blocks;
-    uint32_t difficulty;
-    uint32_t result_address;
-};
+#include "CpuHasher.h"
+#include "HasherCommon.h"
+#include "DmaArena.h"
+#include "Benchmark.h"
+#include "driver/hasher_ioctl.h"
 
 
 extern "C"
@@ -27,88 +23,77 @@ extern "C"
 #define DEFAULT_MAX_BLOCKS 16
 #define DEFAULT_N_EXPERIMENTS 5 
 #define DEFAULT_MAX_DIFFICULTY 16 
+#define DEFAULT_WARMUPS 1
 
 #define FUNC_TESTING 0
 #define DEBUG 0
-#define DUMP 0
-#define ACCELERATOR 1
+// Map the DMA memory cacheable: blocks are filled and results read at memory speed,
+// at the cost of a cache flush before every job and an invalidate after it.
+#define CACHED_DMA 0
 
 const char* DRIVER_NAME="/dev/hasher";
 int driver;
 
-struct experiment_stats
-{
-    double time_taken_ms;
-    uint64_t hash_per_sec;
-};
+// One cma_alloc() block for the whole run, carved into a block slab and a result
+// slab sized for the largest batch: experiments allocate nothing.
+struct dma_arena* arena;
+int blocks_class;
+int results_class;
+void* dma_mem;
 
-uint64_t _bswap64(uint64_t val)
+int arena_open(uint32_t max_blocks)
 {
-    uint64_t res = 0;
-    res |= ((val & 0xff) << 56);
-    res |= ((val & 0xff00) << 40);
-    res |= ((val & 0xff0000) << 24);
-    res |= ((val & 0xff000000) << 8);
-    res |= ((val & 0xff00000000) >> 8);
-    res |= ((val & 0xff0000000000) >> 24);
-    res |= ((val & 0xff000000000000) >> 40);
-    res |= ((val & 0xff00000000000000) >> 56);
-    return res;
+    uint32_t blocks_size = (max_blocks * 64 + DMA_ARENA_ALIGN - 1) & ~(DMA_ARENA_ALIGN - 1);
+    uint32_t results_size = (max_blocks * sizeof(struct hasher_result) + DMA_ARENA_ALIGN - 1) & ~(DMA_ARENA_ALIGN - 1);
+    uint32_t size = blocks_size + results_size + DMA_ARENA_ALIGN;
+
+    dma_mem = cma_alloc(size, CACHED_DMA);
+    if(!dma_mem)
+        return -1;
+    arena = dma_arena_create(dma_mem, (uintptr_t)cma_get_phy_addr(dma_mem), size);
+    blocks_class = dma_arena_add_class(arena, blocks_size, 1);
+    results_class = dma_arena_add_class(arena, results_size, 1);
+    return blocks_class < 0 || results_class < 0 ? -1 : 0;
 }
 
-uint32_t _bswap32(uint32_t val)
+void arena_close(void)
 {
-    uint32_t res = 0;
-    res |= ((val & 0xff) << 24);
-    res |= ((val & 0xff00) << 8);
-    res |= ((val & 0xff0000) >> 8);
-    res |= ((val & 0xff000000) >> 24);
-    return res;
+    dma_arena_destroy(arena);
+    cma_free(dma_mem);
 }
 
-struct hasher_result
-{
-    uint32_t b;
-    uint32_t a;
-    uint32_t d;
-    uint32_t c;
-    uint32_t nonce;
-    uint32_t e;
-}__attribute((packed))__;
-
-
-uint64_t compute_avg_hash_per_second(uint8_t *addr, uint32_t n_blocks, double time_taken_ms)
+void slabs_get(struct dma_slab* blocks, struct dma_slab* results)
 {
-    uint64_t total_nonces = 0;
-    for(uint32_t i = 0; i < n_blocks; ++i)
+    if(dma_arena_alloc(arena, blocks_class, blocks) || dma_arena_alloc(arena, results_class, results))
     {
-        struct hasher_result res = *((struct hasher_result*)(addr + 24*i));
-        total_nonces += res.nonce;
+        dma_arena_print_stats(arena);
+        printf("Error: no free DMA slab\n");
+        exit(-1);
     }
+}
 
-    return (double)total_nonces * 1000 / time_taken_ms;
+void slabs_put(const struct dma_slab* blocks, const struct dma_slab* results)
+{
+    dma_arena_free(arena, blocks_class, blocks);
+    dma_arena_free(arena, results_class, results);
 }
 
-void print_memory_bytes(uint8_t* arr, uint32_t count)
+// Before the accelerator reads the blocks and writes the results: write back the
+// blocks, and no dirty line of the results may be evicted over its records.
+void slabs_for_device(const struct dma_slab* blocks, const struct dma_slab* results, uint32_t n_blocks)
 {
-    for(uint32_t i = 0; i < count; ++i)
-    {
-        printf("%02x", arr[i]);
-        if((i + 1) % 64 == 0)printf("\n");
-    }
-    printf("\n");
+#if CACHED_DMA
+    cma_flush_cache(blocks->virtual_addr, blocks->physical_addr, n_blocks * 64);
+    cma_flush_cache(results->virtual_addr, results->physical_addr, n_blocks * sizeof(struct hasher_result));
+#endif
 }
 
-void print_hash_nonces(uint32_t* start_addr, uint8_t block_count)
+// Before the CPU reads the records the accelerator wrote.
+void slabs_for_cpu(const struct dma_slab* results, uint32_t n_blocks)
 {
-    for(uint32_t b = 0; b < block_count; ++b)
-    {
-        printf("BLOCK: %u\n", b);
-        printf("\tHASH: ");
-        struct hasher_result res = *(struct hasher_result*)((uint8_t*)start_addr +24*b);
-        printf("%08x%08x%08x%08x%08x",res.a, res.b, res.c, res.d, res.e);
-        printf("\tNONCE: %08x\n", res.nonce);
-    }
+#if CACHED_DMA
+    cma_invalidate_cache(results->virtual_addr, results->physical_addr, n_blocks * sizeof(struct hasher_result));
+#endif
 }
 
 void test_device()
@@ -148,21 +133,19 @@ void test_device()
 
 
 
-    clock_t diff;
-    clock_t start = clock();
+    double start = bench_now_ms();
 
-    struct user_message mex = {(uint32_t)physical_addr, n_blocks, difficulty, (uint32_t)((uint8_t*)physical_addr + 64*n_blocks + 64)};
+    struct user_message mex = {(uint32_t)physical_addr, n_blocks, difficulty, (uint32_t)((uint8_t*)physical_addr + 64*n_blocks + 64), 0, 1, 0};
 
     uint32_t driver_err = read(driver, (void*)&mex, sizeof(mex));
     if(driver_err)
     {
-        printf("Invalid read from driver\n");
+        // hasher_platform.c only takes bus addresses with raw_addresses=1
+        printf("Invalid read from driver%s\n", errno == EPERM ? " (load it with raw_addresses=1)" : "");
         exit(-1);
     }
 
-    diff = clock() - start;
-
-    double msec = ((double)diff / CLOCKS_PER_SEC) * 1000;
+    double msec = bench_now_ms() - start;
     printf("\nDONE EXPERIMENT\n");
     printf("Time: %f (ms)", msec);
     print_hash_nonces((uint32_t*)((uint8_t*)virtual_addr + 64*n_blocks + 64), n_blocks);
@@ -181,20 +164,14 @@ struct experiment_stats run_experiment(uint32_t n_blocks, uint32_t difficulty)
 #if DEBUG
     printf("-----------------------------------------------\n\n");
 #endif
-    uint32_t * virtual_addr = (uint32_t *) cma_alloc(n_blocks * 64 + n_blocks * 24 + 1024, 0);
-    if(!virtual_addr)
-    {
-        printf("Error cma_alloc\n"); 
-        exit(-1);
-    }
-
-    uint32_t *physical_addr = (uint32_t *)cma_get_phy_addr(virtual_addr);
+    struct dma_slab blocks, results;
+    slabs_get(&blocks, &results);
 #if DEBUG
-    printf("Physical Addr: %x\n", (uint32_t)physical_addr);
+    printf("Physical Addr: %x\n", (uint32_t)blocks.physical_addr);
 #endif
 
 
-    uint64_t *start_address = (uint64_t*)virtual_addr;
+    uint64_t *start_address = (uint64_t*)blocks.virtual_addr;
     for(uint32_t i = 0; i < n_blocks; ++i)
     {
         for(uint32_t j = 0; j < 8; ++j)
@@ -208,59 +185,35 @@ struct experiment_stats run_experiment(uint32_t n_blocks, uint32_t difficulty)
     print_memory_bytes((uint8_t*)start_address, 64);
 #endif
 
-    struct user_message mex = {(uint32_t)physical_addr, n_blocks, difficulty, (uint32_t)((uint8_t*)physical_addr + 64*n_blocks + 64)};
+    struct user_message mex = {(uint32_t)blocks.physical_addr, n_blocks, difficulty, (uint32_t)results.physical_addr, 0, 1, 0};
+    slabs_for_device(&blocks, &results, n_blocks);
 
-    clock_t diff;
-    clock_t start = clock();
+    double start = bench_now_ms();
 
     uint32_t driver_err = read(driver, (void*)&mex, sizeof(mex));
     if(driver_err)
     {
-        printf("Invalid read from driver\n");
+        // hasher_platform.c only takes bus addresses with raw_addresses=1
+        printf("Invalid read from driver%s\n", errno == EPERM ? " (load it with raw_addresses=1)" : "");
         exit(-1);
     }
 
-    diff = clock() - start;
+    double msec = bench_now_ms() - start;
+    slabs_for_cpu(&results, n_blocks);
 
-    double msec = ((double)diff / CLOCKS_PER_SEC) * 1000;
 #if DEBUG
     printf("\nDONE EXPERIMENT\n");
     printf("Time: %f (ms)", msec);
-    print_hash_nonces((uint32_t*)((uint8_t*)virtual_addr + n_blocks * 64 + 64), n_blocks);
+    print_hash_nonces((uint32_t*)results.virtual_addr, n_blocks);
 #endif
 
     res.time_taken_ms = msec;
-    res.hash_per_sec = compute_avg_hash_per_second((uint8_t*)virtual_addr + n_blocks * 64 + 64, n_blocks, msec);
+    res.hash_per_sec = compute_avg_hash_per_second(results.virtual_addr, n_blocks, msec);
 
-    cma_free(virtual_addr);
+    slabs_put(&blocks, &results);
     return res;
 }
 
-struct hasher_result compute_hash_block_cpu(uint8_t* addr, uint32_t difficulty)
-{
-    uint32_t nonce = 0;
-    struct hasher_result final_result;
-    while(1)
-    {
-        *(uint32_t*)(addr + 60) = nonce;
-        struct internal_state res = sha1(addr, 64);
-        if(!(res.A & difficulty))
-        {
-            //Nonce found
-            final_result.a = res.A;
-            final_result.b = res.B;
-            final_result.c = res.C;
-            final_result.d = res.D;
-            final_result.e = res.E;
-            final_result.nonce = nonce;
-            break;
-        }
-        nonce += 1;
-    }
-    return final_result;
-}
-
-
 struct experiment_stats run_experiment_cpu(uint32_t n_blocks, uint32_t difficulty)
 {
 
@@ -268,14 +221,10 @@ struct experiment_stats run_experiment_cpu(uint32_t n_blocks, uint32_t difficult
 #if DEBUG
     printf("-----------------------------------------------\n\n");
 #endif
-    uint32_t * virtual_addr = (uint32_t *) cma_alloc(n_blocks * 64 + n_blocks * 24 + 1024, 0);
-    if(!virtual_addr)
-    {
-        printf("Error cma_alloc\n"); 
-        exit(-1);
-    }
+    struct dma_slab blocks, results;
+    slabs_get(&blocks, &results);
 
-    uint64_t *start_address = (uint64_t*)virtual_addr;
+    uint64_t *start_address = (uint64_t*)blocks.virtual_addr;
     for(uint32_t i = 0; i < n_blocks; ++i)
     {
         for(uint32_t j = 0; j < 8; ++j)
@@ -290,20 +239,16 @@ struct experiment_stats run_experiment_cpu(uint32_t n_blocks, uint32_t difficult
 #endif
 
 
-    clock_t diff = 0;
-    uint32_t tot_nonces = 0;
-    clock_t start = clock();
+    uint64_t tot_nonces = 0;
+    double start = bench_now_ms();
 
     for(uint32_t i = 0; i < n_blocks; ++i)
     {
-        start = clock();
         struct hasher_result res = compute_hash_block_cpu((uint8_t*)start_address + 64*i, difficulty);
-        diff += (clock() - start);
-        tot_nonces += res.nonce;
+        tot_nonces += res.nonces;
     }
 
-
-    double msec = ((double)diff / CLOCKS_PER_SEC) * 1000;
+    double msec = bench_now_ms() - start;
 #if DEBUG
     printf("\nDONE EXPERIMENT\n");
     printf("Time: %f (ms)", msec);
@@ -312,13 +257,18 @@ struct experiment_stats run_experiment_cpu(uint32_t n_blocks, uint32_t difficult
     res.time_taken_ms = msec;
     res.hash_per_sec = (double)tot_nonces * 1000 / msec;
 
-    cma_free(virtual_addr);
+    slabs_put(&blocks, &results);
     return res;
 }
 
 
 int main(int argc, char ** argv)
 {
+    struct bench_options options = {DEFAULT_MAX_BLOCKS, DEFAULT_N_EXPERIMENTS, DEFAULT_WARMUPS,
+                                    4, DEFAULT_MAX_DIFFICULTY, 4, BENCH_JSON, NULL, "accelerator", 0};
+
+    if(bench_parse_args(argc, argv, &options, "accelerator,cpu"))
+        exit(-1);
 
     driver = open(DRIVER_NAME, O_RDWR);
     if(driver == -1)
@@ -326,102 +276,40 @@ int main(int argc, char ** argv)
         printf("Error opening the driver\n");
         exit(-1);
     }
-#if DUMP
-    freopen("log.txt", "w", stdout);
-#endif
 
-    uint32_t MAX_BLOCKS;
-    uint32_t N_EXPERIMENTS;
-    uint32_t MAX_DIFFICULTY;
-
-    if (argc == 1)
-    {
-        MAX_BLOCKS = DEFAULT_MAX_BLOCKS;
-        N_EXPERIMENTS = DEFAULT_N_EXPERIMENTS;
-        MAX_DIFFICULTY = DEFAULT_MAX_DIFFICULTY;
-    }
-    else if(argc == 4)
-    {
-        MAX_BLOCKS = atoi(argv[1]);
-        N_EXPERIMENTS = atoi(argv[2]);
-        MAX_DIFFICULTY = atoi(argv[3]);
-    }
-    else
+    if(arena_open(options.max_blocks))
     {
-        printf("usage: ./master max_blocks experiments max_difficulty\n");
+        printf("Error cma_alloc\n");
         exit(-1);
     }
 
-
-#if not DUMP
-    printf("----------------------------");
-    printf("Press ENTER to start experiments\n");
-#endif
-    getchar();
-
 #if FUNC_TESTING == 0
 
-    struct experiment_stats stats;
-    double temp = 0.0;
+    struct bench_report* report = bench_report_open(&options, "master_driver");
+    bench_report_meta(report, "cpu_kernel", "%s", pow_get_kernel()->name);
+    bench_report_meta(report, "dma", "%s", CACHED_DMA ? "cached" : "coherent");
 
-    if(MAX_DIFFICULTY > 32)
-    {
-        printf("Invalid difficulty selected\n");
-        exit(-1);
-    }
-    //
     // To make all experiments the same
     srand(12);
 
-    printf("[\n");
-    for(uint32_t d = 4; d <= MAX_DIFFICULTY; d += 4)
+    for(uint32_t d = options.min_difficulty; d <= options.max_difficulty; d += options.difficulty_step)
     {
-        uint32_t difficulty = 0xFFFFFFFF & (0xFFFFFFFF << (32 - d));
-        printf("{\n");
-        printf("\"DIFFICULTY\": \"%08x\",\n", difficulty);
-        printf("\"BLOCK_EXPERIMENTS\": [\n");
-        for(uint32_t i = 1; i < MAX_BLOCKS; ++i)
+        for(uint32_t i = 1; i < options.max_blocks; ++i)
         {
-            double avg = 0.0;
-            double max = 0.0;
-            double min = 100000000.0;
-            double hash_per_sec = 0;
-            for(uint32_t j = 0; j < N_EXPERIMENTS; ++j)
-            {
-#if ACCELERATOR
-                stats = run_experiment(i, difficulty);
-#else
-                stats = run_experiment_cpu(i, difficulty);
-#endif
-                temp = stats.time_taken_ms;
-                if(temp > max)max = temp;
-                else if (temp < min)min=temp;
-                avg += temp;
-                hash_per_sec += stats.hash_per_sec;
-            }
-            printf("{\"Blocks\": %u, \"min_time\": %f, \"max_time\": %f, \"avg_time\": %f, \"avg_hash_per_sec\": %f}", i, min, max, avg / N_EXPERIMENTS, hash_per_sec / N_EXPERIMENTS);
-            if(i != MAX_BLOCKS - 1)
-                printf(",\n");
+            bench_measure(report, "accelerator", i, d, run_experiment);
+            bench_measure(report, "cpu", i, d, run_experiment_cpu);
         }
-        printf("]\n");
-        printf("}");
-        //IF WE CHANGE INCREMENT VALUE REMEMBER TO CHANGE THIS TOO
-        if(d != MAX_DIFFICULTY)
-            printf(",\n");
     }
-    printf("]\n");
+    bench_report_close(report);
 
 
     //////////////////////////////////////////////  
 
-#if DUMP
-    fclose(stdout);
-#endif
 #else
     test_device();
 #endif
 
+    arena_close();
     close(driver);
     return 0;
 }
-